@@ -6,27 +6,44 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
-import bisect
+import collections
 import logging
 import threading
+import time
 import urllib.parse as urllib_parse
 
 from . import backends
+from . import blockcache
 from . import errors
+from . import ioprio
+from . import iosched
+from . import jobs
 from . import measure
+from . import nbdexport
 from . import ops
+from . import progress
+from . import qos
+from . import timerwheel
 from . import util
 
 log = logging.getLogger("auth")
 
+# Number of random access ranges to collect before merging them into the
+# completed ranges.
+PENDING_RANGES = 64
+
 
 class Ticket:
 
-    def __init__(self, ticket_dict):
+    def __init__(self, ticket_dict, qos_host=None, block_cache=None,
+                 scheduler=None, watcher=None):
         if not isinstance(ticket_dict, dict):
             raise errors.InvalidTicket(
                 "Invalid ticket: %r, expecting a dict" % ticket_dict)
 
+        # Used to recreate the ticket in a new daemon during handoff.
+        self._ticket_dict = dict(ticket_dict)
+
         self._uuid = _required(ticket_dict, "uuid", str)
         self._size = _required(ticket_dict, "size", int)
         self._ops = _required(ticket_dict, "ops", list)
@@ -51,13 +68,70 @@ class Ticket:
         self._sparse = _optional(ticket_dict, "sparse", bool, default=False)
         self._dirty = _optional(ticket_dict, "dirty", bool, default=False)
 
+        # Optional cache mode for the file backend, overriding the
+        # backend_file:cache option.
+        self._cache = _optional(ticket_dict, "cache", str)
+        if self._cache not in (None, "direct", "buffered"):
+            raise errors.InvalidTicketParameter(
+                "cache", self._cache,
+                "expecting one of ['buffered', 'direct']")
+
+        # Optional image format, used when serving the image using qemu-nbd.
+        self._format = _optional(ticket_dict, "format", str, default="raw")
+        if self._format not in ("raw", "qcow2"):
+            raise errors.InvalidTicketParameter(
+                "format", self._format, "expecting one of ['qcow2', 'raw']")
+
+        # Optional block cache size, overriding the block_cache:size option.
+        # The cache is used only if block_cache configuration is specified.
+        cache_size = _optional(ticket_dict, "block_cache", int)
+        max_size = block_cache.max_size if block_cache else None
+        if cache_size is not None:
+            if cache_size < 0 or max_size and cache_size > max_size:
+                raise errors.InvalidTicketParameter(
+                    "block_cache", cache_size,
+                    "expecting value between 0 and {}".format(max_size))
+        self._block_cache = None
+        if block_cache:
+            if cache_size is None:
+                cache_size = block_cache.size
+            if cache_size:
+                self._block_cache = blockcache.Cache(
+                    cache_size, block_cache.block_size)
+
+        # Optional QoS limits. Reported in info() only if specified.
+        qos_dict = _optional(ticket_dict, "qos", dict)
+        self._qos_configured = qos_dict is not None
+        self._qos = qos.Throttle(host=qos_host, **_qos_limits(qos_dict or {}))
+
+        # iosched.Client for the ticket storage device, looked up on the
+        # first operation.
+        self._scheduler = scheduler
+        self._io_client = None
+
+        # nbdexport.Export serving the ticket image, set by the authorizer
+        # when backend_file:qemu_nbd is enabled.
+        self.export = None
+
+        # Notified when the ticket state changes, for streaming ticket
+        # status. The watcher keeps the version of the last change.
+        self._watcher = watcher
+        self.version = 0
+
+        # Set after completing an operation. Reporting progress on every
+        # operation is too expensive, so the watcher reports it
+        # periodically.
+        self.progress_pending = False
+
         self._operations = []
         self._lock = threading.Lock()
 
-        # Set holding ongoing operations.
-        self._ongoing = set()
+        # Per-thread ongoing operations and completed ranges. Running an
+        # operation modifies only the current thread slot without locking.
+        self._slots = progress.Slots(_OperationsSlot)
 
-        # Ranges transferred by completed operations.
+        # Ranges transferred by completed operations in threads that do not
+        # use this ticket any more.
         self._completed = []
 
         # Set to true when a ticket is canceled. Once canceled, all operations
@@ -72,6 +146,15 @@ class Ticket:
         # ticket can be removed only when this event is set.
         self._unused = threading.Event()
 
+        # Number of connections using this ticket in the old daemon during
+        # handoff. The ticket is used until the old daemon connections are
+        # finished.
+        self._inherited = 0
+
+        # Set when the ticket was replaced by a new ticket. The ticket is
+        # closed when the last connection is removed.
+        self._replaced = False
+
     @property
     def uuid(self):
         return self._uuid
@@ -115,6 +198,28 @@ class Ticket:
         """
         return self._dirty
 
+    @property
+    def cache(self):
+        """
+        Return the ticket cache mode, or None to use the backend default.
+        """
+        return self._cache
+
+    @property
+    def format(self):
+        return self._format
+
+    @property
+    def qos(self):
+        return self._qos
+
+    @property
+    def block_cache(self):
+        """
+        Return the ticket blockcache.Cache, or None if disabled.
+        """
+        return self._block_cache
+
     @property
     def idle_time(self):
         """
@@ -126,8 +231,8 @@ class Ticket:
 
     @property
     def canceled(self):
-        with self._lock:
-            return self._canceled
+        # Reading a bool is atomic; no locking needed.
+        return self._canceled
 
     def add_context(self, con_id, context):
         with self._lock:
@@ -141,16 +246,25 @@ class Ticket:
             if not self._connections:
                 self._unused.clear()
             self._connections[con_id] = context
+            self._changed()
 
     def get_context(self, con_id):
         return self._connections[con_id]
 
     def remove_context(self, con_id):
+        if self._remove_context(con_id):
+            self.close()
+
+    def _remove_context(self, con_id):
+        """
+        Remove connection context, returning True if the ticket was
+        replaced and is not used any more.
+        """
         with self._lock:
             try:
                 context = self._connections[con_id]
             except KeyError:
-                return
+                return False
 
             log.debug("Removing connection %s context from ticket %s",
                       con_id, self.uuid)
@@ -159,24 +273,51 @@ class Ticket:
             # If context was closed, it is safe to remove it.
             del self._connections[con_id]
 
+            # The context is removed by the connection thread, so the thread
+            # slot will not be used by this ticket any more.
+            self._remove_slot()
+
             # If this was the last connection, wake up caller waiting on
             # cancel().
             if not self._connections:
                 log.debug("Removing last connection for ticket %s", self.uuid)
-                self._unused.set()
+                if not self._inherited:
+                    self._unused.set()
+
+            self._changed()
+
+            return self._replaced and not self._connections
 
     def run(self, operation):
         """
         Run an operation, binding it to the ticket.
         """
+        if self._qos.enabled:
+            operation.qos = self._qos
+        operation.limiter = self._limiter()
         self._add_operation(operation)
         try:
-            return operation.run()
+            with self._qos.io_priority():
+                return operation.run()
         except ops.Canceled:
             log.debug("Operation %s was canceled", operation)
         finally:
             self._remove_operation(operation)
 
+    def _limiter(self):
+        if self._scheduler is None or not self._scheduler.enabled:
+            return None
+        if self._io_client is None:
+            limiter = self._scheduler.limiter(self._url)
+            # Use False to avoid looking up unknown device again.
+            client = limiter.client(self._uuid) if limiter else False
+            # Connections may start concurrently; keep the first client so
+            # all ticket I/O is accounted together.
+            with self._lock:
+                if self._io_client is None:
+                    self._io_client = client
+        return self._io_client or None
+
     def touch(self):
         """
         Extend the ticket and update the last access time.
@@ -188,47 +329,128 @@ class Ticket:
         self._access_time = now
 
     def _add_operation(self, op):
-        with self._lock:
-            if self._canceled:
-                raise errors.AuthorizationError(
-                    "Ticket {} was canceled".format(self.uuid))
+        if self._canceled:
+            raise errors.AuthorizationError(
+                "Ticket {} was canceled".format(self.uuid))
+
+        # Slot attributes are replaced instead of modified, so other threads
+        # can read them without locking.
+        slot = self._slots.get()
+        slot.ongoing += (op,)
 
-            self._ongoing.add(op)
+        # If cancel() was called after we checked, it may have missed this
+        # operation.
+        if self._canceled:
+            slot.ongoing = _remove_op(slot.ongoing, op)
+            raise errors.AuthorizationError(
+                "Ticket {} was canceled".format(self.uuid))
 
     def _remove_operation(self, op):
-        with self._lock:
-            self._ongoing.remove(op)
+        slot = self._slots.get()
 
-            if self._canceled:
-                raise errors.AuthorizationError(
-                    "Ticket {} was canceled".format(self.uuid))
+        if self._canceled:
+            slot.ongoing = _remove_op(slot.ongoing, op)
+            raise errors.AuthorizationError(
+                "Ticket {} was canceled".format(self.uuid))
+
+        # Publish the transferred range before removing the operation, so a
+        # thread reading ongoing operations before the completed ranges
+        # sees the range in at least one of them.
+        start = op.offset
+        end = op.offset + op.done
+        completed, pending = slot.ranges
+
+        if completed and completed[-1].start <= start <= completed[-1].end:
+            # Fast path: sequential operation extending the last range.
+            last = completed[-1]
+            r = measure.Range(last.start, max(last.end, end))
+            slot.ranges = (completed[:-1] + [r], pending)
+        elif not completed:
+            slot.ranges = ([measure.Range(start, end)], pending)
+        else:
+            # Random access: merging all the ranges on every request is too
+            # expensive for small requests, so merge them in batches.
+            pending.append(measure.Range(start, end))
+            if len(pending) >= PENDING_RANGES:
+                merged = measure.merge_ranges(
+                    _copy_ranges(completed) + _copy_ranges(pending))
+                slot.ranges = (merged, [])
+
+        slot.ongoing = _remove_op(slot.ongoing, op)
 
-            r = measure.Range(op.offset, op.offset + op.done)
-            bisect.insort(self._completed, r)
-            self._completed = measure.merge_ranges(self._completed)
+        self.progress_pending = True
         self.touch()
 
+    def _remove_slot(self):
+        """
+        Move current thread completed ranges to the ticket and remove the
+        thread slot. Must be called when holding the lock.
+        """
+        slot = self._slots.current()
+        if slot is None or slot.ongoing:
+            return
+
+        completed, pending = slot.ranges
+        self._completed = measure.merge_ranges(
+            self._completed + _copy_ranges(completed) + _copy_ranges(pending))
+        self._slots.remove()
+
+    def inherit_connections(self, count):
+        """
+        Set the number of connections using this ticket in the old daemon
+        during handoff.
+        """
+        with self._lock:
+            if count == self._inherited:
+                return
+            self._inherited = count
+            if count:
+                self._unused.clear()
+            elif not self._connections:
+                self._unused.set()
+            self._changed()
+
     def active(self):
-        return bool(self._ongoing)
+        # We cannot tell if the old daemon connections are idle.
+        if self._inherited:
+            return True
+        return any(slot.ongoing for slot in self._slots.snapshot())
 
     def transferred(self):
         """
         The number of bytes that were transferred so far using this ticket.
         """
+        ranges = self.transferred_ranges()
+        if ranges is None:
+            return None
+
+        return sum(len(r) for r in ranges)
+
+    def transferred_ranges(self):
+        """
+        Return sorted list of merged ranges transferred so far using this
+        ticket.
+        """
         if len(self.ops) > 1:
             # Both read and write, cannot report meaningful value.
             return None
 
+        # NOTE: this must not modify the ticket state.
         with self._lock:
-            # NOTE: this must not modify the ticket state.
-            completed = [measure.Range(r.start, r.end)
-                         for r in self._completed]
-            ongoing = [measure.Range(op.offset, op.offset + op.done)
-                       for op in self._ongoing]
-
-        ranges = sorted(completed + ongoing)
-        ranges = measure.merge_ranges(ranges)
-        return sum(len(r) for r in ranges)
+            ranges = _copy_ranges(self._completed)
+            slots = self._slots.snapshot()
+
+        for slot in slots:
+            # Read ongoing operations first; an operation is removed only
+            # after its range was added to the completed ranges.
+            ongoing = slot.ongoing
+            ranges.extend(measure.Range(op.offset, op.offset + op.done)
+                          for op in ongoing)
+            completed, pending = slot.ranges
+            ranges.extend(_copy_ranges(completed))
+            ranges.extend(_copy_ranges(pending))
+
+        return measure.merge_ranges(ranges)
 
     def may(self, op):
         if op == "read":
@@ -241,7 +463,7 @@ class Ticket:
         info = {
             "active": self.active(),
             "canceled": self._canceled,
-            "connections": len(self._connections),
+            "connections": self.connections,
             "expires": self._expires,
             "idle_time": self.idle_time,
             "ops": list(self._ops),
@@ -256,14 +478,52 @@ class Ticket:
             info["transfer_id"] = self._transfer_id
         if self.filename:
             info["filename"] = self.filename
+        if self._cache:
+            info["cache"] = self._cache
+        if self._format != "raw":
+            info["format"] = self._format
+        if self._qos_configured:
+            info["qos"] = self._qos.info()
+        if self._block_cache:
+            info["block_cache"] = self._block_cache.info()
+        if self._io_client:
+            info["io_scheduler"] = self._io_client.limiter.info()
         transferred = self.transferred()
         if transferred is not None:
             info["transferred"] = transferred
         return info
 
+    def to_dict(self):
+        """
+        Return ticket dict creating an equivalent ticket, expiring at the
+        same time.
+        """
+        d = dict(self._ticket_dict)
+        now = int(util.monotonic_time())
+        d["timeout"] = max(0, self._expires - now)
+        return d
+
+    @property
+    def connections(self):
+        return len(self._connections) + self._inherited
+
     def extend(self, timeout):
         expires = int(util.monotonic_time()) + timeout
         self._expires = expires
+        self._changed()
+
+    def update_qos(self, qos_dict):
+        """
+        Update QoS limits. Ongoing operations use the new limits for the next
+        I/O.
+
+        Raises errors.InvalidTicketParameter if qos_dict is invalid.
+        """
+        self._qos.update(**_qos_limits(qos_dict))
+        self._qos_configured = True
+        self._ticket_dict["qos"] = dict(
+            self._ticket_dict.get("qos") or {}, **qos_dict)
+        self._changed()
 
     def cancel(self, timeout=60):
         """
@@ -286,15 +546,17 @@ class Ticket:
 
         with self._lock:
             self._canceled = True
-            if not self._connections:
+            self._changed()
+            if not self._connections and not self._inherited:
                 log.debug("Ticket %s was canceled", self.uuid)
                 return True
 
             # Cancel ongoing operations. This speeds up cancellation when
             # streaming lot of data. Operations will be canceled once they
             # complete the current I/O.
-            for op in self._ongoing:
-                op.cancel()
+            for slot in self._slots.snapshot():
+                for op in slot.ongoing:
+                    op.cancel()
 
         if timeout:
             log.info("Waiting until ticket %s is unused", self.uuid)
@@ -307,6 +569,30 @@ class Ticket:
         # The caller need to poll the number of connections.
         return False
 
+    def _changed(self):
+        if self._watcher is not None:
+            self._watcher.ticket_changed(self)
+
+    def replaced(self):
+        """
+        Called when a ticket owning an export was replaced by a new ticket.
+        Cancel the ticket, and close it when the last connection is removed,
+        since connections may still use the ticket export.
+        """
+        with self._lock:
+            self._replaced = True
+        if self.cancel(timeout=0):
+            self.close()
+
+    def close(self):
+        """
+        Release resources owned by the ticket. Called when the ticket is
+        removed, or when a replaced ticket is not used any more. May be
+        called more than once.
+        """
+        if self.export is not None:
+            self.export.close()
+
     def __repr__(self):
         return ("<Ticket "
                 "active={active!r} "
@@ -353,11 +639,127 @@ def _validate(key, value, type):
     return value
 
 
+def _qos_limits(qos_dict):
+    """
+    Validate QoS dict, returning qos.Throttle limits.
+    """
+    limits = {}
+    for key, minval, maxval in (
+            ("bandwidth", 0, None),
+            ("iops", 0, None),
+            ("weight", 1, None),
+            ("io_level", ioprio.MIN_LEVEL, ioprio.MAX_LEVEL)):
+        if key in qos_dict:
+            value = qos_dict[key]
+            if not isinstance(value, int) or isinstance(value, bool):
+                raise errors.InvalidTicketParameter(
+                    "qos." + key, value, "expecting an integer value")
+            if value < minval:
+                raise errors.InvalidTicketParameter(
+                    "qos." + key, value,
+                    "expecting a value >= {}".format(minval))
+            if maxval is not None and value > maxval:
+                raise errors.InvalidTicketParameter(
+                    "qos." + key, value,
+                    "expecting a value <= {}".format(maxval))
+            limits[key] = value
+
+    if "io_class" in qos_dict:
+        value = qos_dict["io_class"]
+        if not isinstance(value, str) or value not in ioprio.CLASSES:
+            raise errors.InvalidTicketParameter(
+                "qos.io_class", value,
+                "expecting one of {}".format(sorted(ioprio.CLASSES)))
+        limits["io_class"] = value
+
+    return limits
+
+
+class _OperationsSlot:
+    """
+    Operations run by a single thread.
+    """
+
+    __slots__ = ("ongoing", "ranges")
+
+    def __init__(self):
+        # Tuple of ongoing operations.
+        self.ongoing = ()
+
+        # Tuple of (completed, pending) ranges, replaced together so other
+        # threads always see a consistent pair.
+        #
+        # completed is a sorted list of ranges transferred by completed
+        # operations. pending is an unsorted list of ranges transferred by
+        # completed random access operations, not merged yet into
+        # completed. pending is only appended by the owner thread, so other
+        # threads can copy it without locking.
+        self.ranges = ([], [])
+
+
+def _remove_op(ongoing, op):
+    if ongoing == (op,):
+        # Common case, single operation per thread.
+        return ()
+    return tuple(o for o in ongoing if o is not op)
+
+
+def _copy_ranges(ranges):
+    # measure.merge_ranges() modifies the ranges.
+    return [measure.Range(r.start, r.end) for r in ranges]
+
+
 class Authorizer:
+    """
+    Ticket store.
+
+    Thread safety: all methods may be called from multiple threads. Lookups
+    and modifications take a short lock; waiting for tickets to become
+    unused is done without the lock. authorize() validates cached tickets
+    without the lock by reading the generation, which is safe without the
+    GIL since attribute reads are atomic.
+    """
+
+    # Seconds to wait before trying again to reclaim an expired ticket that
+    # is still used.
+    RECLAIM_RETRY = 10
+
+    # Number of removed tickets remembered for watching ticket status.
+    # Watchers that missed more removals get all tickets.
+    REMOVED_HISTORY = 1024
 
     def __init__(self, config):
         self._config = config
+        self._lock = threading.Lock()
         self._tickets = {}
+        # Incremented when a ticket is removed or replaced, invalidating
+        # tickets cached in connections contexts.
+        self._generation = 0
+        # Tickets scheduled for reclaiming after they expire.
+        self._expiry = timerwheel.TimerWheel(now=util.monotonic_time())
+        ioprio.validate(config.qos.io_class, config.qos.io_level)
+        blockcache.validate(config.block_cache.block_size)
+        self._qos = qos.Host(
+            bandwidth=config.qos.bandwidth,
+            iops=config.qos.iops,
+            io_class=config.qos.io_class,
+            io_level=config.qos.io_level)
+        self._scheduler = iosched.Scheduler(config.io_scheduler)
+        # Jobs running on behalf of tickets in this process.
+        self.jobs = jobs.Manager(config)
+        # Ticket changes for watch(). Tickets notify us while holding their
+        # lock, so this lock must not be held when taking other locks.
+        self._changes = threading.Condition(threading.Lock())
+        self._version = 0
+        self._removed = collections.deque()
+        # Watchers older than this version may have missed removals.
+        self._removed_horizon = 0
+        # Time progress of active tickets was last reported.
+        self._progress_time = 0
+        # handoff.Peer connected to the old daemon during handoff, and the
+        # number of connections using tickets in the old daemon.
+        self.old_daemon = None
+        self._inherited = {}
 
     def add(self, ticket_dict):
         """
@@ -365,43 +767,326 @@ class Authorizer:
 
         Raises errors.InvalidTicket if ticket dict is invalid.
         """
-        ticket = Ticket(ticket_dict)
-        self._tickets[ticket.uuid] = ticket
+        ticket = Ticket(
+            ticket_dict,
+            qos_host=self._qos,
+            block_cache=self._block_cache_config(ticket_dict),
+            scheduler=self._scheduler,
+            watcher=self)
+        if self._use_qemu_nbd(ticket):
+            ticket.export = nbdexport.Export(ticket, self._config)
+        with self._lock:
+            old = self._tickets.get(ticket.uuid)
+            if old is not None:
+                self._generation += 1
+            self._tickets[ticket.uuid] = ticket
+            self._schedule_reclaim(ticket)
+            ticket.inherit_connections(self._inherited.get(ticket.uuid, 0))
+        self.ticket_changed(ticket)
+        if old is not None and old.export is not None:
+            old.replaced()
+
+    def _use_qemu_nbd(self, ticket):
+        # With remote workers, every process would start its own qemu-nbd,
+        # and qemu-nbd cannot share the image with other processes.
+        return (self._config.backend_file.qemu_nbd and
+                not self._config.remote.workers and
+                ticket.url.scheme == "file")
+
+    def _block_cache_config(self, ticket_dict):
+        # With remote workers, writes in one process cannot invalidate the
+        # cache in other processes.
+        if (self._config.remote.workers and isinstance(ticket_dict, dict) and
+                "write" in ticket_dict.get("ops", ())):
+            return None
+        return self._config.block_cache
 
     def remove(self, ticket_id):
         try:
-            ticket = self._tickets[ticket_id]
+            ticket = self._get(ticket_id)
         except KeyError:
             log.debug("Ticket %s does not exist", ticket_id)
             return
 
+        self._cancel_in_old_daemon(ticket)
+
         # Cancel the ticket and wait until the ticket is unused. Will raise
         # errors.TicketCancelTimeout if the ticket could not be canceled within
         # the timeout.
         if ticket.cancel(self._config.control.remove_timeout):
             # Ticket is unused now, so it is safe to remove it.
-            del self._tickets[ticket_id]
+            self._drop(ticket)
+
+    def remove_many(self, ticket_ids):
+        """
+        Remove multiple tickets, canceling all of them before waiting until
+        they are unused.
+
+        Returns list of ticket ids that could not be removed within
+        control:remove_timeout.
+        """
+        deadline = util.monotonic_time() + self._config.control.remove_timeout
+        pending = list(ticket_ids)
+        while True:
+            pending = [t for t in pending if not self.reclaim(t)]
+            if not pending or util.monotonic_time() >= deadline:
+                return pending
+            time.sleep(0.1)
+
+    def reclaim(self, ticket_id):
+        """
+        Cancel a ticket without waiting, removing it if it is unused.
+
+        Returns True if the ticket was removed or does not exist.
+        """
+        try:
+            ticket = self._get(ticket_id)
+        except KeyError:
+            return True
+
+        self._cancel_in_old_daemon(ticket)
+
+        if ticket.cancel(timeout=0):
+            self._drop(ticket)
+            return True
+
+        return False
+
+    def expire(self):
+        """
+        Reclaim tickets expired more than control:reclaim_timeout seconds
+        ago. Should be called periodically.
+
+        Returns list of reclaimed ticket ids.
+        """
+        if self._config.control.reclaim_timeout < 0:
+            return []
+
+        now = util.monotonic_time()
+        with self._lock:
+            candidates = self._expiry.advance(now)
+
+        reclaimed = []
+        for ticket_id in candidates:
+            try:
+                ticket = self._get(ticket_id)
+            except KeyError:
+                continue
+
+            # The ticket may have been extended after it was scheduled.
+            if self._reclaim_time(ticket) > now:
+                with self._lock:
+                    self._schedule_reclaim(ticket)
+                continue
+
+            log.info("Reclaiming expired ticket %s", ticket_id)
+            if self.reclaim(ticket_id):
+                reclaimed.append(ticket_id)
+            else:
+                log.debug("Ticket %s is still used, retrying in %s seconds",
+                          ticket_id, self.RECLAIM_RETRY)
+                with self._lock:
+                    self._expiry.schedule(ticket_id, now + self.RECLAIM_RETRY)
+
+        return reclaimed
 
     def clear(self):
-        self._tickets.clear()
+        with self._lock:
+            self._generation += 1
+            tickets = list(self._tickets.values())
+            self._tickets.clear()
+            self._expiry = timerwheel.TimerWheel(now=util.monotonic_time())
+        for ticket in tickets:
+            self.jobs.cancel(ticket.uuid)
+            self._ticket_removed(ticket.uuid)
+            ticket.close()
 
     def get(self, ticket_id):
         """
         Gets a ticket ID and returns the proper
         Ticket object from the tickets' cache.
         """
-        return self._tickets[ticket_id]
+        return self._get(ticket_id)
 
-    def authorize(self, ticket_id, op):
+    def _get(self, ticket_id):
+        with self._lock:
+            return self._tickets[ticket_id]
+
+    def _drop(self, ticket):
+        with self._lock:
+            # The ticket may have been replaced while we waited.
+            if self._tickets.get(ticket.uuid) is not ticket:
+                return
+            self._generation += 1
+            del self._tickets[ticket.uuid]
+            self._expiry.cancel(ticket.uuid)
+        self.jobs.cancel(ticket.uuid)
+        self._ticket_removed(ticket.uuid)
+        ticket.close()
+
+    def ticket_changed(self, ticket):
+        """
+        Called by tickets when their state was changed.
+        """
+        with self._changes:
+            self._version += 1
+            ticket.version = self._version
+            self._changes.notify_all()
+
+    def _ticket_removed(self, ticket_id):
+        with self._changes:
+            self._version += 1
+            if len(self._removed) == self.REMOVED_HISTORY:
+                self._removed_horizon = self._removed.popleft()[0]
+            self._removed.append((self._version, ticket_id))
+            self._changes.notify_all()
+
+    def watch(self, since=None, timeout=0):
+        """
+        Wait until tickets change after version since, or timeout expires.
+
+        Returns dict with the current version, the info of tickets changed
+        after version since, and the ids of tickets removed after version
+        since. If since is None, or the watcher may have missed changes,
+        return all tickets, and set "reset" to True; the watcher should
+        replace its state.
+
+        Ticket state changes are reported immediately. Transfer progress is
+        reported at most once per control:progress_interval seconds, after
+        completing operations, and periodically while tickets are active,
+        so long running operations report progress before they complete.
+        """
+        deadline = util.monotonic_time() + timeout
+        interval = self._config.control.progress_interval
+
+        while True:
+            with self._lock:
+                tickets = list(self._tickets.values())
+
+            now = util.monotonic_time()
+            active = ()
+            if now - self._progress_time >= interval:
+                self._progress_time = now
+                active = {t for t in tickets if t.active()}
+
+            with self._changes:
+                for ticket in tickets:
+                    if ticket.progress_pending or ticket in active:
+                        ticket.progress_pending = False
+                        self._version += 1
+                        ticket.version = self._version
+
+                reset = (since is None or
+                         since > self._version or
+                         since < self._removed_horizon)
+
+                if reset or self._version > since or now >= deadline:
+                    version = self._version
+                    removed = [] if reset else [
+                        ticket_id for v, ticket_id in self._removed
+                        if v > since]
+                    break
+
+                self._changes.wait(min(interval, deadline - now))
+
+        # Tickets changed after we read the version will be reported again in
+        # the next call.
+        with self._lock:
+            tickets = list(self._tickets.values())
+        if not reset:
+            tickets = [t for t in tickets if t.version > since]
+
+        return {
+            "version": version,
+            "reset": reset,
+            "tickets": [self._watch_info(t) for t in tickets],
+            "removed": removed,
+        }
+
+    def _watch_info(self, ticket):
+        return ticket.info()
+
+    def dump(self):
+        """
+        Return ticket dicts for recreating the tickets in a new daemon.
+        Canceled tickets are not included.
+        """
+        with self._lock:
+            tickets = list(self._tickets.values())
+        return [t.to_dict() for t in tickets if not t.canceled]
+
+    def connections(self):
+        """
+        Return the number of connections using tickets.
+        """
+        return sum(self.ticket_connections().values())
+
+    def ticket_connections(self):
+        """
+        Return mapping of ticket id to number of connections, for tickets
+        used by connections.
+        """
+        with self._lock:
+            tickets = list(self._tickets.values())
+        return {t.uuid: t.connections for t in tickets if t.connections}
+
+    def inherit_connections(self, connections):
+        """
+        Set the number of connections using tickets in the old daemon during
+        handoff, reported by handoff.Peer.
+        """
+        with self._lock:
+            self._inherited = dict(connections)
+            tickets = list(self._tickets.values())
+        for ticket in tickets:
+            ticket.inherit_connections(connections.get(ticket.uuid, 0))
+
+    def _cancel_in_old_daemon(self, ticket):
+        # The ticket is not removed until the old daemon connections using
+        # it are finished.
+        old_daemon = self.old_daemon
+        if old_daemon is None or not self._inherited.get(ticket.uuid):
+            return
+        try:
+            old_daemon.send({"cancel": ticket.uuid})
+        except OSError as e:
+            log.debug("Cannot cancel ticket %s in old daemon: %s",
+                      ticket.uuid, e)
+
+    def _schedule_reclaim(self, ticket):
+        # Must be called with the lock held.
+        if self._config.control.reclaim_timeout >= 0:
+            self._expiry.schedule(ticket.uuid, self._reclaim_time(ticket))
+
+    def _reclaim_time(self, ticket):
+        return ticket.expires + self._config.control.reclaim_timeout
+
+    def authorize(self, ticket_id, op, context=None):
         """
         Authorizing a ticket operation
+
+        If context is specified, usually the connection context, the ticket
+        is cached in the context. The next calls validate the cached ticket
+        using the store generation, without looking up the ticket.
         """
         log.debug("AUTH op=%s ticket=%s", op, ticket_id)
-        try:
-            ticket = self._tickets[ticket_id]
-        except KeyError:
-            raise errors.AuthorizationError(
-                "No such ticket {}".format(ticket_id))
+
+        handle = None
+        if context is not None:
+            handle = context.get(("auth", ticket_id))
+
+        if handle is None or handle.generation != self._generation:
+            try:
+                with self._lock:
+                    handle = _Handle(
+                        self._tickets[ticket_id], self._generation)
+            except KeyError:
+                raise errors.AuthorizationError(
+                    "No such ticket {}".format(ticket_id))
+            if context is not None:
+                context[("auth", ticket_id)] = handle
+
+        ticket = handle.ticket
 
         if ticket.canceled:
             raise errors.AuthorizationError(
@@ -416,3 +1101,15 @@ class Authorizer:
                 "Ticket {} forbids {}".format(ticket_id, op))
 
         return ticket
+
+
+class _Handle:
+    """
+    Ticket cached in a connection context.
+    """
+
+    __slots__ = ("ticket", "generation")
+
+    def __init__(self, ticket, generation):
+        self.ticket = ticket
+        self.generation = generation
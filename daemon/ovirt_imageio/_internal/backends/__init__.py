@@ -6,16 +6,24 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import logging
+
 from collections import namedtuple
 from functools import partial
 
+from .. import blockcache
 from .. import errors
+from .. import jobs
+from .. import numa
+from .. import ops
 from .. import util
 
 from . import file
 from . import http
 from . import nbd
 
+log = logging.getLogger("backends")
+
 _modules = {
     "file": file,
     "nbd": nbd,
@@ -27,17 +35,32 @@ class Unsupported(Exception):
     """ Requested backend is not supported """
 
 
-class Context(namedtuple("Context", "backend,buffer")):
+class Context(namedtuple("Context", "backend,buffer,buffers,pipeline")):
     """
     Backend context stored per ticket connection.
+
+    buffers is a tuple of all the connection buffers, used by pipelined
+    operations. The first buffer is also available as buffer. pipeline is
+    the ops.Pipeline running the helper thread of pipelined operations, or
+    None if the connection has only one buffer.
     """
     __slots__ = ()
 
+    def __new__(cls, backend, buffer, buffers=None, pipeline=None):
+        if buffers is None:
+            buffers = (buffer,)
+        return tuple.__new__(cls, (backend, buffer, buffers, pipeline))
+
     def close(self):
         try:
-            self.backend.close()
+            if self.pipeline is not None:
+                self.pipeline.close()
         finally:
-            self.buffer.close()
+            try:
+                self.backend.close()
+            finally:
+                for buf in self.buffers:
+                    buf.close()
 
 
 class Closer:
@@ -69,24 +92,48 @@ def get(req, ticket, config):
             raise Unsupported(
                 "Unsupported backend {!r}".format(ticket.url.scheme))
 
+        # Access the ticket image via qemu-nbd managed by the daemon.
+        url = ticket.export.url() if ticket.export else ticket.url
+
         mode = "r+" if "write" in ticket.ops else "r"
-        module = _modules[ticket.url.scheme]
+        module = _modules[url.scheme]
 
         # If HTTP backend has no explict CA file configuration, use CA file
         # from TLS configuration.
         ca_file = config.backend_http.ca_file or config.tls.ca_file
 
         backend = module.open(
-            ticket.url,
+            url,
             mode=mode,
             sparse=ticket.sparse,
             dirty=ticket.dirty,
             max_connections=config.daemon.max_connections,
+            cache=ticket.cache or config.backend_file.cache,
             cafile=ca_file)
 
         backend_config = getattr(config, "backend_" + backend.name)
-        buf = util.aligned_buffer(backend_config.buffer_size)
-        ctx = Context(backend, buf)
+        buffers = tuple(
+            util.aligned_buffer(backend_config.buffer_size)
+            for _ in range(max(1, backend_config.buffer_count)))
+
+        # Place the buffers and the connection thread on the NUMA node of
+        # the storage or the NIC.
+        node = numa.placement(config, ticket, req)
+        if node is not None:
+            log.info("[%s] NUMA node=%s ticket=%s",
+                     req.client_addr, node, ticket.uuid)
+            for buf in buffers:
+                numa.bind_buffer(buf, node)
+            # Job worker threads are shared by all tickets.
+            if config.numa.pin_threads and not isinstance(req, jobs.Job):
+                numa.pin_thread(node)
+
+        # Serve repeated reads from the ticket block cache.
+        if ticket.block_cache:
+            backend = blockcache.Backend(backend, ticket.block_cache)
+
+        pipeline = ops.Pipeline() if len(buffers) > 1 else None
+        ctx = Context(backend, buffers[0], buffers, pipeline)
 
         # Keep the context in the ticket so we monitor the number of
         # connections using the ticket.
@@ -98,6 +145,12 @@ def get(req, ticket, config):
             ctx.close()
             raise
 
+        # If the ticket was replaced, the connection does not use the old
+        # ticket any more; remove the old ticket context.
+        old = req.context.get(ticket.uuid)
+        if old is not None:
+            old.close()
+
         # Register a closer removing the context when the connection is closed.
         req.context[ticket.uuid] = Closer(
             partial(ticket.remove_context, req.connection_id))
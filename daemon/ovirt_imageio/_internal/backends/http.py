@@ -24,7 +24,7 @@ log = logging.getLogger("backends.http")
 
 
 def open(url, mode="r+", sparse=True, dirty=False, max_connections=8,
-         **options):
+         cache=None, **options):
     """
     Open a HTTP backend.
 
@@ -36,6 +36,7 @@ def open(url, mode="r+", sparse=True, dirty=False, max_connections=8,
             getting dirty extents.
         max_connections (int): ignored, http backend reports the value
             published by the remote server.
+        cache (str): ignored, http backend does not use the host page cache.
         **options: backend specific options:
             cafile (str): path to CA certificates to trust for certificate
                 verification. If not set, trust system's default CA
@@ -8,6 +8,7 @@
 
 import logging
 import os
+import re
 
 from .. import errors
 from . import image
@@ -213,6 +214,20 @@ class WriterTo(Backend):
         _copy(self, writer, length, buf)
 
 
+class HoleReader(Backend):
+    """
+    Report runs of zeroes in read data as holes, like NBD server sending
+    hole chunks.
+    """
+
+    def readinto_holes(self, buf):
+        count = self.readinto(buf)
+        with memoryview(buf)[:count] as view:
+            holes = [(m.start(), m.end() - m.start())
+                     for m in re.finditer(rb"\0+", view)]
+        return count, holes
+
+
 def _copy(reader, writer, length, buf):
     step = len(buf)
     todo = length
@@ -112,6 +112,27 @@ class Backend:
         self._position += length
         return length
 
+    def readinto_holes(self, buf):
+        """
+        Like readinto(), but return tuple (count, holes), where holes is a
+        sorted list of (start, length) ranges in buf reported by the server
+        as holes. The caller can zero or skip these ranges instead of
+        writing the zeroes read into buf.
+        """
+        if not self.readable():
+            raise IOError("Unsupported operation: readinto")
+
+        length = min(len(buf), self._client.export_size - self._position)
+        if length <= 0:
+            return 0, []
+
+        holes = []
+        with memoryview(buf)[:length] as view:
+            self._client.readinto(self._position, view, holes=holes)
+
+        self._position += length
+        return length, holes
+
     def write(self, buf):
         if not self.writable():
             raise IOError("Unsupported operation: write")
@@ -6,16 +6,32 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import errno
 import hashlib
 import os
+import threading
+
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
+from contextlib import closing
 from functools import partial
 
 from . import ioutil
+from . import util
+from .backends import image
 
 # This gives best result for Fedora 32 image when using the nbd backend.
 # More testing is needed to determine if this is the best default.
 BLOCK_SIZE = 4 * 1024**2
 
+# Number of threads reading and hashing data blocks when computing local file
+# checksum.
+MAX_WORKERS = 4
+
+# Alignment used for direct I/O when computing local file checksum. Works with
+# both 512 and 4096 bytes sector size.
+ALIGNMENT = 4096
+
 
 class Hash:
     """
@@ -33,6 +49,10 @@ class Hash:
     blocks and call update(data) in the order of the blcoks. The result will be
     equal but much slower.
 
+    To hash blocks in multiple threads, compute the block digests using
+    block_digest() and zero_digest() in any thread, and add them to the hash
+    using update_digest() in the order of the blocks in the file.
+
     The last block may be shorter if the file is not aligned to block_size.
     """
 
@@ -46,17 +66,35 @@ class Hash:
         self._zero_block_digest = self._func(b"\0" * block_size).digest()
 
     def update(self, block):
-        block_digest = self._func(block).digest()
-        self._hash.update(block_digest)
+        self._hash.update(self.block_digest(block))
 
     def zero(self, count):
+        self._hash.update(self.zero_digest(count))
+
+    def block_digest(self, block):
+        """
+        Return digest of data block without modifying the hash. Safe to call
+        from multiple threads.
+        """
+        return self._func(block).digest()
+
+    def zero_digest(self, count):
+        """
+        Return digest of zero block of count bytes without modifying the hash.
+        Safe to call from multiple threads.
+        """
         if count == self._block_size:
             # Fast path.
-            self._hash.update(self._zero_block_digest)
+            return self._zero_block_digest
         else:
             # Slow path.
-            block_digest = self._func(b"\0" * count).digest()
-            self._hash.update(block_digest)
+            return self._func(b"\0" * count).digest()
+
+    def update_digest(self, block_digest):
+        """
+        Add block digest returned from block_digest() or zero_digest().
+        """
+        self._hash.update(block_digest)
 
     def digest(self):
         return self._hash.digest()
@@ -66,9 +104,14 @@ class Hash:
 
 
 def checksum(path, block_size=BLOCK_SIZE, algorithm="blake2b", digest_size=32,
-             detect_zeroes=True):
+             detect_zeroes=True, offset=0, size=None, max_workers=MAX_WORKERS):
     """
-    Compute file checksum without extents information.
+    Compute raw file checksum without qemu-nbd.
+
+    Holes are detected using SEEK_DATA and SEEK_HOLE and hashed without
+    reading them. Data blocks are read using direct I/O and hashed by
+    max_workers threads. The result is the same checksum reported by the
+    server for the same image.
 
     Arguments:
         path (str): Path to image.
@@ -78,27 +121,44 @@ def checksum(path, block_size=BLOCK_SIZE, algorithm="blake2b", digest_size=32,
             and blake2s algorithms; specify None for other algorithms.
         detect_zeroes (bool): If True, detect zeroes in the input, speeing up
             the calculation.
+        offset (int): Offset of the image in the file, used to compute the
+            checksum of a tar member.
+        size (int): Size of the image. If not specified, use the rest of the
+            file after offset.
+        max_workers (int): Number of threads reading and hashing data blocks.
     """
-    length = os.path.getsize(path)
-    block = bytearray(block_size)
     h = Hash(
         block_size=block_size, algorithm=algorithm, digest_size=digest_size)
 
     with open(path, "rb") as f:
-        # Hash full blocks.
-        while length >= block_size:
-            _read_block(f, block_size, block)
-            if detect_zeroes and ioutil.is_zero(block):
-                h.zero(block_size)
-            else:
-                h.update(block)
-            length -= block_size
-
-        # Hash last partial block.
-        if length:
-            with memoryview(block)[:length] as view:
-                _read_block(f, length, view)
-                h.update(view)
+        if size is None:
+            # st_size is 0 for block devices.
+            size = os.lseek(f.fileno(), 0, os.SEEK_END) - offset
+
+        blocks = split(_extents(f.fileno(), offset, size), block_size)
+
+        with closing(_Readers(path, block_size)) as readers, \
+                ThreadPoolExecutor(
+                    max_workers=max_workers,
+                    thread_name_prefix="checksum") as executor:
+
+            # Block digests or futures, in the order of the blocks in the
+            # file. Bounded to limit the amount of blocks read ahead.
+            pending = deque()
+
+            for block in blocks:
+                if block.zero:
+                    pending.append(h.zero_digest(block.length))
+                else:
+                    pending.append(executor.submit(
+                        _block_digest, h, readers, offset + block.start,
+                        block.length, detect_zeroes))
+
+                while len(pending) > max_workers * 2:
+                    h.update_digest(_result(pending.popleft()))
+
+            while pending:
+                h.update_digest(_result(pending.popleft()))
 
     return {
         "algorithm": algorithm,
@@ -107,11 +167,125 @@ def checksum(path, block_size=BLOCK_SIZE, algorithm="blake2b", digest_size=32,
     }
 
 
-def _read_block(f, length, buf):
-    pos = 0
-    while pos < length:
-        with memoryview(buf)[pos:] as view:
-            pos += f.readinto(view)
+def _result(item):
+    if isinstance(item, bytes):
+        return item
+    return item.result()
+
+
+def _block_digest(h, readers, start, length, detect_zeroes):
+    with readers.get().read(start, length) as view:
+        if detect_zeroes and ioutil.is_zero(view):
+            return h.zero_digest(length)
+        else:
+            return h.block_digest(view)
+
+
+def _extents(fd, offset, size):
+    """
+    Generate zero extents for size bytes at offset using SEEK_DATA and
+    SEEK_HOLE. Extents start is relative to offset.
+
+    If the file system does not support detecting holes, the entire range is
+    reported as data.
+    """
+    end = offset + size
+    pos = offset
+
+    while pos < end:
+        try:
+            data = min(os.lseek(fd, pos, os.SEEK_DATA), end)
+        except OSError as e:
+            if e.errno != errno.ENXIO:
+                raise
+            # No data after pos.
+            data = end
+
+        if data > pos:
+            yield image.ZeroExtent(pos - offset, data - pos, True, True)
+            pos = data
+            if pos == end:
+                break
+
+        hole = min(os.lseek(fd, pos, os.SEEK_HOLE), end)
+        yield image.ZeroExtent(pos - offset, hole - pos, False, False)
+        pos = hole
+
+
+class _Readers:
+    """
+    Thread local readers, each using its own file descriptor and buffer.
+    """
+
+    def __init__(self, path, block_size):
+        self._path = path
+        self._block_size = block_size
+        self._local = threading.local()
+        self._lock = threading.Lock()
+        self._readers = []
+
+    def get(self):
+        reader = getattr(self._local, "reader", None)
+        if reader is None:
+            reader = _Reader(self._path, self._block_size)
+            with self._lock:
+                self._readers.append(reader)
+            self._local.reader = reader
+        return reader
+
+    def close(self):
+        with self._lock:
+            for reader in self._readers:
+                reader.close()
+            self._readers = []
+
+
+class _Reader:
+    """
+    Read blocks at unaligned offset and length using direct I/O.
+    """
+
+    def __init__(self, path, block_size):
+        try:
+            self._file = util.open(path, "r", direct=True)
+        except OSError as e:
+            # File system does not support direct I/O (e.g. tmpfs).
+            if e.errno != errno.EINVAL:
+                raise
+            self._file = util.open(path, "r", direct=False)
+        try:
+            # Unaligned block may span one more aligned block.
+            self._buf = util.aligned_buffer(block_size + ALIGNMENT)
+        except BaseException:
+            self._file.close()
+            raise
+
+    def read(self, start, length):
+        """
+        Read length bytes at start, returning a memoryview of the internal
+        buffer. The view must be released before the next read.
+        """
+        skip = start % ALIGNMENT
+        count = util.round_up(skip + length, ALIGNMENT)
+        pos = 0
+
+        self._file.seek(start - skip)
+        while pos < skip + length:
+            with memoryview(self._buf)[pos:count] as view:
+                n = util.uninterruptible(self._file.readinto, view)
+            if n == 0:
+                raise RuntimeError(
+                    "Unexpected end of file reading {} bytes at {}"
+                    .format(length, start))
+            pos += n
+
+        return memoryview(self._buf)[skip:skip + length]
+
+    def close(self):
+        try:
+            self._file.close()
+        finally:
+            self._buf.close()
 
 
 class Block:
@@ -0,0 +1,317 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+blockcache - per-ticket cache of image blocks.
+
+When the same image is read by several connections, or the same ranges are
+read again (e.g. proxy retrying ranges, checksum after download), reading
+from storage again is wasteful, since the file backend uses direct I/O and
+the NBD backend does not cache data.
+
+The cache is shared by all the ticket connections. Every connection wraps
+its backend with a Backend, serving reads from the cache and invalidating
+cached blocks on writes and zeroes.
+"""
+
+import collections
+import logging
+import os
+import threading
+
+from . import util
+
+log = logging.getLogger("blockcache")
+
+# Cached blocks are read from the backend, possibly using direct I/O, so the
+# block size must be aligned to the largest storage block size.
+ALIGNMENT = 4096
+
+
+def validate(block_size):
+    """
+    Raise ValueError if block_size is invalid.
+    """
+    if block_size <= 0 or block_size % ALIGNMENT:
+        raise ValueError(
+            "Invalid block size {}, expecting a positive multiple of {}"
+            .format(block_size, ALIGNMENT))
+
+
+class Cache:
+    """
+    Bounded LRU cache of image blocks.
+
+    Blocks are keyed by block index, and hold up to block_size bytes; the
+    last block of the image may be shorter.
+
+    Thread safety: all methods may be called from multiple threads.
+    """
+
+    def __init__(self, size, block_size):
+        self._size = size
+        self._block_size = block_size
+        self._lock = threading.Lock()
+        self._blocks = collections.OrderedDict()
+        self._used = 0
+        self._hits = 0
+        self._misses = 0
+        # Incremented when blocks are invalidated, so a reader that started
+        # reading from storage before a write does not add stale data.
+        self._generation = 0
+
+    @property
+    def block_size(self):
+        return self._block_size
+
+    @property
+    def generation(self):
+        with self._lock:
+            return self._generation
+
+    def get(self, index):
+        """
+        Return cached block data, or None if the block is not cached.
+        """
+        with self._lock:
+            data = self._blocks.get(index)
+            if data is None:
+                self._misses += 1
+                return None
+            self._blocks.move_to_end(index)
+            self._hits += 1
+            return data
+
+    def put(self, index, data, generation):
+        """
+        Add block data read from storage, unless blocks were invalidated
+        since generation was taken.
+        """
+        if len(data) > self._size:
+            return
+
+        with self._lock:
+            if generation != self._generation:
+                return
+
+            old = self._blocks.pop(index, None)
+            if old is not None:
+                self._used -= len(old)
+
+            self._blocks[index] = data
+            self._used += len(data)
+
+            while self._used > self._size:
+                _, evicted = self._blocks.popitem(last=False)
+                self._used -= len(evicted)
+
+    def invalidate(self, start, end):
+        """
+        Drop blocks overlapping byte range start-end.
+        """
+        first = start // self._block_size
+        last = (end - 1) // self._block_size
+
+        with self._lock:
+            self._generation += 1
+
+            # Zeroing a large range may cover more blocks than cached.
+            if last - first + 1 > len(self._blocks):
+                indexes = [i for i in self._blocks if first <= i <= last]
+            else:
+                indexes = range(first, last + 1)
+
+            for index in indexes:
+                data = self._blocks.pop(index, None)
+                if data is not None:
+                    self._used -= len(data)
+
+    def clear(self):
+        with self._lock:
+            self._generation += 1
+            self._blocks.clear()
+            self._used = 0
+
+    def info(self):
+        with self._lock:
+            return {
+                "size": self._size,
+                "used": self._used,
+                "hits": self._hits,
+                "misses": self._misses,
+            }
+
+
+class Backend:
+    """
+    Backend wrapper serving reads from a shared cache.
+
+    Reads are served from the cache, reading and caching complete cache
+    blocks on misses. Writes and zeroes go to the wrapped backend and
+    invalidate the affected cached blocks.
+    """
+
+    def __init__(self, backend, cache):
+        self._backend = backend
+        self._cache = cache
+        self._position = 0
+        # Used for reading blocks that cannot be read directly into the
+        # caller buffer. Allocated on the first unaligned read.
+        self._buf = None
+
+    @property
+    def cache(self):
+        return self._cache
+
+    def clone(self):
+        return Backend(self._backend.clone(), self._cache)
+
+    # io.BaseIO interface
+
+    def readinto(self, buf):
+        block_size = self._cache.block_size
+        done = 0
+        with memoryview(buf) as view:
+            length = len(view)
+            while done < length:
+                index, skip = divmod(self._position, block_size)
+                todo = length - done
+
+                data = self._cache.get(index)
+                if data is None:
+                    if skip == 0 and todo >= block_size:
+                        # Read directly into the caller buffer.
+                        with view[done:done + block_size] as v:
+                            n = self._read_block(index, v)
+                        self._position += n
+                        done += n
+                        if n < block_size:
+                            break
+                        continue
+
+                    if self._buf is None:
+                        self._buf = util.aligned_buffer(block_size)
+                    with memoryview(self._buf) as v:
+                        n = self._read_block(index, v)
+                        data = v[:n].tobytes()
+
+                n = min(len(data) - skip, todo)
+                if n <= 0:
+                    break
+
+                with memoryview(data)[skip:skip + n] as src:
+                    view[done:done + n] = src
+                self._position += n
+                done += n
+
+        return done
+
+    def write(self, buf):
+        self._backend.seek(self._position)
+        n = self._backend.write(buf)
+        self._invalidate(n)
+        return n
+
+    def zero(self, count):
+        self._backend.seek(self._position)
+        n = self._backend.zero(count)
+        self._invalidate(n)
+        return n
+
+    def tell(self):
+        return self._position
+
+    def seek(self, n, how=os.SEEK_SET):
+        self._position = self._backend.seek(n, how)
+        return self._position
+
+    def flush(self):
+        self._backend.flush()
+
+    def close(self):
+        try:
+            self._backend.close()
+        finally:
+            if self._buf is not None:
+                self._buf.close()
+                self._buf = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, t, v, tb):
+        try:
+            self.close()
+        except Exception:
+            # Do not hide the original error.
+            if t is None:
+                raise
+            log.exception("Error closing backend")
+
+    # Backend interface.
+
+    def extents(self, context="zero"):
+        return self._backend.extents(context=context)
+
+    def readable(self):
+        return self._backend.readable()
+
+    def writable(self):
+        return self._backend.writable()
+
+    def size(self):
+        return self._backend.size()
+
+    @property
+    def block_size(self):
+        return self._backend.block_size
+
+    @property
+    def max_readers(self):
+        return self._backend.max_readers
+
+    @property
+    def max_writers(self):
+        return self._backend.max_writers
+
+    @property
+    def dirty(self):
+        return self._backend.dirty
+
+    @property
+    def sparse(self):
+        return self._backend.sparse
+
+    @property
+    def name(self):
+        return self._backend.name
+
+    # Private.
+
+    def _read_block(self, index, buf):
+        """
+        Read block from the wrapped backend into buf and add it to the
+        cache, returning the number of bytes read.
+        """
+        generation = self._cache.generation
+        self._backend.seek(index * len(buf))
+        n = 0
+        while n < len(buf):
+            with buf[n:] as v:
+                count = self._backend.readinto(v)
+            if count == 0:
+                break
+            n += count
+        if n:
+            with buf[:n] as v:
+                self._cache.put(index, v.tobytes(), generation)
+        return n
+
+    def _invalidate(self, count):
+        if count:
+            self._cache.invalidate(self._position, self._position + count)
+        self._position += count
@@ -0,0 +1,28 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+cgroup - control group v2 helpers.
+"""
+
+import logging
+import os
+
+log = logging.getLogger("cgroup")
+
+
+def join(path):
+    """
+    Move the current process and all its threads to the cgroup v2 directory
+    path. Processes forked later are created in the same cgroup.
+
+    Raises OSError if path is not a cgroup directory, or the process is not
+    allowed to move to the cgroup.
+    """
+    log.info("Moving process %s to cgroup %s", os.getpid(), path)
+    with open(os.path.join(path, "cgroup.procs"), "w") as f:
+        f.write(str(os.getpid()))
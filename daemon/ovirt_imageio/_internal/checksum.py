@@ -14,6 +14,7 @@ from . import blkhash
 from . import errors
 from . import http
 from . import ioutil
+from . import jobs
 from . import ops
 from . import util
 from . import validate
@@ -46,32 +47,34 @@ class Checksum:
             ALGORITHMS,
             default="blake2b")
 
+        block_size = parse_block_size(req)
+        run_async = jobs.requested(req)
+
         try:
-            block_size = int(req.query.get("block_size", blkhash.BLOCK_SIZE))
-        except ValueError:
-            raise http.Error(
-                http.BAD_REQUEST,
-                "Invalid block size: {!r}".format(req.query["block_size"]))
-
-        if not MIN_BLOCK_SIZE <= block_size <= MAX_BLOCK_SIZE:
-            raise http.Error(
-                http.BAD_REQUEST,
-                "Block size out of allowed range: {}-{}"
-                .format(MIN_BLOCK_SIZE, MAX_BLOCK_SIZE))
-
-        if block_size % 4096:
-            raise http.Error(
-                http.BAD_REQUEST, "Block size is not aligned to 4096")
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
+        except errors.AuthorizationError as e:
+            raise http.Error(http.FORBIDDEN, str(e))
+
+        log.info("[%s] CHECKSUM ticket=%s algorithm=%s block_size=%s "
+                 "async=%s", req.client_addr, ticket_id, algorithm,
+                 block_size, run_async)
+
+        if run_async:
+            def checksum(job):
+                ctx = backends.get(job, ticket, self.config)
+                with util.aligned_buffer(block_size) as buf:
+                    op = Operation(
+                        ctx.backend, buf, algorithm, clock=job.clock)
+                    return job.run_operation(op)
+
+            return jobs.start(req, resp, self.auth, ticket, "checksum",
+                              checksum)
 
         try:
-            ticket = self.auth.authorize(ticket_id, "read")
             ctx = backends.get(req, ticket, self.config)
         except errors.AuthorizationError as e:
             raise http.Error(http.FORBIDDEN, str(e))
 
-        log.info("[%s] CHECKSUM ticket=%s algorithm=%s block_size=%s",
-                 req.client_addr, ticket_id, algorithm, block_size)
-
         # For simplicity we create a new buffer even if block_size is same as
         # ctx.buffer length.
 
@@ -86,6 +89,31 @@ class Checksum:
         resp.send_json(checksum)
 
 
+def parse_block_size(req):
+    """
+    Return the "block_size" query parameter, raising http.Error if the
+    block size is invalid.
+    """
+    try:
+        block_size = int(req.query.get("block_size", blkhash.BLOCK_SIZE))
+    except ValueError:
+        raise http.Error(
+            http.BAD_REQUEST,
+            "Invalid block size: {!r}".format(req.query["block_size"]))
+
+    if not MIN_BLOCK_SIZE <= block_size <= MAX_BLOCK_SIZE:
+        raise http.Error(
+            http.BAD_REQUEST,
+            "Block size out of allowed range: {}-{}"
+            .format(MIN_BLOCK_SIZE, MAX_BLOCK_SIZE))
+
+    if block_size % 4096:
+        raise http.Error(
+            http.BAD_REQUEST, "Block size is not aligned to 4096")
+
+    return block_size
+
+
 class Algorithms:
     """
     Handle requests for the /images/ticket-id/checksum/algorithms resource.
@@ -129,8 +157,9 @@ class Operation(ops.Operation):
             else:
                 with memoryview(self._buf)[:block.length] as view:
                     self._backend.seek(block.start)
-                    self._backend.readinto(view)
-                    if self._detect_zeroes and ioutil.is_zero(view):
+                    if self._read_hole(view):
+                        h.zero(block.length)
+                    elif self._detect_zeroes and ioutil.is_zero(view):
                         h.zero(block.length)
                     else:
                         h.update(view)
@@ -146,6 +175,18 @@ class Operation(ops.Operation):
             "checksum": h.hexdigest(),
         }
 
+    def _read_hole(self, view):
+        """
+        Read block into view, returning True if the backend reported the
+        entire block as a hole, so we don't need to scan it for zeroes.
+        """
+        if not hasattr(self._backend, "readinto_holes"):
+            self._backend.readinto(view)
+            return False
+
+        _, holes = self._backend.readinto_holes(view)
+        return holes == [(0, len(view))]
+
 
 def compute(backend, buf, algorithm="sha1", detect_zeroes=True):
     """
@@ -0,0 +1,236 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+compare - compare two images on the server.
+
+Comparing checksums tells if two images are identical, but not where they
+differ. Comparing the images on the server returns the ranges that differ,
+so a client can transfer only these ranges to repair the image.
+
+The images are compared in blocks. Blocks that are zero in both images are
+not read. If only one image has a zero block, only the other image is read.
+Blocks with data in both images are read in parallel and compared.
+"""
+
+import logging
+
+from concurrent.futures import ThreadPoolExecutor
+
+from . import backends
+from . import blkhash
+from . import checksum
+from . import errors
+from . import http
+from . import ioutil
+from . import jobs
+from . import measure
+from . import ops
+from . import util
+
+log = logging.getLogger("compare")
+
+
+class Handler:
+    """
+    Handle requests for the /images/ticket-id/compare resource.
+    """
+
+    def __init__(self, config, auth):
+        self.config = config
+        self.auth = auth
+
+    def get(self, req, resp, ticket_id):
+        if not ticket_id:
+            raise http.Error(http.BAD_REQUEST, "Ticket id is required")
+
+        other_id = req.query.get("other")
+        if not other_id:
+            raise http.Error(http.BAD_REQUEST, "Other ticket id is required")
+
+        if other_id == ticket_id:
+            raise http.Error(
+                http.BAD_REQUEST, "Cannot compare ticket with itself")
+
+        block_size = checksum.parse_block_size(req)
+
+        try:
+            max_ranges = int(req.query.get("max_ranges", 0))
+        except ValueError:
+            max_ranges = -1
+        if max_ranges < 0:
+            raise http.Error(
+                http.BAD_REQUEST,
+                "Invalid max_ranges: {!r}".format(req.query["max_ranges"]))
+
+        run_async = jobs.requested(req)
+
+        try:
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
+            other = self.auth.authorize(other_id, "read", req.context)
+        except errors.AuthorizationError as e:
+            raise http.Error(http.FORBIDDEN, str(e))
+
+        log.info("[%s] COMPARE ticket=%s other=%s block_size=%s "
+                 "max_ranges=%s async=%s", req.client_addr, ticket_id,
+                 other_id, block_size, max_ranges, run_async)
+
+        if run_async:
+            def compare(job):
+                return self._compare(
+                    job, ticket, other, block_size, max_ranges,
+                    job.run_operation)
+
+            return jobs.start(req, resp, self.auth, ticket, "compare",
+                              compare)
+
+        try:
+            result = self._compare(
+                req, ticket, other, block_size, max_ranges, ticket.run)
+        except errors.AuthorizationError as e:
+            resp.close_connection()
+            raise http.Error(http.FORBIDDEN, str(e)) from None
+
+        resp.send_json(result)
+
+    def _compare(self, con, ticket, other, block_size, max_ranges, run):
+        ctx = backends.get(con, ticket, self.config)
+        other_ctx = backends.get(con, other, self.config)
+
+        with util.aligned_buffer(block_size) as buf, \
+                util.aligned_buffer(block_size) as other_buf:
+            op = Operation(
+                ctx.backend,
+                other_ctx.backend,
+                buf,
+                other_buf,
+                max_ranges=max_ranges,
+                other_ticket=other,
+                clock=con.clock)
+            return run(op)
+
+
+class Operation(ops.Operation):
+    """
+    Compare operation.
+
+    The operation is run by the ticket of the first image. If other_ticket
+    is specified, the operation fails when the other ticket is canceled.
+    """
+
+    name = "compare"
+
+    def __init__(self, backend, other_backend, buf, other_buf, max_ranges=0,
+                 other_ticket=None, clock=None):
+        size = max(backend.size(), other_backend.size())
+        super().__init__(size=size, buf=buf, clock=clock)
+        self._backend = backend
+        self._other_backend = other_backend
+        self._other_buf = other_buf
+        self._max_ranges = max_ranges
+        self._other_ticket = other_ticket
+        self._ranges = []
+
+    def _run(self):
+        block_size = len(self._buf)
+        size = self._backend.size()
+        other_size = self._other_backend.size()
+        complete = True
+
+        blocks = zip(
+            blkhash.split(self._backend.extents("zero"), block_size),
+            blkhash.split(self._other_backend.extents("zero"), block_size))
+
+        with ThreadPoolExecutor(
+                max_workers=1, thread_name_prefix="compare") as executor:
+            for block, other_block in blocks:
+                # The last block of the smaller image may be shorter.
+                length = min(block.length, other_block.length)
+
+                if not self._equal(
+                        executor, block.start, length, block.zero,
+                        other_block.zero):
+                    if not self._add_range(block.start, length):
+                        complete = False
+                        break
+
+                self._done += length
+
+                if self._canceled:
+                    raise ops.Canceled
+
+                if self._other_ticket and self._other_ticket.canceled:
+                    raise errors.AuthorizationError(
+                        "Ticket {} was canceled".format(
+                            self._other_ticket.uuid))
+
+        # Bytes after the end of the smaller image differ.
+        if complete and size != other_size:
+            start = min(size, other_size)
+            complete = self._add_range(start, self.size - start)
+            if complete:
+                self._done = self.size
+
+        return {
+            "equal": complete and not self._ranges,
+            "complete": complete,
+            "block_size": block_size,
+            "size": size,
+            "other_size": other_size,
+            "ranges": [{"start": r.start, "length": len(r)}
+                       for r in self._ranges],
+        }
+
+    def _equal(self, executor, start, length, zero, other_zero):
+        if zero and other_zero:
+            return True
+
+        with memoryview(self._buf)[:length] as view, \
+                memoryview(self._other_buf)[:length] as other_view:
+
+            if zero:
+                self._read(self._other_backend, other_view, start)
+                return ioutil.is_zero(other_view)
+
+            if other_zero:
+                self._read(self._backend, view, start)
+                return ioutil.is_zero(view)
+
+            # Read the other image in parallel.
+            future = executor.submit(
+                self._read, self._other_backend, other_view, start)
+            try:
+                self._read(self._backend, view, start)
+            finally:
+                future.result()
+
+            return ioutil.equal(view, other_view)
+
+    def _read(self, backend, view, start):
+        # The backends are read by different threads at the same time.
+        name = "read" if backend is self._backend else "read_other"
+        with self._record(name):
+            backend.seek(start)
+            backend.readinto(view)
+
+    def _add_range(self, start, length):
+        """
+        Add differing range, merging it with the previous range. Returns
+        False if the range could not be added since we have max_ranges
+        ranges.
+        """
+        end = start + length
+        if self._ranges and self._ranges[-1].end == start:
+            last = self._ranges[-1]
+            self._ranges[-1] = measure.Range(last.start, end)
+            return True
+
+        if self._max_ranges and len(self._ranges) == self._max_ranges:
+            return False
+
+        self._ranges.append(measure.Range(start, end))
+        return True
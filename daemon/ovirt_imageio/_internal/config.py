@@ -20,6 +20,15 @@ class daemon:
     # decrease throughput.
     max_connections = 8
 
+    # Number of seconds to wait until a new daemon started during handoff is
+    # ready for requests. If the new daemon is not ready in time, it is killed
+    # and the current daemon continues to serve requests.
+    handoff_timeout = 60
+
+    # Number of seconds to wait until active connections are finished after
+    # a new daemon took over during handoff.
+    drain_timeout = 300
+
     # Daemon run directory. Runtime stuff like socket or profile information
     # will be stored in this directory.
     # This is configurable only for development purposes and is not expected to
@@ -81,6 +90,28 @@ class backend_file:
     # TODO: Tested with single writer, needs testing with multiple readers.
     buffer_size = 8 * 1024**2
 
+    # Number of buffers per connection. When using 2 or more buffers, reading
+    # from storage and sending to the network (or receiving from the network
+    # and writing to storage) are done in parallel, using a helper thread.
+    # Use 1 to disable pipelining and minimize memory usage.
+    buffer_count = 2
+
+    # Cache mode for the file backend. "direct" bypasses the host page cache
+    # using O_DIRECT. "buffered" uses the page cache, keeping only the last
+    # accessed ranges in the cache and dropping older pages, so transfers do
+    # not pollute the host page cache. Sequential transfers also use read
+    # ahead and write behind hints. Buffered mode gives better throughput on
+    # NFS, where O_DIRECT is not passed to the server, and for small random
+    # reads. Tickets may override this using the "cache" key.
+    cache = "direct"
+
+    # Serve file tickets using a qemu-nbd server started by the daemon on the
+    # first access, and stopped when the ticket is removed. This supports
+    # multiple writers, reports real extents, and exposes qcow2 images
+    # specified using the ticket "format" key. The qemu-nbd cache mode
+    # follows the cache option. Not supported with remote workers.
+    qemu_nbd = False
+
 
 class backend_http:
 
@@ -97,6 +128,9 @@ class backend_http:
     # TODO: Needs testing with multiple readers and writers.
     buffer_size = 8 * 1024**2
 
+    # Number of buffers per connection. See backend_file:buffer_count.
+    buffer_count = 2
+
 
 class backend_nbd:
 
@@ -105,6 +139,9 @@ class backend_nbd:
     # TODO: Needs testing with multiple readers and writers.
     buffer_size = 8 * 1024**2
 
+    # Number of buffers per connection. See backend_file:buffer_count.
+    buffer_count = 2
+
 
 class remote:
 
@@ -117,6 +154,14 @@ class remote:
     # configuration.
     port = 54322
 
+    # Number of worker processes serving the remote service. Every worker
+    # listens on the remote port using SO_REUSEPORT, and the kernel
+    # distributes connections between the workers. Using multiple processes
+    # improves throughput when serving many transfers concurrently on hosts
+    # with many cores. The default (0) serves the remote service in the main
+    # process.
+    workers = 0
+
 
 class local:
 
@@ -126,6 +171,32 @@ class local:
     # Local service unix socket for accessing images locally.
     socket = "\u0000/org/ovirt/imageio"
 
+    # Allow local clients to receive the image file descriptor, or a
+    # connected NBD socket, using GET /images/ticket-id/fd. The client can
+    # then do the I/O itself, without copying the data through the daemon.
+    # A passed file descriptor cannot be limited to part of the image or
+    # revoked when the ticket is removed, so this is disabled by default.
+    # Writable tickets using a block cache cannot pass file descriptors.
+    fd_passing = False
+
+    # Maximum size in bytes of the shared memory ring used by the shared
+    # memory transport (GET /images/ticket-id/shm). With this transport, the
+    # daemon reads and writes image data directly from memory shared with
+    # the client, without copying the data through the socket. Use 0 to
+    # disable the shared memory transport.
+    shm_max_size = 64 * 1024**2
+
+
+class nbd_server:
+
+    # Enable NBD server service, exporting tickets over NBD. The export name
+    # is the ticket id. Every NBD command is authorized using the ticket.
+    enable = False
+
+    # NBD server unix socket. TLS is not supported, so the service is
+    # available only to local clients.
+    socket = "\u0000/org/ovirt/imageio/nbd"
+
 
 class control:
 
@@ -160,6 +231,140 @@ class control:
     # only when the number of connections using the ticket is zero.
     remove_timeout = 60
 
+    # Number of seconds to keep an expired ticket before removing it. The
+    # daemon checks expired tickets every second, cancels their ongoing
+    # operations, and removes them when they are unused, releasing the
+    # ticket resources. Until then, the ticket can be extended to continue
+    # the transfer. Use -1 to keep expired tickets until they are removed
+    # using the control service.
+    reclaim_timeout = 300
+
+    # Maximum number of seconds to wait for ticket changes when watching
+    # tickets status using GET /tickets/?since=version&timeout=seconds.
+    watch_timeout = 30
+
+    # Number of seconds between transfer progress reports when watching
+    # tickets status. Ticket state changes are reported immediately.
+    progress_interval = 1.0
+
+
+class qos:
+
+    # Maximum storage bandwidth in bytes per second for all transfers. When
+    # the limit is reached, the bandwidth is shared between the active
+    # tickets according to the ticket qos.weight. Tickets may have their own
+    # lower limits. With remote:workers, every worker process enforces an
+    # equal part of the limit. Use 0 for unlimited bandwidth.
+    bandwidth = 0
+
+    # Maximum number of storage I/O requests per second for all transfers,
+    # shared between the active tickets like bandwidth. Use 0 for unlimited
+    # I/O requests.
+    iops = 0
+
+    # Default I/O scheduling class of the threads doing storage I/O, for
+    # tickets not specifying qos.io_class. Use "idle" to do I/O only when
+    # other processes do not use the storage, "best-effort" with io_level to
+    # lower or raise the priority, or "realtime" to go first (requires
+    # CAP_SYS_ADMIN, ignored otherwise). The default ("none") uses the
+    # priority derived from the daemon nice value. Effective only with I/O
+    # schedulers supporting priorities, like bfq and mq-deadline.
+    io_class = "none"
+
+    # Default I/O priority level for "best-effort" and "realtime" classes,
+    # for tickets not specifying qos.io_level, from 0 (highest) to 7
+    # (lowest).
+    io_level = 4
+
+    # cgroup v2 directory for the daemon and the worker processes, for
+    # limiting the daemon storage I/O using the cgroup io.weight or io.max.
+    # The daemon moves itself to this cgroup before dropping privileges.
+    # When running under systemd, prefer setting Slice= or IOWeight= in the
+    # service unit. The default ("") keeps the daemon in the current cgroup.
+    cgroup = ""
+
+
+class block_cache:
+
+    # Default size in bytes of the per-ticket block cache, serving repeated
+    # reads of the same image ranges from memory. The cache is shared by all
+    # the ticket connections, and cached blocks are invalidated on writes
+    # through the daemon. Tickets may specify their own size using the
+    # "block_cache" key. With remote:workers, the cache is not used for
+    # writable tickets, since writes in one process cannot invalidate the
+    # cache in other processes. Use 0 to disable the cache.
+    size = 0
+
+    # Maximum cache size in bytes a ticket may request.
+    max_size = 1024**3
+
+    # Size in bytes of cached blocks. Must be a multiple of 4096. Reads
+    # smaller than a block read and cache the entire block.
+    block_size = 1024**2
+
+
+class io_scheduler:
+
+    # Limit outstanding storage I/O requests per device (e.g. LUN, NFS
+    # export), shared by all tickets using the device. The limit is
+    # adjusted based on the I/O latency, increasing slowly while the device
+    # is fast, and decreasing quickly when it becomes slow. Requests
+    # waiting for the device are served round robin between the tickets.
+    # With remote workers, every worker process has its own limits.
+    enable = False
+
+    # Initial number of outstanding I/O requests per device.
+    initial_limit = 8
+
+    # Minimal number of outstanding I/O requests per device.
+    min_limit = 1
+
+    # Maximum number of outstanding I/O requests per device.
+    max_limit = 64
+
+    # I/O latency in seconds considered as device overload. Slower requests
+    # decrease the limit.
+    target_latency = 0.5
+
+
+class jobs:
+
+    # Number of threads running asynchronous jobs. Clients may request to
+    # run zero, flush and checksum as a job, getting a "202 Accepted"
+    # response with the job id immediately, and polling the job status at
+    # /jobs/job-id. If set to 0, asynchronous requests are rejected. With
+    # remote workers, every worker process runs its own jobs, so the job
+    # status must be polled using the same connection.
+    workers = 4
+
+    # Maximum number of jobs kept in memory, including finished jobs.
+    # Requests submitting more jobs fail with "503 Service Unavailable".
+    max_jobs = 64
+
+    # Number of seconds to keep finished jobs, so clients can get the
+    # result.
+    keep_time = 300
+
+    # Maximum number of seconds a client can wait for job completion in a
+    # single request.
+    max_wait = 30
+
+
+class numa:
+
+    # Allocate connection buffers on the NUMA node of the storage device or
+    # the NIC used by the transfer, to avoid copying the data between NUMA
+    # nodes. Has no effect on hosts with a single NUMA node.
+    enable = False
+
+    # Node to prefer when the storage device and the NIC are on different
+    # nodes: "storage" or "network". If the preferred node is unknown, for
+    # example with network storage or unix socket, the other one is used.
+    prefer = "storage"
+
+    # Run connection threads only on the cpus of the selected NUMA node.
+    pin_threads = False
+
 
 class profile:
 
@@ -168,6 +373,19 @@ class profile:
     filename = "/run/ovirt-imageio/profile"
 
 
+class log_queue:
+
+    # Write log records in a dedicated thread, so request threads are not
+    # blocked when the log disk is slow. The handlers of the root logger are
+    # replaced by a handler adding records to a bounded queue.
+    enable = True
+
+    # Maximum number of queued log records. When the queue is full, records
+    # are dropped, and the number of dropped records is logged when the
+    # queue has room again.
+    size = 10000
+
+
 # Logger configuration.
 # See Python logging documentation for details how to configure loggers.
 
@@ -221,11 +439,18 @@ class Config:
         self.backend_nbd = backend_nbd()
         self.remote = remote()
         self.local = local()
+        self.nbd_server = nbd_server()
         self.control = control()
+        self.qos = qos()
+        self.block_cache = block_cache()
+        self.io_scheduler = io_scheduler()
+        self.jobs = jobs()
+        self.numa = numa()
         self.profile = profile()
 
         # Logger config.
 
+        self.log_queue = log_queue()
         self.loggers = loggers()
         self.handlers = handlers()
         self.formatters = formatters()
@@ -64,6 +64,13 @@ class UnsupportedOperation(Error):
         self.reason = reason
 
 
+class TooManyJobs(Error):
+    msg = "Too many jobs: {self.max_jobs}"
+
+    def __init__(self, max_jobs):
+        self.max_jobs = max_jobs
+
+
 class TlsConfigurationError(Error):
     msg = ("TLS enabled (see [tls] section in daemon.conf), but not "
            "configured: ca_file = {self.cfg.ca_file}, cert_file = "
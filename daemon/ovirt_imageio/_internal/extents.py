@@ -30,7 +30,7 @@ class Handler:
             raise http.Error(http.BAD_REQUEST, "Ticket id is required")
 
         try:
-            ticket = self.auth.authorize(ticket_id, "read")
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
             ctx = backends.get(req, ticket, self.config)
         except errors.AuthorizationError as e:
             resp.close_connection()
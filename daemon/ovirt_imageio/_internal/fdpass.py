@@ -0,0 +1,148 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import logging
+import os
+import stat
+
+from . import errors
+from . import http
+from . import nbd
+from . import util
+
+log = logging.getLogger("fdpass")
+
+
+class Handler:
+    """
+    Handle requests for the /images/ticket-id/fd resource.
+
+    Pass the image file descriptor, or a connected NBD socket, to a local
+    client using SCM_RIGHTS, so the client can do the I/O itself without
+    copying the data through the daemon. Available only on the local service
+    when local:fd_passing is enabled. File tickets served by qemu-nbd pass a
+    socket connected to qemu-nbd.
+
+    A file descriptor cannot be limited to a byte range, and cannot be
+    revoked when the ticket is removed. To keep the client within the ticket
+    bounds, the ticket must allow access to the entire image, and read only
+    tickets get read only file descriptors. Writable tickets using a block
+    cache cannot pass file descriptors.
+    """
+
+    def __init__(self, config, auth):
+        self.config = config
+        self.auth = auth
+
+    def get(self, req, resp, ticket_id):
+        if not ticket_id:
+            raise http.Error(http.BAD_REQUEST, "Ticket id is required")
+
+        try:
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
+        except errors.AuthorizationError as e:
+            resp.close_connection()
+            raise http.Error(http.FORBIDDEN, str(e))
+
+        writable = "write" in ticket.ops
+
+        if writable and ticket.block_cache:
+            # Writes using the file descriptor bypass the block cache, so
+            # the cache would serve stale data.
+            raise http.Error(
+                http.FORBIDDEN,
+                "Ticket {} uses a block cache, cannot pass writable file "
+                "descriptor".format(ticket_id))
+
+        if ticket.export is not None:
+            # The image is served by qemu-nbd, and may not be a raw image.
+            fd, info = self._open_nbd(ticket, ticket.export.url(), writable)
+        elif ticket.url.scheme == "file":
+            fd, info = self._open_file(ticket, writable)
+        elif ticket.url.scheme == "nbd":
+            fd, info = self._open_nbd(ticket, ticket.url, writable)
+        else:
+            raise http.Error(
+                http.NOT_FOUND,
+                "Backend {!r} does not support passing file descriptors"
+                .format(ticket.url.scheme))
+
+        try:
+            if ticket.size < info["size"]:
+                raise http.Error(
+                    http.FORBIDDEN,
+                    "Ticket {} does not allow access to the entire image"
+                    .format(ticket_id))
+
+            # Passing a file descriptor is considered as client activity.
+            ticket.touch()
+
+            log.info("[%s] PASS FD info=%s ticket=%s",
+                     req.client_addr, info, ticket_id)
+            resp.send_fds(info, [fd])
+        finally:
+            os.close(fd)
+
+    def _open_file(self, ticket, writable):
+        """
+        Open the image and return file descriptor and image info.
+        """
+        mode = "r+" if writable else "r"
+        fio = util.open(ticket.url.path, mode, direct=True)
+        try:
+            fd = fio.fileno()
+            st = os.fstat(fd)
+            if stat.S_ISBLK(st.st_mode):
+                size = os.lseek(fd, 0, os.SEEK_END)
+                os.lseek(fd, 0, os.SEEK_SET)
+            else:
+                size = st.st_size
+            fd = os.dup(fd)
+        finally:
+            fio.close()
+
+        info = {
+            "type": "file",
+            "size": size,
+            "writable": writable,
+            "direct": True,
+        }
+        return fd, info
+
+    def _open_nbd(self, ticket, url, writable):
+        """
+        Connect to the NBD server at url and return the connected socket in
+        the transmission phase and the negotiated session info.
+        """
+        client = nbd.open(url, dirty=ticket.dirty)
+        try:
+            read_only = bool(client.transmission_flags & nbd.FLAG_READ_ONLY)
+            if not writable and not read_only:
+                # We cannot prevent the client from writing to the export.
+                raise http.Error(
+                    http.FORBIDDEN,
+                    "Ticket {} is read only, but the NBD export is writable"
+                    .format(ticket.uuid))
+
+            info = {
+                "type": "nbd",
+                "size": client.export_size,
+                "writable": not read_only,
+                "transmission_flags": client.transmission_flags,
+                "structured_reply": client.structured_reply,
+                "meta_context": client.meta_context,
+                "dirty_bitmap": client.dirty_bitmap,
+                "minimum_block_size": client.minimum_block_size,
+                "preferred_block_size": client.preferred_block_size,
+                "maximum_block_size": client.maximum_block_size,
+            }
+            fd = client.detach()
+        finally:
+            client.close()
+
+        return fd, info
@@ -0,0 +1,387 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+handoff - restart the daemon without refusing connections.
+
+The daemon can use listening sockets inherited from systemd socket
+activation, or from a previous daemon process. Inherited sockets are
+matched to services by address, so the order of the sockets and the socket
+names do not matter.
+
+When the daemon receives SIGUSR2, it saves the installed tickets and starts
+a new daemon process, passing the listening sockets and the tickets. When
+the new daemon is ready, the old daemon stops accepting connections and
+waits until the active connections are finished. New connections are
+accepted by the new daemon from the same listening sockets, so no
+connection is refused during the restart.
+
+Until the old daemon connections are finished, the old daemon reports the
+number of connections using every ticket to the new daemon, and the new
+daemon reports the tickets to cancel to the old daemon. The new daemon
+considers tickets used by the old daemon connections as active, and does
+not remove them until the old daemon connections are finished.
+"""
+
+import json
+import logging
+import os
+import select
+import socket
+import subprocess
+import sys
+import threading
+
+from . import util
+
+log = logging.getLogger("handoff")
+
+# File descriptors passed by systemd start at 3. See sd_listen_fds(3).
+LISTEN_FDS_START = 3
+
+# Environment variables set by the old daemon for the new daemon.
+HANDOFF_FDS = "OVIRT_IMAGEIO_HANDOFF_FDS"
+HANDOFF_STATE = "OVIRT_IMAGEIO_HANDOFF_STATE"
+HANDOFF_READY = "OVIRT_IMAGEIO_HANDOFF_READY"
+HANDOFF_PEER = "OVIRT_IMAGEIO_HANDOFF_PEER"
+
+_SYSTEMD_VARS = ("LISTEN_PID", "LISTEN_FDS", "LISTEN_FDNAMES")
+
+
+class Sockets:
+    """
+    Listening sockets inherited by this process, taken by the services
+    listening on the socket address.
+    """
+
+    def __init__(self, socks=(), from_handoff=False):
+        self._socks = list(socks)
+        # True if the sockets were passed by the old daemon.
+        self.from_handoff = from_handoff
+
+    @classmethod
+    def from_environment(cls, environ=None):
+        """
+        Create sockets passed by systemd or by the old daemon, removing the
+        environment variables so child processes do not inherit them.
+        """
+        if environ is None:
+            environ = os.environ
+        from_handoff = HANDOFF_FDS in environ
+        fds = systemd_fds(environ) + handoff_fds(environ)
+        socks = [_from_fd(fd) for fd in fds]
+        for sock in socks:
+            log.info("Inherited socket %r", _address(sock))
+        return cls(socks, from_handoff=from_handoff)
+
+    def take_tcp(self, port):
+        """
+        Return the TCP socket listening on port, or None.
+        """
+        for sock in self._socks:
+            if (sock.family in (socket.AF_INET, socket.AF_INET6) and
+                    sock.getsockname()[1] == port):
+                self._socks.remove(sock)
+                return sock
+        return None
+
+    def take_unix(self, path):
+        """
+        Return the unix socket listening on path, or None.
+        """
+        for sock in self._socks:
+            if sock.family == socket.AF_UNIX and _address(sock) == path:
+                self._socks.remove(sock)
+                return sock
+        return None
+
+    def close(self):
+        """
+        Close sockets not used by any service.
+        """
+        for sock in self._socks:
+            log.warning("Closing unused inherited socket %r", _address(sock))
+            sock.close()
+        self._socks = []
+
+
+class Peer:
+    """
+    Connection between the old and the new daemon during handoff, sending
+    and receiving JSON messages.
+
+    Thread safety: send() may be called from multiple threads. receive()
+    must be called from a single thread.
+    """
+
+    def __init__(self, sock):
+        self._sock = sock
+        self._lock = threading.Lock()
+        self._buf = b""
+
+    def send(self, msg):
+        data = json.dumps(msg).encode("utf-8") + b"\n"
+        with self._lock:
+            self._sock.sendall(data)
+
+    def receive(self, timeout=None):
+        """
+        Return the next message, or None if no message was received within
+        timeout seconds.
+
+        Raises EOFError if the peer closed the connection.
+        """
+        while b"\n" not in self._buf:
+            if timeout is not None:
+                readable, _, _ = util.uninterruptible(
+                    select.select, [self._sock], [], [], timeout)
+                if not readable:
+                    return None
+            data = util.uninterruptible(self._sock.recv, 4096)
+            if not data:
+                raise EOFError("Peer closed the connection")
+            self._buf += data
+
+        line, self._buf = self._buf.split(b"\n", 1)
+        return json.loads(line)
+
+    def close(self):
+        self._sock.close()
+
+
+def systemd_fds(environ):
+    """
+    Return file descriptors passed by systemd socket activation.
+    """
+    try:
+        pid = int(environ.get("LISTEN_PID", "0"))
+        count = int(environ.get("LISTEN_FDS", "0"))
+    except ValueError:
+        log.warning("Ignoring invalid systemd socket activation variables")
+        count = 0
+    else:
+        # Variables inherited from our parent are not for us.
+        if pid != os.getpid():
+            count = 0
+
+    for name in _SYSTEMD_VARS:
+        environ.pop(name, None)
+
+    return list(range(LISTEN_FDS_START, LISTEN_FDS_START + count))
+
+
+def handoff_fds(environ):
+    """
+    Return file descriptors passed by the old daemon during handoff.
+    """
+    value = environ.pop(HANDOFF_FDS, "")
+    return [int(fd) for fd in value.split(",") if fd]
+
+
+def save_tickets(auth, path):
+    """
+    Save the installed tickets for the new daemon. The file is readable only
+    by the daemon user since ticket ids grant access to images.
+    """
+    tickets = auth.dump()
+    fd = os.open(path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o600)
+    with os.fdopen(fd, "w") as f:
+        json.dump(tickets, f)
+    log.info("Saved %d tickets to %s", len(tickets), path)
+
+
+def load_tickets(auth, environ=None):
+    """
+    Install the tickets saved by the old daemon, if started during handoff.
+    """
+    if environ is None:
+        environ = os.environ
+    path = environ.pop(HANDOFF_STATE, None)
+    if path is None:
+        return
+
+    with open(path) as f:
+        tickets = json.load(f)
+    os.unlink(path)
+
+    for ticket_dict in tickets:
+        try:
+            auth.add(ticket_dict)
+        except Exception:
+            log.exception("Cannot restore ticket %s",
+                          ticket_dict.get("uuid"))
+
+    log.info("Restored %d tickets from %s", len(tickets), path)
+
+
+def notify_ready(environ=None):
+    """
+    Tell the old daemon that we are ready for requests. Returns True if the
+    daemon was started during handoff.
+    """
+    if environ is None:
+        environ = os.environ
+    value = environ.pop(HANDOFF_READY, None)
+    if value is None:
+        return False
+
+    fd = int(value)
+    try:
+        os.write(fd, b"1")
+    finally:
+        os.close(fd)
+    return True
+
+
+def connect_old_daemon(auth, environ=None):
+    """
+    Connect to the old daemon, if started during handoff, and get the
+    number of connections using the tickets in the old daemon.
+
+    Returns Peer connected to the old daemon, or None.
+    """
+    if environ is None:
+        environ = os.environ
+    value = environ.pop(HANDOFF_PEER, None)
+    if value is None:
+        return None
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM, fileno=int(value))
+    peer = Peer(sock)
+
+    # The old daemon sends the connections after starting us, and waits
+    # until we are ready.
+    try:
+        msg = peer.receive()
+    except BaseException:
+        peer.close()
+        raise
+
+    auth.inherit_connections(msg["connections"])
+    auth.old_daemon = peer
+    return peer
+
+
+def watch_old_daemon(auth):
+    """
+    Start a thread updating the number of connections using the tickets in
+    the old daemon, until the old daemon connections are finished.
+    """
+    util.start_thread(_watch_old_daemon, args=(auth,), name="handoff")
+
+
+def _watch_old_daemon(auth):
+    peer = auth.old_daemon
+    try:
+        while True:
+            msg = peer.receive()
+            auth.inherit_connections(msg["connections"])
+    except EOFError:
+        log.info("Old daemon connections finished")
+    except Exception:
+        log.exception("Error receiving connections from old daemon")
+    finally:
+        auth.old_daemon = None
+        auth.inherit_connections({})
+        peer.close()
+
+
+def spawn(config, auth, socks, argv=None):
+    """
+    Start a new daemon inheriting the listening sockets and the tickets, and
+    wait until it is ready for requests.
+
+    Returns Peer connected to the new daemon if the new daemon is ready. The
+    caller should report the number of connections using the tickets until
+    the connections are finished, and then close the peer. If the new daemon
+    failed or was not ready within config.daemon.handoff_timeout seconds, it
+    is killed and None is returned; the current daemon should continue to
+    serve requests.
+    """
+    if argv is None:
+        argv = [sys.executable] + sys.argv
+
+    path = os.path.join(config.daemon.run_dir, "handoff.json")
+    save_tickets(auth, path)
+
+    fds = [sock.fileno() for sock in socks]
+    parent, child = socket.socketpair()
+    peer = Peer(parent)
+    r, w = os.pipe()
+    try:
+        env = dict(os.environ)
+        for name in _SYSTEMD_VARS:
+            env.pop(name, None)
+        env[HANDOFF_FDS] = ",".join(str(fd) for fd in fds)
+        env[HANDOFF_STATE] = path
+        env[HANDOFF_READY] = str(w)
+        env[HANDOFF_PEER] = str(child.fileno())
+
+        log.info("Starting new daemon %s", argv)
+        proc = subprocess.Popen(
+            argv, env=env, pass_fds=fds + [w, child.fileno()])
+    except BaseException:
+        os.close(r)
+        peer.close()
+        _remove(path)
+        raise
+    finally:
+        os.close(w)
+        child.close()
+
+    with os.fdopen(r, "rb") as f:
+        # The new daemon waits for the connections before it is ready, so
+        # it knows which tickets are used when it starts to serve requests.
+        try:
+            peer.send({"connections": auth.ticket_connections()})
+        except OSError as e:
+            log.error("Error sending connections to new daemon: %s", e)
+            ready = False
+        else:
+            ready = _wait_ready(f, config.daemon.handoff_timeout)
+
+    if not ready:
+        log.error("New daemon pid=%s was not ready, killing it", proc.pid)
+        proc.kill()
+        proc.wait()
+        peer.close()
+        _remove(path)
+        return None
+
+    log.info("New daemon pid=%s is ready", proc.pid)
+    return peer
+
+
+def _wait_ready(f, timeout):
+    # The new daemon writes one byte when ready. If the new daemon exits,
+    # we get EOF.
+    readable, _, _ = util.uninterruptible(select.select, [f], [], [], timeout)
+    return bool(readable) and f.read(1) == b"1"
+
+
+def _from_fd(fd):
+    # Python 3.6 does not detect the family of a socket created from a file
+    # descriptor.
+    tmp = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM, fileno=fd)
+    family = tmp.getsockopt(socket.SOL_SOCKET, socket.SO_DOMAIN)
+    tmp.detach()
+    return socket.socket(family, socket.SOCK_STREAM, fileno=fd)
+
+
+def _address(sock):
+    address = sock.getsockname()
+    # Abstract unix socket addresses are returned as bytes.
+    if sock.family == socket.AF_UNIX:
+        address = util.ensure_text(address)
+    return address
+
+
+def _remove(path):
+    try:
+        os.unlink(path)
+    except FileNotFoundError:
+        pass
@@ -6,11 +6,11 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import array
 import errno
 import http.server
 import io
 import ipaddress
-import itertools
 import json
 import logging
 import re
@@ -19,6 +19,7 @@ import socketserver
 import urllib
 
 from . import stats
+from . import util
 from . import version
 
 log = logging.getLogger("http")
@@ -27,6 +28,7 @@ log = logging.getLogger("http")
 # See https://tools.ietf.org/html/rfc2616#section-6.1.1
 CONTINUE = 100
 OK = 200
+ACCEPTED = 202
 NO_CONTENT = 204
 PARTIAL_CONTENT = 206
 BAD_REQUEST = 400
@@ -38,6 +40,7 @@ CONFLICT = 409
 REQUEST_URI_TOO_LARGE = 414
 REQUESTED_RANGE_NOT_SATISFIABLE = 416
 INTERNAL_SERVER_ERROR = 500
+SERVICE_UNAVAILABLE = 503
 
 # Taken from asyncore.py. Treat these as expected error when reading or writing
 # to client connection.
@@ -74,22 +77,37 @@ class Server(socketserver.ThreadingMixIn,
     # A callable called for every request.
     app = None
 
+    # Set after handing off the listening socket to a new daemon. Keep-alive
+    # connections are closed after the next response, so clients reconnect
+    # to the new daemon.
+    draining = False
+
     # Clock used to profile connections. The default NullClock does not
     # profile anything to minimize overhead. Set to stats.Clock to enable
     # profiling.
     clock_class = stats.NullClock
 
-    def __init__(self, server_address, RequestHandlerClass, prefer_ipv4=False):
+    def __init__(self, server_address, RequestHandlerClass, prefer_ipv4=False,
+                 reuse_port=False, sock=None):
         super().__init__(
             server_address, RequestHandlerClass, bind_and_activate=False)
 
+        # If set, multiple processes can listen on the same port, and the
+        # kernel distributes incoming connections between them.
+        self.reuse_port = reuse_port
+
         # Close old socket created in parent constructor.
         if self.socket:
             self.socket.close()
 
         try:
-            self.create_socket(prefer_ipv4)
-            self.server_bind()
+            if sock is None:
+                self.create_socket(prefer_ipv4)
+                self.server_bind()
+            else:
+                # Listening socket inherited from systemd or from the
+                # previous daemon, already bound.
+                self.use_socket(sock)
             self.server_activate()
         except BaseException:
             self.server_close()
@@ -122,10 +140,24 @@ class Server(socketserver.ThreadingMixIn,
             self.socket_type)
         self.socket = socket.socket(self.address_family, self.socket_type)
 
+    def use_socket(self, sock):
+        """
+        Use an inherited bound socket instead of creating a new one.
+        """
+        self.socket = sock
+        self.address_family = sock.family
+        self.server_address = sock.getsockname()[:2]
+        host, port = self.server_address
+        self.server_name = socket.getfqdn(host)
+        self.server_port = port
+
     def server_bind(self):
         """
         Override server_bind to make server_address uniform.
         """
+        if self.reuse_port:
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+
         super().server_bind()
 
         # TCPServer.server_bind() overwrites server_address with
@@ -165,7 +197,7 @@ class Connection(http.server.BaseHTTPRequestHandler):
 
     # For generating connection ids. Start from 1 to match the connection
     # thread name.
-    _counter = itertools.count(1)
+    _counter = util.Sequence(1)
 
     def setup(self):
         self.id = next(self._counter)
@@ -293,6 +325,13 @@ class Request:
     def connection_id(self):
         return self._con.id
 
+    @property
+    def socket(self):
+        """
+        Return the connection socket.
+        """
+        return self._con.connection
+
     @property
     def clock(self):
         """
@@ -496,19 +535,61 @@ class Response:
             self.headers["content-range"] = e.content_range
         self.write(body)
 
-    def send_json(self, obj):
+    def send_json(self, obj, status_code=OK):
         """
         Send a JSON response.
         """
         if self._started:
             raise AssertionError("Response already sent")
 
-        self.status_code = OK
+        self.status_code = status_code
         body = json.dumps(obj).encode("utf-8") + b"\n"
         self.headers["content-length"] = len(body)
         self.headers["content-type"] = "application/json"
         self.write(body)
 
+    def send_fds(self, obj, fds):
+        """
+        Send a JSON response, passing file descriptors fds to the client
+        using SCM_RIGHTS. Supported only on unix socket.
+
+        The file descriptors are attached to the first byte of the response,
+        so the client must receive the response using recvmsg().
+        """
+        if self._started:
+            raise AssertionError("Response already sent")
+
+        self._started = True
+        self.status_code = OK
+        body = json.dumps(obj).encode("utf-8") + b"\n"
+        self.headers["content-length"] = len(body)
+        self.headers["content-type"] = "application/json"
+
+        b = io.BytesIO()
+        self._write_header(b)
+        b.write(body)
+        data = b.getvalue()
+
+        sock = self._con.connection
+        fds = array.array("i", fds)
+        n = sock.sendmsg(
+            [data], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, fds)])
+        if n < len(data):
+            sock.sendall(data[n:])
+
+    def takeover(self):
+        """
+        Take over the connection after sending the response, for using
+        another protocol on the same connection. Returns the connection
+        (rfile, wfile). The connection is closed when the request handler
+        returns.
+        """
+        if not self._started:
+            raise AssertionError("Response was not sent")
+
+        self._con.close_connection = True
+        return self._con.rfile, self._con.wfile
+
     def close_connection(self):
         """
         Mark the connection for closing when the request completes.
@@ -546,6 +627,9 @@ class Response:
         Write HTTP header to buffer b, avoiding one syscall per line in python
         2.7.
         """
+        if self._con.server.draining:
+            self.close_connection()
+
         if self.status_code in self._con.responses:
             msg = self._con.responses[self.status_code][0].encode("latin1")
         else:
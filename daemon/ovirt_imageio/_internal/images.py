@@ -13,12 +13,13 @@ from . import backends
 from . import cors
 from . import errors
 from . import http
+from . import jobs
 from . import ops
 from . import validate
 
 log = logging.getLogger("images")
 
-BASE_FEATURES = ("checksum", "extents")
+BASE_FEATURES = ("checksum", "compare", "extents")
 ALL_FEATURES = BASE_FEATURES + ("flush", "zero")
 
 
@@ -53,7 +54,7 @@ class Handler:
         flush = (flush == "y")
 
         try:
-            ticket = self.auth.authorize(ticket_id, "write")
+            ticket = self.auth.authorize(ticket_id, "write", req.context)
             ctx = backends.get(req, ticket, self.config)
         except errors.AuthorizationError as e:
             resp.close_connection()
@@ -65,14 +66,15 @@ class Handler:
             "[%s] WRITE size=%d offset=%d flush=%s close=%s ticket=%s",
             req.client_addr, size, offset, flush, close, ticket_id)
 
-        op = ops.Write(
+        op = ops.PipelinedWrite(
             ctx.backend,
             req,
-            ctx.buffer,
+            ctx.buffers,
             size,
             offset=offset,
             flush=flush,
-            clock=req.clock)
+            clock=req.clock,
+            pipeline=ctx.pipeline)
         try:
             ticket.run(op)
         except errors.AuthorizationError as e:
@@ -108,7 +110,7 @@ class Handler:
                 # TODO: validate size with actual image size.
 
         try:
-            ticket = self.auth.authorize(ticket_id, "read")
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
             ctx = backends.get(req, ticket, self.config)
         except errors.AuthorizationError as e:
             resp.close_connection()
@@ -137,13 +139,14 @@ class Handler:
             resp.headers["content-range"] = "bytes %d-%d/%d" % (
                 offset, offset + size - 1, ticket.size)
 
-        op = ops.Read(
+        op = ops.PipelinedRead(
             ctx.backend,
             resp,
-            ctx.buffer,
+            ctx.buffers,
             size,
             offset=offset,
-            clock=req.clock)
+            clock=req.clock,
+            pipeline=ctx.pipeline)
         try:
             ticket.run(op)
         except errors.AuthorizationError as e:
@@ -176,10 +179,10 @@ class Handler:
         size = validate.integer(msg, "size", minval=0)
         offset = validate.integer(msg, "offset", minval=0, default=0)
         flush = validate.boolean(msg, "flush", default=False)
+        run_async = jobs.requested(req, msg)
 
         try:
-            ticket = self.auth.authorize(ticket_id, "write")
-            ctx = backends.get(req, ticket, self.config)
+            ticket = self.auth.authorize(ticket_id, "write", req.context)
         except errors.AuthorizationError as e:
             resp.close_connection()
             raise http.Error(http.FORBIDDEN, str(e))
@@ -187,8 +190,27 @@ class Handler:
         validate.allowed_range(offset, size, ticket)
 
         log.debug(
-            "[%s] ZERO size=%d offset=%d flush=%s ticket=%s",
-            req.client_addr, size, offset, flush, ticket_id)
+            "[%s] ZERO size=%d offset=%d flush=%s async=%s ticket=%s",
+            req.client_addr, size, offset, flush, run_async, ticket_id)
+
+        if run_async:
+            def zero(job):
+                ctx = backends.get(job, ticket, self.config)
+                op = ops.Zero(
+                    ctx.backend,
+                    size,
+                    offset=offset,
+                    flush=flush,
+                    clock=job.clock)
+                job.run_operation(op)
+
+            return jobs.start(req, resp, self.auth, ticket, "zero", zero)
+
+        try:
+            ctx = backends.get(req, ticket, self.config)
+        except errors.AuthorizationError as e:
+            resp.close_connection()
+            raise http.Error(http.FORBIDDEN, str(e))
 
         op = ops.Zero(
             ctx.backend,
@@ -206,14 +228,29 @@ class Handler:
             raise http.Error(http.BAD_REQUEST, str(e))
 
     def _flush(self, req, resp, ticket_id, msg):
+        run_async = jobs.requested(req, msg)
+
         try:
-            ticket = self.auth.authorize(ticket_id, "write")
-            ctx = backends.get(req, ticket, self.config)
+            ticket = self.auth.authorize(ticket_id, "write", req.context)
         except errors.AuthorizationError as e:
             resp.close_connection()
             raise http.Error(http.FORBIDDEN, str(e))
 
-        log.info("[%s] FLUSH ticket=%s", req.client_addr, ticket_id)
+        log.info("[%s] FLUSH async=%s ticket=%s",
+                 req.client_addr, run_async, ticket_id)
+
+        if run_async:
+            def flush(job):
+                ctx = backends.get(job, ticket, self.config)
+                job.run_operation(ops.Flush(ctx.backend, clock=job.clock))
+
+            return jobs.start(req, resp, self.auth, ticket, "flush", flush)
+
+        try:
+            ctx = backends.get(req, ticket, self.config)
+        except errors.AuthorizationError as e:
+            resp.close_connection()
+            raise http.Error(http.FORBIDDEN, str(e))
 
         op = ops.Flush(ctx.backend, clock=req.clock)
 
@@ -242,7 +279,7 @@ class Handler:
         else:
             # Reporting real image capabilities per ticket.
             try:
-                ticket = self.auth.authorize(ticket_id, "read")
+                ticket = self.auth.authorize(ticket_id, "read", req.context)
                 ctx = backends.get(req, ticket, self.config)
             except errors.AuthorizationError as e:
                 resp.close_connection()
@@ -10,12 +10,16 @@ io - I/O operations on backends.
 """
 
 import logging
+import os
 import threading
 
 from collections import deque, namedtuple
 from contextlib import closing
 from functools import partial
 
+from . import errors
+from . import ioutil
+from . import progress as _progress
 from . import util
 
 # Limit maximum zero and copy size to spread the workload better to multiple
@@ -39,6 +43,24 @@ def copy(src, dst, dirty=False, max_workers=MAX_WORKERS,
 
     buffer_size = min(buffer_size, MAX_BUFFER_SIZE)
 
+    if progress:
+        progress.size = src.size()
+        # Workers update the progress concurrently, but the progress object
+        # may not support concurrent updates.
+        reporter = _progress.Reporter(progress)
+    else:
+        reporter = None
+
+    try:
+        _copy(src, dst, dirty, max_workers, buffer_size, zero, hole, reporter,
+              name)
+    finally:
+        if reporter:
+            reporter.flush()
+
+
+def _copy(src, dst, dirty, max_workers, buffer_size, zero, hole, progress,
+          name):
     with Executor(name=name) as executor:
         # This is a bit ugly. We get src and dst backends, to keep same
         # interface as the non-concurrent version. We use src backend here to
@@ -47,15 +69,14 @@ def copy(src, dst, dirty=False, max_workers=MAX_WORKERS,
 
         # The first worker clones src and use dst itself.
         executor.add_worker(
-            partial(Handler, src.clone, lambda: dst, buffer_size, progress))
+            partial(Handler, src.clone, lambda: dst, buffer_size, progress,
+                    executor.canceled, zero))
 
         # The rest of the workers clone both src and dst.
         for _ in range(max_workers - 1):
             executor.add_worker(
-                partial(Handler, src.clone, dst.clone, buffer_size, progress))
-
-        if progress:
-            progress.size = src.size()
+                partial(Handler, src.clone, dst.clone, buffer_size, progress,
+                        executor.canceled, zero))
 
         try:
             # Submit requests to executor.
@@ -135,12 +156,20 @@ class Executor:
         self._workers = []
         self._queue = Queue(queue_depth)
         self._errors = []
+        # Set when the executor is aborted or a worker fails, stopping
+        # handlers copying without holding the GIL.
+        self._canceled = bytearray(1)
 
     # Public interface.
 
+    @property
+    def canceled(self):
+        return self._canceled
+
     def add_worker(self, handler_factory):
         name = "{}/{}".format(self._name, len(self._workers))
-        w = Worker(handler_factory, self._queue, self._errors, name=name)
+        w = Worker(handler_factory, self._queue, self._errors, self._canceled,
+                   name=name)
         self._workers.append(w)
 
     def submit(self, req):
@@ -171,6 +200,7 @@ class Executor:
         workers exit.
         """
         log.debug("Aborting executor %s", self._name)
+        self._canceled[0] = 1
         self._queue.close()
         self._join_workers()
 
@@ -212,10 +242,12 @@ class Executor:
 
 class Worker:
 
-    def __init__(self, handler_factory, queue, errors, name="worker"):
+    def __init__(self, handler_factory, queue, errors, canceled,
+                 name="worker"):
         self._handler_factory = handler_factory
         self._queue = queue
         self._errors = errors
+        self._canceled = canceled
         self._name = name
 
         log.debug("Starting worker %s", name)
@@ -243,6 +275,7 @@ class Worker:
             log.debug("Worker %s cancelled", self._name)
         except Exception as e:
             self._errors.append(e)
+            self._canceled[0] = 1
             self._queue.close()
             log.exception("Worker %s failed", self._name)
         else:
@@ -252,7 +285,7 @@ class Worker:
 class Handler:
 
     def __init__(self, src_factory, dst_factory, buffer_size=BUFFER_SIZE,
-                 progress=None):
+                 progress=None, canceled=None, zero=True):
         # Connecting to backend server may fail. Don't leave open connections
         # after failures.
         self._src = src_factory()
@@ -262,8 +295,21 @@ class Handler:
             self._src.close()
             raise
 
-        self._buf = bytearray(buffer_size)
+        # Aligned buffer is required when copying between file descriptors
+        # using direct I/O.
+        self._buf = util.aligned_buffer(buffer_size)
         self._progress = progress
+        self._canceled = canceled
+        # If False, the destination is zeroed, and holes read from the source
+        # are skipped.
+        self._zero = zero
+
+        # If both backends are backed by file descriptors, copy the data
+        # natively without holding the GIL.
+        self._can_pump = (hasattr(self._src, "fileno") and
+                          hasattr(self._dst, "fileno"))
+        if self._can_pump:
+            self._align = max(self._src.block_size, self._dst.block_size)
 
     def zero(self, req):
         # TODO: Assumes complete zero(); not compatible with file backend.
@@ -276,16 +322,30 @@ class Handler:
         self._src.seek(req.start)
         self._dst.seek(req.start)
 
-        if hasattr(self._dst, "read_from"):
+        # Server side copy may copy only part of the request, or nothing.
+        count = self._copy_from(req)
+        if count < req.length:
+            rest = Request(req.op, req.start + count, req.length - count)
+            if count:
+                self._src.seek(rest.start)
+                self._dst.seek(rest.start)
+            self._copy(rest)
+
+        if self._progress:
+            self._progress.update(req.length)
+
+    def _copy(self, req):
+        if self._can_pump and req.start % self._align == 0:
+            self._pump(req)
+        elif hasattr(self._dst, "read_from"):
             self._dst.read_from(self._src, req.length, self._buf)
         elif hasattr(self._src, "write_to"):
             self._src.write_to(self._dst, req.length, self._buf)
+        elif hasattr(self._src, "readinto_holes"):
+            self._sparse_copy(req)
         else:
             self._generic_copy(req)
 
-        if self._progress:
-            self._progress.update(req.length)
-
     def flush(self, req):
         self._dst.flush()
 
@@ -300,6 +360,100 @@ class Handler:
                 self._src.close()
             except Exception:
                 log.exception("Error closing %s", self._src)
+            finally:
+                self._buf.close()
+
+    def _copy_from(self, req):
+        """
+        Try server side copy, returning the number of bytes copied.
+        """
+        if not hasattr(self._dst, "copy_from"):
+            return 0
+
+        count = self._dst.copy_from(
+            self._src, req.length, canceled=self._canceled)
+        if count is None:
+            return 0
+
+        self._check_canceled()
+        return count
+
+    def _pump(self, req):
+        """
+        Copy request between file descriptors without holding the GIL.
+
+        copy_data() pads unaligned writes with zeroes, so only the aligned
+        part is copied by copy_data(), and the unaligned end of the last
+        request is copied using the backends.
+        """
+        length = util.round_down(req.length, self._align)
+        if length:
+            ioutil.copy_data(
+                self._src.fileno(), self._dst.fileno(), req.start, length,
+                self._buf, align=self._align, canceled=self._canceled)
+            self._check_canceled()
+
+        if length < req.length:
+            self._copy_tail(req.start + length, req.length - length)
+
+    def _copy_tail(self, start, length):
+        """
+        Copy the unaligned end of the source using read-modify-write of the
+        last destination block. Bytes after the end of the source keep
+        their content, and if the destination file was extended to block
+        size, it is truncated back, so we never write after the end of the
+        source.
+        """
+        end = start + length
+        dst_size = self._dst.size()
+
+        block = util.aligned_buffer(self._align)
+        with closing(block):
+            self._dst.seek(start)
+            self._dst.readinto(block)
+
+            with memoryview(self._buf)[:self._align] as view:
+                self._src.seek(start)
+                read = self._src.readinto(view)
+                if read < length:
+                    raise errors.PartialContent(length, read)
+                block[:length] = view[:length]
+
+            self._dst.seek(start)
+            self._dst.write(block)
+
+        if self._dst.size() > max(dst_size, end):
+            os.ftruncate(self._dst.fileno(), max(dst_size, end))
+
+    def _check_canceled(self):
+        if self._canceled and self._canceled[0]:
+            raise Closed
+
+    def _sparse_copy(self, req):
+        """
+        Copy request from source reporting holes in read data. Holes are
+        zeroed or skipped instead of writing the zeroes to the destination.
+        """
+        # TODO: Assumes complete write() and zero(); not compatible with
+        # file backend.
+        align = self._dst.block_size
+        pos = req.start
+        end = req.start + req.length
+
+        while pos < end:
+            with memoryview(self._buf)[:min(end - pos, len(self._buf))] as v:
+                count, holes = self._src.readinto_holes(v)
+                for start, length, hole in _segments(pos, count, holes, align):
+                    if hole and not self._zero:
+                        continue
+                    self._dst.seek(start)
+                    if hole:
+                        self._dst.zero(length)
+                    else:
+                        with v[start - pos:start - pos + length] as data:
+                            self._dst.write(data)
+            pos += count
+            self._check_canceled()
 
     def _generic_copy(self, req):
         # TODO: Assumes complete readinto() and write(); not compatible with
@@ -317,6 +471,28 @@ class Handler:
             self._dst.write(view)
 
 
+def _segments(offset, length, holes, align):
+    """
+    Split length bytes read at offset to (start, length, hole) segments,
+    using holes (start, length) ranges relative to offset. Holes are
+    shrunk to align, since zeroing unaligned ranges is slower than writing
+    the zeroes; the rest of the hole is written as data.
+    """
+    pos = offset
+    end = offset + length
+    for start, size in holes:
+        hole_start = util.round_up(offset + start, align)
+        hole_end = util.round_down(offset + start + size, align)
+        if hole_end <= hole_start:
+            continue
+        if hole_start > pos:
+            yield pos, hole_start - pos, False
+        yield hole_start, hole_end - hole_start, True
+        pos = hole_end
+    if pos < end:
+        yield pos, end - pos, False
+
+
 class Closed(Exception):
     """
     Raised when trying to access a closed queue.
@@ -333,7 +509,12 @@ class Queue:
     """
 
     def __init__(self, max_size):
-        self._cond = threading.Condition(threading.Lock())
+        # Producers and consumers wait on separate conditions, so notify()
+        # wakes up the right kind of thread when there are multiple
+        # producers and consumers.
+        lock = threading.Lock()
+        self._not_empty = threading.Condition(lock)
+        self._not_full = threading.Condition(lock)
         self._queue = deque(maxlen=max_size)
         self._closed = False
 
@@ -342,29 +523,29 @@ class Queue:
         return self._closed
 
     def put(self, item):
-        with self._cond:
-            self._wait_while(length=self._queue.maxlen)
+        with self._not_full:
+            self._wait_while(self._not_full, length=self._queue.maxlen)
             self._queue.append(item)
-            self._cond.notify()
+            self._not_empty.notify()
 
     def get(self):
-        with self._cond:
-            self._wait_while(length=0)
+        with self._not_empty:
+            self._wait_while(self._not_empty, length=0)
             item = self._queue.popleft()
-            if len(self._queue) == self._queue.maxlen - 1:
-                self._cond.notify()
+            self._not_full.notify()
             return item
 
-    def _wait_while(self, length):
+    def _wait_while(self, cond, length):
         if self._closed:
             raise Closed
         while len(self._queue) == length:
-            self._cond.wait()
+            cond.wait()
             if self._closed:
                 raise Closed
 
     def close(self):
-        with self._cond:
+        with self._not_empty:
             self._closed = True
             self._queue.clear()
-            self._cond.notify_all()
+            self._not_empty.notify_all()
+            self._not_full.notify_all()
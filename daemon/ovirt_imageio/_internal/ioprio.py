@@ -0,0 +1,91 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+ioprio - storage I/O scheduling priority.
+
+The priority is set on the thread doing the storage I/O while running an
+operation. Threads started by the operation inherit the priority. The
+priority is effective only with I/O schedulers supporting priorities, like
+bfq and mq-deadline.
+"""
+
+import contextlib
+import logging
+
+from . import ioutil
+
+log = logging.getLogger("ioprio")
+
+# Supported I/O scheduling classes.
+NONE = "none"
+REALTIME = "realtime"
+BEST_EFFORT = "best-effort"
+IDLE = "idle"
+
+CLASSES = {
+    NONE: ioutil.IOPRIO_CLASS_NONE,
+    REALTIME: ioutil.IOPRIO_CLASS_RT,
+    BEST_EFFORT: ioutil.IOPRIO_CLASS_BE,
+    IDLE: ioutil.IOPRIO_CLASS_IDLE,
+}
+
+# Priority levels for realtime and best-effort classes. Lower level means
+# higher priority.
+MIN_LEVEL = 0
+MAX_LEVEL = 7
+DEFAULT_LEVEL = 4
+
+# Classes we failed to set, logged only once.
+_failed = set()
+
+
+def validate(io_class, io_level):
+    """
+    Raise ValueError if io_class or io_level are invalid.
+    """
+    if io_class not in CLASSES:
+        raise ValueError(
+            "Unsupported class {!r}, expecting one of {}"
+            .format(io_class, sorted(CLASSES)))
+    if not MIN_LEVEL <= io_level <= MAX_LEVEL:
+        raise ValueError(
+            "Invalid level {}, expecting {}-{}"
+            .format(io_level, MIN_LEVEL, MAX_LEVEL))
+
+
+@contextlib.contextmanager
+def thread_priority(io_class, io_level):
+    """
+    Set the calling thread I/O priority, restoring the previous priority on
+    exit.
+
+    If the priority cannot be set, for example using the realtime class
+    without CAP_SYS_ADMIN, the thread keeps its current priority.
+    """
+    if io_class == NONE:
+        yield
+        return
+
+    # Level is meaningful only for realtime and best-effort classes.
+    level = 0 if io_class == IDLE else io_level
+
+    old = ioutil.ioprio_get()
+    try:
+        ioutil.ioprio_set(CLASSES[io_class], level)
+    except OSError as e:
+        if io_class not in _failed:
+            _failed.add(io_class)
+            log.warning("Cannot set I/O priority class=%s level=%s: %s",
+                        io_class, level, e)
+        yield
+        return
+
+    try:
+        yield
+    finally:
+        ioutil.ioprio_set(*old)
@@ -0,0 +1,234 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+iosched - limit outstanding storage I/O per device.
+
+Tickets using the same device (e.g. LUN, NFS export) issue I/O
+independently, each using up to max_connections connections. When the
+device is overloaded, latency explodes and throughput drops.
+
+Every device gets a limiter, shared by all tickets using the device. The
+limiter allows up to limit outstanding I/O requests, and adjusts the limit
+using AIMD (additive increase, multiplicative decrease) based on the
+observed I/O latency. Requests waiting for the device are served round
+robin between the tickets.
+"""
+
+import collections
+import logging
+import os
+import stat
+import threading
+import time
+
+log = logging.getLogger("iosched")
+
+
+class Limiter:
+    """
+    Limit outstanding I/O requests on a device.
+
+    When an I/O completes within target_latency, the limit is increased by
+    1 / limit, so it grows by about 1 for every limit completed requests.
+    When an I/O is slower, the limit is multiplied by decrease, at most once
+    per the slow I/O latency, since all the requests in flight at that time
+    are likely to be slow.
+
+    Thread safety: all methods may be called from multiple threads.
+    """
+
+    def __init__(self, name, initial_limit=8, min_limit=1, max_limit=64,
+                 target_latency=0.5, decrease=0.5, clock=time.monotonic):
+        self._name = name
+        self._min_limit = min_limit
+        self._max_limit = max_limit
+        self._target_latency = target_latency
+        self._decrease = decrease
+        self._clock = clock
+        self._lock = threading.Lock()
+        self._limit = float(initial_limit)
+        self._inflight = 0
+        # Mapping of owner to queue of waiting events. Owners are served
+        # round robin.
+        self._waiting = collections.OrderedDict()
+        self._last_decrease = None
+
+    @property
+    def name(self):
+        return self._name
+
+    @property
+    def limit(self):
+        return int(self._limit)
+
+    def client(self, owner):
+        return Client(self, owner)
+
+    def acquire(self, owner):
+        """
+        Wait until an I/O request can be submitted to the device.
+        """
+        with self._lock:
+            if not self._waiting and self._inflight < int(self._limit):
+                self._inflight += 1
+                return
+            event = threading.Event()
+            self._waiting.setdefault(owner, collections.deque()).append(event)
+
+        event.wait()
+
+    def release(self, latency):
+        """
+        Complete an I/O request that took latency seconds.
+        """
+        with self._lock:
+            self._inflight -= 1
+            self._update(latency)
+            self._wake_up()
+
+    def info(self):
+        with self._lock:
+            return {
+                "device": self._name,
+                "limit": int(self._limit),
+                "inflight": self._inflight,
+                "waiting": sum(len(q) for q in self._waiting.values()),
+            }
+
+    def _update(self, latency):
+        if latency <= self._target_latency:
+            # Increase the limit only if it was reached, so an idle device
+            # does not grow the limit without testing it.
+            if self._inflight + 1 >= int(self._limit):
+                self._limit = min(
+                    self._max_limit, self._limit + 1 / self._limit)
+            return
+
+        now = self._clock()
+        if (self._last_decrease is not None and
+                now - self._last_decrease < latency):
+            return
+
+        self._last_decrease = now
+        limit = max(self._min_limit, self._limit * self._decrease)
+        if int(limit) < int(self._limit):
+            log.debug("Device %s latency %.3f seconds, decreasing limit "
+                      "to %d", self._name, latency, limit)
+        self._limit = limit
+
+    def _wake_up(self):
+        while self._waiting and self._inflight < int(self._limit):
+            owner, queue = next(iter(self._waiting.items()))
+            event = queue.popleft()
+            # Move owner to the end, serving the next owner next time.
+            del self._waiting[owner]
+            if queue:
+                self._waiting[owner] = queue
+            self._inflight += 1
+            event.set()
+
+
+class Client:
+    """
+    Submit I/O requests to a device limiter on behalf of an owner,
+    typically a ticket.
+    """
+
+    def __init__(self, limiter, owner):
+        self._limiter = limiter
+        self._owner = owner
+
+    @property
+    def limiter(self):
+        return self._limiter
+
+    def io(self):
+        """
+        Return context manager waiting until an I/O request can be
+        submitted, and measuring the request latency.
+        """
+        return _Request(self._limiter, self._owner)
+
+
+class _Request:
+
+    __slots__ = ("_limiter", "_owner", "_start")
+
+    def __init__(self, limiter, owner):
+        self._limiter = limiter
+        self._owner = owner
+
+    def __enter__(self):
+        self._limiter.acquire(self._owner)
+        self._start = time.monotonic()
+        return self
+
+    def __exit__(self, t, v, tb):
+        self._limiter.release(time.monotonic() - self._start)
+
+
+class Scheduler:
+    """
+    Keep a limiter per device, shared by all tickets using the device.
+    """
+
+    def __init__(self, config):
+        self._config = config
+        self._lock = threading.Lock()
+        self._limiters = {}
+
+    @property
+    def enabled(self):
+        return self._config.enable
+
+    def limiter(self, url):
+        """
+        Return the limiter for the device serving url, or None if the
+        scheduler is disabled or the device is unknown.
+        """
+        if not self._config.enable:
+            return None
+
+        key = device_key(url)
+        if key is None:
+            return None
+
+        with self._lock:
+            limiter = self._limiters.get(key)
+            if limiter is None:
+                log.info("Creating limiter for device %s", key)
+                limiter = Limiter(
+                    key,
+                    initial_limit=self._config.initial_limit,
+                    min_limit=self._config.min_limit,
+                    max_limit=self._config.max_limit,
+                    target_latency=self._config.target_latency)
+                self._limiters[key] = limiter
+            return limiter
+
+
+def device_key(url):
+    """
+    Return a key identifying the device serving url, or None if unknown.
+
+    For files, this is the block device, or the anonymous device of the NFS
+    mount. For HTTP, this is the remote server.
+    """
+    if url.scheme == "file":
+        try:
+            st = os.stat(url.path)
+        except OSError as e:
+            log.debug("Cannot stat %s: %s", url.path, e)
+            return None
+        dev = st.st_rdev if stat.S_ISBLK(st.st_mode) else st.st_dev
+        return "dev:{}:{}".format(os.major(dev), os.minor(dev))
+
+    if url.scheme in ("http", "https"):
+        return "http:" + url.netloc
+
+    return None
@@ -11,10 +11,41 @@
 #include <Python.h>
 
 #define GNU_SOURCE
-#include <fcntl.h>
+#include <errno.h>
+#include <fcntl.h>      /* sync_file_range */
+#include <unistd.h>     /* pread, pwrite, copy_file_range */
 #include <linux/falloc.h>  /* For FALLOC_FL_* on RHEL, glibc < 2.18 */
 #include <sys/ioctl.h>  /* ioctl */
-#include <linux/fs.h>   /* BLKZEROOUT */
+#include <sys/syscall.h>  /* SYS_ioprio_set, SYS_ioprio_get, SYS_mbind */
+#include <linux/fs.h>   /* BLKZEROOUT, FICLONERANGE */
+
+/*
+ * I/O priority definitions from linux/ioprio.h, not available in older
+ * kernel headers. glibc does not provide wrappers for these syscalls.
+ */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_MASK ((1UL << IOPRIO_CLASS_SHIFT) - 1)
+#define IOPRIO_WHO_PROCESS 1
+
+enum {
+    IOPRIO_CLASS_NONE,
+    IOPRIO_CLASS_RT,
+    IOPRIO_CLASS_BE,
+    IOPRIO_CLASS_IDLE,
+};
+
+/*
+ * Memory policy definitions from linux/mempolicy.h. We don't link with
+ * libnuma for a single syscall.
+ */
+#define MPOL_PREFERRED 1
+#define MAX_NODE (sizeof(unsigned long) * 8)
+
+/*
+ * Maximum number of bytes to copy in one copy_file_range() call, so we can
+ * check the canceled flag frequently.
+ */
+#define COPY_STEP (64 * 1024 * 1024)
 
 PyDoc_STRVAR(blkzeroout_doc, "\
 blkzeroout(fd, offset, length)\n\
@@ -143,6 +174,40 @@ out:
     return PyBool_FromLong(res);
 }
 
+PyDoc_STRVAR(equal_doc, "\
+equal(a, b)\n\
+Return True if buffers a and b have the same length and content. The GIL\n\
+is released while comparing the buffers.\n\
+\n\
+Arguments\n\
+  a (buffer):  first buffer\n\
+  b (buffer):  second buffer\n\
+");
+
+static PyObject *
+equal(PyObject *self, PyObject *args)
+{
+    Py_buffer a;
+    Py_buffer b;
+    int res;
+
+    if (!PyArg_ParseTuple(args, "s*s*:equal", &a, &b))
+        return NULL;
+
+    if (a.len != b.len) {
+        res = 0;
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        res = memcmp(a.buf, b.buf, a.len) == 0;
+        Py_END_ALLOW_THREADS
+    }
+
+    PyBuffer_Release(&a);
+    PyBuffer_Release(&b);
+
+    return PyBool_FromLong(res);
+}
+
 PyDoc_STRVAR(py_fallocate_doc, "\
 fallocate(fd, mode, offset, length)\n\
 Allows the caller to directly manipulate the allocated disk space for\n\
@@ -192,12 +257,480 @@ py_fallocate(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+/* Return true if the optional canceled buffer was set. */
+static inline int
+is_canceled(Py_buffer *canceled)
+{
+    return canceled->buf && ((volatile char *)canceled->buf)[0];
+}
+
+static int
+get_canceled(PyObject *obj, Py_buffer *canceled)
+{
+    canceled->buf = NULL;
+
+    if (obj == Py_None)
+        return 0;
+
+    if (PyObject_GetBuffer(obj, canceled, PyBUF_WRITABLE) != 0)
+        return -1;
+
+    if (canceled->len < 1) {
+        PyBuffer_Release(canceled);
+        PyErr_SetString(PyExc_ValueError, "canceled buffer is empty");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+release_canceled(Py_buffer *canceled)
+{
+    if (canceled->buf)
+        PyBuffer_Release(canceled);
+}
+
+/*
+ * Read count bytes at offset into buf, filling the rest of the buffer with
+ * zeroes if we reach end of file. Return 0 on success, -1 on error.
+ */
+static int
+read_full(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t pos = 0;
+
+    while (pos < count) {
+        ssize_t n = pread(fd, buf + pos, count - pos, offset + pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            /* End of file. */
+            memset(buf + pos, 0, count - pos);
+            break;
+        }
+        pos += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write count bytes from buf at offset. Return 0 on success, -1 on error.
+ */
+static int
+write_full(int fd, const char *buf, size_t count, off_t offset)
+{
+    size_t pos = 0;
+
+    while (pos < count) {
+        ssize_t n = pwrite(fd, buf + pos, count - pos, offset + pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+    }
+
+    return 0;
+}
+
+PyDoc_STRVAR(copy_data_doc, "\
+copy_data(src_fd, dst_fd, offset, length, buf, align=1, canceled=None)\n\
+Copy length bytes at offset from src_fd to dst_fd using pread() and\n\
+pwrite(), without holding the GIL during the copy.\n\
+\n\
+If the length is not aligned to align, the last write is padded with\n\
+zeroes to the next aligned offset. Reading after the end of the source\n\
+file returns zeroes.\n\
+\n\
+Arguments\n\
+  src_fd (int):         file descriptor open for read\n\
+  dst_fd (int):         file descriptor open for write\n\
+  offset (int):         start of range in both files\n\
+  length (int):         length of range\n\
+  buf (buffer):         writable buffer used for copying. When using direct\n\
+                        I/O, the buffer must be aligned, and its length must\n\
+                        be a multiple of align.\n\
+  align (int):          alignment required for direct I/O\n\
+  canceled (buffer):    if specified, the copy is stopped when the first\n\
+                        byte in the buffer becomes non-zero\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed.\n\
+\n\
+Returns\n\
+  Number of bytes copied (int). May be less than length if the copy was\n\
+  canceled.\n\
+");
+
+static PyObject *
+copy_data(PyObject *self, PyObject *args, PyObject *kw)
+{
+    char *keywords[] = {"src_fd", "dst_fd", "offset", "length", "buf",
+                        "align", "canceled", NULL};
+    int src_fd;
+    int dst_fd;
+    long long offset;
+    long long length;
+    Py_buffer buf;
+    long long align = 1;
+    PyObject *canceled_obj = Py_None;
+    Py_buffer canceled;
+    long long done = 0;
+    int err = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "iiLLw*|LO:copy_data",
+                keywords, &src_fd, &dst_fd, &offset, &length, &buf, &align,
+                &canceled_obj))
+        return NULL;
+
+    if (align < 1 || buf.len < align || buf.len % align) {
+        PyErr_SetString(PyExc_ValueError,
+                        "buffer length must be a multiple of align");
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+
+    if (get_canceled(canceled_obj, &canceled)) {
+        PyBuffer_Release(&buf);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    while (done < length && !is_canceled(&canceled)) {
+        size_t count = length - done < buf.len ? length - done : buf.len;
+        size_t aligned = (count + align - 1) / align * align;
+
+        err = read_full(src_fd, buf.buf, aligned, offset + done);
+        if (err)
+            break;
+
+        err = write_full(dst_fd, buf.buf, aligned, offset + done);
+        if (err)
+            break;
+
+        done += count;
+    }
+
+    Py_END_ALLOW_THREADS
+
+    release_canceled(&canceled);
+    PyBuffer_Release(&buf);
+
+    if (err)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    return PyLong_FromLongLong(done);
+}
+
+PyDoc_STRVAR(py_copy_file_range_doc, "\
+copy_file_range(src_fd, src_offset, dst_fd, dst_offset, length,\n\
+                canceled=None)\n\
+Copy length bytes from src_fd at src_offset to dst_fd at dst_offset using\n\
+copy_file_range(), without holding the GIL during the copy. The kernel may\n\
+copy the data without reading it into user space, share the data blocks\n\
+(reflink), or offload the copy to the storage server (NFS 4.2).\n\
+\n\
+Arguments\n\
+  src_fd (int):         file descriptor open for read\n\
+  src_offset (int):     start of range in src_fd\n\
+  dst_fd (int):         file descriptor open for write\n\
+  dst_offset (int):     start of range in dst_fd\n\
+  length (int):         length of range\n\
+  canceled (buffer):    if specified, the copy is stopped when the first\n\
+                        byte in the buffer becomes non-zero\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed. If nothing was copied yet, errno\n\
+  EXDEV, EINVAL, EOPNOTSUPP, or ENOSYS means that copy_file_range() is not\n\
+  supported for these files.\n\
+\n\
+Returns\n\
+  Number of bytes copied (int). May be less than length if the copy was\n\
+  canceled, or if the source file ended before src_offset + length.\n\
+\n\
+See COPY_FILE_RANGE(2) for more info.\n\
+");
+
+static PyObject *
+py_copy_file_range(PyObject *self, PyObject *args, PyObject *kw)
+{
+    char *keywords[] = {"src_fd", "src_offset", "dst_fd", "dst_offset",
+                        "length", "canceled", NULL};
+    int src_fd;
+    long long src_offset;
+    int dst_fd;
+    long long dst_offset;
+    long long length;
+    PyObject *canceled_obj = Py_None;
+    Py_buffer canceled;
+    long long done = 0;
+    int err = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "iLiLL|O:copy_file_range",
+                keywords, &src_fd, &src_offset, &dst_fd, &dst_offset,
+                &length, &canceled_obj))
+        return NULL;
+
+    if (get_canceled(canceled_obj, &canceled))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    while (done < length && !is_canceled(&canceled)) {
+        loff_t src_off = src_offset + done;
+        loff_t dst_off = dst_offset + done;
+        size_t count = length - done < COPY_STEP ? length - done : COPY_STEP;
+        ssize_t n;
+
+        n = copy_file_range(src_fd, &src_off, dst_fd, &dst_off, count, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err = -1;
+            break;
+        }
+        if (n == 0) {
+            /* End of source file. */
+            break;
+        }
+
+        done += n;
+    }
+
+    Py_END_ALLOW_THREADS
+
+    release_canceled(&canceled);
+
+    if (err)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    return PyLong_FromLongLong(done);
+}
+
+PyDoc_STRVAR(clone_range_doc, "\
+clone_range(src_fd, src_offset, dst_fd, dst_offset, length)\n\
+Share length bytes from src_fd at src_offset with dst_fd at dst_offset\n\
+using FICLONERANGE (reflink). The data is not copied; the destination\n\
+range shares the source data blocks until one of them is modified.\n\
+\n\
+Arguments\n\
+  src_fd (int):         file descriptor open for read\n\
+  src_offset (int):     start of range in src_fd\n\
+  dst_fd (int):         file descriptor open for write\n\
+  dst_offset (int):     start of range in dst_fd\n\
+  length (int):         length of range. Zero means clone up to the end\n\
+                        of the source file.\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed. Errno EOPNOTSUPP, ENOTTY, EXDEV, or\n\
+  ENOSYS means that reflink is not supported for these files. EINVAL means\n\
+  that the range is not aligned to the file system block size.\n\
+\n\
+See IOCTL_FICLONERANGE(2) for more info.\n\
+");
+
+static PyObject *
+clone_range(PyObject *self, PyObject *args, PyObject *kw)
+{
+    char *keywords[] = {"src_fd", "src_offset", "dst_fd", "dst_offset",
+                        "length", NULL};
+    int src_fd;
+    int dst_fd;
+    struct file_clone_range range;
+    int err;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "iKiKK:clone_range",
+                keywords, &src_fd, &range.src_offset, &dst_fd,
+                &range.dest_offset, &range.src_length))
+        return NULL;
+
+    range.src_fd = src_fd;
+
+    Py_BEGIN_ALLOW_THREADS
+    err = ioctl(dst_fd, FICLONERANGE, &range);
+    Py_END_ALLOW_THREADS
+
+    if (err != 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ioprio_set_doc, "\
+ioprio_set(ioclass, level)\n\
+Set the I/O scheduling class and priority level of the calling thread.\n\
+\n\
+Arguments\n\
+  ioclass (int):  one of IOPRIO_CLASS_* constants\n\
+  level (int):    priority level, 0 (highest) to 7 (lowest). Must be 0 for\n\
+                  IOPRIO_CLASS_NONE, ignored for IOPRIO_CLASS_IDLE.\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed. Errno EPERM means that the thread is\n\
+  not allowed to use the real time class.\n\
+\n\
+See IOPRIO_SET(2) for more info.\n\
+");
+
+static PyObject *
+ioprio_set(PyObject *self, PyObject *args)
+{
+    int ioclass;
+    int level;
+    int err;
+
+    if (!PyArg_ParseTuple(args, "ii:ioprio_set", &ioclass, &level))
+        return NULL;
+
+    /* Who 0 means the calling thread. */
+    err = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                  (ioclass << IOPRIO_CLASS_SHIFT) | level);
+    if (err != 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(ioprio_get_doc, "\
+ioprio_get()\n\
+Return the I/O scheduling class and priority level of the calling thread.\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed.\n\
+\n\
+Returns\n\
+  (ioclass, level) tuple\n\
+");
+
+static PyObject *
+ioprio_get(PyObject *self, PyObject *args)
+{
+    long res;
+
+    res = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (res == -1)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    return Py_BuildValue("(ii)", (int) (res >> IOPRIO_CLASS_SHIFT),
+                         (int) (res & IOPRIO_PRIO_MASK));
+}
+
+PyDoc_STRVAR(mbind_doc, "\
+mbind(buf, node)\n\
+Prefer allocating buffer memory on NUMA node. If the node does not have\n\
+enough free memory, memory is allocated on other nodes.\n\
+\n\
+Must be called before the buffer memory is accessed; pages already\n\
+allocated are not moved.\n\
+\n\
+Arguments\n\
+  buf (buffer):  writable buffer aligned to page size, like mmap.mmap\n\
+  node (int):    NUMA node number\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed.\n\
+\n\
+See MBIND(2) for more info.\n\
+");
+
+static PyObject *
+py_mbind(PyObject *self, PyObject *args)
+{
+    Py_buffer b;
+    int node;
+    unsigned long nodemask;
+    long err;
+
+    if (!PyArg_ParseTuple(args, "w*i:mbind", &b, &node))
+        return NULL;
+
+    if (node < 0 || node >= (int) MAX_NODE) {
+        PyBuffer_Release(&b);
+        errno = EINVAL;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    nodemask = 1UL << node;
+
+    /* The kernel ignores the last bit of maxnode. */
+    err = syscall(SYS_mbind, b.buf, b.len, MPOL_PREFERRED, &nodemask,
+                  MAX_NODE + 1, 0);
+
+    PyBuffer_Release(&b);
+
+    if (err != 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(py_sync_file_range_doc, "\
+sync_file_range(fd, offset, length, flags)\n\
+Start or wait for writeback of dirty pages in a file range to storage.\n\
+This does not flush file metadata or the storage write cache; use fsync()\n\
+for durability.\n\
+\n\
+Arguments\n\
+  fd (int):      file descriptor open for write\n\
+  offset (int):  start of range\n\
+  length (int):  length of range. Zero means up to the end of the file.\n\
+  flags (int):   bitwise OR of SYNC_FILE_RANGE_* constants\n\
+\n\
+Raises\n\
+  OSError if the oprartion failed.\n\
+\n\
+See SYNC_FILE_RANGE(2) for more info.\n\
+");
+
+static PyObject *
+py_sync_file_range(PyObject *self, PyObject *args)
+{
+    int fd;
+    int64_t offset;
+    int64_t length;
+    unsigned int flags;
+    int err;
+
+    if (!PyArg_ParseTuple(args, "iLLI:sync_file_range", &fd, &offset,
+                &length, &flags))
+        return NULL;
+
+    /* May block waiting for writeback. */
+    Py_BEGIN_ALLOW_THREADS
+    err = sync_file_range(fd, offset, length, flags);
+    Py_END_ALLOW_THREADS
+
+    if (err != 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef module_methods[] = {
     {"blkzeroout", (PyCFunction) blkzeroout, METH_VARARGS | METH_KEYWORDS,
         blkzeroout_doc},
     {"blksszget", (PyCFunction) blksszget, METH_VARARGS, blksszget_doc},
     {"is_zero", (PyCFunction) is_zero, METH_VARARGS, is_zero_doc},
+    {"equal", (PyCFunction) equal, METH_VARARGS, equal_doc},
     {"fallocate", (PyCFunction) py_fallocate, METH_VARARGS, py_fallocate_doc},
+    {"copy_data", (PyCFunction) copy_data, METH_VARARGS | METH_KEYWORDS,
+        copy_data_doc},
+    {"copy_file_range", (PyCFunction) py_copy_file_range,
+        METH_VARARGS | METH_KEYWORDS, py_copy_file_range_doc},
+    {"clone_range", (PyCFunction) clone_range, METH_VARARGS | METH_KEYWORDS,
+        clone_range_doc},
+    {"ioprio_set", (PyCFunction) ioprio_set, METH_VARARGS, ioprio_set_doc},
+    {"ioprio_get", (PyCFunction) ioprio_get, METH_NOARGS, ioprio_get_doc},
+    {"mbind", (PyCFunction) py_mbind, METH_VARARGS, mbind_doc},
+    {"sync_file_range", (PyCFunction) py_sync_file_range, METH_VARARGS,
+        py_sync_file_range_doc},
     {NULL}  /* Sentinel */
 };
 
@@ -215,6 +748,27 @@ static int module_init(PyObject *m)
     if (PyModule_AddIntConstant(m, "FALLOC_FL_ZERO_RANGE", FALLOC_FL_ZERO_RANGE))
         return -1;
 
+    if (PyModule_AddIntConstant(m, "SYNC_FILE_RANGE_WAIT_BEFORE", SYNC_FILE_RANGE_WAIT_BEFORE))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "SYNC_FILE_RANGE_WRITE", SYNC_FILE_RANGE_WRITE))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "SYNC_FILE_RANGE_WAIT_AFTER", SYNC_FILE_RANGE_WAIT_AFTER))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "IOPRIO_CLASS_NONE", IOPRIO_CLASS_NONE))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "IOPRIO_CLASS_RT", IOPRIO_CLASS_RT))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "IOPRIO_CLASS_BE", IOPRIO_CLASS_BE))
+        return -1;
+
+    if (PyModule_AddIntConstant(m, "IOPRIO_CLASS_IDLE", IOPRIO_CLASS_IDLE))
+        return -1;
+
     return 0;
 }
 
@@ -243,6 +797,16 @@ PyInit_ioutil(void)
     if (module_init(m))
         return NULL;
 
+#ifdef Py_GIL_DISABLED
+    /*
+     * The module has no global state, and functions use only their
+     * arguments, so the free-threaded build does not need to enable the GIL
+     * when importing the module. See PEP 703.
+     */
+    if (PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED))
+        return NULL;
+#endif
+
     return m;
 }
 
@@ -0,0 +1,343 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+jobs - run long operations asynchronously.
+
+Zeroing a large range, computing a checksum of a big image, or flushing on
+slow storage may take minutes, blocking the client connection, and risking
+client or proxy timeouts. Clients can ask to run these operations as a job.
+The request returns immediately with "202 Accepted" and the job info, and
+the client polls the job at /jobs/job-id, optionally waiting until the job
+is finished.
+
+The job id is a random uuid, known only to the client that started the
+job, so accessing the job does not require the ticket id.
+"""
+
+import logging
+import queue
+import threading
+import uuid
+
+from . import errors
+from . import http
+from . import stats
+from . import util
+from . import validate
+
+log = logging.getLogger("jobs")
+
+PENDING = "pending"
+RUNNING = "running"
+DONE = "done"
+FAILED = "failed"
+CANCELED = "canceled"
+
+
+class Handler:
+    """
+    Handle requests for the /jobs/ resource.
+    """
+
+    def __init__(self, config, auth):
+        self.config = config
+        self.auth = auth
+
+    def get(self, req, resp, job_id):
+        """
+        Return job info. If the "wait" query parameter is specified, wait up
+        to wait seconds until the job is finished.
+        """
+        if not job_id:
+            raise http.Error(http.BAD_REQUEST, "Job id is required")
+
+        try:
+            wait = float(req.query.get("wait", 0))
+        except ValueError:
+            raise http.Error(
+                http.BAD_REQUEST,
+                "Invalid wait: {!r}".format(req.query["wait"]))
+
+        job = self._get(job_id)
+        if wait > 0:
+            job.wait(min(wait, self.config.jobs.max_wait))
+
+        resp.send_json(job.info())
+
+    def delete(self, req, resp, job_id):
+        """
+        Cancel a job. The job is kept until it is finished, so the client
+        can poll the job to learn when it was canceled.
+        """
+        if not job_id:
+            raise http.Error(http.BAD_REQUEST, "Job id is required")
+
+        log.info("[%s] CANCEL job=%s", req.client_addr, job_id)
+        self._get(job_id).cancel()
+        resp.status_code = http.NO_CONTENT
+
+    def _get(self, job_id):
+        try:
+            return self.auth.jobs.get(job_id)
+        except KeyError:
+            raise http.Error(
+                http.NOT_FOUND, "No such job {!r}".format(job_id))
+
+
+def requested(req, msg=None):
+    """
+    Return True if the client asked to run the request as a job, using the
+    "async" key in the request JSON message, or the "async=y" query
+    parameter.
+    """
+    if msg is not None:
+        return validate.boolean(msg, "async", default=False)
+    return validate.enum(req.query, "async", ("y", "n"), default="n") == "y"
+
+
+def start(req, resp, auth, ticket, name, func):
+    """
+    Start a job running func(job) on behalf of ticket, and send "202
+    Accepted" response with the job info.
+    """
+    try:
+        job = auth.jobs.submit(ticket, name, func)
+    except errors.UnsupportedOperation as e:
+        raise http.Error(http.BAD_REQUEST, str(e))
+    except errors.TooManyJobs as e:
+        raise http.Error(http.SERVICE_UNAVAILABLE, str(e))
+
+    log.info("[%s] JOB job=%s name=%s ticket=%s",
+             req.client_addr, job.id, name, ticket.uuid)
+
+    resp.headers["location"] = "/jobs/" + job.id
+    resp.send_json(job.info(), status_code=http.ACCEPTED)
+
+
+class Job:
+    """
+    Operation running in the background on behalf of a ticket.
+
+    The job provides the attributes used by backends.get(), so the job
+    backend is opened and cached in the ticket like a connection backend.
+    Canceling the ticket cancels the job operation, and waits until the job
+    is finished.
+    """
+
+    def __init__(self, ticket, name, func):
+        self.id = str(uuid.uuid4())
+        self.connection_id = "job/" + self.id
+        self.client_addr = "job"
+        self.socket = None
+        self.context = http.Context()
+        self.clock = stats.Clock()
+        self._ticket = ticket
+        self._name = name
+        self._func = func
+        self._lock = threading.Lock()
+        self._state = PENDING
+        self._operation = None
+        self._result = None
+        self._error = None
+        self._canceled = False
+        self._finished = None
+        self._done = threading.Event()
+
+    @property
+    def ticket_id(self):
+        return self._ticket.uuid
+
+    @property
+    def state(self):
+        return self._state
+
+    @property
+    def finished(self):
+        """
+        Monotonic time when the job was finished, or None.
+        """
+        return self._finished
+
+    def run_operation(self, op):
+        """
+        Run op on the job ticket, reporting op progress in the job info.
+        """
+        with self._lock:
+            if self._canceled:
+                return None
+            self._operation = op
+        return self._ticket.run(op)
+
+    def run(self):
+        with self._lock:
+            if self._canceled:
+                self._finish(CANCELED)
+                return
+            self._state = RUNNING
+
+        log.info("START job=%s name=%s ticket=%s",
+                 self.id, self._name, self.ticket_id)
+        self.clock.start("job")
+        try:
+            result = self._func(self)
+        except errors.Error as e:
+            log.warning("Job %s failed: %s", self.id, e)
+            state, error = FAILED, str(e)
+        except Exception as e:
+            log.exception("Job %s failed", self.id)
+            state, error = FAILED, str(e)
+        else:
+            if self._canceled or self._ticket.canceled:
+                state, error = CANCELED, None
+            else:
+                state, error = DONE, None
+        finally:
+            self.clock.stop("job")
+            self.context.close()
+
+        with self._lock:
+            if state == DONE:
+                self._result = result
+            self._error = error
+            self._finish(state)
+
+        log.info("FINISH job=%s state=%s %s", self.id, state, self.clock)
+
+    def cancel(self):
+        with self._lock:
+            if self._finished is not None:
+                return
+            self._canceled = True
+            op = self._operation
+        if op is not None:
+            op.cancel()
+
+    def wait(self, timeout=None):
+        return self._done.wait(timeout)
+
+    def info(self):
+        with self._lock:
+            info = {
+                "id": self.id,
+                "name": self._name,
+                "state": self._state,
+            }
+            op = self._operation
+            if op is not None and op.size is not None:
+                info["size"] = op.size
+                info["done"] = op.done
+            if self._result is not None:
+                info["result"] = self._result
+            if self._error is not None:
+                info["error"] = self._error
+            return info
+
+    def _finish(self, state):
+        self._state = state
+        self._finished = util.monotonic_time()
+        self._done.set()
+
+    def __repr__(self):
+        return "<Job id={} name={} state={} at {:#x}>".format(
+            self.id, self._name, self._state, id(self))
+
+
+class Manager:
+    """
+    Run jobs using a pool of worker threads, and keep finished jobs for
+    config.jobs.keep_time seconds.
+
+    Worker threads are started when jobs are submitted, so a daemon not
+    using jobs does not pay for them.
+
+    Thread safety: all methods may be called from multiple threads.
+    """
+
+    def __init__(self, config):
+        self._config = config.jobs
+        self._lock = threading.Lock()
+        self._jobs = {}
+        self._queue = queue.Queue()
+        self._workers = []
+
+    def submit(self, ticket, name, func):
+        """
+        Submit a job running func(job), returning the job.
+        """
+        with self._lock:
+            if self._config.workers < 1:
+                raise errors.UnsupportedOperation("Jobs are disabled")
+
+            self._prune()
+            if len(self._jobs) >= self._config.max_jobs:
+                raise errors.TooManyJobs(self._config.max_jobs)
+
+            job = Job(ticket, name, func)
+            self._jobs[job.id] = job
+
+            if len(self._workers) < self._config.workers:
+                name = "jobs/{}".format(len(self._workers))
+                self._workers.append(util.start_thread(self._run, name=name))
+
+        self._queue.put(job)
+        return job
+
+    def get(self, job_id):
+        """
+        Return the job, or raise KeyError.
+        """
+        with self._lock:
+            self._prune()
+            return self._jobs[job_id]
+
+    def cancel(self, ticket_id):
+        """
+        Cancel the ticket jobs, called when a ticket is removed. The jobs
+        are kept like other finished jobs, so clients can learn that they
+        were canceled.
+        """
+        with self._lock:
+            jobs = [j for j in self._jobs.values() if j.ticket_id == ticket_id]
+
+        for job in jobs:
+            job.cancel()
+
+    def stop(self):
+        """
+        Cancel all jobs and wait until the worker threads exit.
+        """
+        with self._lock:
+            jobs = list(self._jobs.values())
+            workers = self._workers
+            self._workers = []
+
+        for job in jobs:
+            job.cancel()
+        for _ in workers:
+            self._queue.put(None)
+        for t in workers:
+            t.join()
+
+    def _run(self):
+        while True:
+            job = self._queue.get()
+            if job is None:
+                return
+            job.run()
+
+    def _prune(self):
+        # Called with the lock held.
+        now = util.monotonic_time()
+        expired = [
+            job.id for job in self._jobs.values()
+            if job.finished is not None and
+            now - job.finished >= self._config.keep_time
+        ]
+        for job_id in expired:
+            log.debug("Removing finished job %s", job_id)
+            del self._jobs[job_id]
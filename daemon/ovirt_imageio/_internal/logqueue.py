@@ -0,0 +1,195 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+logqueue - write log records in a dedicated thread.
+
+Logging handlers configured in the logger configuration (e.g.
+RotatingFileHandler) write and rotate the log synchronously, holding the
+handler lock. When the log disk is slow, every request thread logging a
+message is blocked.
+
+When installed, the configured handlers of the logger are replaced by a
+handler adding records to a bounded queue, and a writer thread passes the
+records to the original handlers. If the queue is full, records are dropped
+instead of blocking the caller; the number of dropped records is logged by
+the writer thread when the queue has room again.
+"""
+
+import collections
+import logging
+import logging.handlers
+import queue
+import threading
+
+from . import util
+
+# Installed listener, used by start(), stop() and after_fork().
+_listener = None
+
+
+class Handler(logging.handlers.QueueHandler):
+    """
+    Add records to a bounded queue without blocking, counting dropped
+    records when the queue is full.
+    """
+
+    def __init__(self, queue):
+        super().__init__(queue)
+        self._drop_lock = threading.Lock()
+        self._dropped = collections.Counter()
+
+    def enqueue(self, record):
+        try:
+            self.queue.put_nowait(record)
+        except queue.Full:
+            with self._drop_lock:
+                self._dropped[record.levelname] += 1
+
+    def dropped(self):
+        """
+        Return and clear the number of dropped records per level name.
+        """
+        with self._drop_lock:
+            dropped = self._dropped
+            self._dropped = collections.Counter()
+        return dropped
+
+
+class Listener:
+    """
+    Pass records from the queue to the target handlers in a writer thread.
+    """
+
+    # Stop the writer thread.
+    _STOP = object()
+
+    def __init__(self, handler, targets, name="logqueue"):
+        self.handler = handler
+        self.targets = targets
+        self._name = name
+        self._thread = None
+
+    def start(self):
+        self._thread = util.start_thread(self._run, name=self._name)
+
+    def stop(self):
+        """
+        Stop the writer thread and write the remaining records. Safe to
+        call if the thread was not started, for example if the daemon
+        failed during startup.
+        """
+        if self._thread is not None:
+            self.handler.queue.put(self._STOP)
+            self._thread.join()
+            self._thread = None
+
+        while True:
+            try:
+                record = self.handler.queue.get_nowait()
+            except queue.Empty:
+                break
+            if record is not self._STOP:
+                self._handle(record)
+
+        self._report_dropped()
+        for h in self.targets:
+            h.flush()
+
+    def after_fork(self, maxsize):
+        """
+        Called in a forked child process. The writer thread does not exist
+        in the child, and the queued records belong to the parent, so start
+        with an empty queue.
+        """
+        self.handler.queue = queue.Queue(maxsize)
+        self.handler.dropped()
+        self._thread = None
+        self.start()
+
+    def _run(self):
+        q = self.handler.queue
+        while True:
+            record = q.get()
+            if record is self._STOP:
+                break
+            self._handle(record)
+            self._report_dropped()
+
+    def _handle(self, record):
+        for h in self.targets:
+            if record.levelno >= h.level:
+                h.handle(record)
+
+    def _report_dropped(self):
+        dropped = self.handler.dropped()
+        if dropped:
+            counts = ", ".join(
+                "{}={}".format(k, v) for k, v in sorted(dropped.items()))
+            record = logging.makeLogRecord({
+                "name": "logqueue",
+                "levelno": logging.WARNING,
+                "levelname": "WARNING",
+                "msg": "Log queue full, dropped %d records (%s)",
+                "args": (sum(dropped.values()), counts),
+            })
+            self._handle(record)
+
+
+def install(config, logger=None):
+    """
+    Replace the handlers of logger (default root logger) with a queue
+    handler. Records are queued until start() is called.
+    """
+    global _listener
+
+    if not config.log_queue.enable:
+        return
+
+    if logger is None:
+        logger = logging.getLogger()
+
+    targets = logger.handlers[:]
+    handler = Handler(queue.Queue(config.log_queue.size))
+    for h in targets:
+        logger.removeHandler(h)
+    logger.addHandler(handler)
+
+    _listener = Listener(handler, targets)
+
+
+def handlers(logger):
+    """
+    Return the handlers writing the records of logger, including the
+    handlers used by the writer thread.
+    """
+    result = []
+    for h in logger.handlers:
+        if _listener is not None and h is _listener.handler:
+            result.extend(_listener.targets)
+        else:
+            result.append(h)
+    return result
+
+
+def start():
+    """
+    Start the writer thread. Must be called after worker processes are
+    forked.
+    """
+    if _listener is not None:
+        _listener.start()
+
+
+def stop():
+    if _listener is not None:
+        _listener.stop()
+
+
+def after_fork(config):
+    if _listener is not None:
+        _listener.after_fork(config.log_queue.size)
@@ -345,6 +345,21 @@ def _parse_url(url):
     raise Error("Unsupported URL: {}".format(url))
 
 
+def _merge_ranges(ranges):
+    """
+    Return sorted list of (start, length) ranges, merging adjacent ranges.
+    """
+    merged = []
+    for start, length in sorted(ranges):
+        if merged and merged[-1][0] + merged[-1][1] >= start:
+            prev_start, prev_length = merged[-1]
+            end = max(prev_start + prev_length, start + length)
+            merged[-1] = (prev_start, end - prev_start)
+        else:
+            merged.append((start, length))
+    return merged
+
+
 # Client states
 
 CONNECTING = 0
@@ -406,14 +421,25 @@ class Client:
         self.readinto(offset, buf)
         return buf
 
-    def readinto(self, offset, buf):
+    def readinto(self, offset, buf, holes=None):
+        """
+        Read len(buf) bytes at offset into buf.
+
+        If holes is a list, add to it the (start, length) ranges in buf
+        reported by the server as holes. The ranges are sorted and merged.
+        The holes are zeroed in buf, so callers not interested in holes can
+        ignore them.
+        """
         # If structured reply was negotiated, the server must send structured
         # reply to NBD_CMD_READ.
         cmd = Read(
             self._next_handle(), offset, buf,
-            only_structured=self._structured_reply)
+            only_structured=self._structured_reply,
+            holes=[] if holes is not None else None)
         self._send_command(cmd)
         self._recv_reply(cmd)
+        if holes is not None:
+            holes.extend(_merge_ranges(cmd.holes))
         return len(buf)
 
     def write(self, offset, data):
@@ -451,6 +477,30 @@ class Client:
         else:
             self._hard_disconnect()
 
+    def detach(self):
+        """
+        Detach the connected socket during the transmission phase, and return
+        its file descriptor. The client is closed without terminating the
+        session; the caller owns the file descriptor and is responsible for
+        terminating the session.
+        """
+        if self._state != TRANSMISSION:
+            raise Error("Cannot detach client at state {!r}".format(
+                self._state))
+        self._state = CLOSED
+        return self._sock.detach()
+
+    @property
+    def structured_reply(self):
+        return self._structured_reply
+
+    @property
+    def meta_context(self):
+        """
+        Return dict mapping negotiated meta context names to context ids.
+        """
+        return dict(self._meta_context)
+
     # Connecting to NBD server
 
     def _connect(self, address):
@@ -1170,6 +1220,8 @@ class Client:
 
         buf_offset = chunk_offset - cmd.offset
         cmd.buf[buf_offset:buf_offset + chunk_size] = b"\0" * chunk_size
+        if cmd.holes is not None:
+            cmd.holes.append((buf_offset, chunk_size))
 
     def _recv_error_chunk(self, length):
         code, msg_len = self._recv_fmt("!IH")
@@ -1277,11 +1329,15 @@ class Read(Command):
     type = 0
     name = "NBD_CMD_READ"
 
-    def __init__(self, handle, offset, buf, only_structured=False):
+    def __init__(self, handle, offset, buf, only_structured=False,
+                 holes=None):
         super().__init__(handle, offset, len(buf))
         # Buffer for storing the payload from the server.
         self.buf = buf
         self.only_structured = only_structured
+        # If not None, list of (buf_offset, length) hole chunks received
+        # from the server. Chunks may be received in any order.
+        self.holes = holes
 
 
 class Write(Command):
@@ -0,0 +1,110 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+nbdexport - serve file tickets using daemon managed qemu-nbd.
+
+The file backend supports a single writer, does not report real extents for
+qcow2 images, and must do read-modify-write for unaligned I/O. When enabled,
+the daemon starts a qemu-nbd server for the ticket image on the first
+access, and routes the ticket I/O through the NBD backend. The server is
+stopped when the ticket is removed.
+"""
+
+import logging
+import os
+import threading
+
+from . import nbd
+from . import qemu_nbd
+from . import util
+
+log = logging.getLogger("nbdexport")
+
+# Mapping of file backend cache mode to qemu-nbd cache and aio modes.
+_CACHE = {
+    "direct": ("none", "native"),
+    "buffered": ("writeback", "threads"),
+}
+
+# Every HTTP connection, NBD server connection, and job using the ticket
+# opens its own NBD connection, and HTTP connections are not limited, so
+# the export must accept any number of clients (requires qemu-nbd 6.0).
+UNLIMITED_CLIENTS = 0
+
+# Ticket ids are not safe for file names.
+_counter = util.Sequence(1)
+
+
+class Export:
+    """
+    qemu-nbd server exporting a file ticket image.
+
+    Thread safety: all methods may be called from multiple threads.
+    """
+
+    def __init__(self, ticket, config):
+        self._ticket = ticket
+        self._config = config
+        self._lock = threading.Lock()
+        self._server = None
+        self._closed = False
+
+    def url(self):
+        """
+        Return the NBD url of the export, starting qemu-nbd on the first
+        call.
+        """
+        with self._lock:
+            if self._closed:
+                raise RuntimeError(
+                    "Export for ticket {} is closed".format(self._ticket.uuid))
+            if self._server is None:
+                self._server = self._start()
+            return self._server.url
+
+    def close(self):
+        with self._lock:
+            self._closed = True
+            if self._server is not None:
+                log.info("Stopping qemu-nbd for ticket %s",
+                         self._ticket.uuid)
+                self._server.stop()
+                _remove_socket(self._server.sock.path)
+                self._server = None
+
+    def _start(self):
+        ticket = self._ticket
+        run_dir = self._config.daemon.run_dir
+        os.makedirs(run_dir, exist_ok=True)
+        name = "qemu-nbd-{}-{}.sock".format(os.getpid(), next(_counter))
+        sock = nbd.UnixAddress(os.path.join(run_dir, name))
+
+        cache, aio = _CACHE[ticket.cache or self._config.backend_file.cache]
+
+        server = qemu_nbd.Server(
+            ticket.url.path,
+            ticket.format,
+            sock,
+            read_only="write" not in ticket.ops,
+            shared=UNLIMITED_CLIENTS,
+            cache=cache,
+            aio=aio,
+            discard="unmap" if ticket.sparse else "ignore")
+
+        log.info("Starting qemu-nbd for ticket %s format=%s cache=%s aio=%s "
+                 "socket=%s", ticket.uuid, ticket.format, cache, aio,
+                 sock.path)
+        server.start()
+        return server
+
+
+def _remove_socket(path):
+    try:
+        os.unlink(path)
+    except FileNotFoundError:
+        pass
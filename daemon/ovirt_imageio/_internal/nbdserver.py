@@ -0,0 +1,660 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+nbdserver - export tickets over NBD.
+
+NBD clients (e.g. qemu-img, qemu-nbd, backup tools) can access a ticket
+using the NBD protocol instead of HTTP. The export name is the ticket id.
+Every command is authorized and accounted using the ticket, like HTTP
+requests.
+
+Supported features: fixed newstyle negotiation, structured replies,
+base:allocation block status, WRITE_ZEROES, FLUSH, FUA and multi-conn.
+
+See https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+"""
+
+import bisect
+import errno
+import itertools
+import logging
+import select
+import socket
+import socketserver
+import struct
+
+from . import backends
+from . import errors
+from . import http
+from . import nbd
+from . import ops
+from . import util
+
+log = logging.getLogger("nbdserver")
+
+# Options not used by the client.
+OPT_EXPORT_NAME = 1
+OPT_LIST = 3
+OPT_INFO = 6
+
+# Command flags.
+CMD_FLAG_FUA = 1 << 0
+CMD_FLAG_REQ_ONE = 1 << 3
+
+# Commands.
+CMD_READ = nbd.Read.type
+CMD_WRITE = nbd.Write.type
+CMD_DISC = nbd.Disc.type
+CMD_FLUSH = nbd.Flush.type
+CMD_WRITE_ZEROES = nbd.WriteZeroes.type
+CMD_BLOCK_STATUS = nbd.BlockStatus.type
+
+# Errors.
+EPERM = 1
+EIO = 5
+ENOMEM = 12
+EINVAL = 22
+ENOSPC = 28
+EOVERFLOW = 75
+ESHUTDOWN = 108
+
+_ERRNO = {
+    errno.EPERM: EPERM,
+    errno.EACCES: EPERM,
+    errno.EROFS: EPERM,
+    errno.EIO: EIO,
+    errno.ENOMEM: ENOMEM,
+    errno.EINVAL: EINVAL,
+    errno.ENOSPC: ENOSPC,
+    errno.EOVERFLOW: EOVERFLOW,
+    errno.ESHUTDOWN: ESHUTDOWN,
+}
+
+# The only metadata context supported.
+BASE_ALLOCATION = b"base:allocation"
+BASE_ALLOCATION_ID = 1
+
+# Limit the size of option data and request payload.
+MAX_OPTION_SIZE = 4096
+MAX_PAYLOAD = 32 * 1024**2
+
+PREFERRED_BLOCK_SIZE = 4096
+
+# Wire formats.
+OPTION = struct.Struct("!QII")
+OPTION_REPLY = struct.Struct("!QIII")
+REQUEST = nbd.Command.wire_format
+SIMPLE_REPLY = struct.Struct("!IIQ")
+CHUNK = struct.Struct("!IHHQI")
+
+
+class Error(Exception):
+    """
+    Command failed, reported to the client.
+    """
+
+    def __init__(self, code, reason):
+        self.code = code
+        self.reason = reason
+
+    def __str__(self):
+        return "[Error {}] {}".format(self.code, self.reason)
+
+
+class Disconnect(Exception):
+    """
+    The client disconnected, or the connection must be closed.
+    """
+
+
+class Handler:
+    """
+    Keep the configuration and authorizer used by the connections.
+    """
+
+    def __init__(self, config, auth):
+        self.config = config
+        self.auth = auth
+
+
+class Connection(socketserver.BaseRequestHandler):
+    """
+    NBD connection serving one export.
+
+    The connection provides the attributes used by backends.get(), so
+    backends are opened and cached in the ticket like HTTP connections.
+    """
+
+    # For generating connection ids. Start from 1 to match the connection
+    # thread name.
+    _counter = util.Sequence(1)
+
+    def setup(self):
+        # Backends are cached in the ticket by connection id, so the id
+        # must not collide with HTTP connection ids.
+        self.connection_id = "nbd/{}".format(next(self._counter))
+        self.client_addr = "nbd"
+        self.socket = self.request
+        self.context = http.Context()
+        self.clock = self.server.clock_class()
+        self.clock.start("connection")
+
+        self._app = self.server.app
+        self._ticket_id = None
+        self._ticket = None
+        self._structured = False
+        self._base_allocation = False
+        # Cached zero extents and their start offsets for read only tickets.
+        self._extents = None
+        self._extents_start = None
+        log.info("OPEN connection=%s", self.connection_id)
+
+    def handle(self):
+        try:
+            self._negotiate()
+            while True:
+                self._handle_request()
+        except Disconnect as e:
+            log.debug("Connection %s closed: %s", self.connection_id, e)
+        except socket.timeout as e:
+            log.warning("Timeout reading or writing to socket: %s", e)
+        except OSError as e:
+            if e.errno not in http._DISCONNECTED:
+                raise
+            log.debug("Client disconnected: %s", e)
+
+    def finish(self):
+        self.clock.stop("connection")
+        self.context.close()
+        log.info("CLOSE connection=%s %s", self.connection_id, self.clock)
+
+    # Negotiation.
+
+    def _negotiate(self):
+        self._send(struct.pack(
+            "!QQH", nbd.NBDMAGIC, nbd.IHAVEOPT,
+            nbd.FLAG_FIXED_NEWSTYLE | nbd.FLAG_NO_ZEROES))
+
+        client_flags, = struct.unpack("!I", self._recv(4))
+        if not client_flags & nbd.FLAG_C_FIXED_NEWSTYLE:
+            raise Disconnect("Client does not support fixed newstyle")
+        self._no_zeroes = bool(client_flags & nbd.FLAG_C_NO_ZEROES)
+
+        while self._ticket_id is None:
+            magic, opt, length = OPTION.unpack(self._recv(OPTION.size))
+            if magic != nbd.IHAVEOPT:
+                raise Disconnect("Bad option magic {:x}".format(magic))
+            if length > MAX_OPTION_SIZE:
+                raise Disconnect("Option data too large: {}".format(length))
+
+            data = self._recv(length)
+            log.debug("Received option %d length=%d", opt, length)
+
+            if opt == OPT_EXPORT_NAME:
+                self._opt_export_name(data)
+            elif opt == nbd.OPT_ABORT:
+                self._send_option_reply(opt, nbd.REP_ACK)
+                raise Disconnect("Client aborted negotiation")
+            elif opt == OPT_LIST:
+                # Never list the tickets; clients must know the ticket id.
+                self._send_option_reply(opt, nbd.REP_ACK)
+            elif opt == nbd.OPT_STRUCTURED_REPLY:
+                self._opt_structured_reply(opt, data)
+            elif opt in (OPT_INFO, nbd.OPT_GO):
+                self._opt_go(opt, data)
+            elif opt in (nbd.OPT_LIST_META_CONTEXT,
+                         nbd.OPT_SET_META_CONTEXT):
+                self._opt_meta_context(opt, data)
+            else:
+                self._send_option_error(
+                    opt, nbd.REP_ERR_UNSUP, "Unsupported option")
+
+        log.info("[%s] EXPORT ticket=%s structured=%s base_allocation=%s",
+                 self.client_addr, self._ticket_id, self._structured,
+                 self._base_allocation)
+
+    def _opt_export_name(self, data):
+        ticket_id = data.decode("utf-8", errors="replace")
+        try:
+            ticket, ctx = self._open(ticket_id)
+        except errors.AuthorizationError as e:
+            # The client does not expect an error reply.
+            raise Disconnect(str(e))
+        reply = struct.pack(
+            "!QH", self._export_size(ticket, ctx), self._export_flags(ticket))
+        if not self._no_zeroes:
+            reply += b"\0" * 124
+        self._send(reply)
+        self._ticket_id = ticket_id
+        self._ticket = ticket
+
+    def _opt_structured_reply(self, opt, data):
+        if data:
+            self._send_option_error(
+                opt, nbd.REP_ERR_INVALID, "Unexpected option data")
+            return
+        self._structured = True
+        self._send_option_reply(opt, nbd.REP_ACK)
+
+    def _opt_go(self, opt, data):
+        try:
+            name, _ = self._parse_export_name(data)
+        except ValueError as e:
+            self._send_option_error(opt, nbd.REP_ERR_INVALID, str(e))
+            return
+
+        try:
+            ticket, ctx = self._open(name)
+        except errors.AuthorizationError:
+            self._send_option_error(opt, nbd.REP_ERR_UNKNOWN, "No such export")
+            return
+
+        info = struct.pack(
+            "!HQH", nbd.INFO_EXPORT, self._export_size(ticket, ctx),
+            self._export_flags(ticket))
+        self._send_option_reply(opt, nbd.REP_INFO, info)
+
+        # We can serve any request, but unaligned I/O is slower.
+        info = struct.pack(
+            "!HIII", nbd.INFO_BLOCK_SIZE, 1, PREFERRED_BLOCK_SIZE, MAX_PAYLOAD)
+        self._send_option_reply(opt, nbd.REP_INFO, info)
+
+        self._send_option_reply(opt, nbd.REP_ACK)
+
+        if opt == nbd.OPT_GO:
+            self._ticket_id = name
+            self._ticket = ticket
+
+    def _opt_meta_context(self, opt, data):
+        if opt == nbd.OPT_SET_META_CONTEXT and not self._structured:
+            self._send_option_error(
+                opt, nbd.REP_ERR_INVALID, "Structured reply not negotiated")
+            return
+
+        try:
+            _, data = self._parse_export_name(data)
+            queries = self._parse_queries(data)
+        except ValueError as e:
+            self._send_option_error(opt, nbd.REP_ERR_INVALID, str(e))
+            return
+
+        if opt == nbd.OPT_LIST_META_CONTEXT:
+            # Empty list or "base:" query means all contexts in the
+            # namespace.
+            selected = not queries or any(
+                q in (b"base:", BASE_ALLOCATION) for q in queries)
+        else:
+            selected = BASE_ALLOCATION in queries
+            self._base_allocation = selected
+
+        if selected:
+            reply = struct.pack("!I", BASE_ALLOCATION_ID) + BASE_ALLOCATION
+            self._send_option_reply(opt, nbd.REP_META_CONTEXT, reply)
+
+        self._send_option_reply(opt, nbd.REP_ACK)
+
+    def _parse_export_name(self, data):
+        """
+        Parse export name prefixed by 32-bit length, returning the name and
+        the rest of the data.
+        """
+        if len(data) < 4:
+            raise ValueError("Option data too short")
+        length, = struct.unpack_from("!I", data)
+        if len(data) < 4 + length:
+            raise ValueError("Invalid export name length")
+        name = data[4:4 + length].decode("utf-8", errors="replace")
+        return name, data[4 + length:]
+
+    def _parse_queries(self, data):
+        if len(data) < 4:
+            raise ValueError("Option data too short")
+        count, = struct.unpack_from("!I", data)
+        pos = 4
+        queries = []
+        for _ in range(count):
+            if len(data) < pos + 4:
+                raise ValueError("Invalid query")
+            length, = struct.unpack_from("!I", data, pos)
+            pos += 4
+            if len(data) < pos + length:
+                raise ValueError("Invalid query length")
+            queries.append(data[pos:pos + length])
+            pos += length
+        return queries
+
+    def _open(self, ticket_id):
+        ticket = self._app.auth.authorize(ticket_id, "read", self.context)
+        ctx = backends.get(self, ticket, self._app.config)
+        return ticket, ctx
+
+    def _export_size(self, ticket, ctx):
+        return min(ticket.size, ctx.backend.size())
+
+    def _export_flags(self, ticket):
+        flags = (nbd.FLAG_HAS_FLAGS |
+                 nbd.FLAG_SEND_FLUSH |
+                 nbd.FLAG_SEND_FUA |
+                 nbd.FLAG_SEND_WRITE_ZEROES |
+                 nbd.FLAG_CAN_MULTI_CONN)
+        if not ticket.may("write"):
+            flags |= nbd.FLAG_READ_ONLY
+        return flags
+
+    def _send_option_reply(self, opt, reply, data=b""):
+        self._send(OPTION_REPLY.pack(
+            nbd.OPTION_REPLY_MAGIC, opt, reply, len(data)) + data)
+
+    def _send_option_error(self, opt, reply, message):
+        log.debug("Option %d failed: %s", opt, message)
+        self._send_option_reply(opt, reply, message.encode("utf-8"))
+
+    # Transmission.
+
+    def _handle_request(self):
+        self._wait_for_request()
+        magic, flags, cmd, handle, offset, length = REQUEST.unpack(
+            self._recv(REQUEST.size))
+        if magic != nbd.REQUEST_MAGIC:
+            raise Disconnect("Bad request magic {:x}".format(magic))
+
+        log.debug("Received command %d flags=%d offset=%d length=%d",
+                  cmd, flags, offset, length)
+
+        if cmd == CMD_DISC:
+            raise Disconnect("Client disconnected")
+
+        payload = _Payload(self.request, length if cmd == CMD_WRITE else 0)
+        try:
+            if cmd == CMD_READ:
+                self._read(handle, flags, offset, length)
+            elif cmd == CMD_WRITE:
+                self._write(handle, flags, offset, length, payload)
+            elif cmd == CMD_WRITE_ZEROES:
+                self._zero(handle, flags, offset, length)
+            elif cmd == CMD_FLUSH:
+                self._flush(handle)
+            elif cmd == CMD_BLOCK_STATUS:
+                self._block_status(handle, flags, offset, length)
+            else:
+                raise Error(EINVAL, "Unsupported command {}".format(cmd))
+        except Error as e:
+            log.debug("Command %d failed: %s", cmd, e)
+            # Keep the connection in sync with the client.
+            payload.drain()
+            self._send_error(handle, e)
+
+    def _wait_for_request(self):
+        """
+        Wait until the next request is available, checking periodically if
+        the ticket was canceled, so idle connections do not block ticket
+        removal.
+        """
+        poll_interval = self._app.config.daemon.poll_interval
+        while True:
+            readable, _, _ = select.select([self.request], [], [],
+                                           poll_interval)
+            if readable:
+                return
+            # Removing a ticket cancels it.
+            if self._ticket.canceled:
+                raise Disconnect("Ticket {} was canceled".format(
+                    self._ticket_id))
+
+    def _read(self, handle, flags, offset, length):
+        ticket, ctx = self._authorize("read")
+        self._check_range(ticket, ctx, offset, length, EINVAL)
+
+        if self._structured:
+            dst = _DataChunks(self, handle, offset)
+        else:
+            self._send(SIMPLE_REPLY.pack(nbd.SIMPLE_REPLY_MAGIC, 0, handle))
+            dst = self
+
+        op = ops.Read(ctx.backend, dst, ctx.buffer, length, offset=offset,
+                      clock=self.clock)
+        try:
+            self._run(ticket, op)
+        except Error as e:
+            if not self._structured:
+                # The reply header was sent, we cannot report the error.
+                raise Disconnect("Read failed: {}".format(e))
+            if op.done == 0:
+                raise
+            # Some chunks were sent; report the error for the rest.
+            self._send(_error_chunk(
+                handle, nbd.REPLY_FLAG_DONE, e, offset + op.done))
+            return
+
+        if self._structured:
+            self._send_done(handle)
+
+    def _write(self, handle, flags, offset, length, payload):
+        ticket, ctx = self._authorize("write")
+        self._check_range(ticket, ctx, offset, length, ENOSPC)
+
+        op = ops.Write(ctx.backend, payload, ctx.buffer, length,
+                       offset=offset, flush=bool(flags & CMD_FLAG_FUA),
+                       clock=self.clock)
+        self._run(ticket, op)
+        self._send_ok(handle)
+
+    def _zero(self, handle, flags, offset, length):
+        ticket, ctx = self._authorize("write")
+        self._check_range(ticket, ctx, offset, length, ENOSPC)
+
+        op = ops.Zero(ctx.backend, length, offset=offset,
+                      flush=bool(flags & CMD_FLAG_FUA), clock=self.clock)
+        self._run(ticket, op)
+        self._send_ok(handle)
+
+    def _flush(self, handle):
+        ticket, ctx = self._authorize("write")
+        self._run(ticket, ops.Flush(ctx.backend, clock=self.clock))
+        self._send_ok(handle)
+
+    def _block_status(self, handle, flags, offset, length):
+        if not self._base_allocation:
+            raise Error(EINVAL, "base:allocation context not negotiated")
+
+        if length == 0:
+            raise Error(EINVAL, "Invalid block status length 0")
+
+        ticket, ctx = self._authorize("read")
+        self._check_range(ticket, ctx, offset, length, EINVAL)
+
+        end = offset + length
+        descriptors = []
+        try:
+            for ext in self._zero_extents(ticket, ctx, offset):
+                if ext.start + ext.length <= offset:
+                    continue
+                if ext.start >= end:
+                    break
+                start = max(ext.start, offset)
+                ext_end = min(ext.start + ext.length, end)
+                state = 0
+                if ext.zero:
+                    state |= nbd.STATE_ZERO
+                if ext.hole:
+                    state |= nbd.STATE_HOLE
+                descriptors.append((ext_end - start, state))
+                if flags & CMD_FLAG_REQ_ONE:
+                    break
+        except OSError as e:
+            raise Error(_ERRNO.get(e.errno, EIO), str(e)) from None
+
+        # The reply must include at least one descriptor. If the backend
+        # did not report extents for this range, report data.
+        if not descriptors:
+            descriptors.append((length, 0))
+
+        ticket.touch()
+
+        payload = struct.pack("!I", BASE_ALLOCATION_ID) + b"".join(
+            struct.pack("!II", length, state)
+            for length, state in descriptors)
+        self._send(CHUNK.pack(
+            nbd.STRUCTURED_REPLY_MAGIC, nbd.REPLY_FLAG_DONE,
+            nbd.REPLY_TYPE_BLOCK_STATUS, handle, len(payload)) + payload)
+
+    def _zero_extents(self, ticket, ctx, offset):
+        """
+        Return iterator over zero extents, starting at the extent including
+        offset.
+
+        Clients like qemu-img map send block status commands for the entire
+        image, so walking the extents from the start of the image for every
+        command is quadratic. For read only tickets the extents are cached
+        in the connection. Writable images may be modified by other
+        connections, so their extents are not cached.
+        """
+        if ticket.may("write"):
+            return ctx.backend.extents("zero")
+
+        if self._extents is None:
+            self._extents = list(ctx.backend.extents("zero"))
+            self._extents_start = [ext.start for ext in self._extents]
+
+        index = max(bisect.bisect_right(self._extents_start, offset) - 1, 0)
+        return itertools.islice(self._extents, index, None)
+
+    def _authorize(self, op):
+        try:
+            ticket = self._app.auth.authorize(
+                self._ticket_id, op, self.context)
+            ctx = backends.get(self, ticket, self._app.config)
+        except errors.AuthorizationError as e:
+            raise Error(EPERM, str(e)) from None
+        return ticket, ctx
+
+    def _check_range(self, ticket, ctx, offset, length, code):
+        if offset + length > self._export_size(ticket, ctx):
+            raise Error(code, "Request offset={} length={} out of range"
+                        .format(offset, length))
+
+    def _run(self, ticket, op):
+        try:
+            ticket.run(op)
+        except errors.AuthorizationError as e:
+            raise Error(EPERM, str(e)) from None
+        except errors.PartialContent as e:
+            raise Error(EIO, str(e)) from None
+        except OSError as e:
+            if e.errno in http._DISCONNECTED or isinstance(e, socket.timeout):
+                raise
+            raise Error(_ERRNO.get(e.errno, EIO), str(e)) from None
+
+        # ticket.run() returns normally if the operation was canceled.
+        if ticket.canceled:
+            raise Error(ESHUTDOWN, "Ticket {} was canceled".format(
+                ticket.uuid))
+
+    def _send_ok(self, handle):
+        if self._structured:
+            self._send_done(handle)
+        else:
+            self._send(SIMPLE_REPLY.pack(nbd.SIMPLE_REPLY_MAGIC, 0, handle))
+
+    def _send_done(self, handle):
+        self._send(CHUNK.pack(
+            nbd.STRUCTURED_REPLY_MAGIC, nbd.REPLY_FLAG_DONE,
+            nbd.REPLY_TYPE_NONE, handle, 0))
+
+    def _send_error(self, handle, error):
+        if self._structured:
+            self._send(_error_chunk(handle, nbd.REPLY_FLAG_DONE, error))
+        else:
+            self._send(SIMPLE_REPLY.pack(
+                nbd.SIMPLE_REPLY_MAGIC, error.code, handle))
+
+    # Socket helpers.
+
+    def write(self, buf):
+        """
+        Used as ops.Read destination for simple replies.
+        """
+        self._send(buf)
+
+    def _send(self, data):
+        self.request.sendall(data)
+
+    def _recv(self, length):
+        buf = bytearray(length)
+        _recv_into(self.request, memoryview(buf))
+        return bytes(buf)
+
+
+class _DataChunks:
+    """
+    ops.Read destination sending every write as an OFFSET_DATA chunk.
+    """
+
+    def __init__(self, conn, handle, offset):
+        self._conn = conn
+        self._handle = handle
+        self._offset = offset
+
+    def write(self, buf):
+        header = CHUNK.pack(
+            nbd.STRUCTURED_REPLY_MAGIC, 0, nbd.REPLY_TYPE_OFFSET_DATA,
+            self._handle, 8 + len(buf))
+        self._conn._send(header + struct.pack("!Q", self._offset))
+        self._conn._send(buf)
+        self._offset += len(buf)
+
+
+class _Payload:
+    """
+    Request payload reader, limited to the payload length.
+
+    If a command fails before reading the entire payload, the rest of the
+    payload must be drained to keep the connection usable.
+    """
+
+    def __init__(self, sock, length):
+        self._sock = sock
+        self._todo = length
+
+    def readinto(self, buf):
+        with memoryview(buf) as view:
+            if len(view) > self._todo:
+                view = view[:self._todo]
+            n = _recv_into(self._sock, view)
+        self._todo -= n
+        return n
+
+    def drain(self):
+        buf = bytearray(min(self._todo, 1024**2))
+        while self._todo:
+            self.readinto(buf)
+
+
+def _error_chunk(handle, flags, error, offset=None):
+    message = error.reason.encode("utf-8")[:4096]
+    if offset is None:
+        reply_type = nbd.REPLY_TYPE_ERROR
+        payload = struct.pack("!IH", error.code, len(message)) + message
+    else:
+        reply_type = nbd.REPLY_TYPE_ERROR_OFFSET
+        payload = struct.pack(
+            "!IH", error.code, len(message)) + message + struct.pack(
+                "!Q", offset)
+    return CHUNK.pack(
+        nbd.STRUCTURED_REPLY_MAGIC, flags, reply_type, handle,
+        len(payload)) + payload
+
+
+def _recv_into(sock, view):
+    pos = 0
+    while pos < len(view):
+        n = sock.recv_into(view[pos:])
+        if n == 0:
+            raise Disconnect("Client closed the connection")
+        pos += n
+    return pos
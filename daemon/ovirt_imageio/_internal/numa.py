@@ -0,0 +1,207 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+numa - NUMA aware buffer placement and thread affinity.
+
+On hosts with multiple NUMA nodes, the NIC and the storage HBA are attached
+to specific nodes. Allocating the connection buffers on the node of the
+device, and running the connection thread on the same node, avoids copying
+every byte over the interconnect between the nodes.
+"""
+
+import functools
+import glob
+import logging
+import os
+import re
+import socket
+import stat
+
+from . import ioutil
+
+log = logging.getLogger("numa")
+
+SYS_DEVICES = "/sys/devices"
+SYS_NODE = "/sys/devices/system/node"
+SYS_DEV_BLOCK = "/sys/dev/block"
+SYS_CLASS_BLOCK = "/sys/class/block"
+
+# Available in the socket module since python 3.11.
+SO_INCOMING_CPU = getattr(socket, "SO_INCOMING_CPU", 49)
+
+STORAGE = "storage"
+NETWORK = "network"
+
+
+@functools.lru_cache(maxsize=1)
+def nodes():
+    """
+    Return mapping of NUMA node number to set of node cpus. Nodes without
+    cpus are not included.
+    """
+    result = {}
+    for path in glob.glob(os.path.join(SYS_NODE, "node[0-9]*", "cpulist")):
+        node = int(re.search(r"node(\d+)", path).group(1))
+        with open(path) as f:
+            cpus = parse_cpulist(f.read())
+        if cpus:
+            result[node] = cpus
+    return result
+
+
+def parse_cpulist(s):
+    """
+    Parse cpu list like "0-3,8-11" to set of cpus.
+    """
+    cpus = set()
+    for item in s.strip().split(","):
+        if not item:
+            continue
+        if "-" in item:
+            first, last = item.split("-")
+            cpus.update(range(int(first), int(last) + 1))
+        else:
+            cpus.add(int(item))
+    return frozenset(cpus)
+
+
+def cpu_node(cpu):
+    """
+    Return the NUMA node of cpu, or None if unknown.
+    """
+    for node, cpus in nodes().items():
+        if cpu in cpus:
+            return node
+    return None
+
+
+def socket_node(sock):
+    """
+    Return the NUMA node of the cpu processing the socket incoming packets,
+    usually the node of the NIC, or None if unknown.
+    """
+    # Jobs are not bound to a connection socket.
+    if sock is None:
+        return None
+    if sock.family not in (socket.AF_INET, socket.AF_INET6):
+        return None
+    try:
+        cpu = sock.getsockopt(socket.SOL_SOCKET, SO_INCOMING_CPU)
+    except OSError as e:
+        log.debug("Cannot get socket incoming cpu: %s", e)
+        return None
+    if cpu < 0:
+        return None
+    return cpu_node(cpu)
+
+
+def device_node(path):
+    """
+    Return the NUMA node of the block device holding path, or None if
+    unknown. path may be a block device or a file on a local file system.
+    """
+    try:
+        st = os.stat(path)
+    except OSError as e:
+        log.debug("Cannot stat %s: %s", path, e)
+        return None
+
+    dev = st.st_rdev if stat.S_ISBLK(st.st_mode) else st.st_dev
+
+    # Network file systems use anonymous devices (major 0).
+    if os.major(dev) == 0:
+        return None
+
+    sys_path = os.path.join(
+        SYS_DEV_BLOCK, "{}:{}".format(os.major(dev), os.minor(dev)))
+    return _sysfs_block_node(os.path.realpath(sys_path))
+
+
+def _sysfs_block_node(sys_path):
+    # Physical devices: look up the numa_node of the closest parent, for
+    # example the PCI device of the HBA.
+    path = sys_path
+    while path.startswith(SYS_DEVICES + "/"):
+        node = _read_node(os.path.join(path, "numa_node"))
+        if node is not None:
+            return node
+        path = os.path.dirname(path)
+
+    # Device mapper devices (LVM, multipath): use the node of the first
+    # underlying device.
+    slaves = os.path.join(sys_path, "slaves")
+    if os.path.isdir(slaves):
+        for name in sorted(os.listdir(slaves)):
+            node = _sysfs_block_node(
+                os.path.realpath(os.path.join(SYS_CLASS_BLOCK, name)))
+            if node is not None:
+                return node
+
+    return None
+
+
+def _read_node(path):
+    try:
+        with open(path) as f:
+            node = int(f.read())
+    except (OSError, ValueError):
+        return None
+    # The kernel reports -1 when the node is unknown.
+    return node if node >= 0 else None
+
+
+def placement(config, ticket, req):
+    """
+    Return the NUMA node for the request connection buffers and thread, or
+    None if NUMA placement is disabled or the node is unknown.
+    """
+    if not config.numa.enable or len(nodes()) < 2:
+        return None
+
+    def storage():
+        if ticket.url.scheme == "file":
+            return device_node(ticket.url.path)
+        return None
+
+    def network():
+        return socket_node(req.socket)
+
+    if config.numa.prefer == NETWORK:
+        order = (network, storage)
+    else:
+        order = (storage, network)
+
+    for func in order:
+        node = func()
+        if node is not None:
+            return node
+
+    return None
+
+
+def bind_buffer(buf, node):
+    """
+    Prefer allocating buffer memory on NUMA node. Must be called before the
+    buffer is used.
+    """
+    try:
+        ioutil.mbind(buf, node)
+    except OSError as e:
+        log.warning("Cannot bind buffer to node %s: %s", node, e)
+
+
+def pin_thread(node):
+    """
+    Run the calling thread, and threads started by it, only on NUMA node
+    cpus.
+    """
+    try:
+        # pid 0 means the calling thread.
+        os.sched_setaffinity(0, nodes()[node])
+    except OSError as e:
+        log.warning("Cannot pin thread to node %s: %s", node, e)
@@ -7,8 +7,12 @@
 # (at your option) any later version.
 
 import logging
+import queue
+import threading
+import time
 
 from . import errors
+from . import ioutil
 from . import stats
 from . import util
 
@@ -35,6 +39,17 @@ class Operation:
         self._done = 0
         self._clock = clock or stats.NullClock()
         self._canceled = False
+        # Set by pipelined operations after an error, to stop the helper
+        # thread.
+        self._stopped = False
+
+        # qos.Throttle set by the ticket running this operation when I/O
+        # should be throttled.
+        self.qos = None
+
+        # iosched.Client set by the ticket running this operation when
+        # outstanding I/O on the storage device is limited.
+        self.limiter = None
 
     @property
     def size(self):
@@ -65,6 +80,36 @@ class Operation:
         log.debug("Cancelling operation %s", self)
         self._canceled = True
 
+    def _throttle(self, nbytes):
+        """
+        Wait until QoS limits allow storage I/O of nbytes bytes.
+        """
+        if self.qos is None:
+            return
+
+        delay = self.qos.reserve(nbytes)
+        if delay == 0:
+            return
+
+        with self._record("throttle"):
+            deadline = time.monotonic() + delay
+            while True:
+                if self._canceled or self._stopped:
+                    raise Canceled
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    break
+                # Wake up periodically to check for cancellation.
+                time.sleep(min(remaining, 0.1))
+
+    def _io(self):
+        """
+        Return context manager wrapping a storage I/O request.
+        """
+        if self.limiter is None:
+            return _NOT_LIMITED
+        return self.limiter.io()
+
     def _record(self, name):
         """
         Return context manager for recording stats.
@@ -108,7 +153,8 @@ class Read(Operation):
         aligned_todo = util.round_up(self._todo, self._src.block_size)
 
         with memoryview(self._buf)[:aligned_todo] as view:
-            with self._record("read") as s:
+            self._throttle(len(view))
+            with self._io(), self._record("read") as s:
                 count = self._src.readinto(view)
                 s.bytes += count
             if count == 0:
@@ -125,6 +171,96 @@ class Read(Operation):
             raise Canceled
 
 
+class PipelinedRead(Read):
+    """
+    Read data from source backend to file object, reading the next chunks
+    from the backend in a helper thread while the current chunk is written to
+    the file object.
+    """
+
+    def __init__(self, src, dst, bufs, size, offset=0, clock=None,
+                 pipeline=None):
+        super().__init__(src, dst, bufs[0], size, offset=offset, clock=clock)
+        self._bufs = bufs
+        self._pipeline = pipeline
+
+    def _run(self):
+        # Nothing to overlap if the request fits in one buffer.
+        if len(self._bufs) < 2 or self._size <= len(self._buf):
+            return super()._run()
+
+        free = queue.Queue()
+        ready = queue.Queue()
+        for buf in self._bufs:
+            free.put(buf)
+
+        reader = _start_helper(
+            self._pipeline, self._read_chunks, free, ready, "read/pipeline")
+        try:
+            while self._todo:
+                item = ready.get()
+                if item is _PARTIAL:
+                    raise errors.PartialContent(self.size, self.done)
+                if isinstance(item, BaseException):
+                    raise item
+
+                buf, skip, size = item
+                with memoryview(buf)[skip:skip + size] as view:
+                    with self._record("write") as s:
+                        self._dst.write(view)
+                        s.bytes += size
+                self._done += size
+                free.put(buf)
+
+                if self._canceled:
+                    raise Canceled
+        finally:
+            self._stopped = True
+            free.put(None)
+            reader.join()
+
+    def _read_chunks(self, free, ready):
+        """
+        Run in the helper thread, reading chunks into free buffers, and
+        passing them to the caller.
+        """
+        try:
+            block_size = self._src.block_size
+            skip = self._offset % block_size
+            todo = self._size
+            self._src.seek(self._offset - skip)
+
+            while todo:
+                buf = free.get()
+                if buf is None or self._stopped:
+                    return
+
+                if self._src.tell() % block_size:
+                    ready.put(_PARTIAL)
+                    return
+
+                # If todo is not aligned to backend block_size we read
+                # complete block and drop up to block_size - 1 bytes.
+                aligned_todo = util.round_up(todo, block_size)
+
+                with memoryview(buf)[:aligned_todo] as view:
+                    self._throttle(len(view))
+                    with self._io(), self._record("read") as s:
+                        count = self._src.readinto(view)
+                        s.bytes += count
+
+                if count == 0:
+                    ready.put(_PARTIAL)
+                    return
+
+                size = min(count - skip, todo)
+                ready.put((buf, skip, size))
+                todo -= size
+                skip = 0
+        except BaseException as e:
+            ready.put(e)
+
+
 class Write(Operation):
     """
     Write data from file object to destination backend.
@@ -181,10 +317,11 @@ class Write(Operation):
                     break
                 read += n
 
+            self._throttle(read)
             pos = 0
             while pos < read:
                 with view[pos:read] as v:
-                    with self._record("write") as s:
+                    with self._io(), self._record("write") as s:
                         n = self._dst.write(v)
                         s.bytes += n
                 pos += n
@@ -199,6 +336,241 @@ class Write(Operation):
             raise Canceled
 
 
+class PipelinedWrite(Write):
+    """
+    Write data from file object to destination backend, writing the previous
+    chunks to the backend in a helper thread while the next chunk is read
+    from the file object.
+    """
+
+    def __init__(self, dst, src, bufs, size=None, offset=0, flush=True,
+                 clock=None, pipeline=None):
+        super().__init__(dst, src, bufs[0], size=size, offset=offset,
+                         flush=flush, clock=clock)
+        self._bufs = bufs
+        self._pipeline = pipeline
+        self._error = None
+
+    def _run(self):
+        # Nothing to overlap if the request fits in one buffer.
+        if (len(self._bufs) < 2 or
+                self._size is not None and self._size <= len(self._buf)):
+            return super()._run()
+
+        free = queue.Queue()
+        ready = queue.Queue()
+        for buf in self._bufs:
+            free.put(buf)
+
+        self._dst.seek(self._offset)
+
+        writer = _start_helper(
+            self._pipeline, self._write_chunks, free, ready, "write/pipeline")
+        try:
+            partial = self._read_chunks(free, ready)
+        except Canceled:
+            # Write the received chunks; throttling is canceled.
+            raise
+        except BaseException:
+            # Drop the chunks not written yet.
+            self._stopped = True
+            raise
+        finally:
+            ready.put(None)
+            writer.join()
+
+        if self._error:
+            raise self._error
+
+        if partial:
+            raise errors.PartialContent(self.size, self.done)
+
+        if self._flush:
+            with self._record("flush"):
+                self._dst.flush()
+
+    def _read_chunks(self, free, ready):
+        """
+        Read chunks from the file object into free buffers, and pass them to
+        the helper thread. Return True if the file object did not have
+        enough data.
+        """
+        received = 0
+
+        # If offset is not aligned to block size, receive partial chunk until
+        # the start of the next block.
+        unaligned = self._offset % self._dst.block_size
+        if unaligned:
+            step = self._dst.block_size - unaligned
+        else:
+            step = len(self._buf)
+
+        while True:
+            if self._size is None:
+                count = step
+            else:
+                count = min(self._size - received, step)
+                if count == 0:
+                    return False
+
+            buf = free.get()
+            if isinstance(buf, BaseException):
+                # The helper thread failed; the error is raised by the caller.
+                return False
+
+            read = self._receive(buf, count)
+            received += read
+            if read:
+                ready.put((buf, read))
+
+            if read < count:
+                return self._size is not None
+
+            if self._canceled:
+                raise Canceled
+
+            # Now current file position is aligned to block size and we can
+            # receive full chunks.
+            step = len(self._buf)
+
+    def _receive(self, buf, count):
+        with memoryview(buf)[:count] as view:
+            read = 0
+            while read < count:
+                with view[read:] as v:
+                    with self._record("read") as s:
+                        n = self._src.readinto(v)
+                        s.bytes += n
+                if not n:
+                    break
+                read += n
+        return read
+
+    def _write_chunks(self, free, ready):
+        """
+        Run in the helper thread, writing received chunks to the backend.
+        """
+        try:
+            while True:
+                item = ready.get()
+                if item is None or self._stopped:
+                    return
+
+                buf, count = item
+                self._throttle(count)
+                with memoryview(buf)[:count] as view:
+                    pos = 0
+                    while pos < count:
+                        with view[pos:count] as v:
+                            with self._io(), self._record("write") as s:
+                                n = self._dst.write(v)
+                                s.bytes += n
+                        pos += n
+                self._done += count
+                free.put(buf)
+        except BaseException as e:
+            self._error = e
+            free.put(e)
+
+
+# Sent by the helper thread when the backend does not have enough data.
+_PARTIAL = object()
+
+
+class Pipeline:
+    """
+    Helper thread running the storage side of pipelined operations.
+
+    The thread is started by the first operation and reused by the next
+    operations on the same connection, so pipelining does not start a new
+    thread per request. The thread runs one operation at a time.
+    """
+
+    def __init__(self, name="pipeline"):
+        self._name = name
+        self._tasks = queue.Queue()
+        self._thread = None
+
+    def submit(self, func, *args):
+        """
+        Run func(*args) in the helper thread, using the I/O priority of the
+        calling thread. Return a task; task.join() waits until func returns.
+        """
+        if self._thread is None:
+            self._thread = util.start_thread(self._run, name=self._name)
+        task = _Task(func, args, ioutil.ioprio_get())
+        self._tasks.put(task)
+        return task
+
+    def close(self):
+        if self._thread is not None:
+            self._tasks.put(None)
+            self._thread.join()
+            self._thread = None
+
+    def _run(self):
+        prio = ioutil.ioprio_get()
+        while True:
+            task = self._tasks.get()
+            if task is None:
+                return
+
+            if task.prio != prio:
+                try:
+                    ioutil.ioprio_set(*task.prio)
+                    prio = task.prio
+                except OSError as e:
+                    log.warning("Cannot set I/O priority %s: %s",
+                                task.prio, e)
+
+            task.run()
+
+
+class _Task:
+
+    def __init__(self, func, args, prio):
+        self._func = func
+        self._args = args
+        self.prio = prio
+        self._done = threading.Event()
+
+    def run(self):
+        try:
+            self._func(*self._args)
+        except Exception:
+            log.exception("Unhandled error in pipeline task")
+        finally:
+            self._done.set()
+
+    def join(self):
+        self._done.wait()
+
+
+def _start_helper(pipeline, func, free, ready, name):
+    """
+    Run func in the pipeline helper thread, or in a new thread if the
+    operation does not have a pipeline.
+    """
+    if pipeline is not None:
+        return pipeline.submit(func, free, ready)
+    return util.start_thread(func, args=(free, ready), name=name)
+
+
+class _NotLimited:
+    """
+    Used when storage I/O is not limited.
+    """
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, t, v, tb):
+        pass
+
+
+_NOT_LIMITED = _NotLimited()
+
+
 class Zero(Operation):
     """
     Zero byte range.
@@ -230,7 +602,9 @@ class Zero(Operation):
 
         while self._todo:
             step = min(self._todo, self.MAX_STEP)
-            with self._record("zero") as s:
+            # Zeroing does not transfer data, but it is still an I/O request.
+            self._throttle(0)
+            with self._io(), self._record("zero") as s:
                 n = self._dst.zero(step)
                 s.bytes += n
             self._done += n
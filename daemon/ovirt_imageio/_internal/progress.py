@@ -0,0 +1,142 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+progress - lock free progress accounting.
+
+Progress is updated by multiple threads after every request, so updating it
+must be cheap. Every thread updates its own slot without locking, and the
+reader aggregates the slots when it needs the value.
+"""
+
+import threading
+
+
+class Slots:
+    """
+    Registry of per-thread slots.
+
+    The first call to get() in a thread creates the thread slot using factory
+    and registers it, taking a lock. The next calls return the thread slot
+    without locking.
+
+    Only the thread owning the slot may modify it. Other threads can read the
+    slots using snapshot().
+    """
+
+    def __init__(self, factory):
+        self._factory = factory
+        self._local = threading.local()
+        self._lock = threading.Lock()
+        self._slots = []
+
+    def get(self):
+        """
+        Return the current thread slot, creating it on the first call.
+        """
+        slot = getattr(self._local, "slot", None)
+        if slot is None:
+            slot = self._factory()
+            with self._lock:
+                self._slots.append(slot)
+            self._local.slot = slot
+        return slot
+
+    def current(self):
+        """
+        Return the current thread slot, or None if the current thread does not
+        have a slot.
+        """
+        return getattr(self._local, "slot", None)
+
+    def remove(self):
+        """
+        Unregister the current thread slot.
+        """
+        slot = self._local.slot
+        with self._lock:
+            self._slots.remove(slot)
+        del self._local.slot
+
+    def snapshot(self):
+        """
+        Return list of all slots.
+        """
+        with self._lock:
+            return list(self._slots)
+
+
+class _CounterSlot:
+    __slots__ = ("value",)
+
+    def __init__(self):
+        self.value = 0
+
+
+class Counter:
+    """
+    Progress counter supporting concurrent updates without locking.
+
+    Compatible with client.ProgressBar() interface, so it can be used as the
+    progress argument of client.upload() and client.download(). Another thread
+    can read the counter value to report progress.
+    """
+
+    def __init__(self, size=0):
+        self.size = size
+        self._slots = Slots(_CounterSlot)
+
+    def update(self, n):
+        """
+        Increment the counter by n bytes.
+        """
+        self._slots.get().value += n
+
+    @property
+    def value(self):
+        """
+        Return the number of bytes counted by all threads.
+        """
+        return sum(slot.value for slot in self._slots.snapshot())
+
+
+class Reporter:
+    """
+    Report progress from multiple threads to a progress object that does not
+    support concurrent updates, like tqdm.
+
+    Updates are counted without locking. If no other thread is reporting
+    progress, the thread reports the bytes counted since the last report. If
+    another thread is reporting, the update is reported later by the next
+    thread.
+
+    Call flush() when done to report the remaining bytes.
+    """
+
+    def __init__(self, progress):
+        self._progress = progress
+        self._counter = Counter()
+        self._lock = threading.Lock()
+        self._reported = 0
+
+    def update(self, n):
+        self._counter.update(n)
+        if self._lock.acquire(blocking=False):
+            try:
+                self._report()
+            finally:
+                self._lock.release()
+
+    def flush(self):
+        with self._lock:
+            self._report()
+
+    def _report(self):
+        value = self._counter.value
+        if value > self._reported:
+            self._progress.update(value - self._reported)
+            self._reported = value
@@ -34,7 +34,8 @@ class Server:
             sock (nbd.Address): socket address to listen to
             export_name (str): expose export by name
             read_only (bool): export is read-only
-            shared (int): export can be shared by specified number of clients
+            shared (int): export can be shared by specified number of
+                clients, or by any number of clients if 0
             cache (str): cache mode (none, writeback, ...)
             aio (str): AIO mode (native or threads)
             discard (str): discard mode (ignore, unmap)
@@ -0,0 +1,266 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+qos - limit storage bandwidth and I/O requests per second.
+
+Limits are enforced using token buckets before every storage I/O. Every
+ticket may have its own limits, and the daemon may have host limits shared by
+all tickets. When the host limits are reached, the host bandwidth and I/O
+requests are shared between the active tickets according to their weight.
+
+Tickets may also specify the I/O priority of the threads doing the storage
+I/O, defaulting to the host I/O priority.
+"""
+
+import logging
+import threading
+import time
+
+from . import ioprio
+
+log = logging.getLogger("qos")
+
+# Number of seconds of burst allowed by a bucket. Idle ticket can use this
+# amount of tokens without waiting.
+BURST = 1.0
+
+# Ticket that did not do any I/O during this number of seconds after its last
+# reservation ended does not get a share of the host limits.
+ACTIVE_PERIOD = 1.0
+
+# Default ticket weight.
+DEFAULT_WEIGHT = 1
+
+
+class TokenBucket:
+    """
+    Token bucket refilled at rate tokens per second, holding up to burst
+    tokens. A rate of 0 means unlimited.
+
+    Consuming more tokens than available leaves the bucket in debt, so
+    requests larger than the bucket are possible; the caller must wait until
+    the debt is paid.
+    """
+
+    def __init__(self, rate=0, clock=time.monotonic):
+        self._clock = clock
+        self._lock = threading.Lock()
+        self._rate = rate
+        self._burst = rate * BURST
+        self._tokens = self._burst
+        self._updated = clock()
+
+    @property
+    def rate(self):
+        return self._rate
+
+    def update(self, rate):
+        """
+        Change the bucket rate, keeping the current tokens.
+        """
+        with self._lock:
+            self._refill()
+            self._rate = rate
+            self._burst = rate * BURST
+            self._tokens = min(self._tokens, self._burst)
+
+    def reserve(self, n):
+        """
+        Consume n tokens, returning the number of seconds the caller must
+        wait before using them.
+        """
+        with self._lock:
+            if self._rate == 0:
+                return 0.0
+            self._refill()
+            self._tokens -= n
+            if self._tokens >= 0:
+                return 0.0
+            return -self._tokens / self._rate
+
+    def _refill(self):
+        now = self._clock()
+        if self._rate:
+            self._tokens = min(
+                self._burst, self._tokens + (now - self._updated) * self._rate)
+        self._updated = now
+
+
+class Host:
+    """
+    Daemon wide limits shared by all tickets.
+
+    Every active ticket gets a share of the host limits proportional to its
+    weight. Idle tickets do not get a share, so a single active ticket can
+    use the entire host bandwidth.
+    """
+
+    def __init__(self, bandwidth=0, iops=0, io_class=ioprio.NONE,
+                 io_level=ioprio.DEFAULT_LEVEL, clock=time.monotonic):
+        self._bandwidth = bandwidth
+        self._iops = iops
+        self._io_class = io_class
+        self._io_level = io_level
+        self._clock = clock
+        self._lock = threading.Lock()
+        # Mapping of active throttle to the time it becomes idle.
+        self._active = {}
+
+    @property
+    def enabled(self):
+        return bool(self._bandwidth or self._iops)
+
+    @property
+    def io_class(self):
+        return self._io_class
+
+    @property
+    def io_level(self):
+        return self._io_level
+
+    def reserve(self, throttle, nbytes):
+        """
+        Reserve host share for I/O of nbytes bytes, returning the number of
+        seconds to wait.
+        """
+        with self._lock:
+            now = self._clock()
+            changed = throttle not in self._active
+            self._active[throttle] = now
+
+            for t, until in list(self._active.items()):
+                if until < now:
+                    del self._active[t]
+                    changed = True
+
+            if changed:
+                self._rebalance()
+
+            delay = max(throttle._host_bandwidth.reserve(nbytes),
+                        throttle._host_iops.reserve(1))
+
+            # A ticket waiting for its reservation is still active; if it
+            # lost its share while waiting, the other tickets would use
+            # more than the host limits.
+            self._active[throttle] = now + delay + ACTIVE_PERIOD
+
+        return delay
+
+    def rebalance(self):
+        """
+        Recompute the active tickets shares after a weight was changed.
+        """
+        with self._lock:
+            self._rebalance()
+
+    def _rebalance(self):
+        total = sum(t.weight for t in self._active)
+        for t in self._active:
+            share = t.weight / total
+            t._host_bandwidth.update(self._bandwidth * share)
+            t._host_iops.update(self._iops * share)
+        log.debug("Rebalanced %d active tickets", len(self._active))
+
+
+class Throttle:
+    """
+    Limit a ticket bandwidth and I/O requests per second, and keep the ticket
+    I/O priority.
+
+    If io_class or io_level are not specified, use the host I/O priority.
+    """
+
+    def __init__(self, bandwidth=0, iops=0, weight=DEFAULT_WEIGHT,
+                 io_class=None, io_level=None, host=None,
+                 clock=time.monotonic):
+        self._weight = weight
+        self._io_class = io_class
+        self._io_level = io_level
+        self._host = host
+        self._bandwidth = TokenBucket(bandwidth, clock=clock)
+        self._iops = TokenBucket(iops, clock=clock)
+        # Share of the host limits, updated by the host.
+        self._host_bandwidth = TokenBucket(clock=clock)
+        self._host_iops = TokenBucket(clock=clock)
+
+    @property
+    def bandwidth(self):
+        return self._bandwidth.rate
+
+    @property
+    def iops(self):
+        return self._iops.rate
+
+    @property
+    def weight(self):
+        return self._weight
+
+    @property
+    def io_class(self):
+        if self._io_class is None:
+            return self._host.io_class if self._host else ioprio.NONE
+        return self._io_class
+
+    @property
+    def io_level(self):
+        if self._io_level is None:
+            return (self._host.io_level if self._host
+                    else ioprio.DEFAULT_LEVEL)
+        return self._io_level
+
+    @property
+    def enabled(self):
+        """
+        Return True if I/O must be throttled.
+        """
+        return bool(self.bandwidth or self.iops or
+                    self._host and self._host.enabled)
+
+    def update(self, bandwidth=None, iops=None, weight=None, io_class=None,
+               io_level=None):
+        """
+        Change the limits while the ticket is used. The I/O priority is used
+        by the next operation.
+        """
+        if io_class is not None:
+            self._io_class = io_class
+        if io_level is not None:
+            self._io_level = io_level
+        if bandwidth is not None:
+            self._bandwidth.update(bandwidth)
+        if iops is not None:
+            self._iops.update(iops)
+        if weight is not None and weight != self._weight:
+            self._weight = weight
+            if self._host:
+                self._host.rebalance()
+
+    def reserve(self, nbytes):
+        """
+        Reserve I/O of nbytes bytes, returning the number of seconds to wait
+        before doing the I/O.
+        """
+        delay = max(self._bandwidth.reserve(nbytes), self._iops.reserve(1))
+        if self._host and self._host.enabled:
+            delay = max(delay, self._host.reserve(self, nbytes))
+        return delay
+
+    def io_priority(self):
+        """
+        Return context manager setting the calling thread I/O priority.
+        """
+        return ioprio.thread_priority(self.io_class, self.io_level)
+
+    def info(self):
+        return {
+            "bandwidth": self.bandwidth,
+            "iops": self.iops,
+            "weight": self.weight,
+            "io_class": self.io_class,
+            "io_level": self.io_level,
+        }
@@ -18,13 +18,19 @@ import pwd
 import signal
 import socket
 import sys
+import threading
 
 import systemd.daemon
 
 from . import auth
+from . import cgroup
 from . import config
+from . import handoff
+from . import logqueue
 from . import services
+from . import util
 from . import version
+from . import workers
 
 VENDOR_CONF_DIR = "/usr/lib/ovirt-imageio"
 
@@ -40,25 +46,42 @@ def main():
             return
 
         configure_logger(cfg)
-        log.info("Starting (hostname=%s pid=%s, version=%s)",
-                 socket.gethostname(), os.getpid(), version.string)
+        log.info("Starting (hostname=%s pid=%s, version=%s, gil=%s)",
+                 socket.gethostname(), os.getpid(), version.string,
+                 util.gil_enabled())
 
-        server = Server(cfg)
+        server = Server(cfg, sockets=handoff.Sockets.from_environment())
+        handoff.load_tickets(server.auth)
+        handoff.connect_old_daemon(server.auth)
         signal.signal(signal.SIGINT, server.terminate)
         signal.signal(signal.SIGTERM, server.terminate)
+        signal.signal(signal.SIGUSR2, server.request_handoff)
 
         server.start()
         try:
+            # Worker processes were forked, so we can start threads.
+            logqueue.start()
+            if server.auth.old_daemon is not None:
+                handoff.watch_old_daemon(server.auth)
+            if handoff.notify_ready():
+                # We replace the old daemon as the service main process.
+                systemd.daemon.notify("MAINPID={}".format(os.getpid()))
             systemd.daemon.notify("READY=1")
             log.info("Ready for requests")
             while server.running:
                 signal.pause()
+                if server.handoff_requested:
+                    server.handoff_requested = False
+                    if server.handoff():
+                        break
         finally:
             server.stop()
         log.info("Stopped")
     except Exception:
         log.exception("Server failed")
         sys.exit(1)
+    finally:
+        logqueue.stop()
 
 
 def parse_args():
@@ -99,19 +122,62 @@ def configure_logger(cfg):
     parser = configparser.RawConfigParser()
     parser.read_dict(config.to_dict(cfg))
     logging.config.fileConfig(parser, disable_existing_loggers=False)
+    logqueue.install(cfg)
 
 
 class Server:
 
-    def __init__(self, config):
+    def __init__(self, config, sockets=None):
+        """
+        Arguments:
+            config: daemon configuration.
+            sockets (handoff.Sockets): inherited listening sockets, used by
+                the services listening on the same address.
+        """
         self.config = config
         self.running = False
-        self.auth = auth.Authorizer(config)
-        self.remote_service = services.RemoteService(self.config, self.auth)
+        self.handoff_requested = False
+        if sockets is None:
+            sockets = handoff.Sockets()
+        self.workers = None
+        self.remote_service = None
+        if config.remote.workers:
+            # The remote service is served by the workers.
+            self.workers = workers.Pool(
+                config, on_failure=self._worker_failed)
+            self.auth = workers.Authorizer(config, self.workers)
+        else:
+            self.auth = auth.Authorizer(config)
+            self.remote_service = services.RemoteService(
+                self.config, self.auth,
+                sock=sockets.take_tcp(config.remote.port))
         self.local_service = None
         if config.local.enable:
-            self.local_service = services.LocalService(self.config, self.auth)
-        self.control_service = services.ControlService(self.config, self.auth)
+            self.local_service = services.LocalService(
+                self.config, self.auth,
+                sock=sockets.take_unix(config.local.socket))
+        self.nbd_service = None
+        if config.nbd_server.enable:
+            self.nbd_service = services.NBDService(
+                self.config, self.auth,
+                sock=sockets.take_unix(config.nbd_server.socket))
+        if config.control.transport.lower() == "tcp":
+            control_sock = sockets.take_tcp(config.control.port)
+        else:
+            control_sock = sockets.take_unix(config.control.socket)
+        self.control_service = services.ControlService(
+            self.config, self.auth, sock=control_sock)
+        sockets.close()
+        self._reaper = None
+        self._stopped = threading.Event()
+        # Set after handing off to a new daemon.
+        self._draining = False
+
+        # Worker processes forked later inherit the cgroup. A daemon started
+        # during handoff inherits the cgroup of the old daemon, and is not
+        # allowed to join it after the old daemon dropped privileges.
+        if self.config.qos.cgroup and not sockets.from_handoff:
+            cgroup.join(self.config.qos.cgroup)
 
         if os.geteuid() == 0 and self.config.daemon.drop_privileges:
             self._drop_privileges()
@@ -120,22 +186,147 @@ class Server:
         assert not self.running
         self.running = True
 
-        self.remote_service.start()
+        # Workers must be forked before starting any thread.
+        if self.workers is not None:
+            self.workers.start()
+        else:
+            self.remote_service.start()
         if self.local_service is not None:
             self.local_service.start()
+        if self.nbd_service is not None:
+            self.nbd_service.start()
         self.control_service.start()
+        self._reaper = util.start_thread(self._reap, name="reaper")
 
     def stop(self):
         log.debug("Stopping services")
-        self.remote_service.stop()
+        self._stopped.set()
+        if self._reaper is not None:
+            self._reaper.join()
+        if self.workers is not None:
+            self.workers.stop()
+        else:
+            self.remote_service.stop()
         if self.local_service is not None:
             self.local_service.stop()
+        if self.nbd_service is not None:
+            self.nbd_service.stop()
         self.control_service.stop()
+        self.auth.jobs.stop()
+
+    def handoff(self):
+        """
+        Hand off the listening sockets and tickets to a new daemon, and wait
+        until active connections are finished.
+
+        Returns True if the new daemon took over and this daemon should
+        exit.
+        """
+        if self.workers is not None:
+            log.warning("Handoff is not supported with remote workers")
+            return False
+
+        services = [s for s in self._services() if s is not None]
+        try:
+            new_daemon = handoff.spawn(
+                self.config, self.auth, [s.socket for s in services])
+        except Exception:
+            log.exception("Error starting new daemon")
+            return False
+
+        if new_daemon is None:
+            return False
+
+        # The new daemon accepts new connections from now.
+        self._draining = True
+        for service in services:
+            service.handoff()
+
+        try:
+            self._drain(new_daemon)
+        finally:
+            new_daemon.close()
+        return True
+
+    def _drain(self, new_daemon):
+        """
+        Wait until active connections are finished, reporting the number of
+        connections using every ticket to the new daemon, and canceling
+        tickets removed in the new daemon.
+        """
+        timeout = self.config.daemon.drain_timeout
+        deadline = util.monotonic_time() + timeout
+        reported = None
+        while self.running:
+            connections = self.auth.ticket_connections()
+            if new_daemon is not None and connections != reported:
+                try:
+                    new_daemon.send({"connections": connections})
+                except OSError as e:
+                    log.warning("Error reporting connections: %s", e)
+                    new_daemon = None
+                reported = connections
+
+            active = sum(connections.values())
+            if active == 0:
+                log.info("All connections finished")
+                return
+            if util.monotonic_time() >= deadline:
+                log.warning("Timeout draining %d active connections", active)
+                return
+            log.debug("Waiting for %d active connections", active)
+
+            if new_daemon is None:
+                self._stopped.wait(self.config.daemon.poll_interval)
+                continue
+
+            try:
+                msg = new_daemon.receive(self.config.daemon.poll_interval)
+            except (EOFError, OSError) as e:
+                log.warning("Error receiving from new daemon: %s", e)
+                new_daemon = None
+                continue
+
+            if msg is not None:
+                log.info("Canceling ticket %s removed in new daemon",
+                         msg["cancel"])
+                self.auth.reclaim(msg["cancel"])
+
+    def _services(self):
+        return (
+            self.remote_service,
+            self.local_service,
+            self.nbd_service,
+            self.control_service,
+        )
+
+    def _reap(self):
+        # Reclaim expired tickets, releasing their resources even if nobody
+        # removes them.
+        while not self._stopped.wait(1):
+            # After handoff, tickets may have been extended in the new
+            # daemon, which cancels tickets removed there in this daemon.
+            if self._draining:
+                continue
+            try:
+                self.auth.expire()
+            except Exception:
+                log.exception("Error reclaiming expired tickets")
 
     def terminate(self, signo, frame):
         log.info("Received signal %d, shutting down", signo)
         self.running = False
 
+    def _worker_failed(self, name):
+        # The remote service cannot work correctly without all workers.
+        # Shut down so systemd restarts the service.
+        log.error("Worker %s failed, shutting down", name)
+        os.kill(os.getpid(), signal.SIGTERM)
+
+    def request_handoff(self, signo, frame):
+        log.info("Received signal %d, starting handoff", signo)
+        self.handoff_requested = True
+
     def _drop_privileges(self):
         uid = pwd.getpwnam(self.config.daemon.user_name).pw_uid
         gid = grp.getgrnam(self.config.daemon.group_name).gr_gid
@@ -148,7 +339,7 @@ class Server:
             os.chown(run_dir, uid, gid)
 
         # Restore ownership of log files.
-        for h in logging.root.handlers:
+        for h in logqueue.handlers(logging.root):
             # Support only logging.FileHandler and sub-classes.
             filename = getattr(h, "baseFilename", None)
             if filename is not None:
@@ -10,12 +10,17 @@ import logging
 import os
 
 from . import checksum
+from . import compare
 from . import errors
 from . import extents
+from . import fdpass
 from . import http
 from . import images
 from . import info
+from . import jobs
+from . import nbdserver
 from . import profile
+from . import shm
 from . import ssl
 from . import stats
 from . import tickets
@@ -39,6 +44,19 @@ class Service:
         log.debug("Stopping %s", self.name)
         self._server.shutdown()
 
+    def handoff(self):
+        """
+        Stop accepting connections, keeping the listening socket used by the
+        new daemon.
+        """
+        self._server.remove_socket = False
+        self._server.draining = True
+        self.stop()
+
+    @property
+    def socket(self):
+        return self._server.socket
+
     @property
     def port(self):
         return self._server.server_port
@@ -64,13 +82,17 @@ class RemoteService(Service):
 
     name = "remote.service"
 
-    def __init__(self, config, auth):
+    def __init__(self, config, auth, reuse_port=False, sock=None):
         self._config = config
         port = config.remote.port
         if not 0 <= port < 0xFFFF:
             raise errors.InvalidConfig("remote.port", port)
         log.debug("Creating %s on port %d", self.name, port)
-        self._server = http.Server((config.remote.host, port), http.Connection)
+        self._server = http.Server(
+            (config.remote.host, port),
+            http.Connection,
+            reuse_port=reuse_port,
+            sock=sock)
         # TODO: Make clock configurable, disabled by default.
         self._server.clock_class = stats.Clock
         if port == 0:
@@ -82,7 +104,9 @@ class RemoteService(Service):
             (r"/images/(.*)/checksum/algorithms",
                 checksum.Algorithms(config, auth)),
             (r"/images/(.*)/checksum", checksum.Checksum(config, auth)),
+            (r"/images/(.*)/compare", compare.Handler(config, auth)),
             (r"/images/(.*)", images.Handler(config, auth)),
+            (r"/jobs/(.*)", jobs.Handler(config, auth)),
             (r"/info/", info.Handler(config, auth)),
         ])
         log.info("%s listening on %r", self.name, self.address)
@@ -114,21 +138,53 @@ class LocalService(Service):
 
     name = "local.service"
 
-    def __init__(self, config, auth):
+    def __init__(self, config, auth, sock=None):
         self._config = config
         log.debug("Creating %s on socket %r", self.name, config.local.socket)
-        self._server = uhttp.Server(config.local.socket, uhttp.Connection)
+        self._server = uhttp.Server(
+            config.local.socket, uhttp.Connection, sock=sock)
         # TODO: Make clock configurable, disabled by default.
         self._server.clock_class = stats.Clock
         if config.local.socket == "":
             config.local.socket = self.address
-        self._server.app = http.Router([
+        routes = [
             (r"/images/(.*)/extents", extents.Handler(config, auth)),
             (r"/images/(.*)/checksum/algorithms",
                 checksum.Algorithms(config, auth)),
             (r"/images/(.*)/checksum", checksum.Checksum(config, auth)),
-            (r"/images/(.*)", images.Handler(config, auth)),
-        ])
+            (r"/images/(.*)/compare", compare.Handler(config, auth)),
+        ]
+        if config.local.fd_passing:
+            routes.append((r"/images/(.*)/fd", fdpass.Handler(config, auth)))
+        if config.local.shm_max_size:
+            routes.append((r"/images/(.*)/shm", shm.Handler(config, auth)))
+        routes.append((r"/images/(.*)", images.Handler(config, auth)))
+        routes.append((r"/jobs/(.*)", jobs.Handler(config, auth)))
+        self._server.app = http.Router(routes)
+        log.info("%s listening on %r", self.name, self.address)
+
+
+class NBDService(Service):
+    """
+    Service used to access images locally using NBD protocol.
+
+    Every ticket is exported using the ticket id as the export name. Access
+    to the export requires a valid ticket installed using the control
+    service.
+    """
+
+    name = "nbd.service"
+
+    def __init__(self, config, auth, sock=None):
+        self._config = config
+        socket = config.nbd_server.socket
+        log.debug("Creating %s on socket %r", self.name, socket)
+        self._server = uhttp.Server(socket, nbdserver.Connection, sock=sock)
+        # TODO: Make clock configurable, disabled by default.
+        self._server.clock_class = stats.Clock
+        if socket == "":
+            config.nbd_server.socket = self.address
+        self._server.app = nbdserver.Handler(config, auth)
         log.info("%s listening on %r", self.name, self.address)
 
 
@@ -142,7 +198,7 @@ class ControlService(Service):
 
     name = "control.service"
 
-    def __init__(self, config, auth):
+    def __init__(self, config, auth, sock=None):
         self._config = config
         transport = self._config.control.transport.lower()
         if transport == "tcp":
@@ -153,13 +209,14 @@ class ControlService(Service):
             self._server = http.Server(
                 ("localhost", port),
                 http.Connection,
-                prefer_ipv4=config.control.prefer_ipv4)
+                prefer_ipv4=config.control.prefer_ipv4,
+                sock=sock)
             if port == 0:
                 config.control.port = self.port
         elif transport == "unix":
             socket = config.control.socket
             log.debug("Creating %s on socket %r", self.name, socket)
-            self._server = uhttp.Server(socket, uhttp.Connection)
+            self._server = uhttp.Server(socket, uhttp.Connection, sock=sock)
             if socket == "":
                 config.control.socket = self.address
             os.chmod(config.control.socket, DEFAULT_SOCKET_MODE)
@@ -0,0 +1,393 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+shm - shared memory transport for local clients.
+
+The client negotiates the transport using GET /images/ticket-id/shm on the
+local service. The server creates a memfd backed ring of aligned slots, and
+passes it to the client using SCM_RIGHTS. After the response, the connection
+switches to a simple binary protocol:
+
+- The client sends commands (CMD struct): op, slot, offset, length.
+- The server does the storage I/O directly into or from the slot, and sends
+  a completion (REPLY struct): slot, error, count.
+
+The client may submit multiple commands before waiting for the completions.
+Commands are completed in order. Image data is never copied through the
+socket.
+"""
+
+import errno
+import logging
+import mmap
+import os
+import socket
+import struct
+
+from . import backends
+from . import errors
+from . import http
+from . import ops
+from . import uhttp
+from . import util
+
+log = logging.getLogger("shm")
+
+# Default ring geometry when the client does not specify one.
+DEFAULT_SLOTS = 4
+DEFAULT_SLOT_SIZE = 4 * 1024**2
+
+# Slot size must be aligned for direct I/O.
+ALIGNMENT = 4096
+
+# Commands.
+CMD_CLOSE = 0
+CMD_READ = 1
+CMD_WRITE = 2
+CMD_FLUSH = 3
+
+# op, slot, offset, length
+CMD = struct.Struct("!B3xIQQ")
+
+# slot, error, count
+REPLY = struct.Struct("!IiQ")
+
+
+class Handler:
+    """
+    Handle requests for the /images/ticket-id/shm resource.
+    """
+
+    def __init__(self, config, auth):
+        self.config = config
+        self.auth = auth
+
+    def get(self, req, resp, ticket_id):
+        if not ticket_id:
+            raise http.Error(http.BAD_REQUEST, "Ticket id is required")
+
+        slots = _query_int(req, "slots", DEFAULT_SLOTS)
+        slot_size = _query_int(req, "slot_size", DEFAULT_SLOT_SIZE)
+
+        if slot_size <= 0 or slot_size % ALIGNMENT:
+            raise http.Error(
+                http.BAD_REQUEST,
+                "Slot size is not aligned to {}".format(ALIGNMENT))
+
+        max_size = self.config.local.shm_max_size
+        if slots <= 0 or slots * slot_size > max_size:
+            raise http.Error(
+                http.BAD_REQUEST,
+                "Shared memory size out of allowed range: 1-{}"
+                .format(max_size))
+
+        try:
+            ticket = self.auth.authorize(ticket_id, "read", req.context)
+            ctx = backends.get(req, ticket, self.config)
+        except errors.AuthorizationError as e:
+            resp.close_connection()
+            raise http.Error(http.FORBIDDEN, str(e))
+
+        info = {
+            "slots": slots,
+            "slot_size": slot_size,
+            "size": min(ticket.size, ctx.backend.size()),
+            "block_size": ctx.backend.block_size,
+            "writable": "write" in ticket.ops,
+        }
+
+        log.info("[%s] SHM info=%s ticket=%s",
+                 req.client_addr, info, ticket_id)
+
+        fd = os.memfd_create("imageio-shm", os.MFD_CLOEXEC)
+        try:
+            os.ftruncate(fd, slots * slot_size)
+            buf = mmap.mmap(fd, slots * slot_size)
+            try:
+                resp.close_connection()
+                resp.send_fds(info, [fd])
+            except BaseException:
+                buf.close()
+                raise
+        finally:
+            os.close(fd)
+
+        with buf:
+            rfile, wfile = resp.takeover()
+            session = Session(
+                self.auth, ticket_id, ctx.backend, buf, slot_size,
+                clock=req.clock)
+            session.run(rfile, wfile)
+
+
+class Session:
+    """
+    Serve shared memory transport commands on a connection.
+    """
+
+    def __init__(self, auth, ticket_id, backend, buf, slot_size, clock=None):
+        self._auth = auth
+        self._ticket_id = ticket_id
+        self._backend = backend
+        self._buf = buf
+        self._slot_size = slot_size
+        self._slots = len(buf) // slot_size
+        self._clock = clock
+        # Caches the ticket for authorizing commands.
+        self._context = {}
+
+    def run(self, rfile, wfile):
+        while True:
+            cmd = rfile.read(CMD.size)
+            if len(cmd) < CMD.size:
+                log.debug("Client disconnected")
+                break
+
+            op, slot, offset, length = CMD.unpack(cmd)
+            if op == CMD_CLOSE:
+                log.debug("Client closed the session")
+                break
+
+            error, count = self._handle(op, slot, offset, length)
+            wfile.write(REPLY.pack(slot, error, count))
+
+    def _handle(self, op, slot, offset, length):
+        """
+        Run command, returning errno and number of bytes transferred.
+        """
+        try:
+            if op == CMD_READ:
+                return 0, self._read(slot, offset, length)
+            elif op == CMD_WRITE:
+                return 0, self._write(slot, offset, length)
+            elif op == CMD_FLUSH:
+                return 0, self._flush()
+            else:
+                log.warning("Invalid command %s", op)
+                return errno.EINVAL, 0
+        except errors.AuthorizationError as e:
+            log.warning("Command %s failed: %s", op, e)
+            return errno.EPERM, 0
+        except _Invalid as e:
+            log.warning("Invalid command %s: %s", op, e)
+            return errno.EINVAL, 0
+        except OSError as e:
+            log.warning("Command %s failed: %s", op, e)
+            return e.errno or errno.EIO, 0
+        except Exception:
+            log.exception("Command %s failed", op)
+            return errno.EIO, 0
+
+    def _read(self, slot, offset, length):
+        ticket = self._auth.authorize(self._ticket_id, "read", self._context)
+        self._validate(ticket, slot, offset, length)
+
+        # Direct I/O requires aligned offset and length. We read complete
+        # blocks and report only the requested length.
+        block_size = self._backend.block_size
+        if offset % block_size:
+            raise _Invalid("Offset {} not aligned to {}".format(
+                offset, block_size))
+
+        aligned_length = util.round_up(length, block_size)
+        if aligned_length > self._slot_size:
+            raise _Invalid("Length {} exceeds slot size {}".format(
+                aligned_length, self._slot_size))
+
+        with self._slot(slot, aligned_length) as view:
+            op = ReadSlot(
+                self._backend, view, length, offset, clock=self._clock)
+            ticket.run(op)
+        return op.done
+
+    def _write(self, slot, offset, length):
+        ticket = self._auth.authorize(self._ticket_id, "write", self._context)
+        self._validate(ticket, slot, offset, length)
+        with self._slot(slot, length) as view:
+            op = WriteSlot(
+                self._backend, view, length, offset, clock=self._clock)
+            ticket.run(op)
+        return op.done
+
+    def _flush(self):
+        ticket = self._auth.authorize(self._ticket_id, "write", self._context)
+        ticket.run(ops.Flush(self._backend, clock=self._clock))
+        return 0
+
+    def _validate(self, ticket, slot, offset, length):
+        if slot >= self._slots:
+            raise _Invalid("No such slot {}".format(slot))
+        if length > self._slot_size:
+            raise _Invalid("Length {} exceeds slot size {}".format(
+                length, self._slot_size))
+        if offset + length > ticket.size:
+            raise _Invalid("Requested range out of allowed range")
+
+    def _slot(self, slot, length):
+        start = slot * self._slot_size
+        return memoryview(self._buf)[start:start + length]
+
+
+class ReadSlot(ops.Operation):
+    """
+    Read data from backend into shared memory slot.
+    """
+
+    name = "read"
+
+    def __init__(self, backend, view, size, offset, clock=None):
+        super().__init__(size=size, offset=offset, clock=clock)
+        self._backend = backend
+        self._view = view
+
+    def _run(self):
+        self._backend.seek(self._offset)
+        while self._todo > 0:
+            with self._view[self._done:] as v:
+                self._throttle(len(v))
+                with self._io(), self._record("read") as s:
+                    n = self._backend.readinto(v)
+                    s.bytes += n
+            if n == 0:
+                break
+            self._done = min(self._done + n, self._size)
+
+            if self._canceled:
+                raise ops.Canceled
+
+
+class WriteSlot(ops.Operation):
+    """
+    Write data from shared memory slot to backend.
+    """
+
+    name = "write"
+
+    def __init__(self, backend, view, size, offset, clock=None):
+        super().__init__(size=size, offset=offset, clock=clock)
+        self._backend = backend
+        self._view = view
+
+    def _run(self):
+        self._backend.seek(self._offset)
+        while self._todo:
+            with self._view[self._done:] as v:
+                self._throttle(len(v))
+                with self._io(), self._record("write") as s:
+                    n = self._backend.write(v)
+                    s.bytes += n
+            self._done += n
+
+            if self._canceled:
+                raise ops.Canceled
+
+
+class Client:
+    """
+    Shared memory transport client.
+
+    Use buffer(slot) to access the slot data, and read(), write() and
+    flush() to run commands. To keep multiple commands in flight, use
+    submit() and wait().
+    """
+
+    def __init__(self, path, ticket_id, slots=DEFAULT_SLOTS,
+                 slot_size=DEFAULT_SLOT_SIZE, timeout=60):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.settimeout(timeout)
+        self._buf = None
+        try:
+            self._sock.connect(path)
+            uri = "/images/{}/shm?slots={}&slot_size={}".format(
+                ticket_id, slots, slot_size)
+            self.info, fds = uhttp.request_fds(self._sock, uri)
+            try:
+                self._buf = mmap.mmap(
+                    fds[0], self.info["slots"] * self.info["slot_size"])
+            finally:
+                for fd in fds:
+                    os.close(fd)
+        except BaseException:
+            self._sock.close()
+            raise
+
+    def buffer(self, slot):
+        """
+        Return memoryview of slot data.
+        """
+        size = self.info["slot_size"]
+        return memoryview(self._buf)[slot * size:(slot + 1) * size]
+
+    def read(self, slot, offset, length):
+        self.submit(CMD_READ, slot, offset, length)
+        return self.wait()[1]
+
+    def write(self, slot, offset, length):
+        self.submit(CMD_WRITE, slot, offset, length)
+        return self.wait()[1]
+
+    def flush(self):
+        self.submit(CMD_FLUSH, 0, 0, 0)
+        self.wait()
+
+    def submit(self, op, slot, offset, length):
+        self._sock.sendall(CMD.pack(op, slot, offset, length))
+
+    def wait(self):
+        """
+        Wait for the next completion, returning (slot, count).
+
+        Raises OSError if the command failed.
+        """
+        reply = bytearray(REPLY.size)
+        pos = 0
+        while pos < REPLY.size:
+            with memoryview(reply)[pos:] as v:
+                n = util.uninterruptible(self._sock.recv_into, v)
+            if n == 0:
+                raise OSError(errno.ECONNRESET, "Server closed the session")
+            pos += n
+
+        slot, error, count = REPLY.unpack(reply)
+        if error:
+            raise OSError(error, os.strerror(error))
+
+        return slot, count
+
+    def close(self):
+        if self._sock:
+            try:
+                self._sock.sendall(CMD.pack(CMD_CLOSE, 0, 0, 0))
+            except OSError as e:
+                log.debug("Error closing session: %s", e)
+            self._sock.close()
+            self._sock = None
+        if self._buf:
+            self._buf.close()
+            self._buf = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+class _Invalid(Exception):
+    """
+    Raised when a command is invalid.
+    """
+
+
+def _query_int(req, name, default):
+    try:
+        return int(req.query.get(name, default))
+    except ValueError:
+        raise http.Error(
+            http.BAD_REQUEST,
+            "Invalid {}: {!r}".format(name, req.query[name]))
@@ -7,6 +7,7 @@
 # (at your option) any later version.
 
 import collections
+import threading
 import time
 
 from contextlib import contextmanager
@@ -49,32 +50,39 @@ class Clock:
         clock.stop("total")
         log.info("times=%s", clock)
 
+    The clock is usually used by a single thread, but it may be formatted
+    by another thread, or shared by threads of a job. The lock is not
+    contended in the common case, so it is cheap.
     """
 
     def __init__(self, now=time.monotonic):
         # Keep insertion order for nicer output in __repr__.
         self._stats = collections.OrderedDict()
         self._now = now
+        self._lock = threading.Lock()
 
     def start(self, name):
-        s = self._stats.get(name)
-        if s is None:
-            s = self._stats[name] = Stats(name)
+        with self._lock:
+            s = self._stats.get(name)
+            if s is None:
+                s = self._stats[name] = Stats(name)
 
-        if s.started is not None:
-            raise RuntimeError("Stats %r was already started" % name)
+            if s.started is not None:
+                raise RuntimeError("Stats %r was already started" % name)
 
-        s.started = self._now()
+            s.started = self._now()
 
-        return s
+            return s
 
     def stop(self, name):
-        s = self._lookup_started(name)
-        return self._stop(s, True)
+        with self._lock:
+            s = self._lookup_started(name)
+            return self._stop(s, True)
 
     def abort(self, name):
-        s = self._lookup_started(name)
-        return self._stop(s, False)
+        with self._lock:
+            s = self._lookup_started(name)
+            return self._stop(s, False)
 
     @contextmanager
     def run(self, name):
@@ -82,12 +90,15 @@ class Clock:
         try:
             yield s
         except BaseException:
-            self._stop(s, False)
+            with self._lock:
+                self._stop(s, False)
             raise
         else:
-            self._stop(s, True)
+            with self._lock:
+                self._stop(s, True)
 
     def _lookup_started(self, name):
+        # Must be called with the lock held.
         s = self._stats.get(name)
         if s is None:
             raise RuntimeError("No such stats %r" % name)
@@ -98,6 +109,7 @@ class Clock:
         return s
 
     def _stop(self, s, completed):
+        # Must be called with the lock held.
         elapsed = self._now() - s.started
         s.seconds += elapsed
         s.started = None
@@ -107,22 +119,24 @@ class Clock:
         return elapsed
 
     def __repr__(self):
-        now = self._now()
+        with self._lock:
+            now = self._now()
+            values = [(s.name, s.ops, s.bytes, s.started, s.seconds)
+                      for s in self._stats.values()]
+
         stats = []
-        for s in self._stats.values():
-            if s.started is not None:
-                seconds = now - s.started
-            else:
-                seconds = s.seconds
-            values = [
-                "{} ops".format(s.ops),
+        for name, ops, nbytes, started, seconds in values:
+            if started is not None:
+                seconds = now - started
+            fields = [
+                "{} ops".format(ops),
                 "{:.6f} s".format(seconds),
             ]
-            if s.bytes:
-                values.append(util.humansize(s.bytes))
-                values.append(util.humansize(s.bytes / seconds) + "/s")
+            if nbytes:
+                fields.append(util.humansize(nbytes))
+                fields.append(util.humansize(nbytes / seconds) + "/s")
 
-            stats.append("[{} {}]".format(s.name, ", ".join(values)))
+            stats.append("[{} {}]".format(name, ", ".join(fields)))
 
         return " ".join(stats)
 
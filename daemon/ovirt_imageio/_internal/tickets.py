@@ -27,7 +27,7 @@ class Handler:
 
     def get(self, req, resp, ticket_id):
         if not ticket_id:
-            raise http.Error(http.BAD_REQUEST, "Ticket id is required")
+            return self._watch(req, resp)
 
         try:
             ticket = self.auth.get(ticket_id)
@@ -39,6 +39,34 @@ class Handler:
         log.debug("[%s] GET ticket=%s", req.client_addr, ticket_info)
         resp.send_json(ticket_info)
 
+    def _watch(self, req, resp):
+        """
+        Watch tickets status.
+
+        Return the status of all tickets and the current version. When the
+        "since" query parameter is specified, return only the tickets
+        changed and removed after this version, waiting up to "timeout"
+        seconds for changes. The client should use the returned version in
+        the next request.
+
+        When "reset" is true, the response includes all tickets, and the
+        client should replace its state.
+        """
+        try:
+            since = req.query.get("since")
+            if since is not None:
+                since = int(since)
+            timeout = float(req.query.get("timeout", 0))
+        except ValueError as e:
+            raise http.Error(
+                http.BAD_REQUEST, "Invalid watch parameter: {}".format(e))
+
+        timeout = max(0, min(timeout, self.config.control.watch_timeout))
+
+        log.debug("[%s] WATCH since=%s timeout=%s",
+                  req.client_addr, since, timeout)
+        resp.send_json(self.auth.watch(since=since, timeout=timeout))
+
     def put(self, req, resp, ticket_id):
         if not ticket_id:
             raise http.Error(http.BAD_REQUEST, "Ticket id is required")
@@ -59,6 +87,79 @@ class Handler:
             raise http.Error(
                 http.BAD_REQUEST, "Invalid ticket: {}".format(e))
 
+    def post(self, req, resp, ticket_id):
+        """
+        Add, extend, and remove multiple tickets in one request.
+
+        The request is a json object with optional keys:
+
+            add: list of tickets to add
+            extend: list of {"uuid": ticket-id, "timeout": seconds}
+            remove: list of ticket ids to remove
+
+        Operations are done in this order. The response reports the result
+        of every item in the same format; failed items include an "error"
+        message.
+        """
+        if ticket_id:
+            raise http.Error(
+                http.METHOD_NOT_ALLOWED,
+                "Cannot post to ticket {!r}".format(ticket_id))
+
+        try:
+            batch = json.loads(req.read())
+        except ValueError as e:
+            raise http.Error(
+                http.BAD_REQUEST, "Invalid batch: {}".format(e))
+
+        if not isinstance(batch, dict):
+            raise http.Error(
+                http.BAD_REQUEST, "Invalid batch: {!r}".format(batch))
+
+        add = _batch_list(batch, "add", dict)
+        extend = _batch_list(batch, "extend", dict)
+        remove = _batch_list(batch, "remove", str)
+
+        for item in extend:
+            if not isinstance(item.get("uuid"), str):
+                raise http.Error(
+                    http.BAD_REQUEST, "Invalid extend item: {!r}".format(item))
+            validate.integer(item, "timeout", minval=0)
+
+        log.info("[%s] BATCH add=%d extend=%d remove=%d",
+                 req.client_addr, len(add), len(extend), len(remove))
+
+        result = {"add": [], "extend": [], "remove": []}
+
+        for ticket_dict in add:
+            item = {"uuid": ticket_dict.get("uuid")}
+            try:
+                self.auth.add(ticket_dict)
+            except errors.InvalidTicket as e:
+                item["error"] = "Invalid ticket: {}".format(e)
+            result["add"].append(item)
+
+        for patch in extend:
+            item = {"uuid": patch["uuid"]}
+            try:
+                ticket = self.auth.get(patch["uuid"])
+            except KeyError:
+                item["error"] = "No such ticket"
+            else:
+                ticket.extend(patch["timeout"])
+            result["extend"].append(item)
+
+        # Cancel all tickets before waiting, so removing many tickets takes
+        # about the same time as removing one.
+        pending = set(self.auth.remove_many(remove))
+        for ticket_id in remove:
+            item = {"uuid": ticket_id}
+            if ticket_id in pending:
+                item["error"] = "Timeout cancelling ticket"
+            result["remove"].append(item)
+
+        resp.send_json(result)
+
     def patch(self, req, resp, ticket_id):
         if not ticket_id:
             raise http.Error(http.BAD_REQUEST, "Ticket id is required")
@@ -71,7 +172,16 @@ class Handler:
             raise http.Error(
                 http.BAD_REQUEST, "Invalid patch: {}".format(e))
 
-        timeout = validate.integer(patch, "timeout", minval=0)
+        # Patch must include timeout, qos, or both.
+        if "qos" in patch:
+            timeout = validate.integer(patch, "timeout", minval=0, default=-1)
+            qos = patch["qos"]
+            if not isinstance(qos, dict):
+                raise http.Error(
+                    http.BAD_REQUEST, "Invalid qos: {!r}".format(qos))
+        else:
+            timeout = validate.integer(patch, "timeout", minval=0)
+            qos = None
 
         try:
             ticket = self.auth.get(ticket_id)
@@ -79,9 +189,19 @@ class Handler:
             raise http.Error(
                 http.NOT_FOUND, "No such ticket: {}".format(ticket_id))
 
-        log.info("[%s] EXTEND timeout=%s ticket=%s",
-                 req.client_addr, timeout, ticket_id)
-        ticket.extend(timeout)
+        if qos is not None:
+            log.info("[%s] UPDATE qos=%s ticket=%s",
+                     req.client_addr, qos, ticket_id)
+            try:
+                ticket.update_qos(qos)
+            except errors.InvalidTicket as e:
+                raise http.Error(
+                    http.BAD_REQUEST, "Invalid qos: {}".format(e))
+
+        if timeout != -1:
+            log.info("[%s] EXTEND timeout=%s ticket=%s",
+                     req.client_addr, timeout, ticket_id)
+            ticket.extend(timeout)
 
     def delete(self, req, resp, ticket_id):
         """
@@ -105,3 +225,12 @@ class Handler:
             self.auth.clear()
 
         resp.status_code = http.NO_CONTENT
+
+
+def _batch_list(batch, name, item_type):
+    items = batch.get(name, [])
+    if not isinstance(items, list) or not all(
+            isinstance(item, item_type) for item in items):
+        raise http.Error(
+            http.BAD_REQUEST, "Invalid {}: {!r}".format(name, items))
+    return items
@@ -0,0 +1,86 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+timerwheel - hashed timing wheel for expiring many keys.
+
+Scheduling and canceling a key is O(1). Advancing the wheel scans only the
+slots of the elapsed ticks, so the cost depends on the number of keys
+expiring, not on the total number of keys.
+"""
+
+
+class TimerWheel:
+    """
+    Hashed timing wheel.
+
+    Keys are kept in slots by their deadline tick. A slot may hold keys from
+    later rounds of the wheel; these are kept when the slot is scanned.
+
+    Thread safety: not thread safe, the caller must serialize access.
+    """
+
+    def __init__(self, slots=4096, resolution=1.0, now=0):
+        self._slots = [{} for _ in range(slots)]
+        self._resolution = resolution
+        # Mapping of key to (deadline, tick).
+        self._keys = {}
+        self._tick = self._to_tick(now)
+
+    def schedule(self, key, deadline):
+        """
+        Schedule key to expire at deadline, replacing the previous deadline.
+        """
+        self.cancel(key)
+        tick = max(self._to_tick(deadline), self._tick)
+        self._slots[tick % len(self._slots)][key] = deadline
+        self._keys[key] = (deadline, tick)
+
+    def cancel(self, key):
+        """
+        Remove key from the wheel. Does nothing if the key is not scheduled.
+        """
+        entry = self._keys.pop(key, None)
+        if entry is not None:
+            _, tick = entry
+            del self._slots[tick % len(self._slots)][key]
+
+    def deadline(self, key):
+        """
+        Return the key deadline, or None if the key is not scheduled.
+        """
+        entry = self._keys.get(key)
+        return entry[0] if entry else None
+
+    def advance(self, now):
+        """
+        Advance the wheel to now, returning list of expired keys.
+        """
+        target = self._to_tick(now)
+        if target - self._tick >= len(self._slots):
+            ticks = range(len(self._slots))
+        else:
+            ticks = range(self._tick, target + 1)
+
+        expired = []
+        for tick in ticks:
+            slot = self._slots[tick % len(self._slots)]
+            for key, deadline in list(slot.items()):
+                if deadline <= now:
+                    del slot[key]
+                    del self._keys[key]
+                    expired.append(key)
+
+        # The current tick may still have keys expiring later.
+        self._tick = max(self._tick, target)
+        return expired
+
+    def __len__(self):
+        return len(self._keys)
+
+    def _to_tick(self, t):
+        return int(t // self._resolution)
@@ -6,8 +6,10 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import array
 import errno
 import http.client as http_client
+import json
 import logging
 import os
 import socket
@@ -56,6 +58,10 @@ class Server(http.Server):
     server_name = "localhost"
     server_port = None
 
+    # Remove pathname socket on shutdown. Disabled when the socket is owned
+    # by systemd, or handed off to a new daemon.
+    remove_socket = True
+
     def create_socket(self, prefer_ipv4=False):
         self.socket = socket.socket(socket.AF_UNIX, self.socket_type)
 
@@ -78,6 +84,11 @@ class Server(http.Server):
         # See https://docs.python.org/3.9/library/socket.html#socket-families
         self.server_address = util.ensure_text(self.socket.getsockname())
 
+    def use_socket(self, sock):
+        self.socket = sock
+        self.server_address = util.ensure_text(sock.getsockname())
+        self.remove_socket = False
+
     def get_request(self):
         """
         Override to return non-empty client address, expected by
@@ -87,7 +98,7 @@ class Server(http.Server):
         return sock, self.server_address
 
     def shutdown(self):
-        if self.server_address[0] != "\0":
+        if self.remove_socket and self.server_address[0] != "\0":
             self._remove_socket()
         super().shutdown()
 
@@ -116,6 +127,105 @@ class Connection(http.Connection):
         return "local"
 
 
+def receive_fd(path, ticket_id, timeout=60):
+    """
+    Receive the image file descriptor for ticket_id from the local service
+    listening on unix socket path. Requires local:fd_passing.
+
+    Returns:
+        Tuple of (info, fd). info is a dict describing the file descriptor.
+        The caller owns the file descriptor and must close it.
+
+    Raises:
+        http.Error if the request failed.
+    """
+    sock = _create_unix_socket(timeout)
+    with sock:
+        sock.connect(path)
+        info, fds = request_fds(sock, "/images/{}/fd".format(ticket_id))
+
+    if len(fds) != 1:
+        for fd in fds:
+            os.close(fd)
+        raise http.Error(
+            http.INTERNAL_SERVER_ERROR,
+            "Expected 1 file descriptor, received {}".format(len(fds)))
+
+    return info, fds[0]
+
+
+def request_fds(sock, uri):
+    """
+    Send GET request for uri on connected unix socket sock, and return the
+    JSON response and the file descriptors passed with the response.
+
+    The file descriptors are attached to the first byte of the response, so
+    we must receive the response using recvmsg(). The request asks the
+    server to close the connection, so the server will not accept more HTTP
+    requests on this connection.
+
+    Raises:
+        http.Error if the request failed.
+    """
+    request = (
+        "GET {} HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+    ).format(uri).encode("utf-8")
+
+    sock.sendall(request)
+
+    data = bytearray()
+    fds = array.array("i")
+    content_length = None
+    header_end = -1
+
+    while True:
+        msg, ancdata, _, _ = util.uninterruptible(
+            sock.recvmsg, 65536, socket.CMSG_SPACE(fds.itemsize))
+        for cmsg_level, cmsg_type, cdata in ancdata:
+            if (cmsg_level == socket.SOL_SOCKET and
+                    cmsg_type == socket.SCM_RIGHTS):
+                n = len(cdata) // fds.itemsize
+                fds.frombytes(cdata[:n * fds.itemsize])
+        if not msg:
+            break
+
+        data += msg
+
+        if header_end == -1:
+            header_end = data.find(b"\r\n\r\n")
+            if header_end != -1:
+                content_length = _content_length(data[:header_end])
+
+        if (content_length is not None and
+                len(data) >= header_end + 4 + content_length):
+            break
+
+    if header_end == -1:
+        status = http.INTERNAL_SERVER_ERROR
+        body = b"Connection closed before receiving response"
+    else:
+        status = int(data.split(b" ", 2)[1])
+        body = bytes(data[header_end + 4:])
+
+    if status != http.OK:
+        for fd in fds:
+            os.close(fd)
+        raise http.Error(status, body.decode("utf-8").strip())
+
+    return json.loads(body), list(fds)
+
+
+def _content_length(header):
+    for line in header.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            return int(value)
+    return 0
+
+
 def _create_unix_socket(timeout):
     sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
     if timeout is not socket._GLOBAL_DEFAULT_TIMEOUT:
@@ -9,9 +9,12 @@
 import collections
 import errno
 import io
+import itertools
 import mmap
 import os
+import sys
 import threading
+import time
 
 
 def uninterruptible(func, *args):
@@ -33,7 +36,19 @@ def start_thread(func, args=(), kwargs=None, name=None, daemon=True):
 
 
 def monotonic_time():
-    return os.times()[4]
+    # Called on every request; time.monotonic() uses the vDSO and is much
+    # cheaper than os.times(). Both count seconds since boot.
+    return time.monotonic()
+
+
+def gil_enabled():
+    """
+    Return True if the GIL is enabled. In free-threaded Python, importing an
+    extension module that does not declare support for running without the
+    GIL enables the GIL.
+    """
+    is_enabled = getattr(sys, "_is_gil_enabled", None)
+    return is_enabled is None or is_enabled()
 
 
 def humansize(n):
@@ -121,6 +136,26 @@ def ensure_text(s, encoding='utf-8', errors='strict'):
         raise TypeError("not expecting type '%s'" % type(s))
 
 
+class Sequence:
+    """
+    Generate increasing integers from multiple threads.
+
+    Calling next() on itertools.count() is atomic only when holding the GIL,
+    so it cannot be shared by threads in free-threaded Python.
+    """
+
+    def __init__(self, start=0):
+        self._count = itertools.count(start)
+        self._lock = threading.Lock()
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        with self._lock:
+            return next(self._count)
+
+
 class UnbufferedStream:
     """
     Unlike regular file object, read may return any amount of bytes up to the
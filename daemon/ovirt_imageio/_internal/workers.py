@@ -0,0 +1,411 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+"""
+workers - serve the remote service using multiple processes.
+
+When running in a single process, all services share the same GIL, limiting
+the daemon to few cores. When remote.workers is set, the remote service runs
+in worker processes, each listening on the remote port using SO_REUSEPORT, so
+the kernel distributes incoming connections between the workers.
+
+The control service in the main process owns the tickets. Tickets are
+replicated to the workers using a control channel, and ticket status is
+aggregated from all the workers.
+"""
+
+import logging
+import multiprocessing
+import os
+import signal
+import socket
+import threading
+
+from . import auth
+from . import http
+from . import logqueue
+from . import measure
+from . import services
+
+log = logging.getLogger("workers")
+
+
+class Pool:
+    """
+    Worker processes serving the remote service.
+    """
+
+    def __init__(self, config, on_failure=None):
+        """
+        Arguments:
+            config: daemon configuration.
+            on_failure (callable): called with the worker name when a worker
+                terminated unexpectedly. The daemon cannot serve the remote
+                service correctly without all workers, so the server uses
+                this to shut down, and systemd restarts the service.
+        """
+        self._config = config
+        self._on_failure = on_failure
+        self._failed = False
+        self._lock = threading.Lock()
+        self._workers = []
+        self._socket = None
+
+    def start(self):
+        """
+        Start the worker processes. Must be called before starting any
+        thread in the main process.
+        """
+        self._reserve_port()
+
+        ctx = multiprocessing.get_context("fork")
+        for i in range(self._config.remote.workers):
+            conn, child_conn = ctx.Pipe()
+            proc = ctx.Process(
+                target=_run,
+                args=(self._config, child_conn),
+                name="worker/{}".format(i),
+                daemon=True)
+            proc.start()
+            child_conn.close()
+            log.info("Started worker %s pid=%s", proc.name, proc.pid)
+            self._workers.append(_Worker(proc, conn))
+
+        # Wait until all workers are listening.
+        self.call("ping")
+
+    def stop(self):
+        log.debug("Stopping workers")
+        with self._lock:
+            for w in self._workers:
+                if not w.dead:
+                    try:
+                        w.send("stop")
+                    except Exception as e:
+                        log.error(
+                            "Cannot stop worker %s: %s", w.proc.name, e)
+            for w in self._workers:
+                w.proc.join(self._config.control.remove_timeout)
+                if w.proc.is_alive():
+                    log.warning("Terminating worker %s", w.proc.name)
+                    w.proc.terminate()
+                    w.proc.join()
+                w.conn.close()
+            self._workers = []
+
+        if self._socket:
+            self._socket.close()
+            self._socket = None
+
+    def call(self, name, *args):
+        """
+        Call method name on all workers, and return list of results.
+
+        The request is sent to all workers before waiting for the replies,
+        so the workers handle the request concurrently. If a worker failed,
+        raise the first error after receiving all the replies.
+
+        Replies are received only from the workers the request was sent to,
+        so a failure to send to some worker does not leave unread replies
+        in the control channel of the other workers.
+        """
+        with self._lock:
+            sent = []
+            error = None
+            for w in self._workers:
+                try:
+                    w.send(name, *args)
+                except Exception as e:
+                    self._check_worker(w)
+                    if error is None:
+                        error = e
+                else:
+                    sent.append(w)
+
+            results = []
+            for w in sent:
+                try:
+                    results.append(w.receive())
+                except Exception as e:
+                    self._check_worker(w)
+                    if error is None:
+                        error = e
+
+            if error:
+                raise error
+
+            return results
+
+    def _check_worker(self, w):
+        """
+        Called after a worker failed. If the control channel of the worker
+        was closed, report the failure once.
+        """
+        if not w.dead or self._failed:
+            return
+
+        self._failed = True
+        log.error("Worker %s terminated unexpectedly", w.proc.name)
+        if self._on_failure:
+            self._on_failure(w.proc.name)
+
+    def _reserve_port(self):
+        """
+        Bind the remote port without listening, so all workers use the same
+        port when configured to use a random port. This socket does not
+        accept connections.
+        """
+        port = self._config.remote.port
+        ai = next(http.find_addresses(self._config.remote.host, port))
+        self._socket = socket.socket(ai[0], socket.SOCK_STREAM)
+        self._socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        self._socket.bind(ai[4])
+        if port == 0:
+            self._config.remote.port = self._socket.getsockname()[1]
+
+
+class _Worker:
+
+    def __init__(self, proc, conn):
+        self.proc = proc
+        self.conn = conn
+        # Set when the worker terminated unexpectedly.
+        self.dead = False
+
+    def send(self, name, *args):
+        if self.dead:
+            raise self._terminated()
+        try:
+            self.conn.send((name, args))
+        except OSError:
+            # The worker closed the control channel.
+            raise self._terminated() from None
+
+    def receive(self):
+        try:
+            result, error = self.conn.recv()
+        except (EOFError, OSError):
+            raise self._terminated() from None
+
+        if error:
+            cls, args, state = error
+            e = cls.__new__(cls)
+            e.args = args
+            e.__dict__.update(state)
+            raise e
+
+        return result
+
+    def _terminated(self):
+        self.dead = True
+        return RuntimeError("Worker {} terminated".format(self.proc.name))
+
+
+class Authorizer(auth.Authorizer):
+    """
+    Authorizer replicating tickets to the worker processes.
+
+    Tickets are also kept in the main process for the local service.
+    """
+
+    def __init__(self, config, pool):
+        super().__init__(config)
+        self._pool = pool
+
+    def add(self, ticket_dict):
+        # Validate the ticket before sending it to the workers.
+        super().add(ticket_dict)
+        self._pool.call("add", ticket_dict)
+
+    def remove(self, ticket_id):
+        # Cancel the ticket in all workers concurrently, waiting until the
+        # ticket is unused.
+        removed = self._pool.call("remove", ticket_id)
+        if all(removed):
+            super().remove(ticket_id)
+        else:
+            # Some worker still has connections. Keep the ticket so the
+            # caller can poll the number of connections.
+            try:
+                self._get(ticket_id).cancel(timeout=0)
+            except KeyError:
+                pass
+
+    def reclaim(self, ticket_id):
+        # Keep the ticket in the main process until all workers removed it,
+        # so the caller can try again.
+        removed = self._pool.call("reclaim", ticket_id)
+        if all(removed):
+            return super().reclaim(ticket_id)
+
+        try:
+            self._get(ticket_id).cancel(timeout=0)
+        except KeyError:
+            pass
+        return False
+
+    def clear(self):
+        self._pool.call("clear")
+        super().clear()
+
+    def get(self, ticket_id):
+        return SharedTicket(super().get(ticket_id), self._pool)
+
+    def _watch_info(self, ticket):
+        # Progress in the workers is not reported to the main process, so
+        # only state changes are pushed, but the info is always accurate.
+        return SharedTicket(ticket, self._pool).info()
+
+
+class SharedTicket:
+    """
+    Ticket status aggregated from the main process and the workers.
+    """
+
+    def __init__(self, ticket, pool):
+        self._ticket = ticket
+        self._pool = pool
+
+    @property
+    def uuid(self):
+        return self._ticket.uuid
+
+    def extend(self, timeout):
+        self._pool.call("extend", self.uuid, timeout)
+        self._ticket.extend(timeout)
+
+    def update_qos(self, qos_dict):
+        # Validate the limits before sending them to the workers.
+        self._ticket.update_qos(qos_dict)
+        self._pool.call("update_qos", self.uuid, qos_dict)
+
+    def info(self):
+        info = self._ticket.info()
+        ranges = self._ticket.transferred_ranges()
+
+        for worker_info in self._pool.call("info", self.uuid):
+            if worker_info is None:
+                continue
+
+            w, worker_ranges = worker_info
+            info["active"] = info["active"] or w["active"]
+            info["canceled"] = info["canceled"] or w["canceled"]
+            info["connections"] += w["connections"]
+            info["expires"] = max(info["expires"], w["expires"])
+            info["idle_time"] = min(info["idle_time"], w["idle_time"])
+            if "block_cache" in info and "block_cache" in w:
+                for key in ("used", "hits", "misses"):
+                    info["block_cache"][key] += w["block_cache"][key]
+            if ranges is not None:
+                ranges.extend(worker_ranges)
+
+        if ranges is not None:
+            ranges = measure.merge_ranges(ranges)
+            info["transferred"] = sum(len(r) for r in ranges)
+
+        return info
+
+
+class _Handler:
+    """
+    Handle control channel requests in a worker process.
+    """
+
+    def __init__(self, authorizer):
+        self._auth = authorizer
+
+    def ping(self):
+        return os.getpid()
+
+    def add(self, ticket_dict):
+        self._auth.add(ticket_dict)
+
+    def remove(self, ticket_id):
+        """
+        Remove ticket, returning True if the ticket was removed.
+        """
+        self._auth.remove(ticket_id)
+        try:
+            self._auth.get(ticket_id)
+        except KeyError:
+            return True
+        return False
+
+    def reclaim(self, ticket_id):
+        return self._auth.reclaim(ticket_id)
+
+    def clear(self):
+        self._auth.clear()
+
+    def extend(self, ticket_id, timeout):
+        try:
+            ticket = self._auth.get(ticket_id)
+        except KeyError:
+            return
+        ticket.extend(timeout)
+
+    def update_qos(self, ticket_id, qos_dict):
+        try:
+            ticket = self._auth.get(ticket_id)
+        except KeyError:
+            return
+        ticket.update_qos(qos_dict)
+
+    def info(self, ticket_id):
+        try:
+            ticket = self._auth.get(ticket_id)
+        except KeyError:
+            return None
+        return ticket.info(), ticket.transferred_ranges()
+
+
+def _run(config, conn):
+    # The worker is stopped by the main process. If the main process was
+    # killed, the control channel is closed and the worker exits.
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+    signal.signal(signal.SIGTERM, signal.SIG_IGN)
+
+    logqueue.after_fork(config)
+    log.info("Worker started (pid=%s)", os.getpid())
+
+    # Every worker enforces an equal part of the host QoS limits. The worker
+    # has its own copy of the config, so we can modify it.
+    workers = config.remote.workers
+    if config.qos.bandwidth:
+        config.qos.bandwidth = max(1, config.qos.bandwidth // workers)
+    if config.qos.iops:
+        config.qos.iops = max(1, config.qos.iops // workers)
+
+    authorizer = auth.Authorizer(config)
+    remote_service = services.RemoteService(
+        config, authorizer, reuse_port=True)
+    remote_service.start()
+
+    handler = _Handler(authorizer)
+    try:
+        while True:
+            try:
+                name, args = conn.recv()
+            except EOFError:
+                log.warning("Control channel closed, exiting")
+                break
+
+            if name == "stop":
+                break
+
+            try:
+                result = getattr(handler, name)(*args)
+            except Exception as e:
+                log.debug("Request %s%s failed: %s", name, args, e)
+                conn.send((None, (type(e), e.args, e.__dict__)))
+            else:
+                conn.send((result, None))
+    finally:
+        remote_service.stop()
+        log.info("Worker terminated")
+        logqueue.stop()
@@ -33,10 +33,14 @@ from . _api import (
 # For better user experience.
 from . _ui import ProgressBar
 
+# For reporting progress from another thread.
+from .. _internal.progress import Counter as ProgressCounter
+
 __all__ = (
     "BUFFER_SIZE",
     "ImageioClient",
     "ProgressBar",
+    "ProgressCounter",
     "checksum",
     "download",
     "extents",
@@ -244,6 +244,18 @@ def checksum(filename, member=None, block_size=blkhash.BLOCK_SIZE,
     # Get image format and if member specified, its offset and size.
     image_info = info(filename, member=member)
 
+    if image_info["format"] == "raw":
+        # Raw image does not need qemu-nbd; compute the checksum directly from
+        # the file, skipping holes and hashing blocks in multiple threads.
+        return blkhash.checksum(
+            filename,
+            block_size=block_size,
+            algorithm=algorithm,
+            digest_size=32 if algorithm.startswith("blake2") else None,
+            detect_zeroes=detect_zeroes,
+            offset=image_info.get("member-offset", 0),
+            size=image_info.get("member-size", image_info["virtual-size"]))
+
     with _open_nbd(
             filename,
             image_info["format"],
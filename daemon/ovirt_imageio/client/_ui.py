@@ -11,10 +11,14 @@ import threading
 import time
 
 from .. _internal import util
+from .. _internal.progress import Counter
 
 
 class ProgressBar:
 
+    # Maximum number of updates between reading the clock.
+    MAX_CHECK_CALLS = 64
+
     def __init__(self, size=0, output=sys.stdout, step=0.1, width=79,
                  now=time.monotonic):
         """
@@ -37,10 +41,18 @@ class ProgressBar:
         self.lock = threading.Lock()
         self.start = self.now()
         self.next = 0
-        self.done = 0
+        self.counter = Counter()
+
+        # Reading the clock on every update is expensive when many threads
+        # do small updates, so we read it only every check_calls updates,
+        # adapted to read it about 10 times per step.
+        self.calls = 0
+        self.check_calls = 1
+        self.last_check = self.start
 
         # The first update can take some time.
-        self.update(0)
+        self.next = self.start + self.step
+        self._draw(self.start)
 
     def update(self, n):
         """
@@ -54,16 +66,53 @@ class ProgressBar:
         Note: this interface is compatible with tqdm[1], to allow user to use
         different progress implementations.
 
+        This can be called concurrently from multiple threads without
+        blocking. If another thread is drawing the progress, this call returns
+        without drawing.
+
         [1] https://github.com/tqdm/tqdm#manual
         """
-        with self.lock:
-            self.done += n
-            now = self.now()
+        self.counter.update(n)
+
+        # Not locked; losing a concurrent increment only delays the next
+        # check.
+        self.calls += 1
+        if self.calls < self.check_calls:
+            return
+        self.calls = 0
+
+        now = self.now()
+        self._adapt_check_calls(now)
+        if now < self.next:
+            return
+
+        if not self.lock.acquire(blocking=False):
+            return
+        try:
+            # Another thread may have drawn the progress after we checked.
             if now < self.next:
                 return
 
             self.next = now + self.step
             self._draw(now)
+        finally:
+            self.lock.release()
+
+    def _adapt_check_calls(self, now):
+        elapsed = now - self.last_check
+        self.last_check = now
+        if elapsed >= self.step:
+            # Updates became slow; halving would keep delaying the progress
+            # for many slow updates, so check every update.
+            self.check_calls = 1
+        elif elapsed < self.step / 10:
+            self.check_calls = min(self.check_calls * 2, self.MAX_CHECK_CALLS)
+        elif self.check_calls > 1:
+            self.check_calls //= 2
+
+    @property
+    def done(self):
+        return self.counter.value
 
     def close(self):
         with self.lock:
@@ -73,17 +122,18 @@ class ProgressBar:
 
     def _draw(self, now, last=False):
         elapsed = now - self.start
+        done = self.done
 
         if self.size:
-            progress = "%6.2f%%" % (self.done / self.size * 100)
+            progress = "%6.2f%%" % (done / self.size * 100)
         else:
             progress = "-------"
 
         line = "[ %s ] %s, %.2f seconds, %s/s" % (
             progress,
-            util.humansize(self.done),
+            util.humansize(done),
             elapsed,
-            util.humansize(self.done / elapsed if elapsed else 0),
+            util.humansize(done / elapsed if elapsed else 0),
         )
 
         line = line.ljust(self.width, " ")
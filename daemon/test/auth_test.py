@@ -6,13 +6,18 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import sys
+import threading
 import time
 
 import pytest
 
 from ovirt_imageio._internal import config
 from ovirt_imageio._internal import errors
+from ovirt_imageio._internal import ioutil
+from ovirt_imageio._internal import measure
 from ovirt_imageio._internal import ops
+from ovirt_imageio._internal import qos
 from ovirt_imageio._internal import util
 from ovirt_imageio._internal.auth import Ticket, Authorizer
 
@@ -194,12 +199,83 @@ def test_transfered_ongoing_non_continues_ops():
     assert ticket.transferred() == 200
 
 
+def test_transferred_concurrent_connections():
+    ticket = Ticket(testutil.create_ticket(ops=["read"], size=4000))
+
+    # Every connection runs operations in its own thread, transferring
+    # 1000 bytes in 100 bytes steps.
+    def connection(i):
+        ticket.add_context(i, Context())
+        try:
+            for offset in range(i * 1000, (i + 1) * 1000, 100):
+                ticket.run(Operation(offset, 100))
+            assert ticket.transferred() >= 1000
+        finally:
+            ticket.remove_context(i)
+
+    threads = [util.start_thread(connection, args=(i,)) for i in range(4)]
+    for t in threads:
+        t.join()
+
+    # Completed ranges were kept when connections were removed.
+    assert ticket.transferred() == 4000
+    assert not ticket.active()
+    assert ticket.info()["connections"] == 0
+
+
+def test_transferred_random_access():
+    ticket = Ticket(testutil.create_ticket(ops=["read"]))
+
+    # Random access ranges are merged in batches, but reported immediately.
+    offsets = list(range(0, 200 * 100, 100))
+    offsets.reverse()
+    for i, offset in enumerate(offsets):
+        ticket.run(Operation(offset, 50))
+        assert ticket.transferred() == (i + 1) * 50
+
+    # Filling the gaps merges all ranges.
+    for offset in offsets:
+        ticket.run(Operation(offset + 50, 50))
+    assert ticket.transferred_ranges() == [measure.Range(0, 200 * 100)]
+
+
+def test_transferred_never_goes_backwards():
+    ticket = Ticket(testutil.create_ticket(ops=["read"]))
+    done = threading.Event()
+    backwards = []
+
+    def reader():
+        last = 0
+        while not done.is_set():
+            value = ticket.transferred()
+            if value < last:
+                backwards.append((last, value))
+            last = value
+
+    # Switch threads often to find a reader seeing partial updates.
+    interval = sys.getswitchinterval()
+    sys.setswitchinterval(1e-6)
+    t = util.start_thread(reader)
+    try:
+        # Random access operations, merged in batches.
+        for offset in reversed(range(0, 1000 * 100, 100)):
+            ticket.run(Operation(offset, 50))
+    finally:
+        done.set()
+        t.join()
+        sys.setswitchinterval(interval)
+
+    assert backwards == []
+    assert ticket.transferred() == 1000 * 50
+
+
 @pytest.mark.benchmark
-def test_run_operation_benchmark():
-    # Run 1000000 operations with 4 concurrent threads.
+@pytest.mark.parametrize("workers", [1, 2, 4, 8])
+def test_run_operation_benchmark(workers):
+    # Run 1000000 operations with concurrent threads. Run with both the
+    # default and the free-threaded python builds to compare.
     ticket = Ticket(testutil.create_ticket(ops=["read"]))
     operations = 10**6
-    workers = 4
     chunk = 10**9
     step = chunk * workers // operations
 
@@ -221,8 +297,10 @@ def test_run_operation_benchmark():
 
     elapsed = time.monotonic() - start
 
-    print("%d operations, %d concurrent threads in %.3f seconds (%d nsec/op)"
-          % (operations, workers, elapsed, elapsed * 10**9 // operations))
+    print("%d operations, %d concurrent threads, gil=%s in %.3f seconds "
+          "(%d nsec/op)"
+          % (operations, workers, util.gil_enabled(), elapsed,
+             elapsed * 10**9 // operations))
 
 
 @pytest.mark.benchmark
@@ -277,12 +355,205 @@ def test_invalid_argument(arg):
     {"filename": 1},
     {"sparse": 1},
     {"dirty": 1},
+    {"qos": 1},
+    {"qos": {"bandwidth": "not an int"}},
+    {"qos": {"iops": -1}},
+    {"qos": {"weight": 0}},
+    {"qos": {"io_class": "fast"}},
+    {"qos": {"io_class": ["idle"]}},
+    {"qos": {"io_level": 8}},
+    {"cache": 1},
+    {"cache": "writeback"},
+    {"block_cache": "not an int"},
+    {"block_cache": -1},
+    {"format": 1},
+    {"format": "vmdk"},
 ])
 def test_invalid_parameter(kw):
     with pytest.raises(errors.InvalidTicketParameter):
         Ticket(testutil.create_ticket(**kw))
 
 
+def test_cache():
+    ticket = Ticket(testutil.create_ticket())
+    assert ticket.cache is None
+    assert "cache" not in ticket.info()
+
+    ticket = Ticket(testutil.create_ticket(cache="buffered"))
+    assert ticket.cache == "buffered"
+    assert ticket.info()["cache"] == "buffered"
+
+
+def test_format():
+    ticket = Ticket(testutil.create_ticket())
+    assert ticket.format == "raw"
+    assert "format" not in ticket.info()
+
+    ticket = Ticket(testutil.create_ticket(format="qcow2"))
+    assert ticket.format == "qcow2"
+    assert ticket.info()["format"] == "qcow2"
+
+
+def test_qemu_nbd_disabled():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    assert auth.get(ticket_info["uuid"]).export is None
+
+
+def test_io_scheduler_disabled():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="https://host:54322/images/x")
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    op = Operation(0, 100)
+    ticket.run(op)
+    assert op.limiter is None
+    assert "io_scheduler" not in ticket.info()
+
+
+def test_io_scheduler_shared_device():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.io_scheduler.enable = True
+    auth = Authorizer(cfg)
+
+    limiters = []
+    for i in range(2):
+        ticket_info = testutil.create_ticket(
+            url="https://host:54322/images/{}".format(i))
+        auth.add(ticket_info)
+        ticket = auth.get(ticket_info["uuid"])
+        op = Operation(0, 100)
+        ticket.run(op)
+        limiters.append(op.limiter.limiter)
+        info = ticket.info()["io_scheduler"]
+        assert info["device"] == "http:host:54322"
+        assert info["limit"] == cfg.io_scheduler.initial_limit
+
+    # Tickets using the same device share the limiter.
+    assert limiters[0] is limiters[1]
+
+
+@pytest.mark.parametrize("url,workers,enabled", [
+    ("file:///tmp/foo.img", 0, True),
+    ("file:///tmp/foo.img", 2, False),
+    ("nbd:unix:/tmp/sock", 0, False),
+])
+def test_qemu_nbd(url, workers, enabled):
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.backend_file.qemu_nbd = True
+    cfg.remote.workers = workers
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url=url, ops=["read"])
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    assert (ticket.export is not None) == enabled
+
+
+def test_block_cache_disabled():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    assert ticket.block_cache is None
+    assert "block_cache" not in ticket.info()
+
+
+def test_block_cache():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"], block_cache=1024**2)
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    assert ticket.block_cache is not None
+    assert ticket.info()["block_cache"] == {
+        "size": 1024**2,
+        "used": 0,
+        "hits": 0,
+        "misses": 0,
+    }
+
+
+def test_block_cache_too_large():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(
+        ops=["read"], block_cache=cfg.block_cache.max_size + 1)
+    with pytest.raises(errors.InvalidTicketParameter):
+        auth.add(ticket_info)
+
+
+def test_block_cache_workers_writable():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.remote.workers = 2
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["write"], block_cache=1024**2)
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    assert ticket.block_cache is None
+
+
+def test_qos_unset():
+    ticket = Ticket(testutil.create_ticket())
+    assert not ticket.qos.enabled
+    assert "qos" not in ticket.info()
+
+
+def test_qos():
+    ticket = Ticket(testutil.create_ticket(qos={"bandwidth": 1024**2}))
+    assert ticket.qos.enabled
+    assert ticket.info()["qos"] == {
+        "bandwidth": 1024**2,
+        "iops": 0,
+        "weight": 1,
+        "io_class": "none",
+        "io_level": 4,
+    }
+
+
+def test_update_qos():
+    ticket = Ticket(testutil.create_ticket())
+    ticket.update_qos({"iops": 100, "weight": 2, "io_class": "idle"})
+    assert ticket.info()["qos"] == {
+        "bandwidth": 0,
+        "iops": 100,
+        "weight": 2,
+        "io_class": "idle",
+        "io_level": 4,
+    }
+
+
+def test_qos_default_io_priority():
+    host = qos.Host(io_class="best-effort", io_level=6)
+    ticket = Ticket(testutil.create_ticket(qos={}), qos_host=host)
+    assert ticket.qos.io_class == "best-effort"
+    assert ticket.qos.io_level == 6
+
+    ticket = Ticket(
+        testutil.create_ticket(qos={"io_class": "idle"}), qos_host=host)
+    assert ticket.qos.io_class == "idle"
+
+
+@pytest.mark.parametrize("io_class,expected", [
+    ("idle", (ioutil.IOPRIO_CLASS_IDLE, 0)),
+    ("best-effort", (ioutil.IOPRIO_CLASS_BE, 7)),
+])
+def test_run_io_priority(io_class, expected):
+    ticket = Ticket(testutil.create_ticket(
+        ops=["read"], qos={"io_class": io_class, "io_level": 7}))
+    op = Operation()
+    op.run = ioutil.ioprio_get
+
+    before = ioutil.ioprio_get()
+    assert ticket.run(op) == expected
+
+    # Thread priority restored.
+    assert ioutil.ioprio_get() == before
+
+
 def test_sparse_unset():
     ticket = Ticket(testutil.create_ticket())
     assert not ticket.sparse
@@ -556,6 +827,20 @@ def test_authorizer_add():
     assert ticket.uuid == ticket_info["uuid"]
 
 
+def test_authorizer_replace_used_ticket():
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    old = auth.get(ticket_info["uuid"])
+    old.add_context(1, Context())
+
+    # Replacing a ticket does not cancel the old ticket operations.
+    auth.add(ticket_info)
+    assert auth.get(ticket_info["uuid"]) is not old
+    assert not old.canceled
+
+
 def test_authorizer_remove_unused():
     cfg = config.load(["test/conf.d/daemon.conf"])
     auth = Authorizer(cfg)
@@ -704,3 +989,304 @@ def test_authorizer_expired():
     for op in ("read", "write"):
         with pytest.raises(errors.AuthorizationError):
             auth.authorize(ticket.uuid, op)
+
+
+def test_authorizer_reclaim_expired(fake_time):
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    cfg.control.reclaim_timeout = 60
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(timeout=300)
+    auth.add(ticket_info)
+
+    # Expired, but not yet reclaimed.
+    fake_time.now += 300
+    assert auth.expire() == []
+    auth.get(ticket_info["uuid"])
+
+    fake_time.now += 60
+    assert auth.expire() == [ticket_info["uuid"]]
+    with pytest.raises(KeyError):
+        auth.get(ticket_info["uuid"])
+
+
+def test_authorizer_reclaim_extended(fake_time):
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    cfg.control.reclaim_timeout = 60
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(timeout=300)
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+
+    # Extend the ticket before it is reclaimed.
+    fake_time.now += 300
+    ticket.extend(300)
+
+    fake_time.now += 60
+    assert auth.expire() == []
+
+    fake_time.now += 300
+    assert auth.expire() == [ticket.uuid]
+
+
+def test_authorizer_reclaim_used(fake_time):
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    cfg.control.reclaim_timeout = 0
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(timeout=300)
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    ctx = Context()
+    ticket.add_context(1, ctx)
+
+    # The ticket is canceled but kept until the connection is closed.
+    fake_time.now += 300
+    assert auth.expire() == []
+    assert ticket.canceled
+
+    ticket.remove_context(1)
+    assert ctx.closed
+
+    fake_time.now += Authorizer.RECLAIM_RETRY
+    assert auth.expire() == [ticket.uuid]
+
+
+def test_authorizer_reclaim_disabled(fake_time):
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    cfg.control.reclaim_timeout = -1
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(timeout=300)
+    auth.add(ticket_info)
+
+    fake_time.now += 3600
+    assert auth.expire() == []
+    auth.get(ticket_info["uuid"])
+
+
+def test_authorizer_remove_many():
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    cfg.control.remove_timeout = 0.2
+    auth = Authorizer(cfg)
+    tickets = [testutil.create_ticket() for i in range(3)]
+    for ticket_info in tickets:
+        auth.add(ticket_info)
+    used = auth.get(tickets[0]["uuid"])
+    used.add_context(1, Context())
+
+    ids = [t["uuid"] for t in tickets] + ["no-such-ticket"]
+    assert auth.remove_many(ids) == [used.uuid]
+
+    for ticket_info in tickets[1:]:
+        with pytest.raises(KeyError):
+            auth.get(ticket_info["uuid"])
+    assert auth.get(used.uuid).canceled
+
+
+def test_authorizer_context():
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    context = {}
+
+    ticket = auth.authorize(ticket_info["uuid"], "read", context)
+    assert auth.authorize(ticket_info["uuid"], "read", context) is ticket
+    with pytest.raises(errors.AuthorizationError):
+        auth.authorize(ticket_info["uuid"], "write", context)
+
+    # Replacing the ticket invalidates the cached ticket.
+    auth.add(ticket_info)
+    new_ticket = auth.authorize(ticket_info["uuid"], "read", context)
+    assert new_ticket is not ticket
+
+    # Canceled ticket is detected without a lookup.
+    new_ticket.cancel(timeout=0)
+    with pytest.raises(errors.AuthorizationError):
+        auth.authorize(ticket_info["uuid"], "read", context)
+
+    # Removed ticket cannot be authorized.
+    auth.remove(ticket_info["uuid"])
+    with pytest.raises(errors.AuthorizationError):
+        auth.authorize(ticket_info["uuid"], "read", context)
+
+
+@pytest.mark.benchmark
+@pytest.mark.parametrize("cached", [False, True])
+def test_authorize_benchmark(cached):
+    cfg = config.load(["test/conf.d/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    context = {} if cached else None
+    calls = 10**5
+
+    start = time.monotonic()
+    for i in range(calls):
+        auth.authorize(ticket_info["uuid"], "read", context)
+    elapsed = time.monotonic() - start
+
+    print("%d calls in %.3f seconds (%d nsec/op)"
+          % (calls, elapsed, elapsed * 10**9 // calls))
+
+
+@pytest.mark.parametrize("block_size", [0, -4096, 1000, 4096 + 512])
+def test_authorizer_invalid_block_size(block_size):
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.block_cache.block_size = block_size
+    with pytest.raises(ValueError):
+        Authorizer(cfg)
+
+
+def test_watch_all():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    tickets = [testutil.create_ticket(ops=["read"]) for _ in range(2)]
+    for t in tickets:
+        auth.add(t)
+
+    status = auth.watch()
+    assert status["reset"]
+    assert status["version"] > 0
+    assert status["removed"] == []
+    assert sorted(t["uuid"] for t in status["tickets"]) == sorted(
+        t["uuid"] for t in tickets)
+
+
+def test_watch_no_changes():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    auth.add(testutil.create_ticket(ops=["read"]))
+    version = auth.watch()["version"]
+
+    start = time.monotonic()
+    status = auth.watch(since=version, timeout=0.2)
+    assert time.monotonic() - start >= 0.2
+    assert status == {
+        "version": version,
+        "reset": False,
+        "tickets": [],
+        "removed": [],
+    }
+
+
+def test_watch_changes():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    t1 = testutil.create_ticket(ops=["read"])
+    t2 = testutil.create_ticket(ops=["read"])
+    auth.add(t1)
+    auth.add(t2)
+    version = auth.watch()["version"]
+
+    # Only the changed tickets are reported.
+    auth.get(t1["uuid"]).extend(600)
+    status = auth.watch(since=version)
+    assert not status["reset"]
+    assert [t["uuid"] for t in status["tickets"]] == [t1["uuid"]]
+    version = status["version"]
+
+    auth.remove(t2["uuid"])
+    status = auth.watch(since=version)
+    assert status["tickets"] == []
+    assert status["removed"] == [t2["uuid"]]
+
+
+def test_watch_wake_up():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    version = auth.watch()["version"]
+    ticket = testutil.create_ticket(ops=["read"])
+    result = []
+
+    t = util.start_thread(
+        lambda: result.append(auth.watch(since=version, timeout=10)))
+    try:
+        time.sleep(0.1)
+        start = time.monotonic()
+        auth.add(ticket)
+    finally:
+        t.join()
+
+    assert time.monotonic() - start < 5
+    assert [t["uuid"] for t in result[0]["tickets"]] == [ticket["uuid"]]
+
+
+def test_watch_progress():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    version = auth.watch()["version"]
+
+    # Completing an operation reports progress in the next watch.
+    auth.get(ticket_info["uuid"]).run(Operation(0, 100))
+    status = auth.watch(since=version, timeout=10)
+    ticket, = status["tickets"]
+    assert ticket["transferred"] == 100
+
+    # Progress is reported once.
+    status = auth.watch(since=status["version"])
+    assert status["tickets"] == []
+
+
+def test_watch_progress_active():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.control.progress_interval = 0.1
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(ops=["read"])
+    auth.add(ticket_info)
+    version = auth.watch()["version"]
+
+    # Progress of a long running operation is reported periodically before
+    # the operation completes.
+    ticket = auth.get(ticket_info["uuid"])
+    op = Operation(0, 100)
+    ticket._add_operation(op)
+    for i in range(2):
+        status = auth.watch(since=version, timeout=10)
+        info, = status["tickets"]
+        assert info["active"]
+        version = status["version"]
+
+    # Inactive ticket is not reported.
+    op.run()
+    ticket._remove_operation(op)
+    status = auth.watch(since=version, timeout=10)
+    info, = status["tickets"]
+    assert not info["active"]
+    assert info["transferred"] == 100
+
+    status = auth.watch(since=status["version"], timeout=0.3)
+    assert status["tickets"] == []
+
+
+def test_watch_reset_unknown_version():
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    auth.add(testutil.create_ticket(ops=["read"]))
+    version = auth.watch()["version"]
+
+    # Version from previous daemon run.
+    status = auth.watch(since=version + 100)
+    assert status["reset"]
+    assert len(status["tickets"]) == 1
+
+
+def test_watch_reset_missed_removals(monkeypatch):
+    monkeypatch.setattr(Authorizer, "REMOVED_HISTORY", 2)
+    cfg = config.load(["test/conf/daemon.conf"])
+    auth = Authorizer(cfg)
+    tickets = [testutil.create_ticket(ops=["read"]) for _ in range(4)]
+    for t in tickets:
+        auth.add(t)
+    version = auth.watch()["version"]
+
+    auth.remove(tickets[0]["uuid"])
+    auth.remove(tickets[1]["uuid"])
+    status = auth.watch(since=version)
+    assert not status["reset"]
+    assert len(status["removed"]) == 2
+
+    auth.remove(tickets[2]["uuid"])
+    status = auth.watch(since=version)
+    assert status["reset"]
+    assert [t["uuid"] for t in status["tickets"]] == [tickets[3]["uuid"]]
@@ -18,9 +18,11 @@ import pytest
 import userstorage
 
 from ovirt_imageio._internal import errors
+from ovirt_imageio._internal import ioutil
 from ovirt_imageio._internal import util
 from ovirt_imageio._internal.backends import file
 from ovirt_imageio._internal.backends import image
+from ovirt_imageio._internal.backends import memory
 
 from . import storage
 
@@ -655,3 +657,271 @@ def test_clone(user_file):
         buf[:] = b"\0" * len(buf)
         b.readinto(buf)
         assert buf[:] == b"y" * len(buf)
+
+
+@pytest.mark.parametrize("unsupported", [
+    (),
+    ("clone_range",),
+])
+def test_copy_from(user_file, monkeypatch, unsupported):
+    def fail(*args, **kw):
+        raise OSError(errno.EXDEV, "Invalid cross-device link")
+
+    for name in unsupported:
+        monkeypatch.setattr(ioutil, name, fail)
+
+    size = user_file.sector_size * 4
+    src_path = user_file.path + ".src"
+
+    with io.open(src_path, "wb") as f:
+        f.write(b"x" * size)
+    with io.open(user_file.path, "wb") as f:
+        f.truncate(size)
+
+    src_url = urllib.parse.urlparse("file://" + src_path)
+    try:
+        with file.open(src_url) as src, \
+                file.open(user_file.url, "r+") as dst:
+            src.seek(size // 2)
+            dst.seek(size // 4)
+
+            n = dst.copy_from(src, size // 2)
+            if n is None:
+                pytest.skip("Server side copy not supported")
+
+            assert n == size // 2
+            assert src.tell() == size
+            assert dst.tell() == size // 4 + size // 2
+            assert dst.dirty
+    finally:
+        os.remove(src_path)
+
+    with io.open(user_file.path, "rb") as f:
+        assert f.read() == (
+            b"\0" * (size // 4) +
+            b"x" * (size // 2) +
+            b"\0" * (size // 4))
+
+
+@pytest.mark.parametrize("errno_value", [
+    errno.EINVAL, errno.EXDEV, errno.EOPNOTSUPP])
+def test_copy_from_disable_after_failure(tmpdir, monkeypatch, errno_value):
+    calls = []
+
+    def fail(name):
+        def func(*args, **kw):
+            calls.append(name)
+            raise OSError(errno_value, os.strerror(errno_value))
+        return func
+
+    monkeypatch.setattr(ioutil, "clone_range", fail("clone_range"))
+    monkeypatch.setattr(ioutil, "copy_file_range", fail("copy_file_range"))
+
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(8192)
+    url = urllib.parse.urlparse("file:" + path)
+
+    with file.open(url, "r+", cache=file.BUFFERED) as src, \
+            file.open(url, "r+", cache=file.BUFFERED) as dst:
+        assert dst.copy_from(src, 4096) is None
+        assert calls == ["clone_range", "copy_file_range"]
+
+        # The failing methods are not tried again by this backend.
+        del calls[:]
+        assert dst.copy_from(src, 4096) is None
+        assert calls == []
+
+
+def test_copy_from_page_cache(tmpdir, monkeypatch):
+    def fail(*args, **kw):
+        raise OSError(errno.EXDEV, "Invalid cross-device link")
+
+    def copy_file_range(src_fd, src_offset, dst_fd, dst_offset, length,
+                        canceled=None):
+        return length
+
+    monkeypatch.setattr(ioutil, "clone_range", fail)
+    monkeypatch.setattr(ioutil, "copy_file_range", copy_file_range)
+
+    accessed = []
+
+    def record(name):
+        def func(self, offset, count):
+            accessed.append((name, self, offset, count))
+        return func
+
+    monkeypatch.setattr(file.PageCache, "read", record("read"))
+    monkeypatch.setattr(file.PageCache, "write", record("write"))
+
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(1024**2)
+    url = urllib.parse.urlparse("file:" + path)
+
+    with file.open(url, "r", cache=file.BUFFERED) as src, \
+            file.open(url, "r+", cache=file.BUFFERED) as dst:
+        src.seek(8192)
+        dst.seek(65536)
+        assert dst.copy_from(src, 16384) == 16384
+
+        # Copied ranges are accounted in the page cache of both backends.
+        assert accessed == [
+            ("write", dst._page_cache, 65536, 16384),
+            ("read", src._page_cache, 8192, 16384),
+        ]
+
+
+def test_copy_from_unsupported(user_file):
+    src = memory.Backend("r", data=bytearray(b"x" * user_file.sector_size))
+    with file.open(user_file.url, "r+") as dst:
+        assert dst.copy_from(src, user_file.sector_size) is None
+        assert not dst.dirty
+
+
+def test_buffered_read_write(tmpdir):
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(1024**2)
+    url = urllib.parse.urlparse("file:" + path)
+
+    with file.open(url, "r+", cache=file.BUFFERED) as f:
+        assert f.cache == file.BUFFERED
+        assert f.block_size == file.BUFFERED_BLOCK_SIZE
+
+        # Buffered I/O does not require aligned buffers.
+        f.seek(4096)
+        assert f.write(b"x" * 8192) == 8192
+        f.flush()
+
+        buf = bytearray(8192)
+        f.seek(4096)
+        assert f.readinto(buf) == 8192
+        assert buf == b"x" * 8192
+
+        with f.clone() as c:
+            assert c.cache == file.BUFFERED
+            c.seek(4096)
+            assert c.readinto(buf) == 8192
+            assert buf == b"x" * 8192
+
+
+def test_open_invalid_cache(tmpdir):
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(4096)
+    url = urllib.parse.urlparse("file:" + path)
+
+    with pytest.raises(ValueError):
+        file.open(url, "r", cache="writeback")
+
+
+def test_page_cache_drop_behind(tmpdir, monkeypatch):
+    window = file.PageCache.WINDOW
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(4 * window)
+
+    dropped = []
+
+    def posix_fadvise(fd, offset, length, advice):
+        if advice == os.POSIX_FADV_DONTNEED:
+            dropped.append((offset, length))
+
+    monkeypatch.setattr(os, "posix_fadvise", posix_fadvise)
+
+    with io.open(path, "r+b") as f:
+        cache = file.PageCache(f.fileno(), writable=True)
+
+        # Sequential writes; pages one window behind are dropped.
+        for i in range(4):
+            cache.write(i * window, window)
+        assert dropped == [(0, 2 * window)]
+
+        # Random access drops the oldest pages behind the last window.
+        del dropped[:]
+        cache.read(0, 4096)
+        assert dropped == [(2 * window, window + 4096)]
+
+        # Drop all accessed pages.
+        del dropped[:]
+        cache.drop()
+        assert dropped == [(3 * window + 4096, window - 4096), (0, 4096)]
+
+
+def test_page_cache_interleaved_writes(tmpdir, monkeypatch):
+    window = file.PageCache.WINDOW
+    size = 16 * window
+    chunk = 1024**2
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(size)
+
+    dropped = []
+
+    def posix_fadvise(fd, offset, length, advice):
+        if advice == os.POSIX_FADV_DONTNEED:
+            dropped.append((offset, length))
+
+    monkeypatch.setattr(os, "posix_fadvise", posix_fadvise)
+
+    with io.open(path, "r+b") as f:
+        cache = file.PageCache(f.fileno(), writable=True)
+
+        # Simulate 4 client workers, each writing a quarter of the image,
+        # so no write continues the previous one.
+        quarter = size // 4
+        for offset in range(0, quarter, chunk):
+            for worker in range(4):
+                cache.write(worker * quarter + offset, chunk)
+
+        # At most 2 windows are kept in the page cache.
+        assert sum(length for _, length in dropped) >= size - 2 * window
+
+        # Dropping the rest drops every written page once.
+        cache.drop()
+        dropped.sort()
+        assert sum(length for _, length in dropped) == size
+        assert dropped[0][0] == 0
+        for (a_off, a_len), (b_off, _) in zip(dropped, dropped[1:]):
+            assert a_off + a_len == b_off
+
+
+def test_page_cache_random_access(tmpdir, monkeypatch):
+    window = file.PageCache.WINDOW
+    path = str(tmpdir.join("image"))
+    with io.open(path, "wb") as f:
+        f.truncate(4 * window)
+
+    calls = []
+
+    def posix_fadvise(fd, offset, length, advice):
+        calls.append(("fadvise", offset, length, advice))
+
+    def sync_file_range(fd, offset, length, flags):
+        calls.append(("sync_file_range", offset, length, flags))
+
+    monkeypatch.setattr(os, "posix_fadvise", posix_fadvise)
+    monkeypatch.setattr(ioutil, "sync_file_range", sync_file_range)
+
+    with io.open(path, "r+b") as f:
+        cache = file.PageCache(f.fileno(), writable=True)
+
+        # Random reads and writes are left to the page cache.
+        for offset in (3 * window, window, 2 * window + 4096, 0):
+            cache.read(offset, 4096)
+            cache.write(offset + 8192, 4096)
+        assert calls == []
+
+        # Reads continuing the last access read ahead the next window.
+        cache.read(12288, 4096)
+        assert calls == [
+            ("fadvise", 16384, window, os.POSIX_FADV_WILLNEED),
+        ]
+
+        # Sequential writes start writeback.
+        del calls[:]
+        cache.write(16384, 4096)
+        assert calls == [
+            ("sync_file_range", 16384, 4096, ioutil.SYNC_FILE_RANGE_WRITE),
+        ]
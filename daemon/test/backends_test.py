@@ -42,6 +42,10 @@ def test_get_caching(tmpurl, cfg):
     assert ticket.get_context(req.connection_id) is c1
     assert c1.backend.name == "file"
     assert len(c1.buffer) == cfg.backend_file.buffer_size
+    assert len(c1.buffers) == cfg.backend_file.buffer_count
+    assert c1.buffers[0] is c1.buffer
+    for buf in c1.buffers:
+        assert len(buf) == cfg.backend_file.buffer_size
 
     # Next call return the cached instance.
     c2 = backends.get(req, ticket, cfg)
@@ -55,6 +59,24 @@ def test_get_caching(tmpurl, cfg):
     assert c3 is not c1
 
 
+def test_get_replaced_ticket(tmpurl, cfg):
+    ticket_info = testutil.create_ticket(url=urlunparse(tmpurl))
+    old = auth.Ticket(ticket_info)
+    req = Request()
+    backends.get(req, old, cfg)
+    assert old.connections == 1
+
+    # The connection uses now the new ticket, so the old ticket context is
+    # removed.
+    new = auth.Ticket(ticket_info)
+    backends.get(req, new, cfg)
+    assert old.connections == 0
+    assert new.connections == 1
+
+    req.context[new.uuid].close()
+    assert new.connections == 0
+
+
 def test_get_canceled_ticket(tmpurl, cfg):
     ticket = auth.Ticket(
         testutil.create_ticket(url=urlunparse(tmpurl)))
@@ -7,6 +7,7 @@
 # (at your option) any later version.
 
 import hashlib
+import os
 import pytest
 from functools import partial
 
@@ -114,3 +115,84 @@ def test_checksum(tmpdir, size, algorithm, digest_size, checksum):
         "block_size": blkhash.BLOCK_SIZE,
         "checksum": checksum,
     }
+
+
+def reference_checksum(path, offset=0, size=None,
+                       block_size=blkhash.BLOCK_SIZE):
+    h = blkhash.Hash(block_size=block_size)
+    with open(path, "rb") as f:
+        f.seek(offset)
+        data = f.read() if size is None else f.read(size)
+    for start in range(0, len(data), block_size):
+        h.update(data[start:start + block_size])
+    return h.hexdigest()
+
+
+def create_sparse_file(path):
+    # | data | hole | unaligned data | hole | data | hole |
+    with open(path, "wb") as f:
+        f.write(b"a" * 1024**2)
+        f.seek(5 * 1024**2 + 333)
+        f.write(b"b" * 1024**2)
+        f.seek(12 * 1024**2)
+        f.write(b"c" * 4096)
+        f.truncate(16 * 1024**2 + 512)
+
+
+@pytest.mark.parametrize("max_workers", [1, 4])
+@pytest.mark.parametrize("detect_zeroes", [True, False])
+def test_checksum_sparse(tmpdir, max_workers, detect_zeroes):
+    path = str(tmpdir.join("file"))
+    create_sparse_file(path)
+
+    actual = blkhash.checksum(
+        path, detect_zeroes=detect_zeroes, max_workers=max_workers)
+
+    assert actual["checksum"] == reference_checksum(path)
+
+
+@pytest.mark.parametrize("block_size", [64 * 1024, 1024**2])
+def test_checksum_block_size(tmpdir, block_size):
+    path = str(tmpdir.join("file"))
+    create_sparse_file(path)
+
+    actual = blkhash.checksum(path, block_size=block_size)
+
+    assert actual["checksum"] == reference_checksum(
+        path, block_size=block_size)
+
+
+@pytest.mark.parametrize("offset,size", [
+    # Aligned range.
+    (1024**2, 8 * 1024**2),
+    # Unaligned range, like tar member data.
+    (512, 6 * 1024**2 + 1000),
+    # Range starting in a hole.
+    (2 * 1024**2, 1024**2),
+    # Rest of the file.
+    (5 * 1024**2 + 512, None),
+])
+def test_checksum_range(tmpdir, offset, size):
+    path = str(tmpdir.join("file"))
+    create_sparse_file(path)
+
+    actual = blkhash.checksum(path, offset=offset, size=size)
+
+    assert actual["checksum"] == reference_checksum(
+        path, offset=offset, size=size)
+
+
+def test_checksum_block_device_size(tmpdir, monkeypatch):
+    path = str(tmpdir.join("file"))
+    create_sparse_file(path)
+    expected = reference_checksum(path)
+
+    class BlockDeviceStat:
+        st_size = 0
+
+    # Like a block device, st_size is 0.
+    monkeypatch.setattr(os, "fstat", lambda fd: BlockDeviceStat)
+
+    actual = blkhash.checksum(path)
+
+    assert actual["checksum"] == expected
@@ -0,0 +1,181 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import pytest
+
+from ovirt_imageio._internal import blockcache
+from ovirt_imageio._internal.backends import memory
+
+BLOCK_SIZE = 4096
+
+
+class Counter(memory.Backend):
+    """
+    Memory backend counting reads.
+    """
+
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.reads = 0
+
+    def readinto(self, buf):
+        self.reads += 1
+        return super().readinto(buf)
+
+
+@pytest.fixture
+def data():
+    return bytearray(b"".join(
+        bytes([i]) * BLOCK_SIZE for i in range(8)) + b"z" * 100)
+
+
+def test_cache_lru():
+    cache = blockcache.Cache(2 * BLOCK_SIZE, BLOCK_SIZE)
+    gen = cache.generation
+    cache.put(0, b"a" * BLOCK_SIZE, gen)
+    cache.put(1, b"b" * BLOCK_SIZE, gen)
+
+    # Access block 0, so block 1 is evicted.
+    assert cache.get(0) == b"a" * BLOCK_SIZE
+    cache.put(2, b"c" * BLOCK_SIZE, gen)
+
+    assert cache.get(1) is None
+    assert cache.get(0) == b"a" * BLOCK_SIZE
+    assert cache.get(2) == b"c" * BLOCK_SIZE
+    assert cache.info() == {
+        "size": 2 * BLOCK_SIZE,
+        "used": 2 * BLOCK_SIZE,
+        "hits": 3,
+        "misses": 1,
+    }
+
+
+def test_cache_invalidate():
+    cache = blockcache.Cache(4 * BLOCK_SIZE, BLOCK_SIZE)
+    gen = cache.generation
+    for i in range(4):
+        cache.put(i, bytes([i]) * BLOCK_SIZE, gen)
+
+    # Unaligned range overlapping blocks 1 and 2.
+    cache.invalidate(BLOCK_SIZE + 1, 2 * BLOCK_SIZE + 1)
+
+    assert cache.get(0) is not None
+    assert cache.get(1) is None
+    assert cache.get(2) is None
+    assert cache.get(3) is not None
+    assert cache.info()["used"] == 2 * BLOCK_SIZE
+
+
+def test_cache_put_stale():
+    cache = blockcache.Cache(4 * BLOCK_SIZE, BLOCK_SIZE)
+    gen = cache.generation
+
+    # A write invalidated the cache while a reader was reading the block.
+    cache.invalidate(0, BLOCK_SIZE)
+    cache.put(0, b"old" * 100, gen)
+
+    assert cache.get(0) is None
+
+
+def test_backend_read(data):
+    cache = blockcache.Cache(16 * BLOCK_SIZE, BLOCK_SIZE)
+    src = Counter("r", data=data)
+
+    with blockcache.Backend(src, cache) as b:
+        buf = bytearray(len(data))
+        assert b.readinto(buf) == len(data)
+        assert buf == data
+        assert b.tell() == len(data)
+        reads = src.reads
+
+        # Read again from the cache.
+        b.seek(0)
+        buf = bytearray(len(data))
+        assert b.readinto(buf) == len(data)
+        assert buf == data
+        assert src.reads == reads
+
+
+def test_backend_read_unaligned(data):
+    cache = blockcache.Cache(16 * BLOCK_SIZE, BLOCK_SIZE)
+    src = Counter("r", data=data)
+
+    with blockcache.Backend(src, cache) as b:
+        b.seek(BLOCK_SIZE - 10)
+        buf = bytearray(20)
+        assert b.readinto(buf) == 20
+        assert buf == data[BLOCK_SIZE - 10:BLOCK_SIZE + 10]
+
+        # Blocks 0 and 1 are cached now.
+        reads = src.reads
+        b.seek(0)
+        buf = bytearray(2 * BLOCK_SIZE)
+        assert b.readinto(buf) == 2 * BLOCK_SIZE
+        assert buf == data[:2 * BLOCK_SIZE]
+        assert src.reads == reads
+
+
+def test_backend_read_eof(data):
+    cache = blockcache.Cache(16 * BLOCK_SIZE, BLOCK_SIZE)
+    src = memory.Backend("r", data=data)
+
+    with blockcache.Backend(src, cache) as b:
+        b.seek(8 * BLOCK_SIZE)
+        buf = bytearray(BLOCK_SIZE)
+        assert b.readinto(buf) == 100
+        assert buf[:100] == b"z" * 100
+
+        # Read the short last block from the cache.
+        b.seek(8 * BLOCK_SIZE + 50)
+        assert b.readinto(buf) == 50
+        assert b.readinto(buf) == 0
+
+
+def test_backend_shared_cache(data):
+    cache = blockcache.Cache(16 * BLOCK_SIZE, BLOCK_SIZE)
+    src = Counter("r+", data=data)
+
+    # Connections share the backing data; use the same backend to count
+    # reads.
+    b1 = blockcache.Backend(src, cache)
+    b2 = blockcache.Backend(src, cache)
+    with b1, b2:
+        buf = bytearray(BLOCK_SIZE)
+        b1.readinto(buf)
+
+        # Second connection reads from the cache.
+        reads = src.reads
+        buf = bytearray(BLOCK_SIZE)
+        assert b2.readinto(buf) == BLOCK_SIZE
+        assert buf == data[:BLOCK_SIZE]
+        assert src.reads == reads
+
+        # Write through the second connection invalidates the block.
+        b2.seek(10)
+        b2.write(b"x" * 10)
+        b1.seek(0)
+        assert b1.readinto(buf) == BLOCK_SIZE
+        assert buf[10:20] == b"x" * 10
+
+
+def test_backend_zero_invalidates(data):
+    cache = blockcache.Cache(16 * BLOCK_SIZE, BLOCK_SIZE)
+    src = memory.Backend("r+", data=data)
+
+    with blockcache.Backend(src, cache) as b:
+        buf = bytearray(2 * BLOCK_SIZE)
+        b.readinto(buf)
+
+        b.seek(BLOCK_SIZE)
+        assert b.zero(BLOCK_SIZE) == BLOCK_SIZE
+        assert b.tell() == 2 * BLOCK_SIZE
+
+        b.seek(0)
+        b.readinto(buf)
+        assert buf[:BLOCK_SIZE] == data[:BLOCK_SIZE]
+        assert buf[BLOCK_SIZE:] == b"\0" * BLOCK_SIZE
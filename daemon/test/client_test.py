@@ -485,17 +485,8 @@ def test_progress(tmpdir, srv):
     assert progress.size == IMAGE_SIZE
 
     # Note: when using multiple connections order of updates is not
-    # predictable.
-    assert set(progress.updates) == {
-        # First write.
-        4096,
-        # First zero.
-        IMAGE_SIZE // 2 - 4096,
-        # Second write.
-        4096,
-        # Second zero
-        IMAGE_SIZE // 2 - 4096,
-    }
+    # predictable, and concurrent updates may be reported in one call.
+    assert sum(progress.updates) == IMAGE_SIZE
 
 
 def test_progress_callback(tmpdir, srv):
@@ -7,6 +7,7 @@
 # (at your option) any later version.
 
 from ovirt_imageio import client
+from ovirt_imageio._internal import util
 
 
 class FakeTime:
@@ -98,3 +99,60 @@ def test_contextmanager():
         assert f.last.endswith("\r")
 
     assert f.last.endswith("\n")
+
+
+def test_concurrent_updates():
+    f = FakeFile()
+    pb = client.ProgressBar(4 * 1024**2, output=f)
+
+    def worker():
+        for _ in range(1024):
+            pb.update(1024)
+
+    threads = [util.start_thread(worker) for _ in range(4)]
+    for t in threads:
+        t.join()
+
+    pb.close()
+    assert pb.done == 4 * 1024**2
+    assert f.last.startswith("[ 100.00% ] 4.00 MiB")
+
+
+class CountingTime(FakeTime):
+
+    def __init__(self):
+        super().__init__()
+        self.calls = 0
+
+    def __call__(self):
+        self.calls += 1
+        return self.now
+
+
+def test_clock_not_read_on_every_update():
+    fake_time = CountingTime()
+    f = FakeFile()
+    pb = client.ProgressBar(1024**3, output=f, step=0.1, now=fake_time)
+
+    # Many fast updates read the clock less often.
+    calls = fake_time.calls
+    for _ in range(1000):
+        pb.update(1024)
+    assert fake_time.calls - calls < 100
+
+    # When updates become slow, the progress is drawn again after at most
+    # MAX_CHECK_CALLS updates.
+    last = f.last
+    for _ in range(client.ProgressBar.MAX_CHECK_CALLS):
+        fake_time.now += 0.1
+        pb.update(1024)
+        if f.last != last:
+            break
+    assert f.last != last
+
+    # After a slow update, the progress is drawn on every slow update.
+    for _ in range(3):
+        last = f.last
+        fake_time.now += 0.1
+        pb.update(1024)
+        assert f.last != last
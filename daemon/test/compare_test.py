@@ -0,0 +1,314 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import json
+
+import pytest
+
+from ovirt_imageio._internal import blkhash
+from ovirt_imageio._internal import checksum
+from ovirt_imageio._internal import compare
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import jobs
+from ovirt_imageio._internal import ops
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal.backends import memory
+from ovirt_imageio._internal.backends.image import ZeroExtent
+
+from . import http
+from . import testutil
+
+BLOCK_SIZE = 4096
+
+
+def run_compare(a, b, max_ranges=0, block_size=BLOCK_SIZE):
+    op = compare.Operation(
+        a, b, bytearray(block_size), bytearray(block_size),
+        max_ranges=max_ranges)
+    return op.run()
+
+
+def ranges(*pairs):
+    return [{"start": start, "length": length} for start, length in pairs]
+
+
+# Compare operation.
+
+def test_equal():
+    data = bytearray(b"x" * BLOCK_SIZE * 4)
+    a = memory.Backend("r", data)
+    b = memory.Backend("r", bytearray(data))
+    res = run_compare(a, b)
+    assert res == {
+        "equal": True,
+        "complete": True,
+        "block_size": BLOCK_SIZE,
+        "size": len(data),
+        "other_size": len(data),
+        "ranges": [],
+    }
+
+
+def test_zero_in_both_not_read():
+    # Blocks reported as zero in both images are not read, so different
+    # data under zero extents is not detected.
+    size = BLOCK_SIZE * 2
+    extents = {"zero": [ZeroExtent(0, size, True, False)]}
+    a = memory.Backend("r", bytearray(b"a" * size), extents=extents)
+    b = memory.Backend("r", bytearray(b"b" * size), extents=extents)
+    assert run_compare(a, b)["equal"]
+
+
+def test_zero_and_data():
+    size = BLOCK_SIZE * 4
+    a = memory.Backend(
+        "r", bytearray(size),
+        extents={"zero": [ZeroExtent(0, size, True, False)]})
+
+    data = bytearray(size)
+    data[BLOCK_SIZE * 2] = 1
+    b = memory.Backend(
+        "r", data,
+        extents={"zero": [
+            ZeroExtent(0, BLOCK_SIZE, True, False),
+            ZeroExtent(BLOCK_SIZE, BLOCK_SIZE * 3, False, False),
+        ]})
+
+    res = run_compare(a, b)
+    assert not res["equal"]
+    assert res["complete"]
+    assert res["ranges"] == ranges((BLOCK_SIZE * 2, BLOCK_SIZE))
+
+    # Same result comparing the other way.
+    res = run_compare(b, a)
+    assert res["ranges"] == ranges((BLOCK_SIZE * 2, BLOCK_SIZE))
+
+
+def test_data_differ():
+    a = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 8))
+    data = bytearray(b"x" * BLOCK_SIZE * 8)
+    data[BLOCK_SIZE + 1] = 0
+    data[BLOCK_SIZE * 5] = 0
+    b = memory.Backend("r", data)
+
+    res = run_compare(a, b)
+    assert not res["equal"]
+    assert res["complete"]
+    assert res["ranges"] == ranges(
+        (BLOCK_SIZE, BLOCK_SIZE),
+        (BLOCK_SIZE * 5, BLOCK_SIZE),
+    )
+
+
+def test_merge_adjacent_ranges():
+    a = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 8))
+    b = memory.Backend("r", bytearray(
+        b"x" * BLOCK_SIZE * 2 + b"y" * BLOCK_SIZE * 3 + b"x" * BLOCK_SIZE * 3))
+
+    res = run_compare(a, b)
+    assert res["ranges"] == ranges((BLOCK_SIZE * 2, BLOCK_SIZE * 3))
+
+
+def test_max_ranges_merged():
+    # Merged ranges do not count towards max_ranges.
+    a = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 8))
+    b = memory.Backend("r", bytearray(b"xy" * BLOCK_SIZE * 4))
+
+    res = run_compare(a, b, max_ranges=1)
+    assert not res["equal"]
+    assert res["complete"]
+    assert res["ranges"] == ranges((0, BLOCK_SIZE * 8))
+
+
+def test_max_ranges_stop_early():
+    size = BLOCK_SIZE * 8
+    a = memory.Backend("r", bytearray(b"x" * size))
+    data = bytearray(b"x" * size)
+    data[0] = 0
+    data[BLOCK_SIZE * 2] = 0
+    data[BLOCK_SIZE * 4] = 0
+    b = memory.Backend("r", data)
+
+    op = compare.Operation(
+        a, b, bytearray(BLOCK_SIZE), bytearray(BLOCK_SIZE), max_ranges=2)
+    res = op.run()
+    assert not res["equal"]
+    assert not res["complete"]
+    assert res["ranges"] == ranges(
+        (0, BLOCK_SIZE),
+        (BLOCK_SIZE * 2, BLOCK_SIZE),
+    )
+
+    # Compared blocks 0-3, and stopped at block 4.
+    assert op.done == BLOCK_SIZE * 4
+
+
+def test_size_differ():
+    data = bytearray(b"x" * BLOCK_SIZE * 4)
+    a = memory.Backend("r", data)
+    b = memory.Backend("r", data[:BLOCK_SIZE * 2 + 512])
+
+    res = run_compare(a, b)
+    assert not res["equal"]
+    assert res["complete"]
+    assert res["size"] == len(data)
+    assert res["other_size"] == BLOCK_SIZE * 2 + 512
+    assert res["ranges"] == ranges(
+        (BLOCK_SIZE * 2 + 512, BLOCK_SIZE * 2 - 512))
+
+
+def test_size_differ_max_ranges():
+    a = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 4))
+    b = memory.Backend(
+        "r", bytearray(b"y" * BLOCK_SIZE + b"x" * BLOCK_SIZE))
+
+    # Block 0 differs, and the tail cannot be added.
+    res = run_compare(a, b, max_ranges=1)
+    assert not res["complete"]
+    assert res["ranges"] == ranges((0, BLOCK_SIZE))
+
+
+def test_canceled():
+    a = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 4))
+    b = memory.Backend("r", bytearray(b"x" * BLOCK_SIZE * 4))
+    op = compare.Operation(a, b, bytearray(BLOCK_SIZE), bytearray(BLOCK_SIZE))
+    op.cancel()
+    with pytest.raises(ops.Canceled):
+        op.run()
+
+
+# Compare resource.
+
+@pytest.fixture(scope="module")
+def srv():
+    cfg = config.load(["test/conf/daemon.conf"])
+    s = server.Server(cfg)
+    s.start()
+    yield s
+    s.stop()
+
+
+@pytest.fixture(params=[
+    pytest.param(http.RemoteClient, id="http"),
+    pytest.param(http.LocalClient, id="local"),
+])
+def client(srv, request):
+    srv.auth.clear()
+    client = request.param(srv.config)
+    yield client
+    client.close()
+
+
+def create_image(tmpdir, srv, name, data):
+    image = testutil.create_tempfile(tmpdir, name, data)
+    ticket = testutil.create_ticket(url="file://" + str(image), size=len(data))
+    srv.auth.add(ticket)
+    return ticket
+
+
+def test_compare_equal(tmpdir, srv, client):
+    data = b"x" * 1024**2
+    a = create_image(tmpdir, srv, "a", data)
+    b = create_image(tmpdir, srv, "b", data)
+
+    res = client.get(
+        "/images/{}/compare?other={}".format(a["uuid"], b["uuid"]))
+    assert res.status == 200
+    result = json.loads(res.read())
+    assert result == {
+        "equal": True,
+        "complete": True,
+        "block_size": blkhash.BLOCK_SIZE,
+        "size": len(data),
+        "other_size": len(data),
+        "ranges": [],
+    }
+
+
+def test_compare_differ(tmpdir, srv, client):
+    block_size = checksum.MIN_BLOCK_SIZE
+    data = bytearray(b"x" * block_size * 8)
+    a = create_image(tmpdir, srv, "a", data)
+    data[block_size * 3] = 0
+    data[block_size * 4] = 0
+    data[-1] = 0
+    b = create_image(tmpdir, srv, "b", data)
+
+    res = client.get(
+        "/images/{}/compare?other={}&block_size={}".format(
+            a["uuid"], b["uuid"], block_size))
+    assert res.status == 200
+    result = json.loads(res.read())
+    assert not result["equal"]
+    assert result["complete"]
+    assert result["block_size"] == block_size
+    assert result["ranges"] == ranges(
+        (block_size * 3, block_size * 2),
+        (len(data) - block_size, block_size),
+    )
+
+    res = client.get(
+        "/images/{}/compare?other={}&block_size={}&max_ranges=1".format(
+            a["uuid"], b["uuid"], block_size))
+    assert res.status == 200
+    result = json.loads(res.read())
+    assert not result["equal"]
+    assert not result["complete"]
+    assert result["ranges"] == ranges((block_size * 3, block_size * 2))
+
+
+def test_compare_async(tmpdir, srv, client):
+    data = b"x" * 1024**2
+    a = create_image(tmpdir, srv, "a", data)
+    b = create_image(tmpdir, srv, "b", data[:-4096] + b"y" * 4096)
+
+    res = client.get("/images/{}/compare?other={}&async=y".format(
+        a["uuid"], b["uuid"]))
+    assert res.status == 202
+    job = json.loads(res.read())
+    res = client.get(res.getheader("location") + "?wait=10")
+    assert res.status == 200
+    job = json.loads(res.read())
+
+    assert job["name"] == "compare"
+    assert job["state"] == jobs.DONE
+    assert job["done"] == job["size"] == len(data)
+    assert not job["result"]["equal"]
+
+
+@pytest.mark.parametrize("query", [
+    pytest.param("", id="missing-other"),
+    pytest.param("?other=", id="empty-other"),
+    pytest.param("?other={a}", id="same-ticket"),
+    pytest.param("?other={b}&max_ranges=-1", id="negative-max-ranges"),
+    pytest.param("?other={b}&max_ranges=x", id="invalid-max-ranges"),
+    pytest.param("?other={b}&block_size=1000", id="invalid-block-size"),
+])
+def test_compare_bad_request(tmpdir, srv, client, query):
+    a = create_image(tmpdir, srv, "a", b"x" * 4096)
+    b = create_image(tmpdir, srv, "b", b"x" * 4096)
+    query = query.format(a=a["uuid"], b=b["uuid"])
+    res = client.get("/images/{}/compare{}".format(a["uuid"], query))
+    res.read()
+    assert res.status == 400
+
+
+def test_compare_no_other_ticket(tmpdir, srv, client):
+    a = create_image(tmpdir, srv, "a", b"x" * 4096)
+    res = client.get(
+        "/images/{}/compare?other=no-such-ticket".format(a["uuid"]))
+    res.read()
+    assert res.status == 403
+
+
+def test_compare_no_ticket(tmpdir, srv, client):
+    b = create_image(tmpdir, srv, "b", b"x" * 4096)
+    res = client.get(
+        "/images/no-such-ticket/compare?other={}".format(b["uuid"]))
+    res.read()
+    assert res.status == 403
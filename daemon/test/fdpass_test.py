@@ -0,0 +1,182 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import errno
+import http.client as http_client
+import os
+import urllib.parse
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import http
+from ovirt_imageio._internal import nbd
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal import uhttp
+from ovirt_imageio._internal import util
+
+from . import testutil
+
+
+@pytest.fixture(scope="module")
+def srv(tmpdir_factory):
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.local.fd_passing = True
+    cfg.nbd_server.enable = True
+    # NBD URLs do not support abstract sockets.
+    cfg.nbd_server.socket = str(tmpdir_factory.mktemp("nbd").join("sock"))
+    s = server.Server(cfg)
+    s.start()
+    try:
+        yield s
+    finally:
+        s.stop()
+
+
+def test_read_only(tmpdir, srv):
+    data = b"a" * 4096
+    image = testutil.create_tempfile(tmpdir, "image", data)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=len(data), ops=["read"])
+    srv.auth.add(ticket)
+
+    info, fd = uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    try:
+        assert info == {
+            "type": "file",
+            "size": len(data),
+            "writable": False,
+            "direct": True,
+        }
+        # The file descriptor is using direct I/O.
+        with util.aligned_buffer(len(data)) as buf:
+            assert os.preadv(fd, [buf], 0) == len(data)
+            assert buf[:] == data
+
+            # Read only ticket provides read only file descriptor.
+            with pytest.raises(OSError) as e:
+                os.pwritev(fd, [buf], 0)
+            assert e.value.errno == errno.EBADF
+    finally:
+        os.close(fd)
+
+
+def test_read_write(tmpdir, srv):
+    size = 4096
+    image = testutil.create_tempfile(tmpdir, "image", size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["write"])
+    srv.auth.add(ticket)
+
+    info, fd = uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    try:
+        assert info["writable"]
+        with util.aligned_buffer(size) as buf:
+            buf.write(b"b" * size)
+            os.pwritev(fd, [buf], 0)
+    finally:
+        os.close(fd)
+
+    with open(str(image), "rb") as f:
+        assert f.read() == b"b" * size
+
+
+class FakeExport:
+    """
+    Export served by the daemon NBD server instead of qemu-nbd.
+    """
+
+    def __init__(self, srv, ticket_id):
+        address = nbd.UnixAddress(srv.config.nbd_server.socket)
+        self._url = urllib.parse.urlparse(address.url(ticket_id))
+
+    def url(self):
+        return self._url
+
+    def close(self):
+        pass
+
+
+def test_qemu_nbd_export(tmpdir, srv):
+    size = 4096
+    image = testutil.create_tempfile(tmpdir, "image", b"c" * size)
+
+    # Ticket used by the NBD server for serving the export.
+    backing = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["read"])
+    srv.auth.add(backing)
+
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["read"])
+    srv.auth.add(ticket)
+    srv.auth.get(ticket["uuid"]).export = FakeExport(srv, backing["uuid"])
+
+    # We get a connected socket to the export, not the image file.
+    info, fd = uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    try:
+        assert info["type"] == "nbd"
+        assert info["size"] == size
+        assert not info["writable"]
+    finally:
+        os.close(fd)
+
+
+def test_block_cache_read_only(tmpdir, srv):
+    size = 4096
+    image = testutil.create_tempfile(tmpdir, "image", size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["read"],
+        block_cache=1024**2)
+    srv.auth.add(ticket)
+
+    info, fd = uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    os.close(fd)
+    assert not info["writable"]
+
+
+def test_block_cache_writable(tmpdir, srv):
+    size = 4096
+    image = testutil.create_tempfile(tmpdir, "image", size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["write"],
+        block_cache=1024**2)
+    srv.auth.add(ticket)
+
+    # Writes using the file descriptor would bypass the block cache.
+    with pytest.raises(http.Error) as e:
+        uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    assert e.value.code == http_client.FORBIDDEN
+
+
+def test_partial_image(tmpdir, srv):
+    size = 8192
+    image = testutil.create_tempfile(tmpdir, "image", size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size // 2, ops=["read"])
+    srv.auth.add(ticket)
+
+    # Ticket must allow access to the entire image.
+    with pytest.raises(http.Error) as e:
+        uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    assert e.value.code == http_client.FORBIDDEN
+
+
+def test_no_ticket(srv):
+    with pytest.raises(http.Error) as e:
+        uhttp.receive_fd(srv.config.local.socket, "no-such-ticket")
+    assert e.value.code == http_client.FORBIDDEN
+
+
+def test_unsupported_backend(srv):
+    ticket = testutil.create_ticket(
+        url="https://localhost:12345/images/ticket", ops=["read"])
+    srv.auth.add(ticket)
+
+    with pytest.raises(http.Error) as e:
+        uhttp.receive_fd(srv.config.local.socket, ticket["uuid"])
+    assert e.value.code == http_client.NOT_FOUND
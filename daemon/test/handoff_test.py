@@ -0,0 +1,372 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import os
+import socket
+import sys
+import time
+
+import pytest
+
+from ovirt_imageio._internal import auth
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import handoff
+from ovirt_imageio._internal import server
+
+from . import http
+from . import testutil
+
+
+@pytest.fixture
+def cfg(tmpdir):
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.daemon.run_dir = str(tmpdir)
+    cfg.control.socket = str(tmpdir.join("control.sock"))
+    return cfg
+
+
+def listening_tcp():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.bind(("127.0.0.1", 0))
+    sock.listen()
+    return sock
+
+
+def listening_unix(path):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.bind(path)
+    sock.listen()
+    return sock
+
+
+def test_systemd_fds():
+    env = {
+        "LISTEN_PID": str(os.getpid()),
+        "LISTEN_FDS": "2",
+        "LISTEN_FDNAMES": "remote:control",
+    }
+    assert handoff.systemd_fds(env) == [3, 4]
+    assert env == {}
+
+
+def test_systemd_fds_other_process():
+    env = {"LISTEN_PID": str(os.getpid() + 1), "LISTEN_FDS": "2"}
+    assert handoff.systemd_fds(env) == []
+    assert env == {}
+
+
+def test_systemd_fds_invalid():
+    env = {"LISTEN_PID": str(os.getpid()), "LISTEN_FDS": "invalid"}
+    assert handoff.systemd_fds(env) == []
+
+
+def test_systemd_fds_not_activated():
+    assert handoff.systemd_fds({}) == []
+
+
+def test_sockets_from_environment(tmpdir):
+    path = str(tmpdir.join("sock"))
+    tcp = listening_tcp()
+    unix = listening_unix(path)
+    with tcp, unix:
+        env = {handoff.HANDOFF_FDS: "{},{}".format(
+            os.dup(unix.fileno()), os.dup(tcp.fileno()))}
+        sockets = handoff.Sockets.from_environment(env)
+        assert env == {}
+        assert sockets.from_handoff
+
+        port = tcp.getsockname()[1]
+        assert sockets.take_tcp(port + 1) is None
+        with sockets.take_tcp(port) as s:
+            assert s.family == socket.AF_INET
+            assert s.getsockname() == tcp.getsockname()
+        assert sockets.take_tcp(port) is None
+
+        assert sockets.take_unix(path + ".other") is None
+        with sockets.take_unix(path) as s:
+            assert s.family == socket.AF_UNIX
+            assert s.getsockname() == path
+
+        sockets.close()
+
+
+def test_sockets_close_unused():
+    tcp = listening_tcp()
+    with tcp:
+        sock = tcp.dup()
+        sockets = handoff.Sockets([sock])
+        sockets.close()
+        assert sock.fileno() == -1
+
+
+def test_save_load_tickets(tmpdir, cfg, fake_time):
+    old = auth.Authorizer(cfg)
+    ticket = testutil.create_ticket(ops=["read"], timeout=300)
+    old.add(ticket)
+    old.get(ticket["uuid"]).update_qos({"bandwidth": 1024**2})
+    canceled = testutil.create_ticket(ops=["read"])
+    old.add(canceled)
+    old.get(canceled["uuid"]).cancel(timeout=0)
+
+    path = str(tmpdir.join("handoff.json"))
+    fake_time.now += 100
+    handoff.save_tickets(old, path)
+    assert os.stat(path).st_mode & 0o777 == 0o600
+
+    new = auth.Authorizer(cfg)
+    env = {handoff.HANDOFF_STATE: path}
+    handoff.load_tickets(new, env)
+    assert env == {}
+    assert not os.path.exists(path)
+
+    t = new.get(ticket["uuid"])
+    assert t.expires == old.get(ticket["uuid"]).expires
+    assert t.info()["qos"]["bandwidth"] == 1024**2
+    with pytest.raises(KeyError):
+        new.get(canceled["uuid"])
+
+
+def test_load_tickets_not_handoff(cfg):
+    a = auth.Authorizer(cfg)
+    handoff.load_tickets(a, {})
+    assert a.dump() == []
+
+
+def test_notify_ready():
+    r, w = os.pipe()
+    with os.fdopen(r, "rb") as f:
+        env = {handoff.HANDOFF_READY: str(w)}
+        assert handoff.notify_ready(env)
+        assert f.read() == b"1"
+    assert not handoff.notify_ready({})
+
+
+class Context:
+
+    def close(self):
+        pass
+
+
+def test_peer():
+    a, b = socket.socketpair()
+    old, new = handoff.Peer(a), handoff.Peer(b)
+    try:
+        assert new.receive(timeout=0) is None
+
+        old.send({"connections": {"a": 1}})
+        old.send({"connections": {}})
+        assert new.receive() == {"connections": {"a": 1}}
+        assert new.receive(timeout=0) == {"connections": {}}
+
+        old.close()
+        with pytest.raises(EOFError):
+            new.receive()
+    finally:
+        new.close()
+
+
+def test_connect_old_daemon(cfg):
+    new = auth.Authorizer(cfg)
+    ticket = testutil.create_ticket(ops=["read"])
+    new.add(ticket)
+
+    a, b = socket.socketpair()
+    old = handoff.Peer(a)
+    try:
+        old.send({"connections": {ticket["uuid"]: 2}})
+        env = {handoff.HANDOFF_PEER: str(b.detach())}
+        peer = handoff.connect_old_daemon(new, env)
+        assert env == {}
+        assert new.old_daemon is peer
+
+        # The ticket is used by the old daemon connections.
+        t = new.get(ticket["uuid"])
+        assert t.active()
+        assert t.connections == 2
+        assert not new.reclaim(ticket["uuid"])
+        assert old.receive() == {"cancel": ticket["uuid"]}
+
+        handoff.watch_old_daemon(new)
+        old.send({"connections": {ticket["uuid"]: 1}})
+        wait_for(lambda: t.connections == 1)
+
+        # When the old daemon exits, the ticket is not used.
+        old.close()
+        wait_for(lambda: t.connections == 0)
+        assert new.old_daemon is None
+        assert not t.active()
+        assert new.reclaim(ticket["uuid"])
+    finally:
+        old.close()
+
+
+def test_connect_old_daemon_not_handoff(cfg):
+    a = auth.Authorizer(cfg)
+    assert handoff.connect_old_daemon(a, {}) is None
+    assert a.old_daemon is None
+
+
+def wait_for(condition, timeout=2):
+    deadline = time.monotonic() + timeout
+    while not condition():
+        if time.monotonic() >= deadline:
+            raise RuntimeError("Timeout waiting for condition")
+        time.sleep(0.01)
+
+
+CHILD = """
+import sys
+from ovirt_imageio._internal import auth
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import handoff
+sockets = handoff.Sockets.from_environment()
+if sockets.take_tcp(int(sys.argv[1])) is None:
+    sys.exit(1)
+a = auth.Authorizer(config.load(["test/conf/daemon.conf"]))
+handoff.load_tickets(a)
+handoff.connect_old_daemon(a)
+a.old_daemon.send({"connections": a.connections()})
+handoff.notify_ready()
+"""
+
+
+def test_spawn(cfg):
+    tcp = listening_tcp()
+    with tcp:
+        a = auth.Authorizer(cfg)
+        ticket = testutil.create_ticket(ops=["read"])
+        a.add(ticket)
+        a.get(ticket["uuid"]).add_context(1, Context())
+
+        port = tcp.getsockname()[1]
+        argv = [sys.executable, "-c", CHILD, str(port)]
+        peer = handoff.spawn(cfg, a, [tcp], argv=argv)
+        assert peer is not None
+        try:
+            # The new daemon loaded the ticket, and got the connections
+            # before it was ready.
+            assert peer.receive(timeout=10) == {"connections": 1}
+        finally:
+            peer.close()
+
+        # The new daemon loaded the tickets.
+        path = os.path.join(cfg.daemon.run_dir, "handoff.json")
+        assert not os.path.exists(path)
+
+
+def test_spawn_failed(cfg):
+    tcp = listening_tcp()
+    with tcp:
+        a = auth.Authorizer(cfg)
+        argv = [sys.executable, "-c", CHILD, "0"]
+        assert handoff.spawn(cfg, a, [tcp], argv=argv) is None
+        assert not os.path.exists(
+            os.path.join(cfg.daemon.run_dir, "handoff.json"))
+
+
+def test_server_inherited_sockets(cfg):
+    control = listening_unix(cfg.control.socket)
+    sockets = handoff.Sockets([control])
+    s = server.Server(cfg, sockets=sockets)
+    s.start()
+    try:
+        assert s.control_service.socket is control
+        with http.ControlClient(cfg) as c:
+            res = c.get("/tickets/no-such-ticket")
+            res.read()
+            assert res.status == 404
+    finally:
+        s.stop()
+
+    # The socket is owned by systemd.
+    assert os.path.exists(cfg.control.socket)
+
+
+class FakePeer:
+
+    def __init__(self, messages=()):
+        self.messages = list(messages)
+        self.sent = []
+        self.closed = False
+
+    def send(self, msg):
+        self.sent.append(msg)
+
+    def receive(self, timeout=None):
+        if self.messages:
+            return self.messages.pop(0)
+        time.sleep(timeout)
+        return None
+
+    def close(self):
+        self.closed = True
+
+
+def test_server_handoff(cfg, monkeypatch):
+    peer = FakePeer()
+    monkeypatch.setattr(handoff, "spawn", lambda *args: peer)
+    s = server.Server(cfg)
+    s.start()
+    try:
+        with http.ControlClient(cfg) as c:
+            # Open a keep-alive connection before the handoff.
+            res = c.get("/tickets/no-such-ticket")
+            res.read()
+            assert res.getheader("connection") is None
+
+            assert s.handoff()
+            assert peer.closed
+            assert peer.sent == [{"connections": {}}]
+
+            # The next response closes the connection, so the client
+            # reconnects to the new daemon.
+            res = c.get("/tickets/no-such-ticket")
+            res.read()
+            assert res.getheader("connection") == "close"
+    finally:
+        s.stop()
+
+    # The socket is used now by the new daemon.
+    assert os.path.exists(cfg.control.socket)
+
+
+def test_server_handoff_cancel(cfg, monkeypatch):
+    cfg.daemon.drain_timeout = 0.5
+    s = server.Server(cfg)
+    ticket = testutil.create_ticket(ops=["read"])
+    s.auth.add(ticket)
+    t = s.auth.get(ticket["uuid"])
+    t.add_context(1, Context())
+
+    # The ticket was removed in the new daemon.
+    peer = FakePeer([{"cancel": ticket["uuid"]}])
+    monkeypatch.setattr(handoff, "spawn", lambda *args: peer)
+    s.start()
+    try:
+        assert s.handoff()
+    finally:
+        s.stop()
+
+    assert t.canceled
+    assert peer.sent == [{"connections": {ticket["uuid"]: 1}}]
+
+
+def test_server_handoff_failed(cfg, monkeypatch):
+    monkeypatch.setattr(handoff, "spawn", lambda *args: None)
+    s = server.Server(cfg)
+    s.start()
+    try:
+        assert not s.handoff()
+        with http.ControlClient(cfg) as c:
+            res = c.get("/tickets/no-such-ticket")
+            res.read()
+            assert res.status == 404
+    finally:
+        s.stop()
+
+    assert not os.path.exists(cfg.control.socket)
@@ -34,6 +34,9 @@ class HTTPClient:
     def put(self, uri, body, headers=None):
         return self.request("PUT", uri, body=body, headers=headers)
 
+    def post(self, uri, body, headers=None):
+        return self.request("POST", uri, body=body, headers=headers)
+
     def delete(self, uri, headers=None):
         return self.request("DELETE", uri, headers=headers)
 
@@ -27,7 +27,7 @@ CONNECTION_CLOSED = (
 )
 
 
-BASE_FEATURES = {"checksum", "extents"}
+BASE_FEATURES = {"checksum", "compare", "extents"}
 ALL_FEATURES = BASE_FEATURES | {"zero", "flush"}
 
 
@@ -343,6 +343,37 @@ def test_download_no_range(tmpdir, srv, client):
     assert received == b"\0" * size
 
 
+def test_download_block_cache(tmpdir, srv, client):
+    size = 3 * 1024**2 // 2
+    image = testutil.create_tempfile(tmpdir, "image", b"x" * size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, block_cache=4 * 1024**2)
+    srv.auth.add(ticket)
+
+    for i in range(2):
+        res = client.get("/images/" + ticket["uuid"])
+        assert res.status == 200
+        assert res.read() == b"x" * size
+
+    # Only the first download read the 2 cache blocks from storage.
+    info = srv.auth.get(ticket["uuid"]).info()["block_cache"]
+    assert info["misses"] == 2
+    assert info["used"] == size
+
+    # Upload invalidates the cached blocks.
+    res = client.put(
+        "/images/" + ticket["uuid"], b"y" * 4096,
+        headers={"Content-Range": "bytes 1048576-1052671/*"})
+    assert res.status == 200
+    res.read()
+
+    res = client.get(
+        "/images/" + ticket["uuid"],
+        headers={"Range": "bytes=1048576-1052671"})
+    assert res.status == 206
+    assert res.read() == b"y" * 4096
+
+
 def test_download_extends_ticket(tmpdir, srv, client, fake_time):
     size = 1024
     image = testutil.create_tempfile(tmpdir, "image", size=size)
@@ -6,15 +6,19 @@
 # the Free Software Foundation; either version 2 of the License, or
 # (at your option) any later version.
 
+import errno
+import os
 import time
 import pytest
 
 from urllib.parse import urlparse
 
+from ovirt_imageio._internal import ioutil
 from ovirt_imageio._internal import qemu_img
 from ovirt_imageio._internal import qemu_nbd
 from ovirt_imageio._internal import io
-from ovirt_imageio._internal.backends import nbd, memory, image
+from ovirt_imageio._internal import util
+from ovirt_imageio._internal.backends import file, nbd, memory, image
 from ovirt_imageio._internal.nbd import UnixAddress
 
 ZERO_PARAMS = [
@@ -179,6 +183,78 @@ def test_copy_write_to(buffer_size, zero, hole, progress):
     assert dst_backing == src_backing
 
 
+class ZeroCounter(memory.Backend):
+
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.zeroed = 0
+
+    def zero(self, count):
+        self.zeroed += count
+        return super().zero(count)
+
+
+@pytest.mark.parametrize("zero", [True, False])
+def test_copy_holes(zero):
+    # The source has single data extent, but reports holes when reading.
+    src_backing = create_backing("A0B0")
+    src = memory.HoleReader(mode="r", data=src_backing)
+
+    dst_backing = create_backing("CCCC" if zero else "0000")
+    dst = ZeroCounter("r+", data=dst_backing)
+
+    io.copy(src, dst, max_workers=1, buffer_size=1024, zero=zero)
+
+    assert dst_backing == src_backing
+
+    # Holes are zeroed, or skipped if the destination is zeroed.
+    assert dst.zeroed == (2 * CHUNK_SIZE if zero else 0)
+
+
+class ShortCopy(memory.Backend):
+    """
+    Server side copy copying only half of the requested length.
+    """
+
+    def copy_from(self, src, length, canceled=None):
+        count = length // 2
+        buf = bytearray(count)
+        src.readinto(buf)
+        self.write(buf)
+        return count
+
+
+def test_copy_short_copy_from():
+    src_backing = create_backing("ABCD")
+    src = memory.Backend("r", data=src_backing)
+    dst_backing = create_backing("0000")
+    dst = ShortCopy("r+", data=dst_backing)
+
+    p = FakeProgress()
+    io.copy(src, dst, max_workers=1, buffer_size=1024, progress=p)
+
+    # The rest of every request was copied by the handler.
+    assert dst_backing == src_backing
+    assert sum(p.updates) == len(src_backing)
+
+
+@pytest.mark.parametrize("offset,length,holes,align,segments", [
+    # No holes.
+    (0, 100, [], 1, [(0, 100, False)]),
+    # Holes at start, middle, and end.
+    (0, 100, [(0, 10), (40, 20), (90, 10)], 1,
+     [(0, 10, True), (10, 30, False), (40, 20, True), (60, 30, False),
+      (90, 10, True)]),
+    # Holes are shrunk to alignment.
+    (100, 100, [(10, 40)], 8,
+     [(100, 12, False), (112, 32, True), (144, 56, False)]),
+    # Hole smaller than alignment is data.
+    (0, 100, [(10, 4)], 8, [(0, 100, False)]),
+])
+def test_segments(offset, length, holes, align, segments):
+    assert list(io._segments(offset, length, holes, align)) == segments
+
+
 @pytest.mark.parametrize("progress", [None, FakeProgress()])
 def test_copy_dirty(progress):
     src = memory.Backend(
@@ -234,6 +310,119 @@ def test_copy_dirty_progress():
     assert sum(p.updates) == len(dst_backing)
 
 
+@pytest.mark.parametrize("size", [
+    # Aligned image.
+    8 * 1024**2,
+    # Unaligned image, the last request is copied by the backends.
+    8 * 1024**2 + 42,
+    # Unaligned image smaller than the buffer size.
+    1024**2 + 100,
+])
+@pytest.mark.parametrize("unsupported", [
+    # Use best method supported by the file system.
+    (),
+    # Copy using copy_file_range().
+    ("clone_range",),
+    # Copy using copy_data().
+    ("clone_range", "copy_file_range"),
+])
+def test_copy_file_to_file(tmpdir, monkeypatch, size, unsupported):
+    def fail(*args, **kw):
+        raise OSError(errno.EXDEV, "Invalid cross-device link")
+
+    for name in unsupported:
+        monkeypatch.setattr(ioutil, name, fail)
+
+    data = os.urandom(size)
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    with open(src, "wb") as f:
+        f.write(data)
+    with open(dst, "wb") as f:
+        f.truncate(size)
+
+    p = FakeProgress()
+    with file.open(urlparse("file://" + src)) as s, \
+            file.open(urlparse("file://" + dst), "r+") as d:
+        io.copy(s, d, max_workers=2, buffer_size=1024**2, progress=p)
+
+    # Must not write after the end of the source.
+    assert os.path.getsize(dst) == size
+
+    with open(dst, "rb") as f:
+        assert f.read() == data
+
+    assert sum(p.updates) == size
+
+
+def test_copy_file_to_file_unaligned_new_file(tmpdir, monkeypatch):
+    # Copy using copy_data() to an empty destination file.
+    def fail(*args, **kw):
+        raise OSError(errno.EXDEV, "Invalid cross-device link")
+
+    monkeypatch.setattr(ioutil, "clone_range", fail)
+    monkeypatch.setattr(ioutil, "copy_file_range", fail)
+
+    size = 1024**2 + 100
+    data = os.urandom(size)
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    with open(src, "wb") as f:
+        f.write(data)
+    open(dst, "wb").close()
+
+    with file.open(urlparse("file://" + src)) as s, \
+            file.open(urlparse("file://" + dst), "r+") as d:
+        io.copy(s, d, max_workers=1, buffer_size=1024**2)
+
+    assert os.path.getsize(dst) == size
+    with open(dst, "rb") as f:
+        assert f.read() == data
+
+
+def test_copy_file_to_file_unaligned_larger_destination(tmpdir, monkeypatch):
+    # Copy using copy_data() to a larger destination file.
+    def fail(*args, **kw):
+        raise OSError(errno.EXDEV, "Invalid cross-device link")
+
+    monkeypatch.setattr(ioutil, "clone_range", fail)
+    monkeypatch.setattr(ioutil, "copy_file_range", fail)
+
+    size = 1024**2 + 100
+    data = os.urandom(size)
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    with open(src, "wb") as f:
+        f.write(data)
+    with open(dst, "wb") as f:
+        f.write(b"x" * (size + 8192))
+
+    with file.open(urlparse("file://" + src)) as s, \
+            file.open(urlparse("file://" + dst), "r+") as d:
+        io.copy(s, d, max_workers=1, buffer_size=1024**2)
+
+    # Data after the end of the source is not modified.
+    with open(dst, "rb") as f:
+        assert f.read() == data + b"x" * 8192
+
+
+def test_copy_file_to_file_canceled(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    with open(src, "wb") as f:
+        f.write(b"x" * 1024**2)
+    with open(dst, "wb") as f:
+        f.truncate(1024**2)
+
+    canceled = bytearray(b"\1")
+    with file.open(urlparse("file://" + src)) as s, \
+            file.open(urlparse("file://" + dst), "r+") as d:
+        handler = io.Handler(
+            lambda: s, lambda: d, buffer_size=4096, canceled=canceled)
+        with pytest.raises(io.Closed):
+            handler.copy(io.Request(io.COPY, 0, 1024**2))
+
+
 class BackendError(Exception):
     pass
 
@@ -274,6 +463,68 @@ class FailingBackend:
         pass
 
 
+@pytest.mark.benchmark
+@pytest.mark.parametrize("workers", [1, 2, 4, 8])
+def test_copy_benchmark(workers):
+    # Using small buffer size, most time is spent in python code, so this
+    # shows how copy workers scale. Run with both the default and the
+    # free-threaded python builds to compare.
+    size = 128 * 1024**2
+    src = memory.Backend("r", data=bytearray(b"x" * size))
+    dst = memory.Backend("r+", data=bytearray(size))
+
+    start = time.monotonic()
+    io.copy(src, dst, max_workers=workers, buffer_size=4096)
+    elapsed = time.monotonic() - start
+
+    print("%d workers, gil=%s: copied %s in %.3f seconds (%s/s)"
+          % (workers, util.gil_enabled(), util.humansize(size), elapsed,
+             util.humansize(size / elapsed)))
+
+
+def test_queue_multiple_producers():
+    # Producers and consumers must wake up the right kind of thread when the
+    # queue is full or empty.
+    q = io.Queue(1)
+    producers = 4
+    items = 1000
+    received = []
+
+    def produce():
+        for i in range(items):
+            q.put(i)
+
+    def consume():
+        for _ in range(items):
+            received.append(q.get())
+
+    threads = [util.start_thread(produce) for _ in range(producers)]
+    threads += [util.start_thread(consume) for _ in range(producers)]
+    for t in threads:
+        t.join(10)
+        assert not t.is_alive()
+
+    assert sorted(received) == sorted(list(range(items)) * producers)
+
+
+def test_queue_close_wakes_up_producers():
+    q = io.Queue(1)
+    q.put(0)
+    closed = []
+
+    def produce():
+        try:
+            q.put(1)
+        except io.Closed:
+            closed.append(True)
+
+    t = util.start_thread(produce)
+    time.sleep(0.1)
+    q.close()
+    t.join(1)
+    assert closed == [True]
+
+
 def test_reraise_dst_error():
     src = FailingBackend()
     dst = FailingBackend(fail_write=True)
@@ -0,0 +1,195 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import threading
+import time
+
+from urllib.parse import urlparse
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import iosched
+from ovirt_imageio._internal import util
+
+
+class FakeClock:
+
+    def __init__(self):
+        self.now = 0.0
+
+    def __call__(self):
+        return self.now
+
+
+def test_increase_when_limit_reached():
+    limiter = iosched.Limiter("dev", initial_limit=2, target_latency=0.1)
+
+    # Idle device does not increase the limit.
+    for _ in range(10):
+        limiter.acquire("a")
+        limiter.release(0.01)
+    assert limiter.limit == 2
+
+    # Completing requests within the target when the limit is reached
+    # increases the limit by 1 / limit.
+    for _ in range(3):
+        limiter.acquire("a")
+        limiter.acquire("a")
+        limiter.release(0.01)
+        limiter.release(0.01)
+    assert limiter.limit == 3
+
+
+def test_increase_max_limit():
+    limiter = iosched.Limiter(
+        "dev", initial_limit=1, max_limit=2, target_latency=0.1)
+    for _ in range(10):
+        limiter.acquire("a")
+        limiter.release(0.01)
+    assert limiter.limit == 2
+
+
+def test_decrease_once_per_latency():
+    clock = FakeClock()
+    limiter = iosched.Limiter(
+        "dev", initial_limit=16, target_latency=0.1, clock=clock)
+
+    for _ in range(4):
+        limiter.acquire("a")
+
+    # All requests in flight were slow; decrease once.
+    for _ in range(4):
+        limiter.release(1.0)
+    assert limiter.limit == 8
+
+    # After the latency passed, slow request decreases again.
+    clock.now += 1.0
+    limiter.acquire("a")
+    limiter.release(1.0)
+    assert limiter.limit == 4
+
+
+def test_decrease_min_limit():
+    clock = FakeClock()
+    limiter = iosched.Limiter(
+        "dev", initial_limit=2, min_limit=1, target_latency=0.1,
+        clock=clock)
+    for _ in range(3):
+        clock.now += 10
+        limiter.acquire("a")
+        limiter.release(1.0)
+    assert limiter.limit == 1
+
+
+def test_wait_for_limit():
+    limiter = iosched.Limiter("dev", initial_limit=1, target_latency=10)
+    limiter.acquire("a")
+    acquired = threading.Event()
+
+    def waiter():
+        limiter.acquire("b")
+        acquired.set()
+
+    t = util.start_thread(waiter)
+    try:
+        assert not acquired.wait(0.1)
+        assert limiter.info()["waiting"] == 1
+
+        limiter.release(0.01)
+        assert acquired.wait(1)
+        assert limiter.info()["inflight"] == 1
+    finally:
+        t.join()
+
+
+def test_round_robin():
+    limiter = iosched.Limiter(
+        "dev", initial_limit=1, max_limit=1, target_latency=10)
+    limiter.acquire("main")
+
+    # Ticket "a" queues 3 requests before ticket "b" queues 1.
+    order = []
+    threads = []
+    for owner in ("a", "a", "a", "b"):
+        def run(owner=owner):
+            limiter.acquire(owner)
+            order.append(owner)
+            limiter.release(0.01)
+        threads.append(util.start_thread(run))
+        wait_for_waiting(limiter, len(threads))
+
+    limiter.release(0.01)
+    for t in threads:
+        t.join()
+
+    # "b" is served before the rest of "a" requests.
+    assert order == ["a", "b", "a", "a"]
+
+
+def test_client_io():
+    limiter = iosched.Limiter("dev", initial_limit=2)
+    client = limiter.client("ticket")
+    assert client.limiter is limiter
+    with client.io():
+        assert limiter.info()["inflight"] == 1
+    assert limiter.info()["inflight"] == 0
+
+
+def test_client_io_error():
+    limiter = iosched.Limiter("dev", initial_limit=2)
+    client = limiter.client("ticket")
+    with pytest.raises(RuntimeError):
+        with client.io():
+            raise RuntimeError
+    assert limiter.info()["inflight"] == 0
+
+
+def test_device_key_file(tmpdir):
+    a = tmpdir.join("a")
+    a.write("")
+    b = tmpdir.join("b")
+    b.write("")
+    key = iosched.device_key(urlparse("file://" + str(a)))
+    assert key.startswith("dev:")
+    assert iosched.device_key(urlparse("file://" + str(b))) == key
+
+
+@pytest.mark.parametrize("url,key", [
+    ("file:///no/such/file", None),
+    ("https://host:54322/images/x", "http:host:54322"),
+    ("nbd:unix:/sock", None),
+])
+def test_device_key(url, key):
+    assert iosched.device_key(urlparse(url)) == key
+
+
+def test_scheduler_disabled():
+    cfg = config.load(["test/conf/daemon.conf"])
+    scheduler = iosched.Scheduler(cfg.io_scheduler)
+    assert scheduler.limiter(urlparse("https://host/images/x")) is None
+
+
+def test_scheduler_shared_limiter():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.io_scheduler.enable = True
+    scheduler = iosched.Scheduler(cfg.io_scheduler)
+    a = scheduler.limiter(urlparse("https://host/images/a"))
+    b = scheduler.limiter(urlparse("https://host/images/b"))
+    c = scheduler.limiter(urlparse("https://other/images/c"))
+    assert a is b
+    assert a is not c
+    assert a.limit == cfg.io_scheduler.initial_limit
+
+
+def wait_for_waiting(limiter, count, timeout=1):
+    deadline = time.monotonic() + timeout
+    while limiter.info()["waiting"] < count:
+        if time.monotonic() > deadline:
+            raise RuntimeError("Timeout waiting for waiters")
+        time.sleep(0.01)
@@ -174,6 +174,26 @@ def test_is_not_zero_memoryview(buf):
     assert not ioutil.is_zero(memoryview(buf))
 
 
+# Comparing buffers
+
+@pytest.mark.parametrize("a,b", [
+    pytest.param(b"", b"", id="empty"),
+    pytest.param(b"x" * 512, bytearray(b"x" * 512), id="bytearray"),
+    pytest.param(b"x" * 512, memoryview(b"x" * 1024)[512:], id="memoryview"),
+])
+def test_equal(a, b):
+    assert ioutil.equal(a, b)
+
+
+@pytest.mark.parametrize("a,b", [
+    pytest.param(b"x" * 512, b"x" * 511 + b"y", id="last"),
+    pytest.param(b"x" * 512, b"y" + b"x" * 511, id="first"),
+    pytest.param(b"x" * 512, b"x" * 511, id="length"),
+])
+def test_not_equal(a, b):
+    assert not ioutil.equal(a, b)
+
+
 # Checking mmap
 
 @pytest.fixture
@@ -303,3 +323,195 @@ def try_fallocate(fd, mode, offset, count):
         if e.errno != errno.EOPNOTSUPP:
             raise
         pytest.skip("fallocate(mode=%r) not supported" % mode)
+
+
+def create_file(path, data):
+    with open(path, "wb") as f:
+        f.write(data)
+
+
+@pytest.mark.parametrize("length", [
+    BLOCKSIZE * 4,
+    # Unaligned length, last write is padded to alignment.
+    BLOCKSIZE * 3 + 42,
+])
+def test_copy_data(tmpdir, length):
+    data = os.urandom(length)
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, data)
+    create_file(dst, b"")
+
+    buf = util.aligned_buffer(BLOCKSIZE * 2)
+    with closing(buf), util.open(src, "r") as s, util.open(dst, "r+") as d:
+        n = ioutil.copy_data(
+            s.fileno(), d.fileno(), 0, length, buf, align=BLOCKSIZE)
+        assert n == length
+
+    with open(dst, "rb") as f:
+        copied = f.read()
+
+    assert copied[:length] == data
+    assert copied[length:] == b"\0" * (util.round_up(length, BLOCKSIZE) -
+                                       length)
+
+
+def test_copy_data_offset(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, b"a" * BLOCKSIZE + b"b" * BLOCKSIZE + b"c" * BLOCKSIZE)
+    create_file(dst, b"x" * BLOCKSIZE * 3)
+
+    buf = util.aligned_buffer(BLOCKSIZE)
+    with closing(buf), util.open(src, "r") as s, util.open(dst, "r+") as d:
+        n = ioutil.copy_data(
+            s.fileno(), d.fileno(), BLOCKSIZE, BLOCKSIZE, buf,
+            align=BLOCKSIZE)
+        assert n == BLOCKSIZE
+
+    with open(dst, "rb") as f:
+        assert f.read() == (
+            b"x" * BLOCKSIZE + b"b" * BLOCKSIZE + b"x" * BLOCKSIZE)
+
+
+def test_copy_data_canceled(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, b"x" * BLOCKSIZE * 2)
+    create_file(dst, b"")
+
+    canceled = bytearray(b"\1")
+    buf = bytearray(BLOCKSIZE)
+    with open(src, "rb") as s, open(dst, "r+b") as d:
+        n = ioutil.copy_data(
+            s.fileno(), d.fileno(), 0, BLOCKSIZE * 2, buf, canceled=canceled)
+        assert n == 0
+
+    assert os.path.getsize(dst) == 0
+
+
+def test_copy_data_unaligned_buffer():
+    with pytest.raises(ValueError):
+        ioutil.copy_data(0, 1, 0, BLOCKSIZE, bytearray(1000), align=512)
+
+
+@pytest.mark.parametrize("length", [BLOCKSIZE * 4, BLOCKSIZE * 3 + 42])
+def test_copy_file_range(tmpdir, length):
+    data = os.urandom(length)
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, data)
+    create_file(dst, b"")
+
+    with open(src, "rb") as s, open(dst, "r+b") as d:
+        try:
+            n = ioutil.copy_file_range(s.fileno(), 0, d.fileno(), 0, length)
+        except OSError as e:
+            if e.errno not in (errno.EXDEV, errno.EINVAL, errno.EOPNOTSUPP,
+                               errno.ENOSYS):
+                raise
+            pytest.skip("copy_file_range() not supported: %s" % e)
+        assert n == length
+
+    with open(dst, "rb") as f:
+        assert f.read() == data
+
+
+def test_copy_file_range_end_of_file(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, b"x" * BLOCKSIZE)
+    create_file(dst, b"")
+
+    with open(src, "rb") as s, open(dst, "r+b") as d:
+        try:
+            n = ioutil.copy_file_range(
+                s.fileno(), 0, d.fileno(), 0, BLOCKSIZE * 2)
+        except OSError as e:
+            pytest.skip("copy_file_range() not supported: %s" % e)
+        assert n == BLOCKSIZE
+
+
+def test_copy_file_range_offsets(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, b"a" * BLOCKSIZE + b"b" * BLOCKSIZE)
+    create_file(dst, b"x" * BLOCKSIZE * 3)
+
+    with open(src, "rb") as s, open(dst, "r+b") as d:
+        try:
+            n = ioutil.copy_file_range(
+                s.fileno(), BLOCKSIZE, d.fileno(), BLOCKSIZE * 2, BLOCKSIZE)
+        except OSError as e:
+            pytest.skip("copy_file_range() not supported: %s" % e)
+        assert n == BLOCKSIZE
+
+    with open(dst, "rb") as f:
+        assert f.read() == b"x" * BLOCKSIZE * 2 + b"b" * BLOCKSIZE
+
+
+def test_clone_range(tmpdir):
+    src = str(tmpdir.join("src"))
+    dst = str(tmpdir.join("dst"))
+    create_file(src, b"a" * BLOCKSIZE + b"b" * BLOCKSIZE)
+    create_file(dst, b"x" * BLOCKSIZE * 2)
+
+    with open(src, "rb") as s, open(dst, "r+b") as d:
+        try:
+            ioutil.clone_range(s.fileno(), BLOCKSIZE, d.fileno(), 0, BLOCKSIZE)
+        except OSError as e:
+            if e.errno not in (errno.EOPNOTSUPP, errno.ENOTTY, errno.EXDEV,
+                               errno.ENOSYS):
+                raise
+            pytest.skip("clone_range() not supported: %s" % e)
+
+    with open(dst, "rb") as f:
+        assert f.read() == b"b" * BLOCKSIZE + b"x" * BLOCKSIZE
+
+
+def test_ioprio():
+    def run():
+        # Run in a new thread so the test thread priority is not modified.
+        ioutil.ioprio_set(ioutil.IOPRIO_CLASS_BE, 7)
+        result.append(ioutil.ioprio_get())
+        ioutil.ioprio_set(ioutil.IOPRIO_CLASS_IDLE, 0)
+        result.append(ioutil.ioprio_get())
+
+    result = []
+    t = util.start_thread(run)
+    t.join()
+
+    assert result == [
+        (ioutil.IOPRIO_CLASS_BE, 7),
+        (ioutil.IOPRIO_CLASS_IDLE, 0),
+    ]
+
+
+def test_ioprio_invalid_class():
+    with pytest.raises(OSError) as e:
+        ioutil.ioprio_set(7, 0)
+    assert e.value.errno == errno.EINVAL
+
+
+def test_mbind():
+    with closing(util.aligned_buffer(BLOCKSIZE * 4)) as buf:
+        ioutil.mbind(buf, 0)
+        buf.write(b"x" * len(buf))
+
+
+def test_mbind_invalid_node():
+    with closing(util.aligned_buffer(BLOCKSIZE)) as buf:
+        with pytest.raises(OSError) as e:
+            ioutil.mbind(buf, 64)
+        assert e.value.errno == errno.EINVAL
+
+
+def test_sync_file_range(tmpfile):
+    with open(tmpfile, "r+b") as f:
+        f.write(b"x" * BLOCKSIZE)
+        f.flush()
+        ioutil.sync_file_range(
+            f.fileno(), 0, BLOCKSIZE,
+            ioutil.SYNC_FILE_RANGE_WAIT_BEFORE |
+            ioutil.SYNC_FILE_RANGE_WRITE |
+            ioutil.SYNC_FILE_RANGE_WAIT_AFTER)
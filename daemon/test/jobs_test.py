@@ -0,0 +1,268 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import json
+import threading
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import errors
+from ovirt_imageio._internal import jobs
+from ovirt_imageio._internal import ops
+from ovirt_imageio._internal import server
+
+from . import http
+from . import testutil
+
+
+@pytest.fixture(scope="module")
+def srv():
+    cfg = config.load(["test/conf/daemon.conf"])
+    s = server.Server(cfg)
+    s.start()
+    yield s
+    s.stop()
+
+
+@pytest.fixture(params=[
+    pytest.param(http.RemoteClient, id="http"),
+    pytest.param(http.LocalClient, id="local"),
+])
+def client(srv, request):
+    srv.auth.clear()
+    client = request.param(srv.config)
+    yield client
+    client.close()
+
+
+def create_image(tmpdir, srv, data):
+    image = testutil.create_tempfile(tmpdir, "image", data)
+    ticket = testutil.create_ticket(url="file://" + str(image), size=len(data))
+    srv.auth.add(ticket)
+    return image, ticket
+
+
+def wait_for_job(client, res):
+    assert res.status == 202
+    job = json.loads(res.read())
+    assert res.getheader("location") == "/jobs/" + job["id"]
+    res = client.get(res.getheader("location") + "?wait=10")
+    assert res.status == 200
+    return json.loads(res.read())
+
+
+def test_zero(tmpdir, srv, client):
+    data = b"x" * 1024**2
+    image, ticket = create_image(tmpdir, srv, data)
+
+    msg = {"op": "zero", "size": 8192, "offset": 4096, "async": True}
+    res = client.patch("/images/" + ticket["uuid"], json.dumps(msg))
+    job = wait_for_job(client, res)
+
+    assert job["name"] == "zero"
+    assert job["state"] == jobs.DONE
+    assert job["done"] == job["size"] == 8192
+
+    with open(str(image), "rb") as f:
+        assert f.read() == data[:4096] + b"\0" * 8192 + data[12288:]
+
+
+def test_flush(tmpdir, srv, client):
+    image, ticket = create_image(tmpdir, srv, b"x" * 4096)
+
+    msg = {"op": "flush", "async": True}
+    res = client.patch("/images/" + ticket["uuid"], json.dumps(msg))
+    job = wait_for_job(client, res)
+
+    assert job["name"] == "flush"
+    assert job["state"] == jobs.DONE
+
+
+def test_checksum(tmpdir, srv, client):
+    image, ticket = create_image(tmpdir, srv, b"x" * 1024**2)
+
+    res = client.get("/images/" + ticket["uuid"] + "/checksum")
+    assert res.status == 200
+    expected = json.loads(res.read())
+
+    res = client.get("/images/" + ticket["uuid"] + "/checksum?async=y")
+    job = wait_for_job(client, res)
+
+    assert job["name"] == "checksum"
+    assert job["state"] == jobs.DONE
+    assert job["result"] == expected
+
+
+def test_no_job_id(srv, client):
+    res = client.get("/jobs/")
+    assert res.status == 400
+
+
+def test_no_such_job(srv, client):
+    res = client.get("/jobs/no-such-job")
+    res.read()
+    assert res.status == 404
+
+    res = client.delete("/jobs/no-such-job")
+    assert res.status == 404
+
+
+def test_invalid_wait(srv, client):
+    res = client.get("/jobs/job-id?wait=invalid")
+    assert res.status == 400
+
+
+def test_forbidden(tmpdir, srv, client):
+    image, ticket = create_image(tmpdir, srv, b"x" * 4096)
+    srv.auth.remove(ticket["uuid"])
+
+    msg = {"op": "zero", "size": 4096, "async": True}
+    res = client.patch("/images/" + ticket["uuid"], json.dumps(msg))
+    assert res.status == 403
+
+
+def test_jobs_kept_after_ticket_removed(tmpdir, srv, client):
+    image, ticket = create_image(tmpdir, srv, b"x" * 4096)
+
+    msg = {"op": "flush", "async": True}
+    res = client.patch("/images/" + ticket["uuid"], json.dumps(msg))
+    job = wait_for_job(client, res)
+
+    srv.auth.remove(ticket["uuid"])
+
+    # Finished jobs are kept until jobs:keep_time expires.
+    res = client.get("/jobs/" + job["id"])
+    assert res.status == 200
+    assert json.loads(res.read()) == job
+
+
+# Manager tests.
+
+class FakeTicket:
+
+    def __init__(self, uuid="ticket"):
+        self.uuid = uuid
+        self.canceled = False
+
+    def run(self, op):
+        try:
+            return op.run()
+        except ops.Canceled:
+            return None
+
+
+class BlockingOperation(ops.Operation):
+
+    def __init__(self):
+        super().__init__(size=100)
+        self.started = threading.Event()
+        self.unblock = threading.Event()
+
+    def _run(self):
+        self.started.set()
+        while not self.unblock.wait(0.01):
+            if self._canceled:
+                raise ops.Canceled
+        self._done = self.size
+        return "result"
+
+
+@pytest.fixture
+def manager():
+    cfg = config.load(["test/conf/daemon.conf"])
+    m = jobs.Manager(cfg)
+    yield m
+    m.stop()
+
+
+def test_manager_done(manager):
+    op = BlockingOperation()
+    job = manager.submit(FakeTicket(), "test", lambda j: j.run_operation(op))
+    assert manager.get(job.id) is job
+
+    assert op.started.wait(1)
+    info = job.info()
+    assert info["state"] == jobs.RUNNING
+    assert info["size"] == 100
+    assert info["done"] == 0
+
+    op.unblock.set()
+    assert job.wait(1)
+    info = job.info()
+    assert info["state"] == jobs.DONE
+    assert info["done"] == 100
+    assert info["result"] == "result"
+
+
+def test_manager_cancel(manager):
+    op = BlockingOperation()
+    job = manager.submit(FakeTicket(), "test", lambda j: j.run_operation(op))
+    assert op.started.wait(1)
+
+    job.cancel()
+    assert job.wait(1)
+    assert job.state == jobs.CANCELED
+    assert "result" not in job.info()
+
+
+def test_manager_failed(manager):
+    def fail(job):
+        raise errors.AuthorizationError("Ticket was canceled")
+
+    job = manager.submit(FakeTicket(), "test", fail)
+    assert job.wait(1)
+    info = job.info()
+    assert info["state"] == jobs.FAILED
+    assert "Ticket was canceled" in info["error"]
+
+
+def test_manager_cancel_ticket_jobs(manager, fake_time):
+    op = BlockingOperation()
+    ticket = FakeTicket()
+    job = manager.submit(ticket, "test", lambda j: j.run_operation(op))
+    assert op.started.wait(1)
+
+    manager.cancel(ticket.uuid)
+    assert job.wait(1)
+    assert job.state == jobs.CANCELED
+
+    # The canceled job is kept like other finished jobs.
+    assert manager.get(job.id) is job
+    fake_time.now += manager._config.keep_time
+    with pytest.raises(KeyError):
+        manager.get(job.id)
+
+
+def test_manager_too_many_jobs(manager):
+    manager._config.max_jobs = 1
+    op = BlockingOperation()
+    manager.submit(FakeTicket(), "test", lambda j: j.run_operation(op))
+    try:
+        with pytest.raises(errors.TooManyJobs):
+            manager.submit(FakeTicket(), "test", lambda j: None)
+    finally:
+        op.unblock.set()
+
+
+def test_manager_disabled(manager):
+    manager._config.workers = 0
+    with pytest.raises(errors.UnsupportedOperation):
+        manager.submit(FakeTicket(), "test", lambda j: None)
+
+
+def test_manager_keep_time(manager, fake_time):
+    job = manager.submit(FakeTicket(), "test", lambda j: None)
+    assert job.wait(1)
+
+    fake_time.now += manager._config.keep_time - 1
+    assert manager.get(job.id) is job
+
+    fake_time.now += 1
+    with pytest.raises(KeyError):
+        manager.get(job.id)
@@ -0,0 +1,129 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import logging
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import logqueue
+
+
+class ListHandler(logging.Handler):
+
+    def __init__(self, level=logging.NOTSET):
+        super().__init__(level)
+        self.setFormatter(logging.Formatter("%(levelname)s %(message)s"))
+        self.messages = []
+
+    def emit(self, record):
+        self.messages.append(self.format(record))
+
+
+@pytest.fixture
+def cfg():
+    return config.load(["test/conf/daemon.conf"])
+
+
+@pytest.fixture
+def logger(monkeypatch):
+    monkeypatch.setattr(logqueue, "_listener", None)
+    log = logging.getLogger("test.logqueue")
+    log.propagate = False
+    log.setLevel(logging.DEBUG)
+    target = ListHandler()
+    log.addHandler(target)
+    yield log
+    logqueue.stop()
+    for h in log.handlers[:]:
+        log.removeHandler(h)
+
+
+def target(logger):
+    # pytest may add its own handlers; use the handler added by the test.
+    h, = [h for h in logqueue.handlers(logger) if isinstance(h, ListHandler)]
+    return h
+
+
+def test_disabled(cfg, logger):
+    cfg.log_queue.enable = False
+    handlers = logger.handlers[:]
+    logqueue.install(cfg, logger)
+    assert logger.handlers == handlers
+
+
+def test_queued_until_start(cfg, logger):
+    h = target(logger)
+    logqueue.install(cfg, logger)
+    assert isinstance(logger.handlers[0], logqueue.Handler)
+
+    logger.info("message %d", 1)
+    assert h.messages == []
+
+    logqueue.start()
+    logger.info("message %d", 2)
+    logqueue.stop()
+
+    assert h.messages == ["INFO message 1", "INFO message 2"]
+
+
+def test_handler_level(cfg, logger):
+    h = target(logger)
+    h.setLevel(logging.WARNING)
+    logqueue.install(cfg, logger)
+    logqueue.start()
+    logger.info("info")
+    logger.warning("warning")
+    logqueue.stop()
+
+    assert h.messages == ["WARNING warning"]
+
+
+def test_exception(cfg, logger):
+    h = target(logger)
+    logqueue.install(cfg, logger)
+    logqueue.start()
+    try:
+        raise RuntimeError("error")
+    except RuntimeError:
+        logger.exception("failed")
+    logqueue.stop()
+
+    msg, = h.messages
+    assert msg.startswith("ERROR failed\nTraceback")
+    assert "RuntimeError: error" in msg
+
+
+def test_drop(cfg, logger):
+    cfg.log_queue.size = 2
+    h = target(logger)
+    logqueue.install(cfg, logger)
+
+    for i in range(4):
+        logger.info("message %d", i)
+    logger.warning("warning")
+    logqueue.stop()
+
+    assert h.messages == [
+        "INFO message 0",
+        "INFO message 1",
+        "WARNING Log queue full, dropped 3 records (INFO=2, WARNING=1)",
+    ]
+
+
+def test_after_fork(cfg, logger):
+    h = target(logger)
+    logqueue.install(cfg, logger)
+
+    # Parent records are not written by the child.
+    logger.info("parent")
+    logqueue.after_fork(cfg)
+    logger.info("child")
+    logqueue.stop()
+
+    assert h.messages == ["INFO child"]
@@ -147,6 +147,43 @@ def test_raw_readinto(nbd_server):
         assert buf == data
 
 
+def test_raw_readinto_holes(nbd_server):
+    data = b"can read from raw"
+
+    with io.open(nbd_server.image, "wb") as f:
+        f.truncate(3 * 1024**2)
+        f.seek(1024**2)
+        f.write(data)
+
+    nbd_server.start()
+
+    with nbd.open(nbd_server.url) as c:
+        buf = bytearray(b"x" * 3 * 1024**2)
+        holes = []
+        c.readinto(0, buf, holes=holes)
+
+        # Holes are zeroed in buf.
+        assert buf[:1024**2] == b"\0" * 1024**2
+        assert buf[1024**2:1024**2 + len(data)] == data
+        assert buf[2 * 1024**2:] == b"\0" * 1024**2
+
+        # The holes are reported using the file system allocation, so we
+        # check only the start and end.
+        assert holes[0] == (0, 1024**2)
+        assert holes[-1][0] + holes[-1][1] == 3 * 1024**2
+
+
+@pytest.mark.parametrize("ranges,merged", [
+    ([], []),
+    ([(0, 10)], [(0, 10)]),
+    ([(20, 10), (0, 10)], [(0, 10), (20, 10)]),
+    ([(10, 10), (0, 10), (20, 5)], [(0, 25)]),
+    ([(0, 20), (5, 5)], [(0, 20)]),
+])
+def test_merge_ranges(ranges, merged):
+    assert nbd._merge_ranges(ranges) == merged
+
+
 def test_raw_write(tmpdir):
     image = str(tmpdir.join("image"))
     with open(image, "wb") as f:
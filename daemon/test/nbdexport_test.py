@@ -0,0 +1,176 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import http.client as http_client
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import nbdexport
+from ovirt_imageio._internal import qemu_img
+from ovirt_imageio._internal import qemu_nbd
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal.auth import Authorizer
+
+from . import http
+from . import testutil
+
+
+class FakeServer(qemu_nbd.Server):
+
+    started = []
+    stopped = []
+
+    def start(self):
+        self.started.append(self)
+
+    def stop(self):
+        self.stopped.append(self)
+
+
+@pytest.fixture
+def fake_server(monkeypatch):
+    FakeServer.started = []
+    FakeServer.stopped = []
+    monkeypatch.setattr(qemu_nbd, "Server", FakeServer)
+    return FakeServer
+
+
+@pytest.fixture
+def cfg(tmpdir):
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.daemon.run_dir = str(tmpdir)
+    cfg.backend_file.qemu_nbd = True
+    return cfg
+
+
+@pytest.mark.parametrize("kw,args", [
+    ({"ops": ["read"]},
+     {"fmt": "raw", "read_only": True, "cache": "none", "aio": "native",
+      "discard": "ignore"}),
+    ({"ops": ["write"], "sparse": True, "format": "qcow2",
+      "cache": "buffered"},
+     {"fmt": "qcow2", "read_only": False, "cache": "writeback",
+      "aio": "threads", "discard": "unmap"}),
+])
+def test_server_options(cfg, fake_server, kw, args):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img", **kw)
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+
+    url = ticket.export.url()
+    assert url.scheme == "nbd"
+
+    s, = fake_server.started
+    assert s.image == "/tmp/foo.img"
+    assert s.shared == nbdexport.UNLIMITED_CLIENTS
+    assert s.sock.path.startswith(cfg.daemon.run_dir)
+    for name, value in args.items():
+        assert getattr(s, name) == value
+
+
+def test_started_once(cfg, fake_server):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img")
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+
+    assert ticket.export.url() == ticket.export.url()
+    assert len(fake_server.started) == 1
+
+
+def test_stopped_on_remove(cfg, fake_server):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img")
+    auth.add(ticket_info)
+    ticket = auth.get(ticket_info["uuid"])
+    ticket.export.url()
+
+    auth.remove(ticket_info["uuid"])
+    assert fake_server.stopped == fake_server.started
+
+    # The ticket image cannot be accessed after the ticket was removed.
+    with pytest.raises(RuntimeError):
+        ticket.export.url()
+
+
+def test_stopped_on_replace(cfg, fake_server):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img")
+    auth.add(ticket_info)
+    auth.get(ticket_info["uuid"]).export.url()
+
+    auth.add(ticket_info)
+    assert fake_server.stopped == fake_server.started
+
+
+class Context:
+
+    def close(self):
+        pass
+
+
+def test_stopped_on_replace_when_unused(cfg, fake_server):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img")
+    auth.add(ticket_info)
+    old = auth.get(ticket_info["uuid"])
+    old.add_context("con", Context())
+    old.export.url()
+
+    # The old ticket is still used by a connection.
+    auth.add(ticket_info)
+    assert old.canceled
+    assert fake_server.stopped == []
+
+    old.remove_context("con")
+    assert fake_server.stopped == fake_server.started
+
+    # The new ticket export can be used.
+    auth.get(ticket_info["uuid"]).export.url()
+    assert len(fake_server.started) == 2
+
+
+def test_not_started_if_unused(cfg, fake_server):
+    auth = Authorizer(cfg)
+    ticket_info = testutil.create_ticket(url="file:///tmp/foo.img")
+    auth.add(ticket_info)
+    auth.clear()
+    assert fake_server.started == []
+    assert fake_server.stopped == []
+
+
+def test_download_upload_qcow2(tmpdir, cfg):
+    cfg.local.socket = ""
+    srv = server.Server(cfg)
+    srv.start()
+    try:
+        image = str(tmpdir.join("image.qcow2"))
+        size = 1024**2
+        qemu_img.create(image, "qcow2", size=size)
+
+        ticket_info = testutil.create_ticket(
+            url="file://" + image, size=size, format="qcow2")
+        srv.auth.add(ticket_info)
+
+        data = b"x" * 4096
+        with http.RemoteClient(cfg) as c:
+            res = c.put("/images/" + ticket_info["uuid"], data)
+            assert res.status == http_client.OK
+
+            res = c.get("/images/" + ticket_info["uuid"])
+            assert res.status == http_client.OK
+            received = res.read()
+
+        # We read guest data, not the qcow2 file.
+        assert len(received) == size
+        assert received[:len(data)] == data
+        assert received[len(data):] == b"\0" * (size - len(data))
+    finally:
+        srv.stop()
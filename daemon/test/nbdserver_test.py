@@ -0,0 +1,270 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import time
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import http as http_server
+from ovirt_imageio._internal import nbd
+from ovirt_imageio._internal import nbdserver
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal import util
+from ovirt_imageio._internal.backends import file
+from ovirt_imageio._internal.backends.image import ZeroExtent
+
+from . import http
+from . import testutil
+
+CHUNK_SIZE = 1024**2
+
+
+@pytest.fixture(scope="module")
+def srv():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.nbd_server.enable = True
+    cfg.nbd_server.socket = ""
+    s = server.Server(cfg)
+    s.start()
+    try:
+        yield s
+    finally:
+        s.stop()
+
+
+def create_image(tmpdir, srv, data, ops, size=None):
+    image = testutil.create_tempfile(tmpdir, "image", data, size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size or len(data), ops=ops)
+    srv.auth.add(ticket)
+    return image, ticket
+
+
+def connect(srv, ticket_id):
+    address = nbd.UnixAddress(srv.config.nbd_server.socket)
+    return nbd.Client(address, export_name=ticket_id)
+
+
+def test_handshake(tmpdir, srv):
+    data = b"x" * CHUNK_SIZE
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c:
+        assert c.export_size == len(data)
+        assert c.structured_reply
+        assert c.base_allocation
+        assert c.transmission_flags & nbd.FLAG_READ_ONLY
+        assert c.transmission_flags & nbd.FLAG_CAN_MULTI_CONN
+
+
+def test_handshake_unknown_export(srv):
+    with pytest.raises(nbd.OptionError) as e:
+        connect(srv, "no-such-ticket")
+    assert e.value.code == nbd.REP_ERR_UNKNOWN
+
+
+def test_read(tmpdir, srv):
+    data = b"".join(bytes([i]) * CHUNK_SIZE for i in range(4)) + b"z" * 100
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c:
+        assert c.read(0, len(data)) == data
+        # Unaligned read.
+        offset = CHUNK_SIZE - 10
+        assert c.read(offset, 20) == data[offset:offset + 20]
+
+    # The unaligned read was already transferred.
+    info = srv.auth.get(ticket["uuid"]).info()
+    assert info["transferred"] == len(data)
+
+
+def test_read_out_of_range(tmpdir, srv):
+    data = b"x" * 4096
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c:
+        with pytest.raises(nbd.ReplyError) as e:
+            c.read(4096 - 512, 1024)
+        assert e.value.code == nbdserver.EINVAL
+
+        # The connection is still usable.
+        assert c.read(0, 4096) == data
+
+
+def test_write_zero_flush(tmpdir, srv):
+    image, ticket = create_image(
+        tmpdir, srv, b"", ["write"], size=4 * CHUNK_SIZE)
+
+    with connect(srv, ticket["uuid"]) as c:
+        assert not c.transmission_flags & nbd.FLAG_READ_ONLY
+        c.write(0, b"a" * CHUNK_SIZE)
+        c.write(CHUNK_SIZE + 10, b"b" * 100)
+        c.zero(10, 20)
+        c.flush()
+
+    with open(str(image), "rb") as f:
+        data = f.read()
+
+    assert data[:10] == b"a" * 10
+    assert data[10:30] == b"\0" * 20
+    assert data[30:CHUNK_SIZE] == b"a" * (CHUNK_SIZE - 30)
+    assert data[CHUNK_SIZE:CHUNK_SIZE + 10] == b"\0" * 10
+    assert data[CHUNK_SIZE + 10:CHUNK_SIZE + 110] == b"b" * 100
+
+    info = srv.auth.get(ticket["uuid"]).info()
+    assert info["transferred"] == CHUNK_SIZE + 100
+
+
+def test_write_read_only(tmpdir, srv):
+    data = b"x" * 4096
+    image, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c:
+        with pytest.raises(nbd.ReplyError) as e:
+            c.write(0, b"y" * 4096)
+        assert e.value.code == nbdserver.EPERM
+
+        # The payload was drained, so the connection is still usable.
+        assert c.read(0, 4096) == data
+
+    with open(str(image), "rb") as f:
+        assert f.read() == data
+
+
+def test_extents(tmpdir, srv):
+    size = 4 * CHUNK_SIZE
+    _, ticket = create_image(
+        tmpdir, srv, b"x" * CHUNK_SIZE, ["read"], size=size)
+
+    with connect(srv, ticket["uuid"]) as c:
+        extents = c.extents(0, size)["base:allocation"]
+
+        # File system may not report holes, so we cannot assume zero
+        # extents.
+        assert sum(e.length for e in extents) == size
+        assert not extents[0].zero
+
+        # Extents are clipped to the requested range.
+        extents = c.extents(10, 100)["base:allocation"]
+        assert [(e.length, e.zero) for e in extents] == [(100, False)]
+
+
+def test_extents_cached(tmpdir, srv, monkeypatch):
+    size = 4 * CHUNK_SIZE
+    _, ticket = create_image(tmpdir, srv, b"", ["read"], size=size)
+    calls = []
+
+    def extents(self, context="zero"):
+        calls.append(context)
+        yield ZeroExtent(0, CHUNK_SIZE, False, False)
+        yield ZeroExtent(CHUNK_SIZE, 2 * CHUNK_SIZE, True, False)
+        yield ZeroExtent(3 * CHUNK_SIZE, CHUNK_SIZE, False, False)
+
+    monkeypatch.setattr(file.Backend, "extents", extents)
+
+    with connect(srv, ticket["uuid"]) as c:
+        # Query the image like qemu-img map, one extent per command.
+        result = []
+        offset = 0
+        while offset < size:
+            ext = c.extents(offset, size - offset)["base:allocation"][0]
+            result.append((offset, ext.length, ext.zero))
+            offset += ext.length
+
+        assert result == [
+            (0, CHUNK_SIZE, False),
+            (CHUNK_SIZE, 2 * CHUNK_SIZE, True),
+            (3 * CHUNK_SIZE, CHUNK_SIZE, False),
+        ]
+
+        # Query from the middle of an extent.
+        extents = c.extents(CHUNK_SIZE + 10, CHUNK_SIZE)["base:allocation"]
+        assert [(e.length, e.zero) for e in extents] == [(CHUNK_SIZE, True)]
+
+    # Extents were fetched once for this connection.
+    assert calls == ["zero"]
+
+
+def test_extents_not_reported(tmpdir, srv, monkeypatch):
+    size = 2 * CHUNK_SIZE
+    _, ticket = create_image(tmpdir, srv, b"", ["read"], size=size)
+
+    def extents(self, context="zero"):
+        yield ZeroExtent(0, CHUNK_SIZE, True, False)
+
+    monkeypatch.setattr(file.Backend, "extents", extents)
+
+    with connect(srv, ticket["uuid"]) as c:
+        # The reply must include at least one descriptor.
+        extents = c.extents(CHUNK_SIZE, CHUNK_SIZE)["base:allocation"]
+        assert [(e.length, e.zero) for e in extents] == [(CHUNK_SIZE, False)]
+
+
+def test_multi_conn(tmpdir, srv):
+    data = b"x" * CHUNK_SIZE
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c1, \
+            connect(srv, ticket["uuid"]) as c2:
+        assert c1.read(0, 4096) == data[:4096]
+        assert c2.read(4096, 4096) == data[4096:8192]
+        info = srv.auth.get(ticket["uuid"]).info()
+        assert info["connections"] == 2
+
+
+def test_mixed_http_and_nbd(tmpdir, srv, monkeypatch):
+    # Generate the same connection number for HTTP and NBD connections.
+    monkeypatch.setattr(
+        http_server.Connection, "_counter", util.Sequence(1000))
+    monkeypatch.setattr(
+        nbdserver.Connection, "_counter", util.Sequence(1000))
+
+    data = b"".join(bytes([i]) * 4096 for i in range(4))
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+    ticket_id = ticket["uuid"]
+
+    with http.RemoteClient(srv.config) as client:
+        res = client.get("/images/" + ticket_id)
+        assert res.read() == data
+
+        # The NBD connection must use its own backend, not the backend of
+        # the HTTP connection.
+        with connect(srv, ticket_id) as c:
+            assert c.read(4096, 4096) == data[4096:8192]
+            info = srv.auth.get(ticket_id).info()
+            assert info["connections"] == 2
+
+            res = client.get("/images/" + ticket_id,
+                             headers={"Range": "bytes=0-4095"})
+            assert res.read() == data[:4096]
+            assert c.read(8192, 4096) == data[8192:12288]
+
+        # Closing the NBD connection removes its backend.
+        wait_for_connections(srv.auth.get(ticket_id), 1)
+
+
+def wait_for_connections(ticket, count, timeout=1):
+    deadline = time.monotonic() + timeout
+    while ticket.info()["connections"] != count:
+        if time.monotonic() > deadline:
+            raise RuntimeError("Timeout waiting for connections")
+        time.sleep(0.01)
+
+
+def test_ticket_removed(tmpdir, srv):
+    data = b"x" * 4096
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with connect(srv, ticket["uuid"]) as c:
+        assert c.read(0, 4096) == data
+
+        # Idle connections are closed when the ticket is removed.
+        srv.auth.remove(ticket["uuid"])
+        with pytest.raises((nbd.Error, OSError)):
+            c.read(0, 4096)
@@ -0,0 +1,192 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import os
+import socket
+
+import pytest
+
+from ovirt_imageio._internal import auth
+from ovirt_imageio._internal import backends
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import http
+from ovirt_imageio._internal import jobs
+from ovirt_imageio._internal import numa
+from ovirt_imageio._internal import util
+
+from . import testutil
+
+NODES = {0: frozenset([0, 1]), 1: frozenset([2, 3])}
+
+
+@pytest.fixture
+def fake_nodes(monkeypatch):
+    monkeypatch.setattr(numa, "nodes", lambda: NODES)
+
+
+@pytest.fixture
+def fake_sysfs(tmpdir, monkeypatch):
+    devices = tmpdir.mkdir("devices")
+
+    # Physical disk on HBA attached to node 1.
+    hba = devices.mkdir("pci0000:40").mkdir("0000:40:00.0")
+    hba.join("numa_node").write("1\n")
+    sda = hba.mkdir("host0").mkdir("block").mkdir("sda")
+    sda1 = sda.mkdir("sda1")
+
+    # Device mapper device using sda.
+    dm = devices.mkdir("virtual").mkdir("block").mkdir("dm-0")
+    dm.mkdir("slaves").join("sda").mksymlinkto(sda)
+
+    # Device on unknown node.
+    unknown = devices.mkdir("pci0000:00").mkdir("0000:00:01.0")
+    unknown.join("numa_node").write("-1\n")
+    sdb = unknown.mkdir("block").mkdir("sdb")
+
+    class_block = tmpdir.mkdir("class_block")
+    class_block.join("sda").mksymlinkto(sda)
+
+    monkeypatch.setattr(numa, "SYS_DEVICES", str(devices))
+    monkeypatch.setattr(numa, "SYS_CLASS_BLOCK", str(class_block))
+
+    return {"sda": sda, "sda1": sda1, "dm-0": dm, "sdb": sdb}
+
+
+@pytest.mark.parametrize("s,cpus", [
+    ("0", {0}),
+    ("0-3", {0, 1, 2, 3}),
+    ("0-1,8-9\n", {0, 1, 8, 9}),
+    ("1,3", {1, 3}),
+    ("\n", set()),
+])
+def test_parse_cpulist(s, cpus):
+    assert numa.parse_cpulist(s) == cpus
+
+
+def test_nodes():
+    # Every cpu is in exactly one node.
+    cpus = [cpu for node_cpus in numa.nodes().values() for cpu in node_cpus]
+    assert len(cpus) == len(set(cpus))
+
+
+def test_cpu_node(fake_nodes):
+    assert numa.cpu_node(1) == 0
+    assert numa.cpu_node(2) == 1
+    assert numa.cpu_node(42) is None
+
+
+@pytest.mark.parametrize("name,node", [
+    ("sda", 1),
+    ("sda1", 1),
+    ("dm-0", 1),
+    ("sdb", None),
+])
+def test_sysfs_block_node(fake_sysfs, name, node):
+    assert numa._sysfs_block_node(str(fake_sysfs[name])) == node
+
+
+def test_device_node_file(tmpdir):
+    # The node depends on the host; the call must not fail.
+    node = numa.device_node(str(tmpdir))
+    assert node is None or node in numa.nodes()
+
+
+def test_device_node_missing(tmpdir):
+    assert numa.device_node(str(tmpdir.join("missing"))) is None
+
+
+def test_socket_node_unix():
+    a, b = socket.socketpair()
+    with a, b:
+        assert numa.socket_node(a) is None
+
+
+@pytest.mark.parametrize("prefer,node", [
+    ("storage", 1),
+    ("network", 0),
+])
+def test_placement(fake_nodes, monkeypatch, prefer, node):
+    monkeypatch.setattr(numa, "device_node", lambda path: 1)
+    monkeypatch.setattr(numa, "socket_node", lambda sock: 0)
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.numa.enable = True
+    cfg.numa.prefer = prefer
+    ticket = testutil.create_ticket(url="file:///image")
+
+    assert numa.placement(cfg, auth.Ticket(ticket), _Request()) == node
+
+
+def test_placement_fallback(fake_nodes, monkeypatch):
+    monkeypatch.setattr(numa, "socket_node", lambda sock: 0)
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.numa.enable = True
+    ticket = testutil.create_ticket(url="nbd:unix:/sock")
+
+    # Storage node unknown for NBD, use network node.
+    assert numa.placement(cfg, auth.Ticket(ticket), _Request()) == 0
+
+
+def test_placement_disabled(fake_nodes):
+    cfg = config.load(["test/conf/daemon.conf"])
+    ticket = testutil.create_ticket(url="file:///image")
+    assert numa.placement(cfg, auth.Ticket(ticket), _Request()) is None
+
+
+def test_bind_buffer():
+    node = min(numa.nodes())
+    with util.aligned_buffer(1024**2) as buf:
+        numa.bind_buffer(buf, node)
+        buf.write(b"x" * len(buf))
+
+
+def test_pin_thread():
+    node = min(numa.nodes())
+    result = []
+
+    def run():
+        numa.pin_thread(node)
+        result.append(os.sched_getaffinity(0))
+
+    util.start_thread(run).join()
+    assert result == [numa.nodes()[node]]
+
+
+def test_pin_thread_not_in_jobs(tmpdir, monkeypatch):
+    pinned = []
+    monkeypatch.setattr(numa, "placement", lambda cfg, ticket, req: 1)
+    monkeypatch.setattr(numa, "bind_buffer", lambda buf, node: None)
+    monkeypatch.setattr(numa, "pin_thread", pinned.append)
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.numa.pin_threads = True
+    image = testutil.create_tempfile(tmpdir, "image", size=4096)
+    ticket = auth.Ticket(
+        testutil.create_ticket(url="file://" + str(image), size=4096))
+
+    # Job worker threads are shared by all tickets.
+    job = jobs.Job(ticket, "test", None)
+    backends.get(job, ticket, cfg)
+    assert pinned == []
+
+    con = _Connection()
+    backends.get(con, ticket, cfg)
+    assert pinned == [1]
+
+    ticket.remove_context(job.connection_id)
+    ticket.remove_context(con.connection_id)
+
+
+class _Request:
+    socket = None
+
+
+class _Connection(_Request):
+    connection_id = "1"
+    client_addr = "local"
+
+    def __init__(self):
+        self.context = http.Context()
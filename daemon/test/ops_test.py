@@ -8,6 +8,8 @@
 
 import io
 import os
+import threading
+import time
 
 import pytest
 import userstorage
@@ -165,6 +167,79 @@ def test_read_repr():
     assert "size=200 offset=24 done=0" in rep
 
 
+@pytest.mark.parametrize("offset,size", OFFSET_SIZE)
+def test_pipelined_read_full(user_file, offset, size):
+    data = b"b" * size
+
+    with io.open(user_file.path, "wb") as f:
+        f.write(b"a" * offset)
+        f.write(data)
+        f.write(b"c" * 8192)
+
+    dst = io.BytesIO()
+    with file.open(user_file.url, "r") as src, \
+            util.aligned_buffer(128 * 1024) as buf1, \
+            util.aligned_buffer(128 * 1024) as buf2:
+        op = ops.PipelinedRead(src, dst, (buf1, buf2), size, offset=offset)
+        op.run()
+
+    assert dst.getvalue() == data
+    assert op.done == size
+
+
+@pytest.mark.parametrize("offset,size", OFFSET_SIZE)
+def test_pipelined_read_partial_content(user_file, offset, size):
+    with io.open(user_file.path, "wb") as f:
+        f.truncate(offset + size - 1)
+
+    dst = io.BytesIO()
+    with file.open(user_file.url, "r") as src, \
+            util.aligned_buffer(128 * 1024) as buf1, \
+            util.aligned_buffer(128 * 1024) as buf2:
+        op = ops.PipelinedRead(src, dst, (buf1, buf2), size, offset=offset)
+        with pytest.raises(errors.PartialContent) as e:
+            op.run()
+
+    assert e.value.requested == size
+    assert e.value.available == size - 1
+
+
+def test_pipelined_read_cancel():
+    src = memory.Backend("r", bytearray(b"x" * 1024**2))
+    dst = io.BytesIO()
+
+    class CancelingWriter:
+        def write(self, b):
+            op.cancel()
+            return dst.write(b)
+
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedRead(src, CancelingWriter(), (buf1, buf2), 1024**2)
+        with pytest.raises(ops.Canceled):
+            op.run()
+
+    assert dst.getvalue() == b"x" * 4096
+
+
+def test_pipelined_read_error():
+    class FailingBackend(memory.Backend):
+        def readinto(self, buf):
+            if self.tell() >= 8192:
+                raise RuntimeError("read failed")
+            return super().readinto(buf)
+
+    src = FailingBackend("r", bytearray(b"x" * 1024**2))
+    dst = io.BytesIO()
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedRead(src, dst, (buf1, buf2), 1024**2)
+        with pytest.raises(RuntimeError):
+            op.run()
+
+    assert dst.getvalue() == b"x" * 8192
+
+
 @pytest.mark.parametrize("preallocated", [
     pytest.param(True, id="preallocated"),
     pytest.param(False, id="empty"),
@@ -324,6 +399,174 @@ def test_write_no_size(user_file, offset, size):
         assert f.read() == b"\0" * trailer
 
 
+@pytest.mark.parametrize("offset,size", OFFSET_SIZE)
+def test_pipelined_write(user_file, offset, size):
+    with io.open(user_file.path, "wb") as f:
+        f.write(b"x" * (offset + size + 8192))
+
+    data = b"b" * size
+    src = io.BytesIO(data)
+    with file.open(user_file.url, "r+") as dst, \
+            util.aligned_buffer(128 * 1024) as buf1, \
+            util.aligned_buffer(128 * 1024) as buf2:
+        op = ops.PipelinedWrite(dst, src, (buf1, buf2), size, offset=offset)
+        op.run()
+
+    with io.open(user_file.path, "rb") as f:
+        assert f.read(offset) == b"x" * offset
+        assert f.read(size) == data
+        assert f.read() == b"x" * 8192
+
+    assert op.done == size
+
+
+@pytest.mark.parametrize("offset,size", OFFSET_SIZE)
+def test_pipelined_write_partial_content(user_file, offset, size):
+    with io.open(user_file.path, "wb") as f:
+        f.truncate(size + offset)
+
+    src = io.BytesIO(b"x" * (size - 1))
+    with file.open(user_file.url, "r+") as dst, \
+            util.aligned_buffer(128 * 1024) as buf1, \
+            util.aligned_buffer(128 * 1024) as buf2:
+        op = ops.PipelinedWrite(dst, src, (buf1, buf2), size, offset=offset)
+        with pytest.raises(errors.PartialContent) as e:
+            op.run()
+
+    assert e.value.requested == size
+    assert e.value.available == size - 1
+
+
+def test_pipelined_write_no_size():
+    size = 1024**2 + 42
+    dst = memory.Backend("r+", bytearray(size))
+    src = io.BytesIO(b"b" * size)
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedWrite(dst, src, (buf1, buf2))
+        op.run()
+
+    assert op.done == size
+    assert dst.data() == b"b" * size
+
+
+def test_pipelined_write_cancel():
+    size = 1024**2
+    dst = memory.Backend("r+", bytearray(size))
+
+    class CancelingReader(io.BytesIO):
+        def readinto(self, b):
+            op.cancel()
+            return super().readinto(b)
+
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedWrite(
+            dst, CancelingReader(b"b" * size), (buf1, buf2), size)
+        with pytest.raises(ops.Canceled):
+            op.run()
+
+    # Received data is written before the operation is canceled.
+    assert op.done == 4096
+
+
+def test_pipelined_write_error():
+    class FailingBackend(memory.Backend):
+        def write(self, buf):
+            raise RuntimeError("write failed")
+
+    size = 1024**2
+    dst = FailingBackend("r+", bytearray(size))
+    src = io.BytesIO(b"b" * size)
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedWrite(dst, src, (buf1, buf2), size)
+        with pytest.raises(RuntimeError):
+            op.run()
+
+    assert op.done == 0
+
+
+class SlowQoS:
+
+    def reserve(self, nbytes):
+        return 60
+
+
+def test_pipelined_write_error_while_throttled():
+    class FailingReader(io.BytesIO):
+        def readinto(self, b):
+            if self.tell() >= 4096:
+                raise RuntimeError("read failed")
+            return super().readinto(b)
+
+    size = 1024**2
+    dst = memory.Backend("r+", bytearray(size))
+    src = FailingReader(b"b" * size)
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedWrite(dst, src, (buf1, buf2), size)
+        op.qos = SlowQoS()
+        start = time.monotonic()
+        with pytest.raises(RuntimeError):
+            op.run()
+
+    # The helper thread stopped throttling when the operation failed.
+    assert time.monotonic() - start < 10
+    assert op.done == 0
+
+
+def test_pipelined_read_error_while_throttled():
+    class FailingWriter:
+        def write(self, b):
+            raise RuntimeError("write failed")
+
+    src = memory.Backend("r", bytearray(b"x" * 1024**2))
+    with util.aligned_buffer(4096) as buf1, \
+            util.aligned_buffer(4096) as buf2:
+        op = ops.PipelinedRead(src, FailingWriter(), (buf1, buf2), 1024**2)
+        # The first chunk is not throttled.
+        qos = SlowQoS()
+        delays = iter([0])
+        qos.reserve = lambda nbytes: next(delays, 60)
+        op.qos = qos
+        start = time.monotonic()
+        with pytest.raises(RuntimeError):
+            op.run()
+
+    assert time.monotonic() - start < 10
+
+
+def test_pipeline_reuse():
+    threads = []
+
+    class RecordingBackend(memory.Backend):
+        def readinto(self, buf):
+            threads.append(threading.current_thread())
+            return super().readinto(buf)
+
+    src = RecordingBackend("r", bytearray(b"x" * 16384))
+    pipeline = ops.Pipeline()
+    try:
+        with util.aligned_buffer(4096) as buf1, \
+                util.aligned_buffer(4096) as buf2:
+            for offset in (0, 8192):
+                dst = io.BytesIO()
+                op = ops.PipelinedRead(
+                    src, dst, (buf1, buf2), 8192, offset=offset,
+                    pipeline=pipeline)
+                op.run()
+                assert dst.getvalue() == b"x" * 8192
+    finally:
+        pipeline.close()
+
+    # All operations used the same helper thread.
+    assert len(threads) == 4
+    assert len(set(threads)) == 1
+    assert threads[0] is not threading.current_thread()
+    assert not threads[0].is_alive()
+
+
 @pytest.mark.parametrize("sparse", [
     pytest.param(True, id="sparse"),
     pytest.param(False, id="preallocated"),
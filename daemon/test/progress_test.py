@@ -0,0 +1,148 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import threading
+import time
+
+import pytest
+
+from ovirt_imageio._internal import progress
+from ovirt_imageio._internal import util
+
+
+class FakeProgress:
+
+    def __init__(self):
+        self.updates = []
+
+    def update(self, n):
+        self.updates.append(n)
+
+
+def run_threads(func, count):
+    threads = []
+    try:
+        for i in range(count):
+            threads.append(util.start_thread(func, args=(i,)))
+    finally:
+        for t in threads:
+            t.join()
+
+
+def test_slots_per_thread():
+    slots = progress.Slots(list)
+    main = slots.get()
+    assert slots.get() is main
+
+    def worker(i):
+        slots.get().append(i)
+
+    run_threads(worker, 4)
+
+    assert main == []
+    assert sorted(s for s in slots.snapshot() if s) == [[0], [1], [2], [3]]
+
+
+def test_slots_remove():
+    slots = progress.Slots(list)
+    assert slots.current() is None
+
+    slot = slots.get()
+    assert slots.current() is slot
+    assert slots.snapshot() == [slot]
+
+    slots.remove()
+    assert slots.current() is None
+    assert slots.snapshot() == []
+
+
+def test_counter():
+    c = progress.Counter()
+    assert c.value == 0
+    c.update(100)
+    c.update(200)
+    assert c.value == 300
+
+
+def test_counter_concurrent():
+    c = progress.Counter(size=4 * 10000)
+
+    def worker(i):
+        for _ in range(10000):
+            c.update(1)
+
+    run_threads(worker, 4)
+
+    assert c.value == c.size
+
+
+def test_reporter():
+    p = FakeProgress()
+    r = progress.Reporter(p)
+
+    r.update(100)
+    r.update(200)
+    r.flush()
+
+    # Nothing to report.
+    r.flush()
+
+    assert p.updates == [100, 200]
+
+
+def test_reporter_concurrent():
+    p = FakeProgress()
+    r = progress.Reporter(p)
+
+    def worker(i):
+        for _ in range(10000):
+            r.update(1)
+
+    run_threads(worker, 4)
+    r.flush()
+
+    assert sum(p.updates) == 4 * 10000
+
+
+@pytest.mark.benchmark
+@pytest.mark.parametrize("workers", [1, 2, 4, 8])
+def test_counter_benchmark(workers):
+    c = progress.Counter()
+    updates = 10**6
+
+    def worker(i):
+        for _ in range(updates // workers):
+            c.update(4096)
+
+    start = time.monotonic()
+    run_threads(worker, workers)
+    elapsed = time.monotonic() - start
+
+    print("%d updates, %d concurrent threads in %.3f seconds (%d nsec/op)"
+          % (updates, workers, elapsed, elapsed * 10**9 // updates))
+
+
+@pytest.mark.benchmark
+@pytest.mark.parametrize("workers", [1, 2, 4, 8])
+def test_locked_counter_benchmark(workers):
+    # Baseline for comparison with the lock free counter.
+    lock = threading.Lock()
+    value = [0]
+    updates = 10**6
+
+    def worker(i):
+        for _ in range(updates // workers):
+            with lock:
+                value[0] += 4096
+
+    start = time.monotonic()
+    run_threads(worker, workers)
+    elapsed = time.monotonic() - start
+
+    print("%d updates, %d concurrent threads in %.3f seconds (%d nsec/op)"
+          % (updates, workers, elapsed, elapsed * 10**9 // updates))
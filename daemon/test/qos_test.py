@@ -0,0 +1,209 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import io
+import threading
+import time
+
+import pytest
+
+from ovirt_imageio._internal import ops
+from ovirt_imageio._internal import qos
+from ovirt_imageio._internal.backends import memory
+
+
+class FakeClock:
+
+    def __init__(self):
+        self.now = 0.0
+
+    def __call__(self):
+        return self.now
+
+
+def test_bucket_unlimited():
+    clock = FakeClock()
+    b = qos.TokenBucket(clock=clock)
+    assert b.reserve(10**12) == 0
+
+
+def test_bucket_burst():
+    clock = FakeClock()
+    b = qos.TokenBucket(100, clock=clock)
+
+    # Full bucket allows burst without waiting.
+    assert b.reserve(100) == 0
+
+    # Empty bucket - must wait until tokens are refilled.
+    assert b.reserve(50) == pytest.approx(0.5)
+
+    clock.now += 0.5
+    assert b.reserve(100) == pytest.approx(1.0)
+
+
+def test_bucket_refill_limited_to_burst():
+    clock = FakeClock()
+    b = qos.TokenBucket(100, clock=clock)
+    b.reserve(100)
+
+    # Long idle period cannot fill more than burst.
+    clock.now += 60
+    assert b.reserve(100) == 0
+    assert b.reserve(100) == pytest.approx(1.0)
+
+
+def test_bucket_update():
+    clock = FakeClock()
+    b = qos.TokenBucket(100, clock=clock)
+    b.reserve(100)
+
+    b.update(200)
+    assert b.rate == 200
+    assert b.reserve(100) == pytest.approx(0.5)
+
+    # Removing the limit.
+    b.update(0)
+    assert b.reserve(10**12) == 0
+
+
+def test_throttle_bandwidth_and_iops():
+    clock = FakeClock()
+    t = qos.Throttle(bandwidth=1000, iops=10, clock=clock)
+    assert t.enabled
+
+    # Bandwidth is the limiting factor.
+    assert t.reserve(2000) == pytest.approx(1.0)
+
+    # I/O requests are the limiting factor.
+    t = qos.Throttle(bandwidth=10**9, iops=10, clock=clock)
+    for i in range(10):
+        assert t.reserve(1) == 0
+    assert t.reserve(1) == pytest.approx(0.1)
+
+
+def test_throttle_disabled():
+    t = qos.Throttle()
+    assert not t.enabled
+    assert t.reserve(10**12) == 0
+
+    t = qos.Throttle(host=qos.Host())
+    assert not t.enabled
+
+
+def test_host_single_ticket_uses_all_bandwidth():
+    clock = FakeClock()
+    host = qos.Host(bandwidth=1000, clock=clock)
+    t = qos.Throttle(host=host, clock=clock)
+    assert t.enabled
+
+    assert t.reserve(1000) == pytest.approx(1.0)
+
+
+def test_host_weighted_share():
+    clock = FakeClock()
+    host = qos.Host(bandwidth=1000, clock=clock)
+    t1 = qos.Throttle(weight=1, host=host, clock=clock)
+    t2 = qos.Throttle(weight=3, host=host, clock=clock)
+
+    t1.reserve(0)
+    t2.reserve(0)
+
+    assert t1.reserve(250) == pytest.approx(1.0)
+    assert t2.reserve(750) == pytest.approx(1.0)
+
+    # Changing the weight changes the share.
+    clock.now += 1.0
+    t2.update(weight=1)
+    assert t1.reserve(500) == pytest.approx(1.0)
+
+
+def test_host_idle_ticket_loses_share():
+    clock = FakeClock()
+    host = qos.Host(bandwidth=1000, clock=clock)
+    t1 = qos.Throttle(host=host, clock=clock)
+    t2 = qos.Throttle(host=host, clock=clock)
+
+    t1.reserve(0)
+    t2.reserve(0)
+    assert t1.reserve(500) == pytest.approx(1.0)
+
+    # t2 became idle, t1 gets the entire host bandwidth. t1 has 500 tokens
+    # refilled while waiting.
+    clock.now += qos.ACTIVE_PERIOD + 1
+    t1.reserve(0)
+    assert t1.reserve(1500) == pytest.approx(1.0)
+
+
+@pytest.mark.parametrize("tickets", [1, 2, 4, 8])
+def test_host_aggregate_bandwidth(tickets):
+    clock = FakeClock()
+    limit = 10 * 1024**2
+    chunk = 8 * 1024**2
+    duration = 60
+    host = qos.Host(bandwidth=limit, clock=clock)
+    throttles = [qos.Throttle(host=host, clock=clock) for _ in range(tickets)]
+
+    # Every ticket does I/O as fast as possible, waiting before every chunk
+    # as required by the throttle.
+    ready = [0.0] * tickets
+    total = 0
+    while True:
+        i = min(range(tickets), key=ready.__getitem__)
+        clock.now = ready[i]
+        ready[i] = clock.now + throttles[i].reserve(chunk)
+        if ready[i] > duration:
+            break
+        total += chunk
+
+    # Tickets may use the burst once.
+    assert total <= limit * (duration + qos.BURST)
+    assert total >= limit * duration * 0.9
+
+
+def test_host_ticket_limit_lower_than_share():
+    clock = FakeClock()
+    host = qos.Host(bandwidth=1000, clock=clock)
+    t = qos.Throttle(bandwidth=100, host=host, clock=clock)
+    t.reserve(0)
+
+    assert t.reserve(200) == pytest.approx(1.0)
+
+
+def test_read_throttled(monkeypatch):
+    monkeypatch.setattr(qos, "BURST", 0.1)
+    size = 64 * 1024
+    src = memory.Backend("r", data=bytearray(b"x" * size))
+    dst = io.BytesIO()
+    op = ops.Read(src, dst, bytearray(4096), size)
+    op.qos = qos.Throttle(iops=100)
+
+    # Burst of 10 requests, and 6 requests at 100 iops.
+    start = time.monotonic()
+    op.run()
+    elapsed = time.monotonic() - start
+
+    assert dst.getvalue() == b"x" * size
+    assert elapsed >= 0.05
+
+
+def test_cancel_throttled_operation(monkeypatch):
+    monkeypatch.setattr(qos, "BURST", 0.1)
+    size = 1024**2
+    src = memory.Backend("r", data=bytearray(size))
+    dst = io.BytesIO()
+    op = ops.Read(src, dst, bytearray(4096), size)
+    op.qos = qos.Throttle(bandwidth=4096)
+
+    threading.Timer(0.2, op.cancel).start()
+    start = time.monotonic()
+    with pytest.raises(ops.Canceled):
+        op.run()
+    elapsed = time.monotonic() - start
+
+    # Completing the operation would take more than 4 minutes.
+    assert elapsed < 2
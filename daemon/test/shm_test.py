@@ -0,0 +1,190 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import contextlib
+import errno
+import http.client as http_client
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import http
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal import shm
+from ovirt_imageio._internal.backends import memory
+
+from . import testutil
+
+SLOT_SIZE = 64 * 1024
+
+
+@pytest.fixture(scope="module")
+def srv():
+    cfg = config.load(["test/conf/daemon.conf"])
+    s = server.Server(cfg)
+    s.start()
+    try:
+        yield s
+    finally:
+        s.stop()
+
+
+def create_image(tmpdir, srv, data, ops):
+    image = testutil.create_tempfile(tmpdir, "image", data)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=len(data), ops=ops)
+    srv.auth.add(ticket)
+    return image, ticket
+
+
+def test_download(tmpdir, srv):
+    data = b"".join(bytes([i]) * SLOT_SIZE for i in range(8))
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    received = bytearray()
+    with shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=2,
+            slot_size=SLOT_SIZE) as c:
+        assert c.info["size"] == len(data)
+        assert not c.info["writable"]
+
+        # Keep 2 commands in flight.
+        offset = 0
+        for slot in range(2):
+            c.submit(shm.CMD_READ, slot, offset, SLOT_SIZE)
+            offset += SLOT_SIZE
+
+        while len(received) < len(data):
+            slot, count = c.wait()
+            assert count == SLOT_SIZE
+            with c.buffer(slot) as buf:
+                received += buf[:count]
+            if offset < len(data):
+                c.submit(shm.CMD_READ, slot, offset, SLOT_SIZE)
+                offset += SLOT_SIZE
+
+    assert received == data
+
+    info = srv.auth.get(ticket["uuid"]).info()
+    assert info["transferred"] == len(data)
+
+
+def test_download_unaligned_length(tmpdir, srv):
+    data = b"x" * 4096 + b"y" * 100
+    _, ticket = create_image(tmpdir, srv, data, ["read"])
+
+    with shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=1,
+            slot_size=SLOT_SIZE) as c:
+        count = c.read(0, 0, len(data))
+        assert count == len(data)
+        with c.buffer(0) as buf:
+            assert buf[:count] == data
+
+
+def test_upload(tmpdir, srv):
+    size = 4 * SLOT_SIZE
+    image, ticket = create_image(tmpdir, srv, b"\0" * size, ["write"])
+
+    with shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=2,
+            slot_size=SLOT_SIZE) as c:
+        assert c.info["writable"]
+        for i in range(4):
+            slot = i % 2
+            with c.buffer(slot) as buf:
+                buf[:] = bytes([i + 1]) * SLOT_SIZE
+            assert c.write(slot, i * SLOT_SIZE, SLOT_SIZE) == SLOT_SIZE
+        c.flush()
+
+    with open(str(image), "rb") as f:
+        assert f.read() == b"".join(
+            bytes([i + 1]) * SLOT_SIZE for i in range(4))
+
+
+def test_write_read_only(tmpdir, srv):
+    _, ticket = create_image(tmpdir, srv, b"x" * 4096, ["read"])
+
+    with shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=1,
+            slot_size=SLOT_SIZE) as c:
+        with pytest.raises(OSError) as e:
+            c.write(0, 0, 4096)
+        assert e.value.errno == errno.EPERM
+
+
+@pytest.mark.parametrize("slot,offset,length", [
+    pytest.param(1, 0, 4096, id="no-such-slot"),
+    pytest.param(0, 0, SLOT_SIZE + 4096, id="length-exceeds-slot"),
+    pytest.param(0, 4096, 8192, id="out-of-range"),
+    pytest.param(0, 42, 4096, id="unaligned-offset"),
+])
+def test_read_invalid(tmpdir, srv, slot, offset, length):
+    _, ticket = create_image(tmpdir, srv, b"x" * 8192, ["read"])
+
+    with shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=1,
+            slot_size=SLOT_SIZE) as c:
+        with pytest.raises(OSError) as e:
+            c.read(slot, offset, length)
+        assert e.value.errno == errno.EINVAL
+
+        # The session is still usable.
+        assert c.read(0, 0, 4096) == 4096
+
+
+@pytest.mark.parametrize("slots,slot_size", [
+    pytest.param(1, 1000, id="unaligned-slot-size"),
+    pytest.param(0, SLOT_SIZE, id="no-slots"),
+    pytest.param(1024, 1024**2, id="too-large"),
+])
+def test_invalid_ring(tmpdir, srv, slots, slot_size):
+    _, ticket = create_image(tmpdir, srv, b"x" * 4096, ["read"])
+
+    with pytest.raises(http.Error) as e:
+        shm.Client(
+            srv.config.local.socket, ticket["uuid"], slots=slots,
+            slot_size=slot_size)
+    assert e.value.code == http_client.BAD_REQUEST
+
+
+def test_no_ticket(srv):
+    with pytest.raises(http.Error) as e:
+        shm.Client(srv.config.local.socket, "no-such-ticket")
+    assert e.value.code == http_client.FORBIDDEN
+
+
+class FakeLimiter:
+
+    def __init__(self):
+        self.requests = 0
+
+    @contextlib.contextmanager
+    def io(self):
+        self.requests += 1
+        yield
+
+
+def test_slot_ops_limited():
+    backend = memory.Backend("r+", bytearray(b"x" * 8192))
+    buf = bytearray(8192)
+
+    with memoryview(buf) as view:
+        op = shm.ReadSlot(backend, view, 8192, 0)
+        op.limiter = FakeLimiter()
+        op.run()
+    assert buf == b"x" * 8192
+    assert op.limiter.requests == 1
+
+    buf[:] = b"y" * 8192
+    with memoryview(buf) as view:
+        op = shm.WriteSlot(backend, view, 8192, 0)
+        op.limiter = FakeLimiter()
+        op.run()
+    assert backend.data() == b"y" * 8192
+    assert op.limiter.requests == 1
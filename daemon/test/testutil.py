@@ -39,7 +39,8 @@ def random_tcp_port():
 
 def create_ticket(uuid=None, ops=None, timeout=300, size=2**64,
                   url="file:///tmp/foo.img", transfer_id=None, filename=None,
-                  sparse=None, dirty=None):
+                  sparse=None, dirty=None, qos=None, cache=None,
+                  block_cache=None, format=None):
     d = {
         "uuid": uuid or str(uuid4()),
         "timeout": timeout,
@@ -55,6 +56,14 @@ def create_ticket(uuid=None, ops=None, timeout=300, size=2**64,
         d["sparse"] = sparse
     if dirty is not None:
         d["dirty"] = dirty
+    if qos is not None:
+        d["qos"] = qos
+    if cache is not None:
+        d["cache"] = cache
+    if block_cache is not None:
+        d["block_cache"] = block_cache
+    if format is not None:
+        d["format"] = format
     return d
 
 
@@ -77,6 +77,35 @@ def test_get_not_found(srv):
         assert res.status == 404
 
 
+def test_watch(srv):
+    srv.auth.clear()
+    ticket = testutil.create_ticket(ops=["read"])
+    srv.auth.add(ticket)
+    with http.ControlClient(srv.config) as c:
+        res = c.get("/tickets/")
+        assert res.status == 200
+        status = json.loads(res.read())
+        assert status["reset"]
+        assert [t["uuid"] for t in status["tickets"]] == [ticket["uuid"]]
+
+        srv.auth.remove(ticket["uuid"])
+
+        res = c.get("/tickets/?since={}&timeout=10".format(status["version"]))
+        assert res.status == 200
+        changes = json.loads(res.read())
+        assert not changes["reset"]
+        assert changes["version"] > status["version"]
+        assert changes["tickets"] == []
+        assert changes["removed"] == [ticket["uuid"]]
+
+
+@pytest.mark.parametrize("query", ["since=invalid", "since=1&timeout=x"])
+def test_watch_invalid(srv, query):
+    with http.ControlClient(srv.config) as c:
+        res = c.get("/tickets/?" + query)
+        assert res.status == 400
+
+
 def test_put(srv, fake_time):
     ticket = testutil.create_ticket(sparse=False, dirty=False)
     body = json.dumps(ticket)
@@ -193,6 +222,40 @@ def test_extend(srv, fake_time):
         assert server_ticket == ticket
 
 
+def test_patch_qos(srv):
+    ticket = testutil.create_ticket(qos={"bandwidth": 1024**2})
+    srv.auth.add(ticket)
+    body = json.dumps({"qos": {"bandwidth": 2 * 1024**2, "weight": 3}})
+    with http.ControlClient(srv.config) as c:
+        res = c.patch("/tickets/%(uuid)s" % ticket, body)
+        assert res.status == 200
+        server_ticket = srv.auth.get(ticket["uuid"]).info()
+        assert server_ticket["qos"] == {
+            "bandwidth": 2 * 1024**2,
+            "iops": 0,
+            "weight": 3,
+            "io_class": "none",
+            "io_level": 4,
+        }
+        # Timeout was not modified.
+        assert server_ticket["timeout"] == ticket["timeout"]
+
+
+@pytest.mark.parametrize("qos", [
+    "not a dict",
+    {"bandwidth": -1},
+    {"weight": 0},
+])
+def test_patch_qos_invalid(srv, qos):
+    ticket = testutil.create_ticket()
+    srv.auth.add(ticket)
+    body = json.dumps({"qos": qos})
+    with http.ControlClient(srv.config) as c:
+        res = c.patch("/tickets/%(uuid)s" % ticket, body)
+        assert res.status == 400
+        assert "qos" not in srv.auth.get(ticket["uuid"]).info()
+
+
 def test_extend_negative_timeout(srv):
     ticket = testutil.create_ticket(sparse=False)
     srv.auth.add(ticket)
@@ -402,3 +465,61 @@ def test_delete_all(srv):
         # Note: incorrect according to RFC, but required for vdsm.
         assert res.getheader("content-length") == "0"
         pytest.raises(KeyError, srv.auth.get, ticket["uuid"])
+
+
+def test_batch(srv):
+    existing = testutil.create_ticket(timeout=300)
+    srv.auth.add(existing)
+    added = [testutil.create_ticket() for i in range(3)]
+    invalid = testutil.create_ticket()
+    del invalid["size"]
+
+    body = json.dumps({
+        "add": added + [invalid],
+        "extend": [
+            {"uuid": added[0]["uuid"], "timeout": 600},
+            {"uuid": "no-such-ticket", "timeout": 600},
+        ],
+        "remove": [existing["uuid"], "no-such-ticket"],
+    })
+    with http.ControlClient(srv.config) as c:
+        res = c.post("/tickets/", body)
+        assert res.status == 200
+        result = json.loads(res.read())
+
+    assert result["add"][:3] == [{"uuid": t["uuid"]} for t in added]
+    assert "error" in result["add"][3]
+    assert result["extend"][0] == {"uuid": added[0]["uuid"]}
+    assert "error" in result["extend"][1]
+    assert result["remove"] == [
+        {"uuid": existing["uuid"]},
+        {"uuid": "no-such-ticket"},
+    ]
+
+    expires = int(util.monotonic_time()) + 600
+    assert srv.auth.get(added[0]["uuid"]).expires >= expires - 1
+    for t in added[1:]:
+        srv.auth.get(t["uuid"])
+    pytest.raises(KeyError, srv.auth.get, existing["uuid"])
+
+
+@pytest.mark.parametrize("body", [
+    pytest.param("not json", id="not-json"),
+    pytest.param("[]", id="not-object"),
+    pytest.param(json.dumps({"add": {}}), id="invalid-add"),
+    pytest.param(json.dumps({"remove": [1]}), id="invalid-remove"),
+    pytest.param(json.dumps({"extend": [{"uuid": "a"}]}), id="no-timeout"),
+    pytest.param(
+        json.dumps({"extend": [{"uuid": "a", "timeout": -1}]}),
+        id="negative-timeout"),
+])
+def test_batch_invalid(srv, body):
+    with http.ControlClient(srv.config) as c:
+        res = c.post("/tickets/", body)
+        assert res.status == 400
+
+
+def test_batch_ticket_id(srv):
+    with http.ControlClient(srv.config) as c:
+        res = c.post("/tickets/ticket-id", "{}")
+        assert res.status == 405
@@ -0,0 +1,70 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+from ovirt_imageio._internal import timerwheel
+
+
+def test_advance():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0)
+    w.schedule("a", 1.5)
+    w.schedule("b", 3.0)
+    w.schedule("c", 3.5)
+    assert len(w) == 3
+
+    assert w.advance(1.0) == []
+    assert w.advance(1.5) == ["a"]
+    assert sorted(w.advance(3.2)) == ["b"]
+    assert w.advance(4.0) == ["c"]
+    assert len(w) == 0
+
+
+def test_later_rounds():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0)
+    # Same slot, different rounds.
+    w.schedule("a", 2)
+    w.schedule("b", 10)
+    w.schedule("c", 18)
+
+    assert w.advance(2) == ["a"]
+    assert w.advance(9) == []
+    assert w.advance(10) == ["b"]
+    assert w.advance(17) == []
+    assert w.advance(18) == ["c"]
+
+
+def test_advance_more_than_round():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0)
+    for i in range(20):
+        w.schedule(i, i)
+    assert sorted(w.advance(100)) == list(range(20))
+    assert len(w) == 0
+
+
+def test_schedule_in_past():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0, now=10)
+    w.schedule("a", 5)
+    assert w.advance(10) == ["a"]
+
+
+def test_reschedule():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0)
+    w.schedule("a", 2)
+    w.schedule("a", 5)
+    assert w.deadline("a") == 5
+    assert w.advance(4) == []
+    assert w.advance(5) == ["a"]
+    assert w.deadline("a") is None
+
+
+def test_cancel():
+    w = timerwheel.TimerWheel(slots=8, resolution=1.0)
+    w.schedule("a", 2)
+    w.cancel("a")
+    w.cancel("no-such-key")
+    assert w.advance(10) == []
+    assert len(w) == 0
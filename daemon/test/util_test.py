@@ -201,3 +201,28 @@ def test_unbuffered_stream_less():
 ])
 def test_humansize(n, s):
     assert util.humansize(n) == s
+
+
+def test_sequence():
+    seq = util.Sequence(1)
+    assert [next(seq) for _ in range(3)] == [1, 2, 3]
+
+
+def test_sequence_threads():
+    seq = util.Sequence()
+    results = [[] for _ in range(4)]
+
+    def worker(values):
+        for _ in range(1000):
+            values.append(next(seq))
+
+    threads = [util.start_thread(worker, args=(r,)) for r in results]
+    for t in threads:
+        t.join()
+
+    values = sorted(v for r in results for v in r)
+    assert values == list(range(4000))
+
+
+def test_gil_enabled():
+    assert isinstance(util.gil_enabled(), bool)
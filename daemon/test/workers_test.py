@@ -0,0 +1,185 @@
+# ovirt-imageio
+# Copyright (C) 2020 Red Hat, Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+import os
+import signal
+import time
+
+import pytest
+
+from ovirt_imageio._internal import config
+from ovirt_imageio._internal import server
+from ovirt_imageio._internal import util
+from ovirt_imageio._internal import workers
+
+from . import http
+from . import testutil
+
+WORKERS = 2
+
+
+@pytest.fixture(scope="module")
+def srv():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.remote.workers = WORKERS
+    s = server.Server(cfg)
+    s.start()
+    yield s
+    s.stop()
+
+
+def test_workers_running(srv):
+    pids = srv.workers.call("ping")
+    assert len(pids) == WORKERS
+    assert os.getpid() not in pids
+    assert len(set(pids)) == WORKERS
+
+
+def test_download(tmpdir, srv):
+    size = 1024**2
+    image = testutil.create_tempfile(tmpdir, "image", b"x" * size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["read"])
+    srv.auth.add(ticket)
+
+    clients = [http.RemoteClient(srv.config) for i in range(4)]
+    try:
+        for i, c in enumerate(clients):
+            res = c.get(
+                "/images/" + ticket["uuid"],
+                headers={"Range": "bytes=%d-%d" % (
+                    i * size // 4, (i + 1) * size // 4 - 1)})
+            assert res.status == 206
+            assert res.read() == b"x" * (size // 4)
+
+        # Status is aggregated from all workers. The workers complete the
+        # operation after the client received the data, so we may need to
+        # wait.
+        deadline = time.monotonic() + 5
+        while True:
+            info = srv.auth.get(ticket["uuid"]).info()
+            if not info["active"] or time.monotonic() > deadline:
+                break
+            time.sleep(0.05)
+
+        assert info["connections"] == len(clients)
+        assert info["transferred"] == size
+        assert not info["active"]
+    finally:
+        for c in clients:
+            c.close()
+
+
+def test_upload(tmpdir, srv):
+    size = 1024**2
+    image = testutil.create_tempfile(tmpdir, "image", size=size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["write"])
+    srv.auth.add(ticket)
+
+    with http.RemoteClient(srv.config) as c:
+        res = c.put("/images/" + ticket["uuid"], b"y" * size)
+        assert res.status == 200
+        res.read()
+
+    with open(str(image), "rb") as f:
+        assert f.read() == b"y" * size
+
+
+def test_extend(srv):
+    ticket = testutil.create_ticket(timeout=300)
+    srv.auth.add(ticket)
+
+    srv.auth.get(ticket["uuid"]).extend(600)
+
+    # All workers extended the ticket.
+    expires = int(util.monotonic_time()) + 600
+    for ticket_info, _ in srv.workers.call("info", ticket["uuid"]):
+        assert ticket_info["expires"] >= expires - 1
+
+
+def test_remove(tmpdir, srv):
+    size = 4096
+    image = testutil.create_tempfile(tmpdir, "image", b"x" * size)
+    ticket = testutil.create_ticket(
+        url="file://" + str(image), size=size, ops=["read"])
+    srv.auth.add(ticket)
+
+    with http.RemoteClient(srv.config) as c:
+        res = c.get("/images/" + ticket["uuid"])
+        assert res.status == 200
+        res.read()
+
+    srv.auth.remove(ticket["uuid"])
+
+    # Removed from the main process and from all workers.
+    with pytest.raises(KeyError):
+        srv.auth.get(ticket["uuid"])
+    assert srv.workers.call("info", ticket["uuid"]) == [None] * WORKERS
+
+    with http.RemoteClient(srv.config) as c:
+        res = c.get("/images/" + ticket["uuid"])
+        assert res.status == 403
+
+
+def test_reclaim(srv):
+    ticket = testutil.create_ticket()
+    srv.auth.add(ticket)
+
+    assert srv.auth.reclaim(ticket["uuid"])
+
+    # Removed from the main process and from all workers.
+    with pytest.raises(KeyError):
+        srv.auth.get(ticket["uuid"])
+    assert srv.workers.call("info", ticket["uuid"]) == [None] * WORKERS
+
+
+@pytest.fixture
+def pool():
+    cfg = config.load(["test/conf/daemon.conf"])
+    cfg.remote.workers = WORKERS
+    failed = []
+    p = workers.Pool(cfg, on_failure=failed.append)
+    p.failed = failed
+    p.start()
+    yield p
+    p.stop()
+
+
+def test_pool_send_error(pool):
+    w = pool._workers[1]
+    send = w.conn.send
+
+    def fail(obj):
+        raise ValueError("Cannot send")
+
+    w.conn.send = fail
+    with pytest.raises(ValueError):
+        pool.call("ping")
+
+    # The reply of the other worker was consumed, keeping the control
+    # channel in sync.
+    w.conn.send = send
+    assert pool.call("info", "no-such-ticket") == [None] * WORKERS
+
+    # Worker is alive, so this is not a worker failure.
+    assert pool.failed == []
+
+
+def test_pool_worker_terminated(pool):
+    w = pool._workers[0]
+    os.kill(w.proc.pid, signal.SIGKILL)
+    w.proc.join()
+
+    with pytest.raises(RuntimeError):
+        pool.call("ping")
+
+    # The failure is reported once.
+    with pytest.raises(RuntimeError):
+        pool.call("ping")
+    assert pool.failed == [w.proc.name]